@@ -0,0 +1,255 @@
+// bench.cpp - measures the overhead cpprun adds on top of running the compiler and the program directly.
+
+/*
+usage:
+    $ bench_cpprun <cpprun> <source.cpp> [options]
+
+options:
+    --runs=N: repetitions of the fast scenarios, version and cache hit (default 20)
+    --cold-runs=N: repetitions of the cold build scenario (default 3)
+    --max-overhead-ms=SCENARIO:MS[,SCENARIO:MS...]: exit with an error if the median overhead of a scenario
+                                                    (version, cold-build, cache-hit) exceeds MS milliseconds
+    --max-hit-syscalls=N: exit with an error if cpprun makes more than N system calls on a cache hit before it
+                          starts the program, not counting the one stat per header listed in the cache manifest
+                          (not checked where ptrace is not permitted)
+
+The compiler is taken from CPPRUN_CXX (default "c++"). Each cold build uses a fresh CPPRUN_CACHE_DIR.
+*/
+
+#include <sys/ptrace.h>
+
+#include "cpprun.cpp"
+
+namespace cpprun_bench {
+
+using namespace cpprun;
+
+struct Scenario {
+    std::string name;
+    std::vector<double> direct_ms;
+    std::vector<double> cpprun_ms;
+
+    double overhead_ms() const {
+        return median(cpprun_ms) - median(direct_ms);
+    }
+};
+
+// Runs a command with its output discarded and returns its wall time, or throws if it fails.
+double time_cmd(const std::string & prog, const std::vector<std::string> & args, const EnvOverrides & env = {}) {
+    std::string output;
+    CmdStats stats;
+    int rc = spawn_cmd(prog, args, env, STDOUT_FILENO, &output, &stats);
+    if (rc != 0) {
+        throw std::runtime_error(prog + " " + join_shell(args) + " failed with exit code " + std::to_string(rc));
+    }
+    return stats.wall_seconds * 1000;
+}
+
+// Counts the system calls a command makes from its exec until it execs another program (or exits), by tracing it
+// with ptrace. nullopt if ptrace is not permitted (seccomp in containers, Yama ptrace_scope) or the command failed.
+std::optional<size_t> count_syscalls_until_exec(const std::string & prog, const std::vector<std::string> & args,
+                                                const EnvOverrides & env) {
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(prog.c_str()));
+    for (auto & a : args) {
+        argv.push_back(const_cast<char *>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        return std::nullopt;
+    }
+    if (pid == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, nullptr, nullptr) != 0) {
+            _exit(126);
+        }
+        raise(SIGSTOP);
+        for (auto & [name, value] : env) {
+            setenv(name.c_str(), value.c_str(), 1);
+        }
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execv(prog.c_str(), argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)) {
+        return std::nullopt;
+    }
+    if (ptrace(PTRACE_SETOPTIONS, pid, nullptr,
+               reinterpret_cast<void *>(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL)) != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return std::nullopt;
+    }
+    size_t execs = 0, syscalls = 0;
+    bool in_syscall = false;
+    while (ptrace(PTRACE_SYSCALL, pid, nullptr, nullptr) == 0 && waitpid(pid, &status, 0) == pid) {
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            return execs > 0 ? std::make_optional(syscalls) : std::nullopt;
+        }
+        if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXEC << 8))) {
+            if (++execs == 2) {
+                break;
+            }
+            syscalls = 0;
+            in_syscall = true;  // the next stop is the return from execve
+        } else if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            syscalls += in_syscall ? 0 : 1;
+            in_syscall = !in_syscall;
+        }
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return syscalls;
+}
+
+std::map<std::string, double> parse_limits(const std::string & spec) {
+    std::map<std::string, double> limits;
+    std::istringstream iss(spec);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+        auto colon = item.find(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("expected SCENARIO:MS in --max-overhead-ms, got " + item);
+        }
+        limits[item.substr(0, colon)] = std::stod(item.substr(colon + 1));
+    }
+    return limits;
+}
+
+int bench_main(int argc, const char ** argv) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    std::vector<std::string> positional;
+    int runs = 20, cold_runs = 3;
+    std::map<std::string, double> limits;
+    std::optional<size_t> max_hit_syscalls;
+    for (auto & a : args) {
+        if (a.substr(0, 7) == "--runs=") {
+            runs = std::max(1, std::stoi(a.substr(7)));
+        } else if (a.substr(0, 12) == "--cold-runs=") {
+            cold_runs = std::max(1, std::stoi(a.substr(12)));
+        } else if (a.substr(0, 18) == "--max-overhead-ms=") {
+            limits = parse_limits(a.substr(18));
+        } else if (a.substr(0, 19) == "--max-hit-syscalls=") {
+            max_hit_syscalls = std::stoul(a.substr(19));
+        } else {
+            positional.push_back(a);
+        }
+    }
+    if (positional.size() != 2) {
+        std::cerr << "usage: bench_cpprun <cpprun> <source.cpp> [--runs=N] [--cold-runs=N] "
+                     "[--max-overhead-ms=SCENARIO:MS,...] [--max-hit-syscalls=N]"
+                  << std::endl;
+        return 2;
+    }
+    auto cpprun = fs::absolute(positional[0]).string();
+    auto source = fs::absolute(positional[1]).string();
+    const char * cxx_env = std::getenv("CPPRUN_CXX");
+    std::string cxx = cxx_env && *cxx_env ? cxx_env : "c++";
+
+    std::mt19937 rng(std::random_device{}());
+    auto workdir = make_temp_dir(rng);
+    auto exe = (workdir / "direct.exe").string();
+    // the same command line cpprun builds from its defaults, see DEFAULT_CXXFLAGS
+    std::vector<std::string> direct_build = {"-std=c++17", "-Wall", "-Wextra", "-pedantic", "-g", source, "-o", exe};
+    std::vector<std::string> cpprun_build = {"-std=c++17", source};
+    EnvOverrides env = {{"CPPRUN_CXX", cxx}, {"CPPRUN_CXXFLAGS", "-Wall -Wextra -pedantic -g"}};
+
+    std::vector<Scenario> scenarios;
+    std::optional<size_t> hit_syscalls;
+    size_t headers = 0;
+    int rc = 0;
+    try {
+        // warm up the page cache for the compiler and the standard headers
+        time_cmd(cxx, direct_build);
+
+        Scenario version{"version", {}, {}};
+        for (int i = 0; i < runs; ++i) {
+            version.direct_ms.push_back(time_cmd(cxx, {"--version"}));
+            version.cpprun_ms.push_back(time_cmd(cpprun, {"--version"}, env));
+        }
+        scenarios.push_back(version);
+
+        Scenario cold{"cold-build", {}, {}};
+        for (int i = 0; i < cold_runs; ++i) {
+            cold.direct_ms.push_back(time_cmd(cxx, direct_build) + time_cmd(exe, {}));
+            auto cache = workdir / ("cache" + std::to_string(i));
+            auto cold_env = env;
+            cold_env.emplace_back("CPPRUN_CACHE_DIR", cache.string());
+            cold.cpprun_ms.push_back(time_cmd(cpprun, cpprun_build, cold_env));
+            fs::remove_all(cache);
+        }
+        scenarios.push_back(cold);
+
+        Scenario hit{"cache-hit", {}, {}};
+        auto warm_env = env;
+        warm_env.emplace_back("CPPRUN_CACHE_DIR", (workdir / "warm").string());
+        time_cmd(cpprun, cpprun_build, warm_env);
+        for (int i = 0; i < runs; ++i) {
+            hit.direct_ms.push_back(time_cmd(exe, {}));
+            hit.cpprun_ms.push_back(time_cmd(cpprun, cpprun_build, warm_env));
+        }
+        scenarios.push_back(hit);
+        hit_syscalls = count_syscalls_until_exec(cpprun, cpprun_build, warm_env);
+        for (auto & entry : fs::directory_iterator(workdir / "warm" / "artifacts")) {
+            auto manifest = read_file(entry.path() / "manifest");
+            headers = size_t(std::count(manifest.begin(), manifest.end(), '\n'));
+        }
+    } catch (const std::exception & e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        rc = 1;
+    }
+    fs::remove_all(workdir);
+    if (rc != 0) {
+        return rc;
+    }
+
+    std::cout << fs::path(source).filename().string() << " with " << cxx << "\n";
+    std::cout << "scenario       runs   direct ms   cpprun ms  overhead ms      limit\n";
+    std::cout << std::fixed << std::setprecision(1);
+    for (auto & s : scenarios) {
+        auto limit = limits.find(s.name);
+        bool failed = limit != limits.end() && s.overhead_ms() > limit->second;
+        std::cout << std::left << std::setw(12) << s.name << std::right << std::setw(7) << s.cpprun_ms.size()
+                  << std::setw(12) << median(s.direct_ms) << std::setw(12) << median(s.cpprun_ms) << std::setw(13)
+                  << s.overhead_ms() << std::setw(11);
+        if (limit != limits.end()) {
+            std::cout << limit->second;
+        } else {
+            std::cout << "-";
+        }
+        std::cout << (failed ? "  FAILED" : "") << "\n";
+        rc |= failed ? 1 : 0;
+    }
+    std::cout << "cache hit system calls before the program starts: ";
+    if (hit_syscalls) {
+        std::cout << *hit_syscalls << ", " << headers << " of them for checking headers";
+    } else {
+        // not a failure of cpprun: the check is skipped where tracing is not allowed
+        std::cout << "unknown (ptrace is not permitted)";
+    }
+    if (max_hit_syscalls && !hit_syscalls) {
+        std::cout << ", limit " << *max_hit_syscalls << " not checked";
+    } else if (max_hit_syscalls) {
+        bool failed = *hit_syscalls - std::min(headers, *hit_syscalls) > *max_hit_syscalls;
+        std::cout << ", limit " << *max_hit_syscalls << (failed ? "  FAILED" : "");
+        rc |= failed ? 1 : 0;
+    }
+    std::cout << "\n";
+    for (auto & [name, _] : limits) {
+        if (std::none_of(scenarios.begin(), scenarios.end(), [&](auto & s) { return s.name == name; })) {
+            std::cerr << "ERROR: unknown scenario " << name << " in --max-overhead-ms" << std::endl;
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+}  // namespace cpprun_bench
+
+int main(int argc, const char ** argv) {
+    return cpprun_bench::bench_main(argc, argv);
+}
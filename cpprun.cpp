@@ -6,11 +6,70 @@ compile with:
 or:
     $ make out/cpprun
 
+the same code is also a library for building and running programs from within another program, see libcpprun.hpp.
+
 then place the 'cpprun' binary somewhere in your PATH and use it like this:
     $ cpprun [cpprun or build options] -- [program options]
 
 cpprun options:
     --cpprun-compiler-info: show compiler version information and exit
+    --cpprun-size[=N]: build, then report the N (default 20) largest symbols and template families in the
+                       artifact, and the change since the previous build of the same source
+    --cpprun-startup[=N]: build, then profile N (default 5) startups of the program up to main: dynamic loader,
+                          relocations, shared objects and static initializers (main itself is not run)
+    --cpprun-annotate[=HZ]: run the program under a sampling profiler (default 1000 samples per CPU second) and
+                            print its source annotated with the share of samples per line, and the hottest
+                            functions and instructions
+    --cpprun-build-profile: build in separate preprocess, compile, assemble and link steps and report the time and
+                            peak memory of each, instead of running the program
+    --cpprun-stack-usage[=BYTES]: build with -fstack-usage and report the largest stack frames and worst-case call
+                                  chains instead of running the program, warn about frames larger than BYTES
+    --cpprun-build-trends: show the compile time and memory history of each script and flag set, and flag
+                           regressions that coincide with a compiler change
+    --cpprun-header-report[=N]: rank the headers directly included by recently cached builds by their parse cost,
+                                recommend N headers to precompile or replace, and write a prelude header for them
+    --cpprun-static[=full|pie|runtime]: link with -static (default), -static-pie, or only the C++ runtime statically
+                                        (-static-libstdc++ -static-libgcc)
+    --cpprun-doctor: measure process spawn latency, probe builds, filesystems, linkers, precompiled header and
+                     module support and kernel settings, and recommend fixes ranked by the time they save
+    --cpprun-prewarm[=wait]: read the compiler, its programs and runtime libraries, the system headers and the files
+                             of recently used cache entries into the page cache, in the background (from a login
+                             script or a CI setup step), or with =wait in the foreground with a report
+    --cpprun-events-fd=N: write machine readable events (commands with their pid, exit status and resource usage,
+                          phases, cache result) to file descriptor N, as JSON objects prefixed with their length
+    --cpprun-memoize[=FILE,...]: replay the output and exit code of an earlier run with the same executable,
+                                 arguments, standard input and input files (the declared FILEs and those the
+                                 program read) instead of running the program again
+    --cpprun-memoize-env=NAME,...: environment variables whose values are part of the memoized run's key
+    --cpprun-sanitize[=address,undefined,thread,leak]: build a variant per sanitizer (default address, undefined
+                                                      and thread) concurrently, run them in parallel with the same
+                                                      arguments and input, and merge their reports
+    --cpprun-fuzz[=SECONDS]: build the libFuzzer style harness (LLVMFuzzerTestOneInput) in the sources for
+                             fuzzing, run workers for SECONDS (default 60) that share a corpus kept in
+                             CPPRUN_CACHE_DIR, report executions per second and coverage over time, and minimize
+                             the crashes found
+    --cpprun-fuzz-workers=N: number of fuzzing workers (default: one per CPU)
+    --cpprun-capture=BUNDLE: build and run as usual, and write the sources and local headers, build command,
+                             compiler, run arguments, the environment variables of cpprun, the locale and the
+                             runtime libraries, standard input, declared input files and the times of the build
+                             and the run into the tar archive BUNDLE
+    --cpprun-capture-files=FILE,...: input files of the program to include in the bundle
+    --cpprun-capture-env=NAME,...: further environment variables to include in the bundle
+    --cpprun-replay BUNDLE: restore a captured run, rebuild it, run it N times and compare the times with the
+                            captured ones; with --cpprun-annotate or --cpprun-startup, also profile it
+    --cpprun-replay-runs=N: number of replayed runs (default 5)
+    --cpprun-tee=FILE: pass the standard output of the program through and save it to FILE as well, moved between
+                       pipe buffers in the kernel with tee(2) and splice(2) instead of copied through cpprun
+    --cpprun-asm-diff=VARIANT: given twice, build two variants ("-O3", or a compiler and options: "g++-13 -O2"),
+                               disassemble both and show the functions whose size or instruction mix changed most,
+                               side by side; with --cpprun-annotate, weighted by the samples of a profiled run
+    --cpprun-jit: compile a single source file to an object file and link and run it in memory with the ORC JIT
+                  instead of building an executable, if cpprun was built with CPPRUN_JIT (see CMakeLists.txt);
+                  otherwise, and for anything the JIT does not support, build and run as usual
+    --cpprun-pipeline STAGE '|' STAGE ...: build the stages ("[build options] sources [-- run args]" each)
+                                          concurrently, run them connected by pipes like a shell pipeline, and
+                                          report the CPU time of each stage and how long it waited on its pipes
+    --cpprun-no-cache: build even if a cached executable is current, and do not cache the new one
     -c: build only, do not run the program
     -o <file>: specify output file (default is a temporary file in the system temp directory)
     -std=<version>: specify the C++ standard to use (overrides CPPRUN_CXX_STANDARD environment variable)
@@ -21,35 +80,81 @@ environment variables:
     CPPRUN_CXX_STANDARD: specify the C++ standard to use (default is "-std=c++23",set to empty string to disable)
     CPPRUN_CXX: specify the C++ compiler to use (default is "c++")
     CPPRUN_VERBOSE: if set to a non-empty value, print the commands being executed
+    CPPRUN_JOBS: number of compiles to run at the same time when building several source files, or "auto" for one
+                 per CPU (default is 1, which builds them in a single compiler invocation)
+    CPPRUN_METRICS_FILE: append one JSON line with phase timings, cache result, exit code and resource usage per
+                         invocation to this file
+    CPPRUN_METRICS_TEXTFILE: maintain aggregate counters and histograms over all invocations in this file, in the
+                             Prometheus text format (for the node_exporter textfile collector)
+    CPPRUN_CACHE_DIR: directory for built executables, the build time log and other persistent state (default is
+                      $XDG_CACHE_HOME/cpprun or ~/.cache/cpprun, set to empty string to disable)
+    CPPRUN_CACHE_MAX_MB: size limit of the cached executables, the oldest are removed beyond it (default is 1024, 0
+                         for no limit)
 */
 
+#include "libcpprun.hpp"
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <optional>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
+#if defined(CPPRUN_JIT)
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/TargetSelect.h>
+#endif
+
 namespace fs = std::filesystem;
 
 namespace cpprun {
 
-const std::vector<std::string> DEFAULT_CXXFLAGS = {
-    "-Wall",
-    "-Wextra",
-    "-pedantic",
-    "-g",
-};
-
-const std::string DEFAULT_CXX_STANDARD = "-std=c++23";
+// Everything but the API of libcpprun.hpp has internal linkage, so that the library adds no other symbols to the
+// programs that link it.
+namespace {
 
 template <typename T>
 void extend(std::vector<T> & dst, const std::vector<T> & src) {
@@ -80,41 +185,527 @@ static std::string join_shell(const std::vector<std::string> & args) {
     return out;
 }
 
-static int run_cmd(const std::string & prog, const std::vector<std::string> & args, bool verbose) {
-    if (verbose) {
-        std::cout << ">>> " << prog << " " << join_shell(args) << std::endl;
+static double to_seconds(const timeval & tv) {
+    return double(tv.tv_sec) + double(tv.tv_usec) / 1e6;
+}
+
+static double seconds_since(const timespec & start) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return double(now.tv_sec - start.tv_sec) + double(now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+std::string json_string(const std::string & s) {
+    std::ostringstream out;
+    out << '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+static std::string json_stats(const CmdStats & s) {
+    std::ostringstream out;
+    out << "{\"wall_seconds\":" << s.wall_seconds << ",\"user_seconds\":" << s.user_seconds
+        << ",\"system_seconds\":" << s.system_seconds << ",\"max_rss_kb\":" << s.max_rss_kb << "}";
+    return out.str();
+}
+
+std::string json_array(const std::vector<std::string> & values) {
+    std::string out = "[";
+    for (size_t i = 0; i < values.size(); ++i) {
+        out += (i ? "," : "") + json_string(values[i]);
+    }
+    return out + "]";
+}
+
+// Machine readable events for wrappers (--cpprun-events-fd). Each event is a JSON object, preceded by its length
+// in bytes as a decimal number and a newline.
+class EventStream {
+   public:
+    void open(int fd) {
+        fd_ = fd;
+    }
+
+    bool enabled() const {
+        return fd_ >= 0;
+    }
+
+    // fields are the members after "event" and "time", each with a leading comma
+    void emit(const std::string & event, const std::string & fields = "") {
+        if (fd_ < 0) {
+            return;
+        }
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        std::ostringstream json;
+        json << "{\"event\":" << json_string(event) << ",\"time\":" << now.tv_sec << "." << std::setw(6)
+             << std::setfill('0') << now.tv_nsec / 1000 << fields << "}";
+        auto message = std::to_string(json.str().size()) + "\n" + json.str();
+        for (size_t done = 0; done < message.size();) {
+            ssize_t n = write(fd_, message.data() + done, message.size() - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                perror("cpprun: writing to the events fd");
+                fd_ = -1;
+                return;
+            }
+            done += size_t(n);
+        }
+    }
+
+   private:
+    int fd_ = -1;
+};
+
+EventStream & events() {
+    static EventStream stream;
+    return stream;
+}
+
+static void emit_process_start(pid_t pid, const std::string & prog, const std::vector<std::string> & args,
+                               const EnvOverrides & env) {
+    if (!events().enabled()) {
+        return;
+    }
+    std::vector<std::string> command{prog};
+    extend(command, args);
+    std::string env_json;
+    for (auto & [name, value] : env) {
+        env_json += (env_json.empty() ? "" : ",") + json_string(name) + ":" + json_string(value);
+    }
+    events().emit("process_start", ",\"pid\":" + std::to_string(pid) + ",\"argv\":" + json_array(command) +
+                                       ",\"env\":{" + env_json + "}");
+}
+
+static void emit_process_exit(pid_t pid, int status, const CmdStats & stats) {
+    if (!events().enabled()) {
+        return;
+    }
+    auto result = WIFSIGNALED(status) ? ",\"signal\":" + std::to_string(WTERMSIG(status))
+                                      : ",\"exit_code\":" + std::to_string(WEXITSTATUS(status));
+    events().emit("process_exit", ",\"pid\":" + std::to_string(pid) + result + ",\"usage\":" + json_stats(stats));
+}
+
+// The exit code of a wait status, 128 + the signal number for a killed process like in the shell.
+static int exit_code(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return status;
+}
+
+// Writes all of data, or gives up at the first error.
+static bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = write(fd, data.data(), data.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        data.remove_prefix(size_t(n));
+    }
+    return true;
+}
+
+// The largest pipe buffer an unprivileged process may ask for.
+static int max_pipe_size() {
+    std::ifstream in("/proc/sys/fs/pipe-max-size");
+    int size = 0;
+    return in >> size && size > 0 ? size : 1 << 20;
+}
+
+// Output tee (--cpprun-tee): the program writes into a pipe with a large buffer, whose contents tee(2) duplicates
+// into the standard output of cpprun (or, when that is not a pipe, into a second pipe that is spliced to it) and
+// splice(2) then moves into the file. The data stays in pipe buffers in the kernel; only a terminal, which does not
+// support splice, gets it through read and write.
+
+struct TeeOutput {
+    int fd;
+    fs::path path;
+    uintmax_t written = 0;
+};
+
+struct SpliceTarget {
+    int fd;
+    bool splice = true;  // cleared when fd does not support splice
+};
+
+// Moves up to n bytes from the pipe in to the target, stops at the first error. Returns how many it moved.
+static size_t splice_all(int in, SpliceTarget & to, size_t n) {
+    char buf[65536];
+    size_t moved = 0;
+    while (moved < n) {
+        ssize_t m = to.splice ? splice(in, nullptr, to.fd, nullptr, n - moved, SPLICE_F_MOVE) : -1;
+        if (m < 0 && to.splice && errno == EINVAL) {
+            to.splice = false;
+            continue;
+        }
+        if (!to.splice) {
+            m = read(in, buf, std::min(n - moved, sizeof(buf)));
+            if (m > 0 && !write_all(to.fd, std::string_view(buf, size_t(m)))) {
+                break;
+            }
+        }
+        if (m < 0 && errno == EINTR) {
+            continue;
+        }
+        if (m <= 0) {
+            break;
+        }
+        moved += size_t(m);
+    }
+    return moved;
+}
+
+static bool is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// Copies everything from the pipe in to both out and the file, until the writers of in close it. Stops early when
+// out can not be written (its reader is gone), like tee(1); after a write error of the file, the output only goes
+// to out.
+static void tee_pipe(int in, int out, TeeOutput & file) {
+    int copy[2] = {-1, -1};
+    bool out_is_pipe = is_pipe(out);
+    int pipe_size = max_pipe_size();
+    if (!out_is_pipe) {
+        if (pipe2(copy, O_CLOEXEC) != 0) {
+            perror("pipe");
+            return;
+        }
+        fcntl(copy[1], F_SETPIPE_SZ, pipe_size);
+    }
+    SpliceTarget to_out{out}, to_file{file.fd};
+    while (true) {
+        ssize_t n = tee(in, out_is_pipe ? out : copy[1], size_t(pipe_size), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || (!out_is_pipe && splice_all(copy[0], to_out, size_t(n)) < size_t(n))) {
+            break;
+        }
+        size_t saved = to_file.fd >= 0 ? splice_all(in, to_file, size_t(n)) : 0;
+        file.written += saved;
+        if (saved < size_t(n)) {
+            if (to_file.fd >= 0) {
+                std::cerr << "WARNING: unable to write to " << file.path << ": " << std::strerror(errno)
+                          << ", the rest of the output is not saved" << std::endl;
+                to_file.fd = -1;
+            }
+            // out already has these, drop them from in
+            char buf[65536];
+            for (size_t left = size_t(n) - saved; left > 0;) {
+                ssize_t m = read(in, buf, std::min(left, sizeof(buf)));
+                if (m <= 0 && !(m < 0 && errno == EINTR)) {
+                    break;
+                }
+                left -= size_t(std::max<ssize_t>(m, 0));
+            }
+        }
+    }
+    if (copy[0] >= 0) {
+        close(copy[0]);
+        close(copy[1]);
+    }
+}
+
+// Runs a command and waits for it. When capture_fd is not -1, that descriptor of the child (stdout or stderr) is
+// collected into output instead of being passed through, or with tee, passed through and written to its file.
+static int spawn_cmd(const std::string & prog, const std::vector<std::string> & args, const EnvOverrides & env,
+                     int capture_fd, std::string * output, CmdStats * stats, TeeOutput * tee = nullptr) {
+    std::vector<char *> argv;
+    argv.reserve(args.size() + 2);
+    argv.push_back(const_cast<char *>(prog.c_str()));
+    for (auto & s : args) {
+        argv.push_back(const_cast<char *>(s.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    int fds[2] = {-1, -1};
+    if (capture_fd != -1 && pipe(fds) != 0) {
+        perror("pipe");
+        return 127;
     }
+    if (tee) {
+        fcntl(fds[1], F_SETPIPE_SZ, max_pipe_size());
+    }
+
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     pid_t pid = fork();
     if (pid < 0) {
         perror("fork");
+        if (capture_fd != -1) {
+            close(fds[0]);
+            close(fds[1]);
+        }
         return 127;
     }
     if (pid == 0) {
         // child
-        std::vector<char *> argv;
-        argv.reserve(args.size() + 1);
-        argv.push_back(const_cast<char *>(prog.c_str()));
-        for (auto & s : args) {
-            argv.push_back(const_cast<char *>(s.c_str()));
+        if (capture_fd != -1) {
+            dup2(fds[1], capture_fd);
+            close(fds[0]);
+            close(fds[1]);
+        }
+        for (auto & [name, value] : env) {
+            setenv(name.c_str(), value.c_str(), 1);
         }
-        argv.push_back(nullptr);
         execvp(prog.c_str(), argv.data());
         perror("execvp");
         _exit(127);
     }
+
+    emit_process_start(pid, prog, args, env);
+
+    if (tee) {
+        close(fds[1]);
+        // a reader of our output that goes away ends the tee, and then the program with SIGPIPE, not cpprun
+        struct sigaction ignore {}, previous{};
+        ignore.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore, &previous);
+        tee_pipe(fds[0], capture_fd, *tee);
+        sigaction(SIGPIPE, &previous, nullptr);
+        close(fds[0]);
+    } else if (capture_fd != -1) {
+        close(fds[1]);
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                break;
+            }
+            output->append(buf, size_t(n));
+        }
+        close(fds[0]);
+    }
+
     int status = 0;
-    if (waitpid(pid, &status, 0) < 0) {
-        perror("waitpid");
-        return 127;
+    rusage usage{};
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return 127;
+        }
     }
-    if (WIFEXITED(status)) {
-        return WEXITSTATUS(status);
+    CmdStats usage_stats{seconds_since(start), to_seconds(usage.ru_utime), to_seconds(usage.ru_stime),
+                         usage.ru_maxrss};
+    if (stats) {
+        *stats = usage_stats;
     }
-    if (WIFSIGNALED(status)) {
-        return 128 + WTERMSIG(status);
+    emit_process_exit(pid, status, usage_stats);
+    return exit_code(status);
+}
+
+static int run_cmd(const std::string & prog, const std::vector<std::string> & args, bool verbose,
+                   const EnvOverrides & env = {}, CmdStats * stats = nullptr, TeeOutput * tee = nullptr) {
+    if (verbose) {
+        std::cout << ">>> ";
+        for (auto & [name, value] : env) {
+            std::cout << name << "=" << value << " ";
+        }
+        std::cout << prog << " " << join_shell(args) << std::endl;
     }
-    return status;
+    return spawn_cmd(prog, args, env, tee ? STDOUT_FILENO : -1, nullptr, stats, tee);
+}
+
+// Like run_cmd, but collects the standard output (or another descriptor) of the command instead of passing it
+// through.
+static int capture_cmd(const std::string & prog, const std::vector<std::string> & args, std::string & output,
+                       bool verbose, int capture_fd = STDOUT_FILENO, CmdStats * stats = nullptr) {
+    if (verbose) {
+        std::cout << ">>> " << prog << " " << join_shell(args) << std::endl;
+    }
+    return spawn_cmd(prog, args, {}, capture_fd, &output, stats);
+}
+
+// Like spawn_cmd, but for several threads of a host at once: everything the child needs is allocated before fork,
+// the child only makes async-signal-safe calls, and the descriptors of one child are not inherited by another.
+// The standard input is a socket so that a program which exits without reading it does not raise SIGPIPE in the
+// host.
+static RunResult spawn_process(const std::string & path, const std::vector<std::string> & args,
+                               const RunOptions & options) {
+    RunResult result;
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(path.c_str()));
+    for (auto & a : args) {
+        argv.push_back(const_cast<char *>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    std::vector<std::string> env_strings;
+    std::vector<char *> envp;
+    for (char ** e = environ; *e != nullptr; ++e) {
+        std::string_view entry = *e;
+        auto name = entry.substr(0, entry.find('='));
+        if (std::none_of(options.env.begin(), options.env.end(), [&](auto & kv) { return kv.first == name; })) {
+            envp.push_back(*e);
+        }
+    }
+    for (auto & [name, value] : options.env) {
+        env_strings.push_back(name + "=" + value);
+    }
+    for (auto & e : env_strings) {
+        envp.push_back(e.data());
+    }
+    envp.push_back(nullptr);
+    std::string workdir = options.working_directory ? options.working_directory->string() : "";
+
+    int in[2] = {-1, -1}, out[2] = {-1, -1}, err[2] = {-1, -1};
+    auto close_all = [&]() {
+        for (int * fds : {in, out, err}) {
+            for (int i = 0; i < 2; ++i) {
+                if (fds[i] >= 0) {
+                    close(fds[i]);
+                    fds[i] = -1;
+                }
+            }
+        }
+    };
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, in) != 0 ||
+        (options.capture && (pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0))) {
+        result.errors = std::string("cpprun: unable to create pipes: ") + std::strerror(errno) + "\n";
+        result.exit_code = 127;
+        close_all();
+        return result;
+    }
+
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        result.errors = std::string("cpprun: fork: ") + std::strerror(errno) + "\n";
+        result.exit_code = 127;
+        close_all();
+        return result;
+    }
+    if (pid == 0) {
+        // child
+        dup2(in[1], STDIN_FILENO);
+        if (options.capture) {
+            dup2(out[1], STDOUT_FILENO);
+            dup2(err[1], STDERR_FILENO);
+        }
+        if (!workdir.empty() && chdir(workdir.c_str()) != 0) {
+            _exit(127);
+        }
+        execve(path.c_str(), argv.data(), envp.data());
+        _exit(127);
+    }
+    close(in[1]);
+    close(out[1]);
+    close(err[1]);
+    in[1] = out[1] = err[1] = -1;
+
+    int status = 0;
+    rusage usage{};
+    bool reaped = false;
+    size_t written = 0;
+    if (options.input.empty()) {
+        close(in[0]);
+        in[0] = -1;
+    }
+    while (true) {
+        pollfd fds[3];
+        nfds_t nfds = 0;
+        if (in[0] >= 0) {
+            fds[nfds++] = {in[0], POLLOUT, 0};
+        }
+        if (out[0] >= 0) {
+            fds[nfds++] = {out[0], POLLIN, 0};
+        }
+        if (err[0] >= 0) {
+            fds[nfds++] = {err[0], POLLIN, 0};
+        }
+        int timeout_ms = -1;
+        if (options.timeout_seconds) {
+            double remaining = *options.timeout_seconds - seconds_since(start);
+            if (remaining <= 0) {
+                kill(pid, SIGKILL);
+                result.timed_out = true;
+                break;
+            }
+            // with nothing to poll, check now and then whether the program has exited
+            timeout_ms = int(std::min(remaining * 1000 + 1, nfds == 0 ? 10.0 : 1e9));
+        }
+        if (nfds == 0) {
+            if (!options.timeout_seconds) {
+                break;
+            }
+            pid_t done = wait4(pid, &status, WNOHANG, &usage);
+            if (done == pid || (done < 0 && errno != EINTR)) {
+                reaped = done == pid;
+                break;
+            }
+        }
+        if (poll(fds, nfds, timeout_ms) < 0 && errno != EINTR) {
+            break;
+        }
+        for (nfds_t i = 0; i < nfds; ++i) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if (fds[i].fd == in[0]) {
+                ssize_t n = send(in[0], options.input.data() + written, options.input.size() - written,
+                                 MSG_NOSIGNAL | MSG_DONTWAIT);
+                written += n > 0 ? size_t(n) : 0;
+                if (written == options.input.size() || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+                    close(in[0]);
+                    in[0] = -1;
+                }
+                continue;
+            }
+            char buf[4096];
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            int & fd = fds[i].fd == out[0] ? out[0] : err[0];
+            if (n <= 0) {
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            (fd == out[0] ? result.output : result.errors).append(buf, size_t(n));
+            if (options.echo) {
+                write_all(fd == out[0] ? STDOUT_FILENO : STDERR_FILENO, std::string_view(buf, size_t(n)));
+            }
+        }
+    }
+    close_all();
+
+    while (!reaped && wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            result.errors += std::string("cpprun: waitpid: ") + std::strerror(errno) + "\n";
+            result.exit_code = 127;
+            return result;
+        }
+    }
+    result.stats = CmdStats{seconds_since(start), to_seconds(usage.ru_utime), to_seconds(usage.ru_stime),
+                            usage.ru_maxrss};
+    result.exit_code = exit_code(status);
+    return result;
 }
 
 auto split_args(const std::vector<std::string> & args, const std::string & sep = "--") {
@@ -139,16 +730,89 @@ auto split_args(const std::vector<std::string> & args, const std::string & sep =
     };
 }
 
+enum class StaticLink {
+    Full,     // -static
+    Pie,      // -static-pie
+    Runtime,  // -static-libstdc++ -static-libgcc, libc stays dynamic
+};
+
 struct CpprunArgs {
     bool show_compiler_info = false;
     bool build_only = false;
+    bool no_cache = false;
     bool verbose = false;
+    std::optional<size_t> size_report = std::nullopt;
+    std::optional<int> startup_runs = std::nullopt;
+    std::optional<StaticLink> static_link = std::nullopt;
+    bool build_profile = false;
+    std::optional<size_t> header_report = std::nullopt;
+    std::optional<int> annotate_hz = std::nullopt;
+    std::optional<size_t> stack_usage = std::nullopt;
+    bool build_trends = false;
+    bool doctor = false;
+    bool prewarm = false;
+    bool prewarm_wait = false;  // in the foreground, and report what was read
+    std::optional<int> events_fd = std::nullopt;
+    std::optional<std::vector<fs::path>> memoize = std::nullopt;  // the declared input files
+    std::vector<std::string> runtime_flags;  // -fopenmp, -pthread and -ltbb when the sources need them
+    bool pipeline = false;
+    std::vector<std::string> memoize_env;
+    bool jit = false;
+    std::vector<std::string> sanitizers;
+    std::optional<size_t> fuzz_seconds = std::nullopt;
+    std::optional<size_t> fuzz_workers = std::nullopt;
+    std::optional<fs::path> capture_bundle = std::nullopt;
+    std::vector<fs::path> capture_files;  // the declared input files
+    std::vector<std::string> capture_env;  // environment variables to capture besides the default ones
+    std::optional<fs::path> replay_bundle = std::nullopt;
+    size_t replay_runs = 5;
+    std::optional<fs::path> tee_file = std::nullopt;
+    std::vector<std::string> asm_diff;  // the two variants
     std::string cxx = "c++";
     std::optional<std::string> cxx_standard = DEFAULT_CXX_STANDARD;
     std::optional<fs::path> output_path = std::nullopt;
     std::vector<std::string> build_args;
 };
 
+// set for programs built with -fopenmp, see parallel_runtime_env
+const EnvOverrides OPENMP_ENV_DEFAULTS = {{"OMP_PROC_BIND", "close"}, {"OMP_PLACES", "cores"}};
+
+// -fopenmp given by the user or added by parallel_runtime_flags
+bool uses_openmp(const CpprunArgs & args) {
+    return std::find(args.build_args.begin(), args.build_args.end(), "-fopenmp") != args.build_args.end() ||
+           std::find(args.runtime_flags.begin(), args.runtime_flags.end(), "-fopenmp") != args.runtime_flags.end();
+}
+
+// "a,b,c" with empty items left out
+std::vector<std::string> split_list(const std::string & list) {
+    std::vector<std::string> items;
+    std::istringstream iss(list);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// for --cpprun-sanitize, see run_sanitizers
+const std::vector<std::string> SANITIZERS = {"address", "undefined", "thread", "leak"};
+
+std::vector<std::string> parse_sanitizers(const std::string & list) {
+    auto sanitizers = split_list(list);
+    if (sanitizers.empty()) {
+        throw std::runtime_error("--cpprun-sanitize: no sanitizers given");
+    }
+    for (auto & s : sanitizers) {
+        if (std::find(SANITIZERS.begin(), SANITIZERS.end(), s) == SANITIZERS.end()) {
+            throw std::runtime_error("--cpprun-sanitize: unknown sanitizer " + s +
+                                     ", expected address, undefined, thread or leak");
+        }
+    }
+    return sanitizers;
+}
+
 void parse_cxxflags_into(std::vector<std::string> & output, const char * cxxflags_str) {
     std::istringstream iss(cxxflags_str);
     std::string flag;
@@ -189,6 +853,94 @@ CpprunArgs parse_cpprun_args(const std::vector<std::string> & cpprun_args) {
 
         if (a == "--cpprun-compiler-info") {
             args.show_compiler_info = true;
+        } else if (a == "--cpprun-size") {
+            args.size_report = 20;
+        } else if (a.substr(0, 14) == "--cpprun-size=") {
+            args.size_report = std::stoul(a.substr(14));
+        } else if (a == "--cpprun-static" || a == "--cpprun-static=full") {
+            args.static_link = StaticLink::Full;
+        } else if (a == "--cpprun-static=pie") {
+            args.static_link = StaticLink::Pie;
+        } else if (a == "--cpprun-static=runtime") {
+            args.static_link = StaticLink::Runtime;
+        } else if (a.substr(0, 16) == "--cpprun-static=") {
+            throw std::runtime_error("unknown static link mode in " + a + ", expected full, pie or runtime");
+        } else if (a == "--cpprun-header-report") {
+            args.header_report = 20;
+        } else if (a.substr(0, 23) == "--cpprun-header-report=") {
+            args.header_report = std::stoul(a.substr(23));
+        } else if (a == "--cpprun-annotate") {
+            args.annotate_hz = 1000;
+        } else if (a.substr(0, 18) == "--cpprun-annotate=") {
+            args.annotate_hz = std::clamp(std::stoi(a.substr(18)), 1, 1000000);
+        } else if (a == "--cpprun-stack-usage") {
+            args.stack_usage = 0;
+        } else if (a.substr(0, 21) == "--cpprun-stack-usage=") {
+            args.stack_usage = std::stoul(a.substr(21));
+        } else if (a.substr(0, 19) == "--cpprun-events-fd=") {
+            args.events_fd = std::stoi(a.substr(19));
+        } else if (a == "--cpprun-memoize") {
+            args.memoize = std::vector<fs::path>{};
+        } else if (a.substr(0, 17) == "--cpprun-memoize=") {
+            args.memoize = std::vector<fs::path>{};
+            for (auto & file : split_list(a.substr(17))) {
+                args.memoize->push_back(file);
+            }
+        } else if (a.substr(0, 21) == "--cpprun-memoize-env=") {
+            args.memoize_env = split_list(a.substr(21));
+        } else if (a == "--cpprun-sanitize") {
+            args.sanitizers = {"address", "undefined", "thread"};
+        } else if (a.substr(0, 18) == "--cpprun-sanitize=") {
+            args.sanitizers = parse_sanitizers(a.substr(18));
+        } else if (a == "--cpprun-fuzz") {
+            args.fuzz_seconds = 60;
+        } else if (a.substr(0, 14) == "--cpprun-fuzz=") {
+            args.fuzz_seconds = std::max<size_t>(1, std::stoul(a.substr(14)));
+        } else if (a.substr(0, 22) == "--cpprun-fuzz-workers=") {
+            args.fuzz_workers = std::max<size_t>(1, std::stoul(a.substr(22)));
+        } else if (a.substr(0, 17) == "--cpprun-capture=") {
+            args.capture_bundle = fs::path(a.substr(17));
+        } else if (a.substr(0, 23) == "--cpprun-capture-files=") {
+            for (auto & file : split_list(a.substr(23))) {
+                args.capture_files.push_back(file);
+            }
+        } else if (a.substr(0, 21) == "--cpprun-capture-env=") {
+            args.capture_env = split_list(a.substr(21));
+        } else if (a == "--cpprun-replay") {
+            if (i + 1 >= cpprun_args.size()) {
+                throw std::runtime_error("--cpprun-replay requires a bundle");
+            }
+            args.replay_bundle = fs::path(cpprun_args[++i]);
+        } else if (a.substr(0, 16) == "--cpprun-replay=") {
+            args.replay_bundle = fs::path(a.substr(16));
+        } else if (a.substr(0, 21) == "--cpprun-replay-runs=") {
+            args.replay_runs = std::max<size_t>(1, std::stoul(a.substr(21)));
+        } else if (a.substr(0, 18) == "--cpprun-asm-diff=") {
+            args.asm_diff.push_back(a.substr(18));
+        } else if (a.substr(0, 13) == "--cpprun-tee=") {
+            args.tee_file = fs::path(a.substr(13));
+        } else if (a == "--cpprun-jit") {
+            args.jit = true;
+        } else if (a == "--cpprun-pipeline") {
+            args.pipeline = true;
+        } else if (a == "--cpprun-doctor") {
+            args.doctor = true;
+        } else if (a == "--cpprun-prewarm") {
+            args.prewarm = true;
+        } else if (a == "--cpprun-prewarm=wait") {
+            args.prewarm = args.prewarm_wait = true;
+        } else if (a.substr(0, 17) == "--cpprun-prewarm=") {
+            throw std::runtime_error("unknown prewarm mode in " + a + ", expected wait");
+        } else if (a == "--cpprun-build-trends") {
+            args.build_trends = true;
+        } else if (a == "--cpprun-build-profile") {
+            args.build_profile = true;
+        } else if (a == "--cpprun-startup") {
+            args.startup_runs = 5;
+        } else if (a.substr(0, 17) == "--cpprun-startup=") {
+            args.startup_runs = std::max(1, std::stoi(a.substr(17)));
+        } else if (a == "--cpprun-no-cache") {
+            args.no_cache = true;
         } else if (a == "-c") {
             args.build_only = true;
         } else if (a == "-o") {
@@ -206,12 +958,28 @@ CpprunArgs parse_cpprun_args(const std::vector<std::string> & cpprun_args) {
     return args;
 }
 
+std::vector<std::string> static_link_flags(StaticLink mode) {
+    switch (mode) {
+        case StaticLink::Full:
+            return {"-static"};
+        case StaticLink::Pie:
+            return {"-static-pie"};
+        case StaticLink::Runtime:
+            return {"-static-libstdc++", "-static-libgcc"};
+    }
+    return {};
+}
+
 auto collect_build_args(const CpprunArgs & args, const fs::path & output_file) {
     std::vector<std::string> cmd;
     if (args.cxx_standard.has_value()) {
         append(cmd, args.cxx_standard.value());
     }
     extend(cmd, args.build_args);
+    extend(cmd, args.runtime_flags);
+    if (args.static_link && !args.build_only) {
+        extend(cmd, static_link_flags(*args.static_link));
+    }
     if (args.build_only) {
         append(cmd, "-c");
     }
@@ -230,6 +998,13 @@ std::string format_run_dir(uint32_t indent_a, uint32_t indent_b) {
     return "cpprun-" + std::to_string(indent_a) + "-" + std::to_string(indent_b);
 }
 
+template <typename RNG>
+fs::path make_temp_dir(RNG & rng) {
+    auto dir = fs::temp_directory_path() / format_run_dir(random_value(rng), getpid());
+    fs::create_directories(dir);
+    return dir;
+}
+
 bool contains(const std::vector<std::string> & haystack, const std::string & needle) {
     return std::find(haystack.begin(), haystack.end(), needle) != haystack.end();
 }
@@ -242,68 +1017,8242 @@ auto unwrap_or_else(const std::optional<T> & opt, F && fallback) {
     return fallback();
 }
 
-int inner_main(int argc, const char ** argv_raw) {
-    std::vector<std::string> argv(argv_raw + 1, argv_raw + argc);
-    auto [cpprun_args, run_args] = split_args(argv);
+std::string read_file(const fs::path & path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("unable to read " + path.string());
+    }
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
 
-    CpprunArgs args = parse_cpprun_args(cpprun_args);
+// ".tmp<pid>.<n>": unique among the processes, and the threads of a library host, writing next to each other
+static std::string temp_suffix() {
+    static std::atomic<unsigned> counter{0};
+    return ".tmp" + std::to_string(getpid()) + "." + std::to_string(counter++);
+}
 
-    if (args.show_compiler_info or contains(cpprun_args, "--version") or contains(cpprun_args, "-v")) {
-        run_cmd(args.cxx, {"--version"}, true);
-        return 0;
+void write_file_atomic(const fs::path & path, const std::string & contents) {
+    fs::create_directories(path.parent_path());
+    auto tmp = path;
+    tmp += temp_suffix();
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out << contents;
+        if (!out) {
+            throw std::runtime_error("unable to write " + tmp.string());
+        }
     }
+    fs::rename(tmp, path);
+}
 
-    std::mt19937 rng(std::random_device{}());
+uint64_t fnv1a64(std::string_view data, uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
 
-    auto make_path = [&args, &rng]() -> fs::path {
-        auto tmpdir = fs::temp_directory_path();
-        auto rundir = format_run_dir(random_value(rng), getpid());
-        return tmpdir / rundir / (args.build_only ? "artifact.o" : "artifact.exe");
-    };
+// Writes 16 lowercase hex digits and a terminating NUL.
+void hex64_into(uint64_t value, char * out) {
+    for (int i = 15; i >= 0; --i, value >>= 4) {
+        out[i] = "0123456789abcdef"[value & 0xf];
+    }
+    out[16] = '\0';
+}
 
-    fs::path output_path = fs::absolute(unwrap_or_else(args.output_path, make_path));
+std::string hex64(uint64_t value) {
+    char buf[17];
+    hex64_into(value, buf);
+    return buf;
+}
 
-    fs::create_directories(output_path.parent_path());
+// Same as checking fs::path(arg).extension(), without allocating.
+bool is_source_file(std::string_view arg) {
+    static constexpr std::string_view extensions[] = {".cpp", ".cc", ".cxx", ".c++", ".C", ".c"};
+    if (arg.empty() || arg[0] == '-') {
+        return false;
+    }
+    auto slash = arg.rfind('/');
+    auto name = slash == std::string_view::npos ? arg : arg.substr(slash + 1);
+    auto dot = name.rfind('.');
+    if (dot == std::string_view::npos || dot == 0 || name == "..") {
+        return false;
+    }
+    return std::find(std::begin(extensions), std::end(extensions), name.substr(dot)) != std::end(extensions);
+}
 
-    auto cleanup = [&]() {
-        try {
-            if (!args.output_path) {
-                if (args.verbose) {
-                    std::cerr << ">>> Cleaning up temporary directory: " << output_path.parent_path() << std::endl;
-                }
-                // only cleanup if we created the output file in a temporary directory
-                fs::remove_all(output_path.parent_path());
-            }
-        } catch (...) {
+std::vector<fs::path> source_files(const std::vector<std::string> & build_args) {
+    std::vector<fs::path> sources;
+    for (auto & a : build_args) {
+        if (is_source_file(a)) {
+            sources.push_back(fs::absolute(a).lexically_normal());
         }
-    };
+    }
+    return sources;
+}
 
-    auto build_args = collect_build_args(args, output_path);
+std::optional<fs::path> cache_dir() {
+    if (const char * dir = std::getenv("CPPRUN_CACHE_DIR")) {
+        if (std::string(dir).empty()) {
+            return std::nullopt;
+        }
+        return fs::path(dir);
+    }
+    if (const char * xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        return fs::path(xdg) / "cpprun";
+    }
+    if (const char * home = std::getenv("HOME"); home && *home) {
+        return fs::path(home) / ".cache" / "cpprun";
+    }
+    return std::nullopt;
+}
 
-    int rc = run_cmd(args.cxx, build_args, args.verbose);
+// identifies "the same script" across builds, independent of flags and contents
+std::string script_key(const std::vector<fs::path> & sources) {
+    uint64_t hash = fnv1a64("");
+    for (auto & s : sources) {
+        hash = fnv1a64(s.string() + '\n', hash);
+    }
+    return hex64(hash);
+}
 
-    if (rc != 0 || args.build_only) {
-        cleanup();
-        return rc;
+std::optional<fs::path> resolve_program(const std::string & name) {
+    if (name.find('/') != std::string::npos) {
+        return fs::exists(name) ? std::make_optional(fs::absolute(name)) : std::nullopt;
     }
+    const char * path = std::getenv("PATH");
+    std::istringstream iss(path ? path : "");
+    std::string dir;
+    while (std::getline(iss, dir, ':')) {
+        auto candidate = fs::path(dir.empty() ? "." : dir) / name;
+        if (access(candidate.c_str(), X_OK) == 0) {
+            return candidate;
+        }
+    }
+    return std::nullopt;
+}
 
-    if (not fs::exists(output_path)) {
-        std::cerr << "ERROR: expected output file at " << output_path << " was not created, unable to continue!"
-                  << std::endl;
-        cleanup();
-        return 127;
+// Identifies the compiler installation without running it: the file the driver resolves to (through symlinks such
+// as /usr/bin/c++), with its size and mtime. Written without allocations, the cache hit fast path uses it too.
+uint64_t compiler_fingerprint_hash(std::string_view cxx) {
+    char candidate[PATH_MAX];
+    bool found = false;
+    if (cxx.find('/') != std::string_view::npos) {
+        found = cxx.size() < sizeof(candidate);
+        if (found) {
+            std::memcpy(candidate, cxx.data(), cxx.size());
+            candidate[cxx.size()] = '\0';
+        }
+    } else {
+        const char * path = std::getenv("PATH");
+        std::string_view dirs = path ? path : "";
+        while (!found) {
+            auto colon = dirs.find(':');
+            auto dir = dirs.substr(0, colon);
+            if (dir.empty()) {
+                dir = ".";
+            }
+            if (dir.size() + 1 + cxx.size() < sizeof(candidate)) {
+                std::memcpy(candidate, dir.data(), dir.size());
+                candidate[dir.size()] = '/';
+                std::memcpy(candidate + dir.size() + 1, cxx.data(), cxx.size());
+                candidate[dir.size() + 1 + cxx.size()] = '\0';
+                found = access(candidate, X_OK) == 0;
+            }
+            if (colon == std::string_view::npos) {
+                break;
+            }
+            dirs.remove_prefix(colon + 1);
+        }
+    }
+    struct stat st;
+    if (!found || stat(candidate, &st) != 0) {
+        return fnv1a64(cxx);
     }
 
-    rc = run_cmd(output_path.string(), run_args, args.verbose);
+    char stamp[128];
+    auto end = stamp, limit = stamp + sizeof(stamp);
+    for (auto value : {uint64_t(st.st_dev), uint64_t(st.st_ino), uint64_t(st.st_size), uint64_t(st.st_mtim.tv_sec),
+                       uint64_t(st.st_mtim.tv_nsec)}) {
+        end = std::to_chars(end, limit, value).ptr;
+        *end++ = '\n';
+    }
+    return fnv1a64(std::string_view(stamp, size_t(end - stamp)));
+}
 
-    cleanup();
+std::string compiler_fingerprint(const std::string & cxx) {
+    return hex64(compiler_fingerprint_hash(cxx));
+}
+
+std::optional<std::string> missing_static_runtime(const CpprunArgs & args) {
+    auto have = [&](const std::string & file) {
+        std::string out;
+        if (capture_cmd(args.cxx, {"-print-file-name=" + file}, out, false) != 0) {
+            return false;
+        }
+        out.erase(out.find_last_not_of(" \n") + 1);
+        return fs::path(out).is_absolute() && fs::exists(out);
+    };
+
+    if (!have("libstdc++.a") && !have("libc++.a")) {
+        return "the static C++ runtime (libstdc++.a or libc++.a) was not found by " + args.cxx +
+               "; install the static development package of your C++ standard library (e.g. libstdc++-static)";
+    }
+    if (*args.static_link == StaticLink::Runtime) {
+        return std::nullopt;
+    }
+    if (!have("libc.a")) {
+        return "the static C library (libc.a) was not found by " + args.cxx +
+               "; install it (e.g. glibc-static or libc6-dev), or use --cpprun-static=runtime to link only the C++ "
+               "runtime statically";
+    }
+    if (*args.static_link == StaticLink::Pie && !have("rcrt1.o")) {
+        return "the static-pie startup file (rcrt1.o) was not found by " + args.cxx +
+               "; the C library was built without static-pie support, use --cpprun-static instead";
+    }
+    return std::nullopt;
+}
+
+// Probing the toolchain costs several compiler invocations, so a complete runtime is remembered per compiler
+// installation. A missing one is probed again every time: installing the static libraries does not change the
+// compiler fingerprint.
+std::optional<std::string> check_static_runtime(const CpprunArgs & args) {
+    std::optional<fs::path> cached;
+    if (auto dir = cache_dir()) {
+        auto mode = static_link_flags(*args.static_link).front().substr(1);
+        cached = *dir / "static" / (compiler_fingerprint(args.cxx) + "." + mode);
+    }
+    std::error_code ec;
+    if (cached && fs::file_size(*cached, ec) == 0) {
+        return std::nullopt;
+    }
+    auto verdict = missing_static_runtime(args);
+    if (cached && !verdict) {
+        try {
+            write_file_atomic(*cached, "");
+        } catch (const std::exception &) {
+        }
+    }
+    return verdict;
+}
+
+// Everything needed to repeat a cached build: "cxx\ncwd\narg\narg\n..."
+struct BuildRecord {
+    std::string cxx;
+    fs::path cwd;
+    std::vector<std::string> args;
+};
+
+std::string format_build_record(const BuildRecord & record) {
+    std::string out = record.cxx + "\n" + record.cwd.string() + "\n";
+    for (auto & a : record.args) {
+        out += a + "\n";
+    }
+    return out;
+}
+
+std::optional<BuildRecord> parse_build_record(const std::string & text) {
+    std::istringstream iss(text);
+    BuildRecord record;
+    std::string cwd;
+    if (!std::getline(iss, record.cxx) || !std::getline(iss, cwd)) {
+        return std::nullopt;
+    }
+    record.cwd = cwd;
+    for (std::string line; std::getline(iss, line);) {
+        record.args.push_back(line);
+    }
+    return record;
+}
+
+BuildRecord make_build_record(const CpprunArgs & args) {
+    BuildRecord record{args.cxx, fs::current_path(), collect_build_args(args, fs::path{})};
+    record.args.resize(record.args.size() - 2);  // drop "-o" ""
+    return record;
+}
+
+// Artifact cache: executables are stored under CPPRUN_CACHE_DIR/artifacts/<key>, where the key covers the compiler,
+// the working directory, the full command line, the compiler's search path variables and the contents of the source
+// files. Headers and link inputs are not part of the key; the manifest written next to the artifact lists them with
+// their size and mtime, and an entry is only used while all of them are unchanged. The cache is bounded by
+// CPPRUN_CACHE_MAX_MB, beyond which the entries stored longest ago are removed.
+
+// Environment variables that change what the compiler and the linker find
+const char * const CACHE_KEY_ENV[] = {"CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "LIBRARY_PATH",
+                                      "COMPILER_PATH", "GCC_EXEC_PREFIX"};
+const uint64_t DEFAULT_CACHE_MAX_MB = 1024;
+
+std::optional<fs::path> artifact_cache_entry(const CpprunArgs & args) {
+    auto dir = cache_dir();
+    if (!dir || args.no_cache || args.output_path || args.build_only) {
+        return std::nullopt;
+    }
+    auto sources = source_files(args.build_args);
+    if (sources.empty()) {
+        return std::nullopt;
+    }
+
+    // the runtime flags follow from the sources, which are in the key, and the headers, which are in the manifest
+    auto key_args = args;
+    key_args.runtime_flags.clear();
+    uint64_t key = fnv1a64(compiler_fingerprint(args.cxx) + '\n' + fs::current_path().string() + '\n');
+    for (auto & a : collect_build_args(key_args, fs::path{})) {
+        key = fnv1a64(a + '\n', key);
+    }
+    for (auto name : CACHE_KEY_ENV) {
+        if (const char * value = std::getenv(name)) {
+            key = fnv1a64(std::string(name) + "=" + value + "\n", key);
+        }
+    }
+    for (auto & s : sources) {
+        std::error_code ec;
+        if (!fs::is_regular_file(s, ec)) {
+            return std::nullopt;
+        }
+        key = fnv1a64(read_file(s), key);
+    }
+    return *dir / "artifacts" / hex64(key);
+}
+
+// Parses a make-style dependency file as written by -MD: "target: dep1 dep2 \<newline> dep3"
+std::vector<std::string> parse_depfile(const std::string & text) {
+    std::vector<std::string> deps;
+    auto colon = text.find(": ");
+    if (colon == std::string::npos) {
+        return deps;
+    }
+    std::string current;
+    for (size_t i = colon + 2; i < text.size(); ++i) {
+        char c = text[i];
+        if (c == '\\' && i + 1 < text.size() && (text[i + 1] == ' ' || text[i + 1] == '#')) {
+            current += text[++i];
+        } else if (c == '\\' && i + 1 < text.size() && text[i + 1] == '\n') {
+            ++i;
+        } else if (c == ' ' || c == '\t' || c == '\n') {
+            if (!current.empty()) {
+                deps.push_back(current);
+                current.clear();
+            }
+        } else {
+            current += c;
+        }
+    }
+    if (!current.empty()) {
+        deps.push_back(current);
+    }
+    return deps;
+}
+
+// "size sec.nsec", or "- -" for a file that does not exist
+static std::string file_stamp(const fs::path & path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return "- -";
+    }
+    return std::to_string(st.st_size) + " " + std::to_string(st.st_mtim.tv_sec) + "." +
+           std::to_string(st.st_mtim.tv_nsec);
+}
+
+std::string format_manifest(const std::vector<std::string> & deps, const std::vector<fs::path> & sources) {
+    std::string out;
+    for (auto & d : deps) {
+        auto path = fs::absolute(d).lexically_normal();
+        if (std::find(sources.begin(), sources.end(), path) == sources.end()) {
+            out += file_stamp(path) + " " + path.string() + "\n";
+        }
+    }
+    return out;
+}
+
+// "size mtime path" per line; all listed files must still carry the same stamp
+bool manifest_is_current(const std::string & manifest) {
+    std::istringstream iss(manifest);
+    std::string size, mtime, path;
+    while (iss >> size >> mtime && std::getline(iss >> std::ws, path)) {
+        if (file_stamp(path) != size + " " + mtime) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The files the link reads besides the objects of the sources: object files, archives and shared libraries given
+// as arguments, and the libraries that -l selects, searched like the linker does (-L directories, then the
+// compiler's library path).
+std::vector<std::string> link_inputs(const CpprunArgs & args) {
+    std::vector<std::string> inputs, dirs, libs;
+    auto build_args = collect_build_args(args, fs::path{});
+    for (size_t i = 0; i < build_args.size(); ++i) {
+        auto & a = build_args[i];
+        if ((a == "-L" || a == "-l") && i + 1 < build_args.size()) {
+            (a == "-L" ? dirs : libs).push_back(build_args[++i]);
+        } else if (a.size() > 2 && (a.substr(0, 2) == "-L" || a.substr(0, 2) == "-l")) {
+            (a[1] == 'L' ? dirs : libs).push_back(a.substr(2));
+        } else if (!a.empty() && a[0] != '-' && !is_source_file(a)) {
+            std::error_code ec;
+            if (fs::is_regular_file(a, ec)) {
+                inputs.push_back(a);
+            }
+        }
+    }
+
+    bool static_only = contains(build_args, "-static") || contains(build_args, "-static-pie");
+    for (auto & lib : libs) {
+        std::vector<std::string> names;
+        if (lib[0] == ':') {
+            names = {lib.substr(1)};
+        } else if (static_only) {
+            names = {"lib" + lib + ".a"};
+        } else {
+            names = {"lib" + lib + ".so", "lib" + lib + ".a"};
+        }
+        std::optional<fs::path> found;
+        for (size_t d = 0; !found && d < dirs.size(); ++d) {
+            for (auto & name : names) {
+                std::error_code ec;
+                if (fs::exists(fs::path(dirs[d]) / name, ec)) {
+                    found = fs::path(dirs[d]) / name;
+                    break;
+                }
+            }
+        }
+        for (size_t n = 0; !found && n < names.size(); ++n) {
+            std::string out;
+            if (capture_cmd(args.cxx, {"-print-file-name=" + names[n]}, out, false) == 0) {
+                out.erase(out.find_last_not_of(" \n") + 1);
+                std::error_code ec;
+                if (fs::path(out).is_absolute() && fs::exists(out, ec)) {
+                    found = out;
+                }
+            }
+        }
+        if (found) {
+            inputs.push_back(found->string());
+        }
+    }
+    return inputs;
+}
+
+// Removes the entries stored longest ago until the artifact cache fits into CPPRUN_CACHE_MAX_MB (0 for no limit).
+// Entries without a manifest are still being stored by another process and are left alone.
+void prune_artifact_cache(const fs::path & artifacts) {
+    uint64_t max_mb = DEFAULT_CACHE_MAX_MB;
+    if (const char * value = std::getenv("CPPRUN_CACHE_MAX_MB"); value && *value) {
+        max_mb = std::strtoull(value, nullptr, 10);
+    }
+    if (max_mb == 0) {
+        return;
+    }
+
+    std::vector<std::tuple<fs::file_time_type, fs::path, uintmax_t>> entries;
+    uintmax_t total = 0;
+    std::error_code ec;
+    for (auto & e : fs::directory_iterator(artifacts, ec)) {
+        uintmax_t size = 0;
+        for (auto & file : fs::directory_iterator(e.path(), ec)) {
+            std::error_code size_ec;
+            auto file_size = file.file_size(size_ec);
+            size += size_ec ? 0 : file_size;
+        }
+        total += size;
+        std::error_code stamp_ec;
+        auto stamp = fs::last_write_time(e.path() / "manifest", stamp_ec);
+        if (!stamp_ec) {
+            entries.emplace_back(stamp, e.path(), size);
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    for (auto & [stamp, path, size] : entries) {
+        if (total <= max_mb * 1024 * 1024) {
+            break;
+        }
+        fs::remove_all(path, ec);
+        total -= size;
+    }
+}
+
+bool cache_entry_is_valid(const fs::path & entry, const std::string & artifact_name = "artifact.exe") {
+    std::error_code ec;
+    if (!fs::exists(entry / artifact_name, ec) || !fs::exists(entry / "manifest", ec)) {
+        return false;
+    }
+    return manifest_is_current(read_file(entry / "manifest"));
+}
+
+void store_cache_entry(const fs::path & entry, const CpprunArgs & args, const fs::path & artifact,
+                       const fs::path & depfile, const std::string & artifact_name = "artifact.exe") {
+    auto deps = fs::exists(depfile) ? parse_depfile(read_file(depfile)) : std::vector<std::string>{};
+    extend(deps, link_inputs(args));
+    write_file_atomic(entry / "manifest", format_manifest(deps, source_files(args.build_args)));
+    write_file_atomic(entry / "command", format_build_record(make_build_record(args)));
+    // the fast path leaves entries with environment defaults (see parallel_runtime_env) to the regular path
+    if (uses_openmp(args)) {
+        std::string env;
+        for (auto & [name, value] : OPENMP_ENV_DEFAULTS) {
+            env += name + "=" + value + "\n";
+        }
+        write_file_atomic(entry / "env", env);
+    } else {
+        std::error_code ec;
+        fs::remove(entry / "env", ec);
+    }
+
+    auto tmp = entry / (artifact_name + temp_suffix());
+    fs::copy_file(artifact, tmp, fs::copy_options::overwrite_existing);
+    fs::rename(tmp, entry / artifact_name);
+    prune_artifact_cache(entry.parent_path());
+}
+
+// Cache hit fast path: main() first checks whether the invocation is a plain "cpprun [flags] sources [-- args]"
+// with a current cache entry, and if so execs the cached executable in place of cpprun. It computes the same key
+// as artifact_cache_entry and checks the manifest like cache_entry_is_valid, but with string_views into argv and
+// fixed buffers instead of the heap, no iostreams and no std::filesystem. Anything else takes the regular path.
+
+constexpr size_t FAST_PATH_MAX_ARGS = 256;
+
+// A NUL-terminated path assembled in a fixed buffer.
+class PathBuffer {
+   public:
+    PathBuffer & operator+=(std::string_view s) {
+        if (ok_ && size_ + s.size() < sizeof(data_)) {
+            std::memcpy(data_ + size_, s.data(), s.size());
+            size_ += s.size();
+            data_[size_] = '\0';
+        } else {
+            ok_ = false;
+        }
+        return *this;
+    }
+
+    void resize(size_t size) {
+        size_ = size;
+        data_[size_] = '\0';
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    const char * c_str() const {
+        return data_;
+    }
+
+    bool ok() const {
+        return ok_;
+    }
+
+   private:
+    char data_[PATH_MAX] = {};
+    size_t size_ = 0;
+    bool ok_ = true;
+};
+
+// Hashes the contents of a regular file into hash; false if it can not be read.
+static bool hash_file(const char * path, uint64_t & hash) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            close(fd);
+            return false;
+        }
+        hash = fnv1a64(std::string_view(buf, size_t(n)), hash);
+    }
+    close(fd);
+    return true;
+}
+
+// Same check as manifest_is_current, for a manifest of at most 64 KiB.
+static bool fast_manifest_is_current(const char * manifest_path) {
+    static char manifest[65536];
+    int fd = open(manifest_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    size_t size = 0;
+    ssize_t n;
+    while (size < sizeof(manifest) && (n = read(fd, manifest + size, sizeof(manifest) - size)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        size += size_t(n);
+    }
+    close(fd);
+    if (size == sizeof(manifest)) {
+        return false;
+    }
+
+    std::string_view text(manifest, size);
+    while (!text.empty()) {
+        auto newline = text.find('\n');
+        auto line = text.substr(0, newline);
+        text.remove_prefix(newline == std::string_view::npos ? text.size() : newline + 1);
+
+        auto space1 = line.find(' ');
+        auto space2 = space1 == std::string_view::npos ? space1 : line.find(' ', space1 + 1);
+        if (space2 == std::string_view::npos) {
+            return false;
+        }
+        PathBuffer path;
+        path += line.substr(space2 + 1);
+        struct stat st;
+        if (!path.ok()) {
+            return false;
+        }
+        if (stat(path.c_str(), &st) != 0) {
+            if (line.substr(0, space2) == "- -") {
+                continue;
+            }
+            return false;
+        }
+        // the stamp as written by file_stamp: "size sec.nsec"
+        char stamp[64];
+        auto end = std::to_chars(stamp, stamp + sizeof(stamp), st.st_size).ptr;
+        *end++ = ' ';
+        end = std::to_chars(end, stamp + sizeof(stamp), st.st_mtim.tv_sec).ptr;
+        *end++ = '.';
+        end = std::to_chars(end, stamp + sizeof(stamp), st.st_mtim.tv_nsec).ptr;
+        if (line.substr(0, space2) != std::string_view(stamp, size_t(end - stamp))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Finds the cached executable for a plain invocation, and where its run arguments start in argv.
+bool find_cached_artifact(int argc, const char ** argv, PathBuffer & artifact, int & run_begin) {
+    auto env_set = [](const char * name) {
+        const char * value = std::getenv(name);
+        return value && *value;
+    };
+    const char * verbose = std::getenv("CPPRUN_VERBOSE");
+    if ((verbose && std::atoi(verbose)) || env_set("CPPRUN_METRICS_FILE") || env_set("CPPRUN_METRICS_TEXTFILE")) {
+        return false;
+    }
+
+    // the build arguments in the order collect_build_args produces them
+    std::string_view args[FAST_PATH_MAX_ARGS];
+    size_t nargs = 1;  // args[0] is the -std= flag, if any
+    std::optional<std::string_view> standard = DEFAULT_CXX_STANDARD;
+    if (const char * env_standard = std::getenv("CPPRUN_CXX_STANDARD")) {
+        standard = *env_standard ? std::make_optional<std::string_view>(env_standard) : std::nullopt;
+    }
+    if (const char * cxxflags = std::getenv("CPPRUN_CXXFLAGS")) {
+        // whitespace separated, like parse_cxxflags_into
+        std::string_view flags = cxxflags;
+        auto space = [](char c) { return std::isspace(static_cast<unsigned char>(c)) != 0; };
+        while (true) {
+            auto begin = std::find_if_not(flags.begin(), flags.end(), space);
+            auto end = std::find_if(begin, flags.end(), space);
+            if (begin == end) {
+                break;
+            }
+            if (nargs == FAST_PATH_MAX_ARGS) {
+                return false;
+            }
+            args[nargs++] = flags.substr(size_t(begin - flags.begin()), size_t(end - begin));
+            flags.remove_prefix(size_t(end - flags.begin()));
+        }
+    } else {
+        for (auto & flag : DEFAULT_CXXFLAGS) {
+            if (nargs == FAST_PATH_MAX_ARGS) {
+                return false;
+            }
+            args[nargs++] = flag;
+        }
+    }
+
+    run_begin = argc;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view a = argv[i];
+        if (a == "--") {
+            run_begin = i + 1;
+            break;
+        }
+        // options with a meaning of their own take the regular path
+        if (a.substr(0, 9) == "--cpprun-" || a == "-c" || a == "-o" || a == "-v" || a == "--version") {
+            return false;
+        }
+        if (a.substr(0, 5) == "-std=") {
+            standard = a;
+        } else if (nargs == FAST_PATH_MAX_ARGS) {
+            return false;
+        } else {
+            args[nargs++] = a;
+        }
+    }
+    size_t first = 1;
+    if (standard) {
+        args[0] = *standard;
+        first = 0;
+    }
+
+    const char * cxx = std::getenv("CPPRUN_CXX");
+    char fingerprint[17];
+    hex64_into(compiler_fingerprint_hash(cxx ? cxx : "c++"), fingerprint);
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return false;
+    }
+    uint64_t key = fnv1a64(fingerprint);
+    key = fnv1a64("\n", key);
+    key = fnv1a64(cwd, key);
+    key = fnv1a64("\n", key);
+    for (size_t i = first; i < nargs; ++i) {
+        key = fnv1a64(args[i], key);
+        key = fnv1a64("\n", key);
+    }
+    key = fnv1a64("-o\n\n", key);  // collect_build_args without an output file
+    for (auto name : CACHE_KEY_ENV) {
+        if (const char * value = std::getenv(name)) {
+            key = fnv1a64(name, key);
+            key = fnv1a64("=", key);
+            key = fnv1a64(value, key);
+            key = fnv1a64("\n", key);
+        }
+    }
+
+    bool any_source = false;
+    for (size_t i = 1; i < nargs; ++i) {
+        if (is_source_file(args[i])) {
+            PathBuffer source;
+            source += args[i];
+            if (!source.ok() || !hash_file(source.c_str(), key)) {
+                return false;
+            }
+            any_source = true;
+        }
+    }
+    if (!any_source) {
+        return false;
+    }
+
+    auto & entry = artifact = PathBuffer();
+    const char * dir = std::getenv("CPPRUN_CACHE_DIR");
+    const char * xdg = std::getenv("XDG_CACHE_HOME");
+    const char * home = std::getenv("HOME");
+    if (dir) {
+        if (!*dir) {
+            return false;
+        }
+        entry += dir;
+    } else if (xdg && *xdg) {
+        entry += xdg;
+        entry += "/cpprun";
+    } else if (home && *home) {
+        entry += home;
+        entry += "/.cache/cpprun";
+    } else {
+        return false;
+    }
+    char hex[17];
+    hex64_into(key, hex);
+    entry += "/artifacts/";
+    entry += hex;
+    auto entry_size = entry.size();
+    entry += "/manifest";
+    if (!entry.ok() || !fast_manifest_is_current(entry.c_str())) {
+        return false;
+    }
+    entry.resize(entry_size);
+    entry += "/env";
+    if (!entry.ok() || access(entry.c_str(), F_OK) == 0) {
+        return false;
+    }
+    entry.resize(entry_size);
+    entry += "/artifact.exe";
+    return entry.ok();
+}
+
+// Returns only if the fast path does not apply or the exec failed.
+void exec_if_cached(int argc, const char ** argv) {
+    PathBuffer artifact;
+    int run_begin = argc;
+    if (!find_cached_artifact(argc, argv, artifact, run_begin) || argc - run_begin + 2 > int(FAST_PATH_MAX_ARGS)) {
+        return;
+    }
+    const char * run_argv[FAST_PATH_MAX_ARGS];
+    size_t nrun = 0;
+    run_argv[nrun++] = artifact.c_str();
+    for (int i = run_begin; i < argc; ++i) {
+        run_argv[nrun++] = argv[i];
+    }
+    run_argv[nrun] = nullptr;
+    execv(artifact.c_str(), const_cast<char * const *>(run_argv));
+}
+
+// Minimal ELF64 reader, enough to look at sections and symbols without binutils.
+
+struct ElfSection {
+    std::string name;
+    uint32_t type = 0;
+    uint64_t flags = 0;
+    uint64_t addr = 0;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint32_t link = 0;
+    uint32_t info = 0;
+    uint64_t entsize = 0;
+};
+
+struct ElfSymbol {
+    std::string name;
+    uint64_t value = 0;
+    uint64_t size = 0;
+    uint16_t shndx = 0;
+    unsigned char type = 0;
+    unsigned char bind = 0;
+};
+
+struct ElfFile {
+    uint16_t type = 0;
+    uint16_t machine = 0;
+    std::string data;
+    std::vector<ElfSection> sections;
+    std::vector<ElfSymbol> symbols;  // indexed like the symbol table, including the null symbol
+
+    const ElfSection * find_section(const std::string & name) const {
+        for (auto & s : sections) {
+            if (s.name == name) {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+
+    std::string_view section_data(const ElfSection & section) const {
+        if (section.type == SHT_NOBITS || section.offset + section.size > data.size()) {
+            return {};
+        }
+        return std::string_view(data).substr(section.offset, section.size);
+    }
+};
+
+template <typename T>
+T read_at(std::string_view data, uint64_t offset) {
+    if (offset + sizeof(T) > data.size()) {
+        throw std::runtime_error("truncated ELF file");
+    }
+    T value;
+    std::memcpy(&value, data.data() + offset, sizeof(T));
+    return value;
+}
+
+std::string read_cstr(std::string_view data, uint64_t offset) {
+    if (offset >= data.size()) {
+        return {};
+    }
+    auto end = data.find('\0', offset);
+    return std::string(data.substr(offset, end == std::string_view::npos ? end : end - offset));
+}
+
+static void read_elf_symbols(ElfFile & elf, const ElfSection & symtab) {
+    auto syms = elf.section_data(symtab);
+    auto strtab = symtab.link < elf.sections.size() ? elf.section_data(elf.sections[symtab.link]) : std::string_view{};
+    for (uint64_t off = 0; off + sizeof(Elf64_Sym) <= syms.size(); off += sizeof(Elf64_Sym)) {
+        auto sym = read_at<Elf64_Sym>(syms, off);
+        ElfSymbol out;
+        out.name = read_cstr(strtab, sym.st_name);
+        out.value = sym.st_value;
+        out.size = sym.st_size;
+        out.shndx = sym.st_shndx;
+        out.type = ELF64_ST_TYPE(sym.st_info);
+        out.bind = ELF64_ST_BIND(sym.st_info);
+        elf.symbols.push_back(std::move(out));
+    }
+}
+
+ElfFile read_elf(const fs::path & path) {
+    ElfFile elf;
+    elf.data = read_file(path);
+    std::string_view data = elf.data;
+
+    if (data.size() < EI_NIDENT || data.substr(0, SELFMAG) != ELFMAG) {
+        throw std::runtime_error(path.string() + " is not an ELF file");
+    }
+    if (data[EI_CLASS] != ELFCLASS64 || data[EI_DATA] != ELFDATA2LSB) {
+        throw std::runtime_error(path.string() + ": only little-endian ELF64 is supported");
+    }
+
+    auto ehdr = read_at<Elf64_Ehdr>(data, 0);
+    elf.type = ehdr.e_type;
+    elf.machine = ehdr.e_machine;
+
+    std::vector<uint32_t> name_offsets;
+    for (uint16_t i = 0; i < ehdr.e_shnum; ++i) {
+        auto shdr = read_at<Elf64_Shdr>(data, ehdr.e_shoff + uint64_t(i) * ehdr.e_shentsize);
+        ElfSection s;
+        s.type = shdr.sh_type;
+        s.flags = shdr.sh_flags;
+        s.addr = shdr.sh_addr;
+        s.offset = shdr.sh_offset;
+        s.size = shdr.sh_size;
+        s.link = shdr.sh_link;
+        s.info = shdr.sh_info;
+        s.entsize = shdr.sh_entsize;
+        name_offsets.push_back(shdr.sh_name);
+        elf.sections.push_back(s);
+    }
+    if (ehdr.e_shstrndx < elf.sections.size()) {
+        auto names = elf.section_data(elf.sections[ehdr.e_shstrndx]);
+        for (size_t i = 0; i < elf.sections.size(); ++i) {
+            elf.sections[i].name = read_cstr(names, name_offsets[i]);
+        }
+    }
+
+    // prefer the full symbol table, stripped binaries only have the dynamic one
+    const ElfSection * symtab = nullptr;
+    for (auto & s : elf.sections) {
+        if (s.type == SHT_SYMTAB || (s.type == SHT_DYNSYM && symtab == nullptr)) {
+            symtab = &s;
+        }
+    }
+    if (symtab) {
+        read_elf_symbols(elf, *symtab);
+    }
+    return elf;
+}
+
+std::string demangle(const std::string & name) {
+    int status = 0;
+    char * out = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+    if (status != 0 || out == nullptr) {
+        return name;
+    }
+    std::string result(out);
+    std::free(out);
+    return result;
+}
+
+// Collapses template arguments so that all instantiations of a template land in the same bucket,
+// e.g. "std::vector<int, std::allocator<int> >::push_back(int const&)" -> "std::vector<>::push_back(int const&)"
+std::string template_family(const std::string & demangled) {
+    static const std::vector<std::string> operators = {
+        "operator<<=", "operator<<", "operator<=>", "operator<=", "operator<",  "operator->*",
+        "operator->",  "operator>>=", "operator>>", "operator>=", "operator>",
+    };
+    std::string out;
+    int depth = 0;
+    for (size_t i = 0; i < demangled.size(); ++i) {
+        if (depth == 0 && demangled.compare(i, 8, "operator") == 0) {
+            auto op = std::find_if(operators.begin(), operators.end(),
+                                   [&](auto & o) { return demangled.compare(i, o.size(), o) == 0; });
+            if (op != operators.end()) {
+                out += *op;
+                i += op->size() - 1;
+                continue;
+            }
+        }
+        char c = demangled[i];
+        if (c == '<') {
+            if (depth++ == 0) {
+                out += '<';
+            }
+        } else if (c == '>' && depth > 0) {
+            if (--depth == 0) {
+                out += '>';
+            }
+        } else if (depth == 0) {
+            out += c;
+        }
+    }
+    return out;
+}
+
+struct SizeEntry {
+    std::string name;
+    std::string section;
+    uint64_t bytes = 0;
+    size_t count = 0;
+};
+
+struct SizeReport {
+    std::map<std::string, uint64_t> sections;
+    std::vector<SizeEntry> symbols;   // sorted by size, descending
+    std::vector<SizeEntry> families;  // sorted by size, descending
+};
+
+// .text.foo, .rodata.str1.1, .data.rel.ro etc are accounted to their parent section
+std::optional<std::string> size_bucket(const std::string & section_name) {
+    for (const char * bucket : {".text", ".rodata", ".data"}) {
+        if (section_name == bucket || section_name.rfind(std::string(bucket) + ".", 0) == 0) {
+            return std::string(bucket);
+        }
+    }
+    return std::nullopt;
+}
+
+SizeReport compute_size_report(const ElfFile & elf) {
+    SizeReport report;
+    std::vector<std::optional<std::string>> buckets;
+    for (auto & s : elf.sections) {
+        auto b = size_bucket(s.name);
+        buckets.push_back(b);
+        if (b && (s.flags & SHF_ALLOC)) {
+            report.sections[*b] += s.size;
+        }
+    }
+
+    std::map<std::pair<uint16_t, uint64_t>, bool> seen;  // aliases (e.g. C1/C2 constructors) share an address
+    std::map<std::string, SizeEntry> families;
+    for (auto & sym : elf.symbols) {
+        if (sym.size == 0 || sym.shndx == SHN_UNDEF || sym.shndx >= buckets.size() || !buckets[sym.shndx]) {
+            continue;
+        }
+        if (sym.type != STT_FUNC && sym.type != STT_OBJECT) {
+            continue;
+        }
+        if (seen[{sym.shndx, sym.value}]) {
+            continue;
+        }
+        seen[{sym.shndx, sym.value}] = true;
+
+        SizeEntry entry{demangle(sym.name), *buckets[sym.shndx], sym.size, 1};
+        auto family = template_family(entry.name);
+        auto & f = families[family];
+        f.name = family;
+        f.section = entry.section;
+        f.bytes += entry.bytes;
+        f.count += 1;
+        report.symbols.push_back(std::move(entry));
+    }
+    for (auto & [_, f] : families) {
+        report.families.push_back(f);
+    }
+
+    auto by_size = [](const SizeEntry & a, const SizeEntry & b) {
+        return a.bytes != b.bytes ? a.bytes > b.bytes : a.name < b.name;
+    };
+    std::sort(report.symbols.begin(), report.symbols.end(), by_size);
+    std::sort(report.families.begin(), report.families.end(), by_size);
+    return report;
+}
+
+// family -> bytes, as stored between builds
+using SizeSnapshot = std::map<std::string, uint64_t>;
+
+SizeSnapshot size_snapshot(const SizeReport & report) {
+    SizeSnapshot snapshot;
+    for (auto & [section, bytes] : report.sections) {
+        snapshot["[section] " + section] = bytes;
+    }
+    for (auto & f : report.families) {
+        snapshot[f.name] = f.bytes;
+    }
+    return snapshot;
+}
+
+std::string format_size_snapshot(const SizeSnapshot & snapshot) {
+    std::string out;
+    for (auto & [name, bytes] : snapshot) {
+        out += std::to_string(bytes) + '\t' + name + '\n';
+    }
+    return out;
+}
+
+SizeSnapshot parse_size_snapshot(const std::string & text) {
+    SizeSnapshot snapshot;
+    std::istringstream iss(text);
+    std::string line;
+    while (std::getline(iss, line)) {
+        auto tab = line.find('\t');
+        if (tab != std::string::npos) {
+            snapshot[line.substr(tab + 1)] = std::stoull(line.substr(0, tab));
+        }
+    }
+    return snapshot;
+}
+
+void print_size_report(std::ostream & out, const SizeReport & report, const std::optional<SizeSnapshot> & previous,
+                       size_t top) {
+    out << "section       bytes\n";
+    for (auto & [section, bytes] : report.sections) {
+        out << std::left << std::setw(8) << section << std::right << std::setw(12) << bytes << "\n";
+    }
+
+    out << "\ntop symbols:\n";
+    for (size_t i = 0; i < std::min(top, report.symbols.size()); ++i) {
+        auto & s = report.symbols[i];
+        out << std::setw(10) << s.bytes << "  " << std::left << std::setw(8) << s.section << std::right << s.name
+            << "\n";
+    }
+
+    out << "\ntop template families:\n";
+    for (size_t i = 0; i < std::min(top, report.families.size()); ++i) {
+        auto & f = report.families[i];
+        out << std::setw(10) << f.bytes << "  " << std::setw(5) << f.count << "x  " << f.name << "\n";
+    }
+
+    if (!previous) {
+        out << "\nno previous build of this source to compare against\n";
+        return;
+    }
+
+    auto current = size_snapshot(report);
+    std::vector<std::pair<int64_t, std::string>> deltas;
+    for (auto & [name, bytes] : current) {
+        auto it = previous->find(name);
+        int64_t delta = int64_t(bytes) - (it == previous->end() ? 0 : int64_t(it->second));
+        if (delta != 0) {
+            deltas.emplace_back(delta, name);
+        }
+    }
+    for (auto & [name, bytes] : *previous) {
+        if (current.count(name) == 0) {
+            deltas.emplace_back(-int64_t(bytes), name);
+        }
+    }
+    std::sort(deltas.begin(), deltas.end(), [](auto & a, auto & b) {
+        return std::abs(a.first) != std::abs(b.first) ? std::abs(a.first) > std::abs(b.first) : a.second < b.second;
+    });
+
+    out << "\nchanges since previous build:\n";
+    if (deltas.empty()) {
+        out << "    (none)\n";
+    }
+    for (size_t i = 0; i < std::min(top, deltas.size()); ++i) {
+        out << std::setw(10) << std::showpos << deltas[i].first << std::noshowpos << "  " << deltas[i].second << "\n";
+    }
+}
+
+int report_binary_size(const fs::path & artifact, const std::vector<fs::path> & sources, size_t top) {
+    SizeReport report;
+    try {
+        report = compute_size_report(read_elf(artifact));
+    } catch (const std::exception & e) {
+        std::cerr << "ERROR: unable to analyze " << artifact << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::optional<fs::path> snapshot_path;
+    if (auto dir = cache_dir(); dir && !sources.empty()) {
+        snapshot_path = *dir / "size" / (script_key(sources) + ".tsv");
+    }
+
+    std::optional<SizeSnapshot> previous;
+    if (snapshot_path && fs::exists(*snapshot_path)) {
+        previous = parse_size_snapshot(read_file(*snapshot_path));
+    }
+
+    print_size_report(std::cout, report, previous, top);
+
+    if (snapshot_path) {
+        try {
+            write_file_atomic(*snapshot_path, format_size_snapshot(size_snapshot(report)));
+        } catch (const std::exception & e) {
+            std::cerr << "WARNING: unable to store size snapshot: " << e.what() << std::endl;
+        }
+    }
+    return 0;
+}
+
+// Startup profiling: a small shim is compiled with the configured compiler and preloaded into the program. It
+// timestamps its own constructor, interposes __libc_start_main to time each .init_array entry of the executable
+// and to record the moment main is entered, then exits without running main. Static executables can not preload
+// anything, so for them the shim is linked in and wraps __libc_start_main with -Wl,--wrap instead.
+
+const char * const STARTUP_SHIM_SOURCE = R"shim(
+#include <dlfcn.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+using main_fn = int (*)(int, char **, char **);
+using init_fn = void (*)(int, char **, char **);
+using start_main_fn = int (*)(main_fn, int, char **, void (*)(), void (*)(), void (*)(), void *);
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+uint64_t preload_ns = 0;
+uint64_t start_main_ns = 0;
+char report_path[4096];
+
+struct InitTiming {
+    uint64_t offset;
+    uint64_t ns;
+};
+InitTiming inits[1024];
+size_t num_inits = 0;
+
+#ifndef CPPRUN_SHIM_STATIC
+
+void noop_init(int, char **, char **) {
+}
+
+int find_init_array(dl_phdr_info * info, size_t, void * data) {
+    auto out = static_cast<ElfW(Addr) **>(data);
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        if (info->dlpi_phdr[i].p_type != PT_DYNAMIC) {
+            continue;
+        }
+        auto dyn = reinterpret_cast<ElfW(Dyn) *>(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+        ElfW(Addr) array = 0;
+        ElfW(Addr) size = 0;
+        for (; dyn->d_tag != DT_NULL; ++dyn) {
+            if (dyn->d_tag == DT_INIT_ARRAY) {
+                array = dyn->d_un.d_ptr;
+            } else if (dyn->d_tag == DT_INIT_ARRAYSZ) {
+                size = dyn->d_un.d_val;
+            }
+        }
+        if (array != 0) {
+            // some loaders relocate d_ptr in place, others leave it as a link-time address
+            out[0] = reinterpret_cast<ElfW(Addr) *>(array >= info->dlpi_addr ? array : array + info->dlpi_addr);
+            out[1] = reinterpret_cast<ElfW(Addr) *>(size);
+            out[2] = reinterpret_cast<ElfW(Addr) *>(info->dlpi_addr);
+        }
+    }
+    return 1;  // the executable is always the first object
+}
+
+// Runs and times every .init_array entry of the executable, then replaces it with a no-op so libc does not run
+// it again.
+void run_timed_initializers(int argc, char ** argv, char ** envp) {
+    ElfW(Addr) * found[3] = {nullptr, nullptr, nullptr};
+    dl_iterate_phdr(find_init_array, found);
+    auto array = found[0];
+    size_t count = reinterpret_cast<size_t>(found[1]) / sizeof(ElfW(Addr));
+    auto base = reinterpret_cast<ElfW(Addr)>(found[2]);
+    if (array == nullptr || count == 0) {
+        return;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    auto first = reinterpret_cast<uintptr_t>(array) & ~uintptr_t(page - 1);
+    auto last = reinterpret_cast<uintptr_t>(array + count);
+    bool writable = mprotect(reinterpret_cast<void *>(first), last - first, PROT_READ | PROT_WRITE) == 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        auto fn = reinterpret_cast<init_fn>(array[i]);
+        if (fn == nullptr || reinterpret_cast<uintptr_t>(fn) == uintptr_t(-1)) {
+            continue;
+        }
+        uint64_t t = now_ns();
+        fn(argc, argv, envp);
+        t = now_ns() - t;
+        if (num_inits < sizeof(inits) / sizeof(inits[0])) {
+            inits[num_inits++] = InitTiming{reinterpret_cast<uintptr_t>(fn) - base, t};
+        }
+        if (writable) {
+            array[i] = reinterpret_cast<ElfW(Addr)>(&noop_init);
+        }
+    }
+    if (writable) {
+        mprotect(reinterpret_cast<void *>(first), last - first, PROT_READ);
+    }
+}
+
+#endif
+
+int count_object(dl_phdr_info * info, size_t, void * data) {
+    auto out = static_cast<FILE *>(data);
+    if (info->dlpi_name != nullptr && info->dlpi_name[0] != '\0') {
+        fprintf(out, "dso %s\n", info->dlpi_name);
+    }
+    return 0;
+}
+
+int wrapped_main(int, char **, char **) {
+    uint64_t main_ns = now_ns();
+    FILE * out = fopen(report_path, "w");
+    if (out != nullptr) {
+        fprintf(out, "pid %ld\n", long(getpid()));
+        fprintf(out, "preload_ns %llu\n", (unsigned long long)preload_ns);
+        fprintf(out, "start_main_ns %llu\n", (unsigned long long)start_main_ns);
+        fprintf(out, "main_ns %llu\n", (unsigned long long)main_ns);
+        for (size_t i = 0; i < num_inits; ++i) {
+            fprintf(out, "init %llx %llu\n", (unsigned long long)inits[i].offset, (unsigned long long)inits[i].ns);
+        }
+        dl_iterate_phdr(count_object, out);
+        fclose(out);
+    }
+    _exit(0);
+}
+
+#ifdef CPPRUN_SHIM_STATIC
+
+// Linked into static executables with -Wl,--wrap=__libc_start_main. This runs before libc has initialized itself
+// (IRELATIVE relocations, TLS, environ), so neither the initializers nor most of libc can be touched yet. Instead,
+// every .init_array entry is pointed at timed_init, which libc then calls in order; the array is still writable,
+// RELRO is applied later. In static PIE executables, the relocation of the array restores the entries, and the
+// initializers are not timed.
+
+init_fn saved_inits[1024];
+size_t num_saved_inits = 0;
+size_t next_init = 0;
+
+void timed_init(int argc, char ** argv, char ** envp) {
+    if (next_init >= num_saved_inits) {
+        return;
+    }
+    auto fn = saved_inits[next_init++];
+    uint64_t t = now_ns();
+    fn(argc, argv, envp);
+    t = now_ns() - t;
+    if (num_inits < sizeof(inits) / sizeof(inits[0])) {
+        inits[num_inits++] = InitTiming{reinterpret_cast<uintptr_t>(fn), t};
+    }
+}
+
+}  // namespace
+
+extern "C" void (*__init_array_start[])(int, char **, char **);
+extern "C" void (*__init_array_end[])(int, char **, char **);
+extern "C" int __real___libc_start_main(main_fn, int, char **, void (*)(), void (*)(), void (*)(), void *);
+
+extern "C" int __wrap___libc_start_main(main_fn main, int argc, char ** argv, void (*init)(), void (*fini)(),
+                                        void (*rtld_fini)(), void * stack_end) {
+    start_main_ns = now_ns();
+    preload_ns = start_main_ns;
+    const char key[] = "CPPRUN_STARTUP_REPORT=";
+    for (char ** env = argv + argc + 1; *env != nullptr; ++env) {
+        size_t i = 0;
+        while (key[i] != '\0' && (*env)[i] == key[i]) {
+            ++i;
+        }
+        if (key[i] == '\0') {
+            for (size_t j = 0; j + 1 < sizeof(report_path) && (*env)[i + j] != '\0'; ++j) {
+                report_path[j] = (*env)[i + j];
+            }
+        }
+    }
+    for (auto entry = __init_array_start; entry < __init_array_end; ++entry) {
+        auto fn = *entry;
+        if (fn != nullptr && reinterpret_cast<uintptr_t>(fn) != uintptr_t(-1) &&
+            num_saved_inits < sizeof(saved_inits) / sizeof(saved_inits[0])) {
+            saved_inits[num_saved_inits++] = fn;
+            *entry = timed_init;
+        }
+    }
+    (void)main;
+    return __real___libc_start_main(wrapped_main, argc, argv, init, fini, rtld_fini, stack_end);
+}
+
+#else
+
+__attribute__((constructor)) void startup_shim_init() {
+    preload_ns = now_ns();
+    if (const char * path = getenv("CPPRUN_STARTUP_REPORT")) {
+        snprintf(report_path, sizeof(report_path), "%s", path);
+    }
+    unsetenv("CPPRUN_STARTUP_REPORT");
+    unsetenv("LD_PRELOAD");
+    unsetenv("LD_DEBUG");
+    unsetenv("LD_DEBUG_OUTPUT");
+}
+
+}  // namespace
+
+extern "C" int __libc_start_main(main_fn main, int argc, char ** argv, void (*init)(), void (*fini)(),
+                                 void (*rtld_fini)(), void * stack_end) {
+    start_main_ns = now_ns();
+    auto real = reinterpret_cast<start_main_fn>(dlsym(RTLD_NEXT, "__libc_start_main"));
+    (void)main;
+    run_timed_initializers(argc, argv, environ);
+    return real(wrapped_main, argc, argv, init, fini, rtld_fini, stack_end);
+}
+
+#endif
+)shim";
+
+uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ULL + uint64_t(ts.tv_nsec);
+}
+
+struct StartupSample {
+    long pid = 0;
+    uint64_t exec_ns = 0;
+    uint64_t preload_ns = 0;
+    uint64_t start_main_ns = 0;
+    uint64_t main_ns = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> initializers;  // (address in the executable, duration ns)
+    std::vector<std::string> dsos;
+    std::map<std::string, uint64_t> loader;  // from LD_DEBUG=statistics
+};
+
+StartupSample parse_startup_report(const std::string & text) {
+    StartupSample sample;
+    std::istringstream iss(text);
+    std::string key;
+    while (iss >> key) {
+        if (key == "pid") {
+            iss >> sample.pid;
+        } else if (key == "preload_ns") {
+            iss >> sample.preload_ns;
+        } else if (key == "start_main_ns") {
+            iss >> sample.start_main_ns;
+        } else if (key == "main_ns") {
+            iss >> sample.main_ns;
+        } else if (key == "init") {
+            uint64_t offset = 0, ns = 0;
+            iss >> std::hex >> offset >> std::dec >> ns;
+            sample.initializers.emplace_back(offset, ns);
+        } else if (key == "dso") {
+            std::string name;
+            std::getline(iss >> std::ws, name);
+            sample.dsos.push_back(name);
+        }
+    }
+    return sample;
+}
+
+// Parses the first "runtime linker statistics" block, e.g.
+//     7316:	  total startup time in dynamic loader: 180449 cycles
+//     7316:	            time needed for relocation: 100399 cycles (55.6%)
+//     7316:	                 number of relocations: 1766
+std::map<std::string, uint64_t> parse_ld_debug_statistics(const std::string & text) {
+    std::map<std::string, uint64_t> stats;
+    std::istringstream iss(text);
+    std::string line;
+    int blocks = 0;
+    while (std::getline(iss, line)) {
+        if (line.find("runtime linker statistics") != std::string::npos && ++blocks > 1) {
+            break;
+        }
+        auto colon = line.rfind(':');
+        auto tab = line.find('\t');
+        if (colon == std::string::npos || tab == std::string::npos || colon < tab) {
+            continue;
+        }
+        auto name = line.substr(tab + 1, colon - tab - 1);
+        name.erase(0, name.find_first_not_of(' '));
+        std::istringstream value(line.substr(colon + 1));
+        uint64_t v = 0;
+        if (!name.empty() && value >> v) {
+            stats[name] = v;
+        }
+    }
+    return stats;
+}
+
+struct DynamicInfo {
+    std::vector<std::string> needed;
+    bool bind_now = false;
+    bool pie = false;
+    size_t relative_relocs = 0;
+    size_t symbolic_relocs = 0;
+    size_t plt_relocs = 0;
+};
+
+DynamicInfo read_dynamic_info(const ElfFile & elf) {
+    DynamicInfo info;
+    info.pie = elf.type == ET_DYN;
+    for (auto & s : elf.sections) {
+        if (s.type == SHT_DYNAMIC) {
+            auto dyn = elf.section_data(s);
+            auto strtab = s.link < elf.sections.size() ? elf.section_data(elf.sections[s.link]) : std::string_view{};
+            for (uint64_t off = 0; off + sizeof(Elf64_Dyn) <= dyn.size(); off += sizeof(Elf64_Dyn)) {
+                auto d = read_at<Elf64_Dyn>(dyn, off);
+                if (d.d_tag == DT_NEEDED) {
+                    info.needed.push_back(read_cstr(strtab, d.d_un.d_val));
+                } else if (d.d_tag == DT_BIND_NOW || (d.d_tag == DT_FLAGS && (d.d_un.d_val & DF_BIND_NOW)) ||
+                           (d.d_tag == DT_FLAGS_1 && (d.d_un.d_val & DF_1_NOW))) {
+                    info.bind_now = true;
+                }
+            }
+        } else if (s.type == SHT_RELA && (s.flags & SHF_ALLOC)) {
+            auto relocs = elf.section_data(s);
+            for (uint64_t off = 0; off + sizeof(Elf64_Rela) <= relocs.size(); off += sizeof(Elf64_Rela)) {
+                auto r = read_at<Elf64_Rela>(relocs, off);
+                auto type = ELF64_R_TYPE(r.r_info);
+                bool aarch64 = elf.machine == EM_AARCH64;
+                if (type == (aarch64 ? R_AARCH64_RELATIVE : R_X86_64_RELATIVE)) {
+                    info.relative_relocs++;
+                } else if (type == (aarch64 ? R_AARCH64_JUMP_SLOT : R_X86_64_JUMP_SLOT)) {
+                    info.plt_relocs++;
+                } else {
+                    info.symbolic_relocs++;
+                }
+            }
+        }
+#ifdef SHT_RELR
+        if (s.type == SHT_RELR) {
+            info.relative_relocs += s.size / sizeof(Elf64_Relr);
+        }
+#endif
+    }
+    return info;
+}
+
+// name of the symbol containing the given address, or the hex address if there is none
+std::string symbolize(const ElfFile & elf, uint64_t address) {
+    for (auto & sym : elf.symbols) {
+        if (sym.type == STT_FUNC && address >= sym.value && address < sym.value + std::max<uint64_t>(sym.size, 1)) {
+            return demangle(sym.name);
+        }
+    }
+    std::ostringstream ss;
+    ss << "0x" << std::hex << address;
+    return ss.str();
+}
+
+template <typename T>
+T median(std::vector<T> values) {
+    if (values.empty()) {
+        return T{};
+    }
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static std::string format_us(uint64_t ns) {
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(1) << std::setw(10) << double(ns) / 1000.0 << " us";
+    return ss.str();
+}
+
+void print_startup_report(std::ostream & out, const std::vector<StartupSample> & samples, const ElfFile & elf) {
+    auto field = [&](auto get) {
+        std::vector<uint64_t> values;
+        for (auto & s : samples) {
+            values.push_back(get(s));
+        }
+        return median(values);
+    };
+    auto to_main = field([](auto & s) { return s.main_ns - s.exec_ns; });
+    auto to_preload = field([](auto & s) { return s.preload_ns - s.exec_ns; });
+    auto to_start_main = field([](auto & s) { return s.start_main_ns - s.preload_ns; });
+    auto to_main_from_start = field([](auto & s) { return s.main_ns - s.start_main_ns; });
+
+    std::map<uint64_t, std::vector<uint64_t>> init_times;
+    for (auto & s : samples) {
+        for (auto & [addr, ns] : s.initializers) {
+            init_times[addr].push_back(ns);
+        }
+    }
+    uint64_t init_total = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> inits;
+    for (auto & [addr, times] : init_times) {
+        inits.emplace_back(median(times), addr);
+        init_total += median(times);
+    }
+    std::sort(inits.rbegin(), inits.rend());
+
+    out << "startup profile (median of " << samples.size() << " runs):\n";
+    out << "  exec -> main                 " << format_us(to_main) << "\n";
+    out << "    exec -> preload ctor       " << format_us(to_preload) << "   (fork/exec, dynamic loader)\n";
+    out << "    preload -> libc start      " << format_us(to_start_main) << "   (shared library initializers)\n";
+    out << "    libc start -> main         " << format_us(to_main_from_start) << "   (" << inits.size()
+        << " static initializers, " << std::fixed << std::setprecision(1) << double(init_total) / 1000.0
+        << " us)\n";
+
+    auto & loader = samples.front().loader;
+    auto stat = [&](const std::string & name) {
+        auto it = loader.find(name);
+        return it == loader.end() ? uint64_t(0) : it->second;
+    };
+    if (!loader.empty()) {
+        auto total = stat("total startup time in dynamic loader");
+        auto percent = [&](uint64_t v) { return total ? 100.0 * double(v) / double(total) : 0.0; };
+        out << std::fixed << std::setprecision(1);
+        out << "\ndynamic loader (LD_DEBUG=statistics):\n";
+        out << "  total                        " << std::setw(10) << total << " cycles\n";
+        out << "    relocation                 " << std::setw(10) << stat("time needed for relocation")
+            << " cycles (" << percent(stat("time needed for relocation")) << "%)\n";
+        out << "    loading objects            " << std::setw(10) << stat("time needed to load objects")
+            << " cycles (" << percent(stat("time needed to load objects")) << "%)\n";
+        out << "  relocations processed        " << std::setw(10) << stat("number of relocations") << " ("
+            << stat("number of relocations from cache") << " from cache, " << stat("number of relative relocations")
+            << " relative)\n";
+    }
+
+    auto dyn = read_dynamic_info(elf);
+    out << "\nartifact: " << (dyn.pie ? "PIE" : "non-PIE") << ", " << (dyn.bind_now ? "immediate" : "lazy")
+        << " binding, " << dyn.relative_relocs << " relative / " << dyn.symbolic_relocs << " symbolic / "
+        << dyn.plt_relocs << " PLT relocations\n";
+    out << "  direct dependencies (" << dyn.needed.size() << "):";
+    for (auto & n : dyn.needed) {
+        out << " " << n;
+    }
+    out << "\n  loaded at main (" << samples.front().dsos.size() << "):";
+    for (auto & n : samples.front().dsos) {
+        out << " " << fs::path(n).filename().string();
+    }
+    out << "\n";
+
+    if (!inits.empty()) {
+        out << "\nstatic initializers:\n";
+        for (auto & [ns, addr] : inits) {
+            out << "  " << format_us(ns) << "  " << symbolize(elf, addr) << "\n";
+        }
+    }
+
+    std::vector<std::string> suggestions;
+    if (!dyn.needed.empty()) {
+        suggestions.push_back("link statically (-static, or -static-libstdc++ -static-libgcc) to skip loading " +
+                              std::to_string(samples.front().dsos.size()) + " shared objects and their relocations");
+    }
+    if (!dyn.needed.empty() && !dyn.bind_now && dyn.plt_relocs > 0) {
+        suggestions.push_back("link with -Wl,-z,now (and -fno-plt) to bind the " + std::to_string(dyn.plt_relocs) +
+                              " PLT entries up front instead of through the lazy resolver");
+    }
+    static const std::vector<std::string> base_libs = {"libstdc++", "libc.", "libm.", "libgcc_s", "linux-vdso",
+                                                       "ld-linux", "libc++", "libc++abi"};
+    std::vector<std::string> extra;
+    for (auto & n : dyn.needed) {
+        if (std::none_of(base_libs.begin(), base_libs.end(), [&](auto & b) { return n.rfind(b, 0) == 0; })) {
+            extra.push_back(n);
+        }
+    }
+    if (!extra.empty()) {
+        suggestions.push_back("drop or statically link " + join_shell(extra) +
+                              ", every extra DSO costs an open/mmap and symbol lookups");
+    }
+    if (dyn.pie && dyn.relative_relocs > 1000) {
+        suggestions.push_back("link with -no-pie to avoid " + std::to_string(dyn.relative_relocs) +
+                              " relative relocations");
+    }
+    if (!inits.empty() && inits.front().first > 100000) {
+        suggestions.push_back("move work out of the static initializer " + symbolize(elf, inits.front().second) +
+                              " (" + std::to_string(inits.front().first / 1000) +
+                              " us), e.g. into a function-local static");
+    }
+
+    out << "\nsuggestions:\n";
+    if (suggestions.empty()) {
+        out << "  (none)\n";
+    }
+    for (auto & s : suggestions) {
+        out << "  - " << s << "\n";
+    }
+}
+
+static std::optional<std::vector<StartupSample>> sample_startup(const CpprunArgs & args, const fs::path & exe,
+                                                                const std::optional<fs::path> & preload,
+                                                                const fs::path & workdir, int runs) {
+    std::vector<StartupSample> samples;
+    for (int i = 0; i < runs; ++i) {
+        auto report = workdir / (exe.stem().string() + ".startup." + std::to_string(i));
+        auto ld_debug = workdir / (exe.stem().string() + ".ld_debug." + std::to_string(i));
+        EnvOverrides env = {{"CPPRUN_STARTUP_REPORT", report.string()}};
+        if (preload) {
+            extend(env, {
+                            {"LD_PRELOAD", preload->string()},
+                            {"LD_DEBUG", "statistics"},
+                            {"LD_DEBUG_OUTPUT", ld_debug.string()},
+                        });
+        }
+        uint64_t exec_ns = monotonic_ns();
+        run_cmd(exe.string(), {}, args.verbose, env);
+        if (!fs::exists(report)) {
+            std::cerr << "ERROR: " << exe << " did not reach main under the startup shim" << std::endl;
+            return std::nullopt;
+        }
+        auto sample = parse_startup_report(read_file(report));
+        sample.exec_ns = exec_ns;
+        sample.dsos.erase(std::remove_if(sample.dsos.begin(), sample.dsos.end(),
+                                         [&](auto & d) { return preload && fs::path(d) == *preload; }),
+                          sample.dsos.end());
+        auto stats = ld_debug;
+        stats += "." + std::to_string(sample.pid);
+        if (fs::exists(stats)) {
+            sample.loader = parse_ld_debug_statistics(read_file(stats));
+        }
+        samples.push_back(std::move(sample));
+    }
+    return samples;
+}
+
+static uint64_t median_time_to_main(const std::vector<StartupSample> & samples) {
+    std::vector<uint64_t> values;
+    for (auto & s : samples) {
+        values.push_back(s.main_ns - s.exec_ns);
+    }
+    return median(values);
+}
+
+int profile_startup(const CpprunArgs & args, const fs::path & artifact, const fs::path & workdir, int runs) {
+    auto shim_source = workdir / "startup_shim.cpp";
+    auto shim = workdir / "startup_shim.so";
+    {
+        std::ofstream out(shim_source);
+        out << STARTUP_SHIM_SOURCE;
+    }
+    int rc = run_cmd(args.cxx, {"-shared", "-fPIC", "-O2", "-o", shim.string(), shim_source.string(), "-ldl"},
+                     args.verbose);
+    if (rc != 0) {
+        std::cerr << "ERROR: unable to build the startup shim with " << args.cxx << std::endl;
+        return rc;
+    }
+
+    if (!args.static_link) {
+        auto samples = sample_startup(args, artifact, shim, workdir, runs);
+        if (!samples) {
+            return 1;
+        }
+        print_startup_report(std::cout, *samples, read_elf(artifact));
+        return 0;
+    }
+
+    // static link mode: profile the static build, and a regular dynamically linked build to compare against
+    auto dynamic_args = args;
+    dynamic_args.static_link = std::nullopt;
+    auto dynamic_exe = workdir / "dynamic.exe";
+    rc = run_cmd(args.cxx, collect_build_args(dynamic_args, dynamic_exe), args.verbose);
+    if (rc != 0) {
+        return rc;
+    }
+    auto dynamic_samples = sample_startup(args, dynamic_exe, shim, workdir, runs);
+
+    std::optional<std::vector<StartupSample>> samples;
+    auto profiled = artifact;
+    if (*args.static_link == StaticLink::Runtime) {
+        samples = sample_startup(args, artifact, shim, workdir, runs);
+    } else {
+        auto shim_object = workdir / "startup_shim.o";
+        auto static_exe = workdir / "static.exe";
+        rc = run_cmd(args.cxx,
+                     {"-c", "-O2", "-DCPPRUN_SHIM_STATIC", "-o", shim_object.string(), shim_source.string()},
+                     args.verbose);
+        auto build_args = collect_build_args(args, static_exe);
+        extend(build_args, {shim_object.string(), "-Wl,--wrap=__libc_start_main"});
+        if (rc == 0) {
+            rc = run_cmd(args.cxx, build_args, args.verbose);
+        }
+        if (rc != 0) {
+            std::cerr << "ERROR: unable to link the startup shim into the static executable" << std::endl;
+            return rc;
+        }
+        samples = sample_startup(args, static_exe, std::nullopt, workdir, runs);
+        profiled = static_exe;
+    }
+    if (!samples || !dynamic_samples) {
+        return 1;
+    }
+
+    print_startup_report(std::cout, *samples, read_elf(profiled));
+    if (*args.static_link == StaticLink::Pie) {
+        std::cout << "\nstatic initializers: not timed in static PIE executables\n";
+    }
+
+    auto static_ns = median_time_to_main(*samples);
+    auto dynamic_ns = median_time_to_main(*dynamic_samples);
+    std::cout << "\nexec -> main, " << static_link_flags(*args.static_link).front() << " vs dynamic linking:\n"
+              << "  static   " << format_us(static_ns) << "\n"
+              << "  dynamic  " << format_us(dynamic_ns) << "\n"
+              << "  change   " << std::showpos << std::fixed << std::setprecision(1) << std::setw(10)
+              << (double(static_ns) - double(dynamic_ns)) / 1000.0 << std::noshowpos << " us\n";
+    return 0;
+}
+
+// DWARF line table reader (.debug_line, versions 2 to 5), used to map instruction addresses back to source lines.
+
+struct LineRange {
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    uint32_t file = 0;  // index into LineTable::files
+    uint32_t line = 0;
+};
+
+struct LineTable {
+    std::vector<std::string> files;
+    std::vector<LineRange> ranges;  // sorted by begin
+
+    const LineRange * find(uint64_t address) const {
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), address,
+                                   [](uint64_t a, const LineRange & r) { return a < r.begin; });
+        if (it == ranges.begin()) {
+            return nullptr;
+        }
+        --it;
+        return address < it->end ? &*it : nullptr;
+    }
+};
+
+class DwarfReader {
+   public:
+    DwarfReader(std::string_view data, uint64_t offset = 0) : data_(data), offset_(offset) {
+    }
+
+    uint64_t offset() const {
+        return offset_;
+    }
+    void seek(uint64_t offset) {
+        offset_ = offset;
+    }
+    bool done() const {
+        return offset_ >= data_.size();
+    }
+
+    template <typename T>
+    T fixed() {
+        auto value = read_at<T>(data_, offset_);
+        offset_ += sizeof(T);
+        return value;
+    }
+
+    uint64_t uleb() {
+        uint64_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            auto byte = fixed<uint8_t>();
+            if (shift < 64) {
+                value |= uint64_t(byte & 0x7f) << shift;
+            }
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+    }
+
+    int64_t sleb() {
+        int64_t value = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = fixed<uint8_t>();
+            if (shift < 64) {
+                value |= int64_t(byte & 0x7f) << shift;
+            }
+            shift += 7;
+        } while (byte & 0x80);
+        if (shift < 64 && (byte & 0x40)) {
+            value |= -(int64_t(1) << shift);
+        }
+        return value;
+    }
+
+    std::string cstr() {
+        auto s = read_cstr(data_, offset_);
+        offset_ += s.size() + 1;
+        return s;
+    }
+
+    void skip(uint64_t n) {
+        offset_ += n;
+    }
+
+   private:
+    std::string_view data_;
+    uint64_t offset_;
+};
+
+static std::string read_dwarf_form_string(DwarfReader & r, uint64_t form, bool dwarf64, const ElfFile & elf) {
+    auto strp = [&](const char * section) {
+        uint64_t off = dwarf64 ? r.fixed<uint64_t>() : r.fixed<uint32_t>();
+        auto s = elf.find_section(section);
+        return s ? read_cstr(elf.section_data(*s), off) : std::string();
+    };
+    switch (form) {
+        case 0x08:  // DW_FORM_string
+            return r.cstr();
+        case 0x1f:  // DW_FORM_line_strp
+            return strp(".debug_line_str");
+        case 0x0e:  // DW_FORM_strp
+            return strp(".debug_str");
+    }
+    throw std::runtime_error("unsupported string form in .debug_line");
+}
+
+static uint64_t read_dwarf_form_value(DwarfReader & r, uint64_t form, bool dwarf64) {
+    switch (form) {
+        case 0x0b:  // DW_FORM_data1
+            return r.fixed<uint8_t>();
+        case 0x05:  // DW_FORM_data2
+            return r.fixed<uint16_t>();
+        case 0x06:  // DW_FORM_data4
+            return r.fixed<uint32_t>();
+        case 0x07:  // DW_FORM_data8
+            return r.fixed<uint64_t>();
+        case 0x0f:  // DW_FORM_udata
+            return r.uleb();
+        case 0x1e:  // DW_FORM_data16
+            r.skip(16);
+            return 0;
+        case 0x09:  // DW_FORM_block
+            r.skip(r.uleb());
+            return 0;
+        case 0x1f:  // DW_FORM_line_strp
+        case 0x0e:  // DW_FORM_strp
+            return dwarf64 ? r.fixed<uint64_t>() : r.fixed<uint32_t>();
+        case 0x08:  // DW_FORM_string
+            r.cstr();
+            return 0;
+    }
+    throw std::runtime_error("unsupported form in .debug_line");
+}
+
+// DWARF 5 directory and file tables are described by (content type, form) pairs
+static std::vector<std::pair<std::string, uint64_t>> read_dwarf5_entries(DwarfReader & r, bool dwarf64,
+                                                                         const ElfFile & elf) {
+    std::vector<std::pair<uint64_t, uint64_t>> format;
+    auto format_count = r.fixed<uint8_t>();
+    for (int i = 0; i < format_count; ++i) {
+        auto type = r.uleb();
+        format.emplace_back(type, r.uleb());
+    }
+    std::vector<std::pair<std::string, uint64_t>> entries;
+    auto count = r.uleb();
+    for (uint64_t i = 0; i < count; ++i) {
+        std::pair<std::string, uint64_t> entry;
+        for (auto [type, form] : format) {
+            if (type == 1) {  // DW_LNCT_path
+                entry.first = read_dwarf_form_string(r, form, dwarf64, elf);
+            } else if (type == 2) {  // DW_LNCT_directory_index
+                entry.second = read_dwarf_form_value(r, form, dwarf64);
+            } else {
+                read_dwarf_form_value(r, form, dwarf64);
+            }
+        }
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+LineTable read_line_table(const ElfFile & elf) {
+    LineTable table;
+    auto section = elf.find_section(".debug_line");
+    if (!section) {
+        return table;
+    }
+    auto data = elf.section_data(*section);
+    DwarfReader r(data);
+    std::map<std::string, uint32_t> file_ids;
+
+    while (!r.done()) {
+        uint64_t unit_length = r.fixed<uint32_t>();
+        bool dwarf64 = unit_length == 0xffffffff;
+        if (dwarf64) {
+            unit_length = r.fixed<uint64_t>();
+        }
+        uint64_t unit_end = r.offset() + unit_length;
+        auto version = r.fixed<uint16_t>();
+        if (version >= 5) {
+            r.fixed<uint8_t>();  // address_size
+            r.fixed<uint8_t>();  // segment_selector_size
+        }
+        uint64_t header_length = dwarf64 ? r.fixed<uint64_t>() : r.fixed<uint32_t>();
+        uint64_t program_start = r.offset() + header_length;
+        uint8_t min_inst_length = r.fixed<uint8_t>();
+        if (version >= 4) {
+            r.fixed<uint8_t>();  // maximum_operations_per_instruction
+        }
+        r.fixed<uint8_t>();  // default_is_stmt
+        int8_t line_base = r.fixed<int8_t>();
+        uint8_t line_range = r.fixed<uint8_t>();
+        uint8_t opcode_base = r.fixed<uint8_t>();
+        std::vector<uint8_t> opcode_lengths(opcode_base > 0 ? opcode_base - 1 : 0);
+        for (auto & l : opcode_lengths) {
+            l = r.fixed<uint8_t>();
+        }
+
+        std::vector<std::string> dirs;
+        std::vector<std::pair<std::string, uint64_t>> files;
+        if (version >= 5) {
+            for (auto & [name, _] : read_dwarf5_entries(r, dwarf64, elf)) {
+                dirs.push_back(name);
+            }
+            files = read_dwarf5_entries(r, dwarf64, elf);
+        } else {
+            dirs.push_back("");  // the compilation directory, not recorded here
+            for (auto d = r.cstr(); !d.empty(); d = r.cstr()) {
+                dirs.push_back(d);
+            }
+            files.emplace_back("", 0);  // file numbers start at 1 before DWARF 5
+            for (auto f = r.cstr(); !f.empty(); f = r.cstr()) {
+                auto dir = r.uleb();
+                r.uleb();  // mtime
+                r.uleb();  // length
+                files.emplace_back(f, dir);
+            }
+        }
+        std::vector<uint32_t> file_map;
+        for (auto & [name, dir] : files) {
+            auto path = fs::path(name);
+            if (path.is_relative() && dir < dirs.size()) {
+                path = fs::path(dirs[dir]) / path;
+            }
+            auto key = path.lexically_normal().string();
+            auto [it, inserted] = file_ids.emplace(key, uint32_t(table.files.size()));
+            if (inserted) {
+                table.files.push_back(key);
+            }
+            file_map.push_back(it->second);
+        }
+
+        // line number program state machine
+        r.seek(program_start);
+        uint64_t address = 0;
+        uint64_t file = 1;
+        int64_t line = 1;
+        std::optional<LineRange> pending;
+        auto emit_row = [&](bool end_sequence) {
+            if (pending && address > pending->begin) {
+                pending->end = address;
+                table.ranges.push_back(*pending);
+            }
+            pending.reset();
+            if (!end_sequence && file < file_map.size()) {
+                pending = LineRange{address, address, file_map[file], uint32_t(line)};
+            }
+        };
+        while (r.offset() < unit_end) {
+            auto opcode = r.fixed<uint8_t>();
+            if (opcode >= opcode_base) {
+                auto adjusted = opcode - opcode_base;
+                address += uint64_t(adjusted / line_range) * min_inst_length;
+                line += line_base + adjusted % line_range;
+                emit_row(false);
+            } else if (opcode == 0) {
+                auto length = r.uleb();
+                auto next = r.offset() + length;
+                auto ext = length > 0 ? r.fixed<uint8_t>() : 0;
+                if (ext == 1) {  // DW_LNE_end_sequence
+                    emit_row(true);
+                    address = 0;
+                    file = 1;
+                    line = 1;
+                } else if (ext == 2) {  // DW_LNE_set_address
+                    address = length - 1 == 4 ? r.fixed<uint32_t>() : r.fixed<uint64_t>();
+                }
+                r.seek(next);
+            } else if (opcode == 1) {  // DW_LNS_copy
+                emit_row(false);
+            } else if (opcode == 2) {  // DW_LNS_advance_pc
+                address += r.uleb() * min_inst_length;
+            } else if (opcode == 3) {  // DW_LNS_advance_line
+                line += r.sleb();
+            } else if (opcode == 4) {  // DW_LNS_set_file
+                file = r.uleb();
+            } else if (opcode == 8) {  // DW_LNS_const_add_pc
+                address += uint64_t((255 - opcode_base) / line_range) * min_inst_length;
+            } else if (opcode == 9) {  // DW_LNS_fixed_advance_pc
+                address += r.fixed<uint16_t>();
+            } else {
+                for (int i = 0; i < opcode_lengths[opcode - 1]; ++i) {
+                    r.uleb();
+                }
+            }
+        }
+        r.seek(unit_end);
+    }
+
+    std::sort(table.ranges.begin(), table.ranges.end(),
+              [](const LineRange & a, const LineRange & b) { return a.begin < b.begin; });
+    return table;
+}
+
+// Function symbols sorted by address, for mapping many addresses to symbols.
+class SymbolIndex {
+   public:
+    explicit SymbolIndex(const ElfFile & elf) {
+        for (auto & s : elf.symbols) {
+            if (s.type == STT_FUNC && s.size > 0 && s.shndx != SHN_UNDEF) {
+                symbols_.push_back(&s);
+            }
+        }
+        std::sort(symbols_.begin(), symbols_.end(), [](auto * a, auto * b) { return a->value < b->value; });
+    }
+
+    const ElfSymbol * find(uint64_t address) const {
+        auto it = std::upper_bound(symbols_.begin(), symbols_.end(), address,
+                                   [](uint64_t a, const ElfSymbol * s) { return a < s->value; });
+        if (it == symbols_.begin()) {
+            return nullptr;
+        }
+        --it;
+        return address < (*it)->value + (*it)->size ? *it : nullptr;
+    }
+
+   private:
+    std::vector<const ElfSymbol *> symbols_;
+};
+
+// Sampling profiler: a preloaded shim takes a SIGPROF sample of the interrupted instruction pointer at a fixed rate
+// of consumed CPU time and writes the samples, together with the load addresses of all objects, when the program
+// exits.
+
+const char * const SAMPLING_SHIM_SOURCE = R"shim(
+#include <link.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+constexpr size_t MAX_SAMPLES = 1 << 22;
+uintptr_t samples[MAX_SAMPLES];
+std::atomic<size_t> num_samples{0};
+char report_path[4096];
+
+void on_sigprof(int, siginfo_t *, void * context) {
+    auto uc = static_cast<ucontext_t *>(context);
+#if defined(__x86_64__)
+    uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+    uintptr_t pc = uc->uc_mcontext.pc;
+#else
+    uintptr_t pc = 0;
+    (void)uc;
+#endif
+    size_t i = num_samples.fetch_add(1, std::memory_order_relaxed);
+    if (i < MAX_SAMPLES) {
+        samples[i] = pc;
+    }
+}
+
+int write_object(dl_phdr_info * info, size_t, void * data) {
+    auto out = static_cast<FILE *>(data);
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        auto & ph = info->dlpi_phdr[i];
+        if (ph.p_type == PT_LOAD && (ph.p_flags & PF_X)) {
+            fprintf(out, "object %lx %lx %lx %s\n", (unsigned long)info->dlpi_addr,
+                    (unsigned long)(info->dlpi_addr + ph.p_vaddr),
+                    (unsigned long)(info->dlpi_addr + ph.p_vaddr + ph.p_memsz),
+                    info->dlpi_name[0] != '\0' ? info->dlpi_name : "[executable]");
+        }
+    }
+    return 0;
+}
+
+void write_report() {
+    static std::atomic<bool> written{false};
+    if (report_path[0] == '\0' || written.exchange(true)) {
+        return;
+    }
+    itimerval off{};
+    setitimer(ITIMER_PROF, &off, nullptr);
+    FILE * out = fopen(report_path, "w");
+    if (out == nullptr) {
+        return;
+    }
+    dl_iterate_phdr(write_object, out);
+    size_t n = num_samples.load() < MAX_SAMPLES ? num_samples.load() : MAX_SAMPLES;
+    for (size_t i = 0; i < n; ++i) {
+        fprintf(out, "%lx\n", (unsigned long)samples[i]);
+    }
+    fclose(out);
+}
+
+__attribute__((constructor)) void sampling_shim_init() {
+    const char * path = getenv("CPPRUN_PROFILE_REPORT");
+    const char * hz = getenv("CPPRUN_PROFILE_HZ");
+    if (path == nullptr) {
+        return;
+    }
+    snprintf(report_path, sizeof(report_path), "%s", path);
+    unsetenv("CPPRUN_PROFILE_REPORT");
+    unsetenv("LD_PRELOAD");
+    atexit(write_report);
+
+    struct sigaction sa{};
+    sa.sa_sigaction = on_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, nullptr);
+
+    long usec = 1000000 / (hz ? atol(hz) : 1000);
+    itimerval timer{};
+    timer.it_interval.tv_sec = usec / 1000000;
+    timer.it_interval.tv_usec = usec % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+__attribute__((destructor)) void sampling_shim_fini() {
+    write_report();
+}
+
+}  // namespace
+)shim";
+
+struct LoadedObject {
+    uint64_t base = 0;
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    std::string name;
+};
+
+struct SampleProfile {
+    std::vector<LoadedObject> objects;
+    std::vector<uint64_t> pcs;
+};
+
+SampleProfile parse_sample_profile(const std::string & text) {
+    SampleProfile profile;
+    std::istringstream iss(text);
+    std::string line;
+    while (std::getline(iss, line)) {
+        if (line.rfind("object ", 0) == 0) {
+            std::istringstream ls(line.substr(7));
+            LoadedObject o;
+            ls >> std::hex >> o.base >> o.begin >> o.end;
+            std::getline(ls >> std::ws, o.name);
+            profile.objects.push_back(o);
+        } else if (!line.empty()) {
+            profile.pcs.push_back(std::stoull(line, nullptr, 16));
+        }
+    }
+    return profile;
+}
+
+// Executable samples keyed by link-time address, plus the number of samples in every other object.
+struct AttributedSamples {
+    std::map<uint64_t, size_t> executable;
+    std::map<std::string, size_t> elsewhere;
+    size_t total = 0;
+};
+
+AttributedSamples attribute_samples(const SampleProfile & profile) {
+    AttributedSamples out;
+    for (auto pc : profile.pcs) {
+        out.total++;
+        auto object = std::find_if(profile.objects.begin(), profile.objects.end(),
+                                   [&](auto & o) { return pc >= o.begin && pc < o.end; });
+        if (object == profile.objects.end()) {
+            out.elsewhere["[unknown]"]++;
+        } else if (object->name == "[executable]") {
+            out.executable[pc - object->base]++;
+        } else {
+            out.elsewhere[fs::path(object->name).filename().string()]++;
+        }
+    }
+    return out;
+}
+
+void print_annotated_profile(std::ostream & out, const AttributedSamples & samples, const ElfFile & elf,
+                             const LineTable & lines, const std::vector<fs::path> & sources, size_t top) {
+    if (samples.total == 0) {
+        out << "no samples were taken, the program ran for less than one sampling interval\n";
+        return;
+    }
+    auto pct = [&](size_t n) { return 100.0 * double(n) / double(samples.total); };
+    SymbolIndex symbols(elf);
+
+    std::map<std::string, size_t> by_function;
+    std::map<std::pair<uint32_t, uint32_t>, size_t> by_line;
+    size_t in_executable = 0;
+    for (auto & [address, count] : samples.executable) {
+        in_executable += count;
+        auto sym = symbols.find(address);
+        by_function[sym ? demangle(sym->name) : "[unknown]"] += count;
+        if (auto range = lines.find(address)) {
+            by_line[{range->file, range->line}] += count;
+        }
+    }
+
+    out << std::fixed << std::setprecision(1);
+    out << samples.total << " samples, " << pct(in_executable) << "% in the executable\n";
+    for (auto & [object, count] : samples.elsewhere) {
+        out << std::setw(7) << pct(count) << "%  " << object << "\n";
+    }
+
+    auto sorted = [](auto & m) {
+        std::vector<std::pair<size_t, typename std::decay_t<decltype(m)>::key_type>> v;
+        for (auto & [k, n] : m) {
+            v.emplace_back(n, k);
+        }
+        std::sort(v.begin(), v.end(), [](auto & a, auto & b) { return a.first > b.first; });
+        return v;
+    };
+
+    out << "\nhottest functions:\n";
+    auto functions = sorted(by_function);
+    for (size_t i = 0; i < std::min(top, functions.size()); ++i) {
+        out << std::setw(7) << pct(functions[i].first) << "%  " << functions[i].second << "\n";
+    }
+
+    if (lines.ranges.empty()) {
+        out << "\nno line table found, build with -g to see source lines\n";
+    }
+
+    for (auto & source : sources) {
+        auto file = std::find(lines.files.begin(), lines.files.end(), source.string());
+        if (file == lines.files.end()) {
+            continue;
+        }
+        auto file_id = uint32_t(file - lines.files.begin());
+        out << "\n" << source.string() << ":\n";
+        std::ifstream in(source);
+        std::string text;
+        for (uint32_t line = 1; std::getline(in, text); ++line) {
+            auto it = by_line.find({file_id, line});
+            if (it != by_line.end()) {
+                out << std::setw(7) << pct(it->second) << "%";
+            } else {
+                out << "        ";
+            }
+            out << std::setw(6) << line << " | " << text << "\n";
+        }
+    }
+
+    out << "\nhottest lines:\n";
+    auto hot_lines = sorted(by_line);
+    for (size_t i = 0; i < std::min(top, hot_lines.size()); ++i) {
+        auto [file, line] = hot_lines[i].second;
+        out << std::setw(7) << pct(hot_lines[i].first) << "%  " << lines.files[file] << ":" << line << "\n";
+    }
+
+    out << "\nhottest instructions:\n";
+    auto instructions = sorted(samples.executable);
+    for (size_t i = 0; i < std::min(top, instructions.size()); ++i) {
+        auto address = instructions[i].second;
+        out << std::setw(7) << pct(instructions[i].first) << "%  0x" << std::hex << address << std::dec;
+        if (auto sym = symbols.find(address)) {
+            out << "  " << demangle(sym->name) << "+0x" << std::hex << address - sym->value << std::dec;
+        }
+        if (auto range = lines.find(address)) {
+            out << "  " << fs::path(lines.files[range->file]).filename().string() << ":" << range->line;
+        }
+        out << "\n";
+    }
+}
+
+int annotate_run(const CpprunArgs & args, const fs::path & artifact, const std::vector<std::string> & run_args,
+                 const fs::path & workdir) {
+    auto shim_source = workdir / "sampling_shim.cpp";
+    auto shim = workdir / "sampling_shim.so";
+    std::ofstream(shim_source) << SAMPLING_SHIM_SOURCE;
+    int rc = run_cmd(args.cxx, {"-shared", "-fPIC", "-O2", "-o", shim.string(), shim_source.string()},
+                     args.verbose);
+    if (rc != 0) {
+        std::cerr << "ERROR: unable to build the sampling shim with " << args.cxx << std::endl;
+        return rc;
+    }
+
+    auto report = workdir / "samples.txt";
+    rc = run_cmd(artifact.string(), run_args, args.verbose,
+                 {
+                     {"LD_PRELOAD", shim.string()},
+                     {"CPPRUN_PROFILE_REPORT", report.string()},
+                     {"CPPRUN_PROFILE_HZ", std::to_string(*args.annotate_hz)},
+                 });
+    if (!fs::exists(report)) {
+        std::cerr << "WARNING: no samples were written (statically linked, or the program did not exit normally)"
+                  << std::endl;
+        return rc;
+    }
+
+    auto elf = read_elf(artifact);
+    print_annotated_profile(std::cout, attribute_samples(parse_sample_profile(read_file(report))), elf,
+                            read_line_table(elf), source_files(args.build_args), 20);
+    return rc;
+}
+
+// Build profiling: the build is split into its separate compiler driver steps so that each one can be timed and
+// measured on its own.
+
+bool is_link_only_arg(const std::string & a) {
+    static const std::vector<std::string> prefixes = {"-l", "-L", "-Wl,", "-Xlinker", "-static", "-shared",
+                                                      "-rdynamic", "-pie", "-no-pie", "-fuse-ld="};
+    for (auto & p : prefixes) {
+        if (a.rfind(p, 0) == 0) {
+            return true;
+        }
+    }
+    auto ext = fs::path(a).extension().string();
+    return a[0] != '-' && (ext == ".o" || ext == ".a" || ext == ".so");
+}
+
+// A link-only option whose value is the next argument: "-L dir", "-l name", "-Xlinker arg"
+bool is_split_link_arg(const std::string & a) {
+    return a == "-L" || a == "-l" || a == "-Xlinker";
+}
+
+// The arguments without the link-only ones, the values of split ones included
+std::vector<std::string> without_link_only_args(const std::vector<std::string> & args) {
+    std::vector<std::string> out;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (is_split_link_arg(args[i])) {
+            ++i;
+        } else if (!is_link_only_arg(args[i])) {
+            out.push_back(args[i]);
+        }
+    }
+    return out;
+}
+
+// Wall time of the "phase ..." and "template instantiation" rows of GCC's -ftime-report, e.g.
+//  phase parsing                      :   0.62 ( 70%)   0.31 ( 82%)   0.94 ( 72%)    45M ( 75%)
+std::vector<std::pair<std::string, double>> parse_time_report(const std::string & text) {
+    std::vector<std::pair<std::string, double>> phases;
+    std::istringstream iss(text);
+    std::string line;
+    while (std::getline(iss, line)) {
+        auto colon = line.find(" : ");
+        if (colon == std::string::npos) {
+            continue;
+        }
+        auto name = line.substr(0, colon);
+        name.erase(0, name.find_first_not_of(' '));
+        name.erase(name.find_last_not_of(' ') + 1);
+        if (name.rfind("phase ", 0) != 0 && name != "template instantiation") {
+            continue;
+        }
+        auto values = line.substr(colon + 3);
+        std::replace_if(values.begin(), values.end(), [](char c) { return c == '(' || c == ')' || c == '%'; }, ' ');
+        std::istringstream vs(values);
+        std::vector<std::string> tokens;
+        for (std::string t; vs >> t;) {
+            tokens.push_back(t);
+        }
+        // usr (pct) sys (pct) wall (pct) ggc (pct)
+        if (tokens.size() >= 6) {
+            phases.emplace_back(name, std::stod(tokens[4]));
+        }
+    }
+    return phases;
+}
+
+struct StageProfile {
+    std::string name;
+    CmdStats stats;
+    std::vector<std::pair<std::string, double>> phases;
+};
+
+void print_build_profile(std::ostream & out, const std::vector<StageProfile> & stages,
+                         const std::vector<std::pair<fs::path, size_t>> & preprocessed_lines) {
+    double total = 0;
+    for (auto & s : stages) {
+        total += s.stats.wall_seconds;
+    }
+
+    out << std::fixed << std::setprecision(1);
+    out << "stage                           wall ms   cpu ms  peak RSS MB\n";
+    for (auto & s : stages) {
+        out << std::left << std::setw(30) << s.name << std::right << std::setw(9) << s.stats.wall_seconds * 1000
+            << std::setw(9) << (s.stats.user_seconds + s.stats.system_seconds) * 1000 << std::setw(13)
+            << double(s.stats.max_rss_kb) / 1024 << "\n";
+        for (auto & [phase, seconds] : s.phases) {
+            out << "  " << std::left << std::setw(28) << phase << std::right << std::setw(9) << seconds * 1000
+                << "\n";
+        }
+    }
+    out << std::left << std::setw(30) << "total" << std::right << std::setw(9) << total * 1000 << "\n";
+
+    out << "\npreprocessed size:\n";
+    for (auto & [source, lines] : preprocessed_lines) {
+        out << std::setw(10) << lines << " lines  " << source.filename().string() << "\n";
+    }
+
+    // attribute the stages to the part of the toolchain that dominates them
+    double front_end = 0, back_end = 0, link = 0;
+    for (auto & s : stages) {
+        if (s.name.rfind("preprocess", 0) == 0) {
+            front_end += s.stats.wall_seconds;
+        } else if (s.name.rfind("link", 0) == 0) {
+            link += s.stats.wall_seconds;
+        } else if (s.name.rfind("assemble", 0) == 0) {
+            back_end += s.stats.wall_seconds;
+        } else {
+            double parse = 0;
+            for (auto & [phase, seconds] : s.phases) {
+                if (phase == "phase parsing" || phase == "phase lang. deferred") {
+                    parse += seconds;
+                }
+            }
+            parse = std::min(parse, s.stats.wall_seconds);
+            front_end += parse;
+            back_end += s.stats.wall_seconds - parse;
+        }
+    }
+    if (total <= 0) {
+        return;
+    }
+    auto pct = [&](double v) { return 100.0 * v / total; };
+    out << "\nfront-end " << pct(front_end) << "%, optimizer/codegen " << pct(back_end) << "%, linker " << pct(link)
+        << "%: ";
+    if (front_end >= back_end && front_end >= link) {
+        out << "front-end bound; reduce included headers and template instantiations, or precompile headers\n";
+    } else if (back_end >= link) {
+        out << "optimizer bound; try a lower -O level for iteration, or move hot templates out of headers\n";
+    } else {
+        out << "linker bound; try a faster linker (-fuse-ld=gold/lld/mold) or fewer/static libraries\n";
+    }
+}
+
+int profile_build(const CpprunArgs & args, const fs::path & output_path, const fs::path & workdir) {
+    auto sources = source_files(args.build_args);
+    if (sources.empty()) {
+        std::cerr << "ERROR: --cpprun-build-profile needs at least one source file" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> compile_flags;
+    std::vector<std::string> link_flags;
+    if (args.cxx_standard) {
+        append(compile_flags, *args.cxx_standard);
+    }
+    for (size_t i = 0; i < args.build_args.size(); ++i) {
+        auto & a = args.build_args[i];
+        if (is_source_file(a)) {
+            continue;
+        }
+        if (is_link_only_arg(a)) {
+            append(link_flags, a);
+            if (is_split_link_arg(a) && i + 1 < args.build_args.size()) {
+                append(link_flags, args.build_args[++i]);
+            }
+        } else {
+            append(compile_flags, a);
+        }
+    }
+    if (args.static_link) {
+        extend(link_flags, static_link_flags(*args.static_link));
+    }
+
+    std::vector<StageProfile> stages;
+    std::vector<std::pair<fs::path, size_t>> preprocessed_lines;
+    std::vector<std::string> objects;
+    auto run_stage = [&](const std::string & name, std::vector<std::string> cmd, bool time_report) {
+        StageProfile stage{name, {}, {}};
+        int rc = 0;
+        if (time_report) {
+            std::string report;
+            append(cmd, "-ftime-report");
+            rc = capture_cmd(args.cxx, cmd, report, args.verbose, STDERR_FILENO, &stage.stats);
+            stage.phases = parse_time_report(report);
+            if (rc != 0) {
+                std::cerr << report;
+            }
+        } else {
+            rc = run_cmd(args.cxx, cmd, args.verbose, {}, &stage.stats);
+        }
+        stages.push_back(stage);
+        return rc;
+    };
+
+    for (auto & source : sources) {
+        auto base = workdir / source.stem();
+        auto suffix = sources.size() > 1 ? " " + source.filename().string() : std::string();
+        auto ii = base.string() + ".ii", s = base.string() + ".s", o = base.string() + ".o";
+
+        auto cmd = compile_flags;
+        extend(cmd, {"-E", source.string(), "-o", ii});
+        int rc = run_stage("preprocess" + suffix, cmd, false);
+        if (rc != 0) {
+            return rc;
+        }
+        auto text = read_file(ii);
+        preprocessed_lines.emplace_back(source, std::count(text.begin(), text.end(), '\n'));
+
+        cmd = compile_flags;
+        extend(cmd, {"-S", ii, "-o", s});
+        if ((rc = run_stage("compile" + suffix, cmd, true)) != 0) {
+            return rc;
+        }
+
+        cmd = compile_flags;
+        extend(cmd, {"-c", s, "-o", o});
+        if ((rc = run_stage("assemble" + suffix, cmd, false)) != 0) {
+            return rc;
+        }
+        append(objects, o);
+    }
+
+    if (!args.build_only) {
+        auto cmd = objects;
+        extend(cmd, link_flags);
+        extend(cmd, {"-o", output_path.string()});
+        int rc = run_stage("link", cmd, false);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    print_build_profile(std::cout, stages, preprocessed_lines);
+    return 0;
+}
+
+// Header cost analysis over the builds recorded in the artifact cache.
+
+// One line per entry of a "-H" include tree, e.g. ".. /usr/include/c++/12/bits/stl_tree.h"
+std::vector<std::pair<int, std::string>> parse_include_tree(const std::string & text) {
+    std::vector<std::pair<int, std::string>> tree;
+    std::istringstream iss(text);
+    std::string line;
+    while (std::getline(iss, line)) {
+        auto depth = line.find_first_not_of('.');
+        if (depth == 0 || depth == std::string::npos || line[depth] != ' ') {
+            continue;
+        }
+        tree.emplace_back(int(depth), line.substr(depth + 1));
+    }
+    return tree;
+}
+
+// The "#include <...>" search list printed by "c++ -v -E"
+std::vector<fs::path> parse_system_include_dirs(const std::string & text) {
+    std::vector<fs::path> dirs;
+    std::istringstream iss(text);
+    std::string line;
+    bool in_list = false;
+    while (std::getline(iss, line)) {
+        if (line.rfind("#include <...> search starts here:", 0) == 0) {
+            in_list = true;
+        } else if (line.rfind("End of search list.", 0) == 0) {
+            in_list = false;
+        } else if (in_list && !line.empty() && line[0] == ' ') {
+            auto dir = line.substr(1);
+            auto framework = dir.find(" (framework directory)");
+            if (framework != std::string::npos) {
+                dir.erase(framework);
+            }
+            dirs.push_back(fs::path(dir).lexically_normal());
+        }
+    }
+    return dirs;
+}
+
+std::vector<fs::path> system_include_dirs(const CpprunArgs & args) {
+    std::string out;
+    std::vector<std::string> cmd;
+    if (args.cxx_standard) {
+        append(cmd, *args.cxx_standard);
+    }
+    extend(cmd, {"-v", "-E", "-x", "c++", "/dev/null", "-o", "/dev/null"});
+    capture_cmd(args.cxx, cmd, out, false, STDERR_FILENO);
+    return parse_system_include_dirs(out);
+}
+
+// How a header would be spelled in an #include directive: <vector> for system headers, "path" for everything else
+std::string include_spelling(const fs::path & header, const std::vector<fs::path> & system_dirs) {
+    std::optional<fs::path> best;
+    for (auto & dir : system_dirs) {
+        auto rel = header.lexically_relative(dir);
+        if (!rel.empty() && *rel.begin() != ".." && (!best || rel.string().size() < best->string().size())) {
+            best = rel;
+        }
+    }
+    return best ? "<" + best->string() + ">" : "\"" + header.string() + "\"";
+}
+
+// Most recently used first
+std::vector<fs::path> recent_cache_entries(size_t limit) {
+    std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+    auto dir = cache_dir();
+    std::error_code ec;
+    if (!dir || !fs::is_directory(*dir / "artifacts", ec)) {
+        return {};
+    }
+    for (auto & e : fs::directory_iterator(*dir / "artifacts", ec)) {
+        auto stamp = fs::last_write_time(e.path() / "artifact.exe", ec);
+        if (!ec) {
+            entries.emplace_back(stamp, e.path());
+        }
+    }
+    std::sort(entries.rbegin(), entries.rend());
+    std::vector<fs::path> out;
+    for (size_t i = 0; i < std::min(limit, entries.size()); ++i) {
+        out.push_back(entries[i].second);
+    }
+    return out;
+}
+
+struct HeaderCost {
+    fs::path path;
+    std::string spelling;
+    std::set<std::string> builds;  // cache entries that include it directly
+    size_t pulled_in = 0;           // headers it includes transitively
+    double parse_seconds = 0;
+    double instantiation_seconds = 0;
+
+    double total_seconds() const {
+        return parse_seconds * double(builds.size());
+    }
+};
+
+// Lighter replacements for some notoriously expensive standard headers
+const std::map<std::string, std::string> LIGHTER_HEADERS = {
+    {"<bits/stdc++.h>", "include only the standard headers that are actually used"},
+    {"<iostream>", "<cstdio> (or <print> in C++23) for plain output, <ostream>/<istream> in headers"},
+    {"<sstream>", "<charconv> (std::to_chars/from_chars) or std::to_string for number formatting"},
+    {"<fstream>", "<cstdio> (fopen/fread) for simple file I/O"},
+    {"<regex>", "hand-written parsing with <string_view>, std::regex is expensive to compile and to run"},
+    {"<iomanip>", "<format> (C++20) or printf-style formatting"},
+    {"<functional>", "a template parameter instead of std::function where possible"},
+    {"<locale>", "<cctype> when only character classification is needed"},
+};
+
+// stable system headers that are expensive or shared by several builds are worth precompiling
+bool is_precompile_candidate(const HeaderCost & h) {
+    return h.spelling[0] == '<' && (h.builds.size() > 1 || h.parse_seconds > 0.1);
+}
+
+// headers are expected to be sorted by total cost, most expensive first
+void print_header_report(std::ostream & out, const std::vector<HeaderCost> & headers, size_t builds, size_t top,
+                         const std::optional<fs::path> & prelude) {
+    out << std::fixed << std::setprecision(1);
+    out << "header cost over " << builds << " cached builds:\n";
+    out << "  total ms  per-include ms  instantiate ms  builds  headers pulled in  header\n";
+    for (size_t i = 0; i < std::min(top, headers.size()); ++i) {
+        auto & h = headers[i];
+        out << std::setw(10) << h.total_seconds() * 1000 << std::setw(16) << h.parse_seconds * 1000 << std::setw(16)
+            << h.instantiation_seconds * 1000 << std::setw(8) << h.builds.size() << std::setw(19) << h.pulled_in
+            << "  " << h.spelling << "\n";
+    }
+
+    out << "\nrecommendations:\n";
+    std::vector<std::string> precompile;
+    for (auto & h : headers) {
+        if (is_precompile_candidate(h) && precompile.size() < top) {
+            precompile.push_back(h.spelling);
+        }
+    }
+    if (!precompile.empty()) {
+        out << "  - precompile " << join_shell(precompile) << "\n";
+    }
+    for (auto & h : headers) {
+        auto lighter = LIGHTER_HEADERS.find(h.spelling);
+        if (lighter != LIGHTER_HEADERS.end()) {
+            out << "  - replace " << h.spelling << " (" << h.parse_seconds * 1000 << " ms per include, "
+                << h.builds.size() << " builds): " << lighter->second << "\n";
+        }
+    }
+    for (auto & h : headers) {
+        if (h.spelling[0] == '"' && h.parse_seconds > 0.2) {
+            out << "  - " << h.spelling << " costs " << h.parse_seconds * 1000
+                << " ms per include; move implementation details and rarely used includes out of it\n";
+        }
+    }
+    if (prelude) {
+        out << "\nprelude header for precompilation written to " << *prelude << ", use it with:\n"
+            << "    c++ -x c++-header <flags> " << prelude->string() << "    (once, creates prelude.hpp.gch)\n"
+            << "    cpprun -include " << prelude->string() << " <source>\n";
+    }
+}
+
+int report_header_costs(const CpprunArgs & args, const fs::path & workdir, size_t top) {
+    auto entries = recent_cache_entries(100);
+    auto system_dirs = system_include_dirs(args);
+    auto original_cwd = fs::current_path();
+
+    std::map<fs::path, HeaderCost> headers;
+    std::map<fs::path, BuildRecord> measure_with;  // the flags to parse each header with
+    size_t builds = 0;
+    for (auto & entry : entries) {
+        std::error_code ec;
+        if (!fs::exists(entry / "command", ec)) {
+            continue;
+        }
+        auto record = parse_build_record(read_file(entry / "command"));
+        if (!record) {
+            continue;
+        }
+
+        auto cmd = without_link_only_args(record->args);
+        extend(cmd, {"-H", "-fsyntax-only"});
+        std::string tree_text;
+        if (!fs::is_directory(record->cwd, ec)) {
+            continue;
+        }
+        fs::current_path(record->cwd);
+        int rc = capture_cmd(record->cxx, cmd, tree_text, args.verbose, STDERR_FILENO);
+        fs::current_path(original_cwd);
+        if (rc != 0) {
+            continue;
+        }
+        builds++;
+
+        auto tree = parse_include_tree(tree_text);
+        for (size_t i = 0; i < tree.size(); ++i) {
+            if (tree[i].first != 1) {
+                continue;
+            }
+            auto path = (record->cwd / tree[i].second).lexically_normal();
+            auto & h = headers[path];
+            h.path = path;
+            h.spelling = include_spelling(path, system_dirs);
+            h.builds.insert(entry.filename().string());
+            size_t pulled_in = 0;
+            for (size_t j = i + 1; j < tree.size() && tree[j].first > 1; ++j) {
+                pulled_in++;
+            }
+            h.pulled_in = std::max(h.pulled_in, pulled_in);
+            measure_with.emplace(path, *record);
+        }
+    }
+
+    if (headers.empty()) {
+        std::cerr << "no cached builds to analyze yet, run some programs with cpprun first" << std::endl;
+        return 1;
+    }
+
+    auto tu = workdir / "header.cpp";
+    for (auto & [path, h] : headers) {
+        auto & record = measure_with.at(path);
+        std::ofstream(tu) << "#include \"" << path.string() << "\"\n";
+        std::vector<std::string> cmd;
+        for (auto & a : record.args) {
+            if (!is_source_file(a) && !is_link_only_arg(a)) {
+                append(cmd, a);
+            }
+        }
+        extend(cmd, {"-fsyntax-only", "-ftime-report", tu.string()});
+
+        std::string report;
+        CmdStats stats;
+        fs::current_path(record.cwd);
+        capture_cmd(record.cxx, cmd, report, args.verbose, STDERR_FILENO, &stats);
+        fs::current_path(original_cwd);
+
+        // GCC reports its phases, otherwise fall back to the CPU time of the whole syntax check
+        h.parse_seconds = 0;
+        for (auto & [phase, seconds] : parse_time_report(report)) {
+            if (phase == "phase parsing" || phase == "phase lang. deferred") {
+                h.parse_seconds += seconds;
+            } else if (phase == "template instantiation") {
+                h.instantiation_seconds = seconds;
+            }
+        }
+        if (h.parse_seconds == 0) {
+            h.parse_seconds = stats.user_seconds + stats.system_seconds;
+        }
+    }
+
+    std::vector<HeaderCost> costs;
+    for (auto & [_, h] : headers) {
+        costs.push_back(h);
+    }
+    std::sort(costs.begin(), costs.end(), [](auto & a, auto & b) {
+        return a.total_seconds() != b.total_seconds() ? a.total_seconds() > b.total_seconds()
+                                                      : a.spelling < b.spelling;
+    });
+
+    std::optional<fs::path> prelude;
+    if (auto dir = cache_dir()) {
+        std::string text = "// Commonly used, expensive headers of recent cpprun builds. Generated by cpprun.\n"
+                           "#pragma once\n";
+        size_t count = 0;
+        for (auto & h : costs) {
+            if (is_precompile_candidate(h) && count++ < top) {
+                text += "#include " + h.spelling + "\n";
+            }
+        }
+        if (count > 0) {
+            prelude = *dir / "prelude.hpp";
+            write_file_atomic(*prelude, text);
+        }
+    }
+
+    print_header_report(std::cout, costs, builds, top, prelude);
+    return 0;
+}
+
+// Page cache prewarming (--cpprun-prewarm): on a cold host, the first builds spend much of their time reading the
+// compiler and thousands of headers from disk. The files builds read - the compiler driver and the programs it
+// runs, the runtime libraries it links, the system include directories and the files of recently used cache
+// entries - are read ahead into the page cache by a few threads, in a background process unless
+// --cpprun-prewarm=wait.
+
+struct PrewarmGroup {
+    std::string name;
+    std::vector<fs::path> files;
+};
+
+struct PrewarmTotals {
+    size_t files = 0;
+    uintmax_t bytes = 0;
+    uintmax_t cold_bytes = 0;  // not in the page cache before
+};
+
+// Readahead is I/O bound, more threads than CPUs keep more requests in flight
+const size_t PREWARM_THREADS = 8;
+const size_t PREWARM_CACHE_ENTRIES = 50;
+
+// The files a manifest lists, see manifest_is_current
+std::vector<fs::path> manifest_paths(const std::string & manifest) {
+    std::vector<fs::path> paths;
+    std::istringstream iss(manifest);
+    std::string line;
+    while (std::getline(iss, line)) {
+        std::istringstream fields(line);
+        std::string size, mtime, path;
+        if (fields >> size >> mtime && std::getline(fields >> std::ws, path)) {
+            paths.push_back(path);
+        }
+    }
+    return paths;
+}
+
+// Each regular file once, in the first group that lists it
+std::vector<PrewarmGroup> prewarm_files(const CpprunArgs & args) {
+    std::set<fs::path> seen;
+    std::vector<PrewarmGroup> groups;
+    auto add = [&](const fs::path & path) {
+        std::error_code ec;
+        auto file = fs::canonical(path, ec);
+        if (!ec && fs::is_regular_file(file, ec) && seen.insert(file).second) {
+            groups.back().files.push_back(file);
+        }
+    };
+    auto ask_compiler = [&](const std::string & option) -> std::optional<fs::path> {
+        std::string out;
+        if (capture_cmd(args.cxx, {option}, out, args.verbose) != 0) {
+            return std::nullopt;
+        }
+        out.erase(out.find_last_not_of(" \n") + 1);
+        // both print the name as given when they do not find it
+        return out.find('/') != std::string::npos ? std::make_optional(fs::path(out)) : resolve_program(out);
+    };
+
+    groups.push_back({"compiler", {}});
+    if (auto driver = resolve_program(args.cxx)) {
+        add(*driver);
+    }
+    std::vector<std::string> programs = {"cc1plus", "collect2", "lto-wrapper", "as", "ld"};
+    for (auto & a : args.build_args) {
+        if (a.substr(0, 9) == "-fuse-ld=") {
+            programs.push_back("ld." + a.substr(9));
+        }
+    }
+    for (auto & program : programs) {
+        if (auto path = ask_compiler("-print-prog-name=" + program)) {
+            add(*path);
+        }
+    }
+
+    groups.push_back({"runtime", {}});
+    for (auto name : {"libstdc++.so", "libstdc++.a", "libgcc_s.so", "libgcc.a", "libc.so", "libc.so.6",
+                      "libc_nonshared.a", "libm.so", "libm.so.6", "Scrt1.o", "crti.o", "crtn.o", "crtbeginS.o",
+                      "crtendS.o"}) {
+        if (auto path = ask_compiler(std::string("-print-file-name=") + name); path && path->is_absolute()) {
+            add(*path);
+        }
+    }
+
+    groups.push_back({"system headers", {}});
+    for (auto & dir : system_include_dirs(args)) {
+        std::error_code ec;
+        for (auto it = fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied, ec);
+             !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+            add(it->path());
+        }
+    }
+
+    groups.push_back({"cached builds", {}});
+    for (auto & entry : recent_cache_entries(PREWARM_CACHE_ENTRIES)) {
+        add(entry / "artifact.exe");
+        add(entry / "manifest");
+        try {
+            for (auto & path : manifest_paths(read_file(entry / "manifest"))) {
+                add(path);
+            }
+        } catch (const std::exception &) {
+            // an entry that is being replaced, or was removed meanwhile
+        }
+    }
+    return groups;
+}
+
+// Counts the resident pages with mincore, then reads the file ahead.
+static PrewarmTotals prewarm_file(const fs::path & path) {
+    PrewarmTotals totals;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if (fd < 0) {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);  // O_NOATIME needs the owner
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return totals;
+    }
+    totals.files = 1;
+    totals.bytes = uintmax_t(st.st_size);
+    if (st.st_size > 0) {
+        size_t page = size_t(sysconf(_SC_PAGESIZE));
+        size_t pages = (size_t(st.st_size) + page - 1) / page;
+        void * map = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            std::vector<unsigned char> resident(pages);
+            if (mincore(map, size_t(st.st_size), resident.data()) == 0) {
+                size_t cold = size_t(std::count_if(resident.begin(), resident.end(), [](auto r) { return !(r & 1); }));
+                totals.cold_bytes = std::min<uintmax_t>(uintmax_t(cold) * page, totals.bytes);
+            }
+            munmap(map, size_t(st.st_size));
+        }
+        if (readahead(fd, 0, size_t(st.st_size)) != 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        }
+    }
+    close(fd);
+    return totals;
+}
+
+std::vector<PrewarmTotals> prewarm(const std::vector<PrewarmGroup> & groups, size_t threads) {
+    std::vector<std::pair<size_t, const fs::path *>> files;
+    for (size_t g = 0; g < groups.size(); ++g) {
+        for (auto & f : groups[g].files) {
+            files.emplace_back(g, &f);
+        }
+    }
+    std::vector<PrewarmTotals> totals(groups.size());
+    std::atomic<size_t> next{0};
+    std::mutex mutex;
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < std::min(threads, files.size()); ++t) {
+        workers.emplace_back([&] {
+            std::vector<PrewarmTotals> local(groups.size());
+            for (size_t i; (i = next++) < files.size();) {
+                auto f = prewarm_file(*files[i].second);
+                auto & l = local[files[i].first];
+                l.files += f.files;
+                l.bytes += f.bytes;
+                l.cold_bytes += f.cold_bytes;
+            }
+            std::lock_guard lock(mutex);
+            for (size_t g = 0; g < groups.size(); ++g) {
+                totals[g].files += local[g].files;
+                totals[g].bytes += local[g].bytes;
+                totals[g].cold_bytes += local[g].cold_bytes;
+            }
+        });
+    }
+    for (auto & w : workers) {
+        w.join();
+    }
+    return totals;
+}
+
+void print_prewarm_report(std::ostream & out, const std::vector<PrewarmGroup> & groups,
+                          const std::vector<PrewarmTotals> & totals, double seconds) {
+    auto mb = [](uintmax_t bytes) { return double(bytes) / (1024 * 1024); };
+    out << std::left << std::setw(16) << "" << std::right << std::setw(8) << "files" << std::setw(12) << "MB"
+        << std::setw(12) << "cold MB" << "\n";
+    PrewarmTotals all;
+    for (size_t g = 0; g < groups.size(); ++g) {
+        out << std::left << std::setw(16) << groups[g].name << std::right << std::setw(8) << totals[g].files
+            << std::fixed << std::setprecision(1) << std::setw(12) << mb(totals[g].bytes) << std::setw(12)
+            << mb(totals[g].cold_bytes) << "\n";
+        all.files += totals[g].files;
+        all.bytes += totals[g].bytes;
+        all.cold_bytes += totals[g].cold_bytes;
+    }
+    out << "prewarm: " << all.files << " files, " << std::fixed << std::setprecision(1) << mb(all.bytes) << " MB, "
+        << mb(all.cold_bytes) << " MB of them read from disk, in " << std::setprecision(2) << seconds << " s"
+        << std::endl;
+}
+
+int run_prewarm(const CpprunArgs & args) {
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    auto groups = prewarm_files(args);
+    size_t files = 0;
+    for (auto & g : groups) {
+        files += g.files.size();
+    }
+    if (args.prewarm_wait) {
+        auto totals = prewarm(groups, PREWARM_THREADS);
+        print_prewarm_report(std::cout, groups, totals, seconds_since(start));
+        return 0;
+    }
+
+    // detached from the session and the terminal, so that it survives the login shell or CI step that started it
+    std::cout << std::flush;
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        setsid();
+        if (fork() != 0) {
+            _exit(0);
+        }
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        prewarm(groups, PREWARM_THREADS);
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+    std::cout << "prewarm: reading " << files << " files into the page cache in the background" << std::endl;
+    return 0;
+}
+
+// Parallel runtime detection: the sources and the local headers they include are scanned for OpenMP pragmas,
+// threads and parallel algorithms, and the flags these need are added to the build (CpprunArgs::runtime_flags).
+// Flags the user already gave, or their negations, take precedence.
+
+struct ParallelRuntime {
+    bool openmp = false;        // #pragma omp
+    bool threads = false;       // std::thread, std::jthread, std::async
+    bool parallel_stl = false;  // <execution>
+};
+
+// Scans one file; the names of its quoted includes are appended to local_includes.
+void scan_parallel_runtime(const std::string & text, ParallelRuntime & found,
+                           std::vector<std::string> & local_includes) {
+    std::istringstream iss(text);
+    for (std::string line; std::getline(iss, line);) {
+        if (line.find("std::thread") != std::string::npos || line.find("std::jthread") != std::string::npos ||
+            line.find("std::async") != std::string::npos) {
+            found.threads = true;
+        }
+        auto hash = line.find_first_not_of(" \t");
+        if (hash == std::string::npos || line[hash] != '#') {
+            continue;
+        }
+        std::istringstream directive(line.substr(hash + 1));
+        std::string word, operand;
+        directive >> word >> operand;
+        if (word == "pragma" && operand == "omp") {
+            found.openmp = true;
+        } else if (word == "include" && (operand == "<thread>" || operand == "<future>")) {
+            found.threads = true;
+        } else if (word == "include" && operand == "<execution>") {
+            found.parallel_stl = true;
+        } else if (word == "include" && operand.size() > 2 && operand[0] == '"') {
+            local_includes.push_back(operand.substr(1, operand.find('"', 1) - 1));
+        }
+    }
+}
+
+ParallelRuntime detect_parallel_runtime(const CpprunArgs & args) {
+    std::vector<fs::path> include_dirs;
+    for (size_t i = 0; i < args.build_args.size(); ++i) {
+        auto & a = args.build_args[i];
+        if ((a == "-I" || a == "-iquote") && i + 1 < args.build_args.size()) {
+            include_dirs.push_back(args.build_args[++i]);
+        } else if (a.substr(0, 2) == "-I") {
+            include_dirs.push_back(a.substr(2));
+        }
+    }
+
+    ParallelRuntime found;
+    std::set<fs::path> seen;
+    std::vector<fs::path> pending = source_files(args.build_args);
+    while (!pending.empty()) {
+        auto file = pending.back();
+        pending.pop_back();
+        std::error_code ec;
+        if (!seen.insert(file).second || !fs::is_regular_file(file, ec)) {
+            continue;
+        }
+        std::vector<std::string> includes;
+        scan_parallel_runtime(read_file(file), found, includes);
+        for (auto & name : includes) {
+            // wherever the compiler might find it: in the -I directories or next to the including file
+            for (auto & dir : include_dirs) {
+                if (fs::exists(dir / name, ec)) {
+                    pending.push_back(fs::absolute(dir / name).lexically_normal());
+                }
+            }
+            if (fs::exists(file.parent_path() / name, ec)) {
+                pending.push_back((file.parent_path() / name).lexically_normal());
+            }
+        }
+    }
+    return found;
+}
+
+// libstdc++ runs the parallel algorithms on TBB when its headers are installed, and then needs -ltbb. This runs
+// before the cache lookup, so the include directories are cached per compiler installation and standard; the
+// headers themselves are looked up every time.
+static bool tbb_available(const CpprunArgs & args) {
+    std::optional<fs::path> cached;
+    if (auto dir = cache_dir()) {
+        cached = *dir / "include-dirs" /
+                 (compiler_fingerprint(args.cxx) + "." + hex64(fnv1a64(args.cxx_standard.value_or(""))));
+    }
+    std::vector<fs::path> dirs;
+    if (cached && fs::exists(*cached)) {
+        std::istringstream iss(read_file(*cached));
+        for (std::string line; std::getline(iss, line);) {
+            dirs.emplace_back(line);
+        }
+    } else {
+        dirs = system_include_dirs(args);
+        if (cached && !dirs.empty()) {
+            std::string text;
+            for (auto & dir : dirs) {
+                text += dir.string() + "\n";
+            }
+            try {
+                write_file_atomic(*cached, text);
+            } catch (const std::exception &) {
+            }
+        }
+    }
+    std::error_code ec;
+    for (auto & dir : dirs) {
+        if (fs::exists(dir / "tbb" / "version.h", ec) || fs::exists(dir / "tbb" / "tbb.h", ec)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::string> parallel_runtime_flags(const CpprunArgs & args, const ParallelRuntime & found) {
+    auto given = [&](std::initializer_list<const char *> flags) {
+        return std::any_of(flags.begin(), flags.end(), [&](const char * f) { return contains(args.build_args, f); });
+    };
+    std::vector<std::string> flags;
+    if (found.openmp && !given({"-fopenmp", "-fno-openmp", "-fopenmp-simd", "-qopenmp"})) {
+        flags.push_back("-fopenmp");
+    }
+    if ((found.threads || found.parallel_stl || found.openmp) && !given({"-pthread", "-lpthread"})) {
+        flags.push_back("-pthread");
+    }
+    if (found.parallel_stl && !given({"-ltbb"}) && tbb_available(args)) {
+        flags.push_back("-ltbb");
+    }
+    return flags;
+}
+
+// Thread placement for OpenMP programs, unless the user has chosen one.
+EnvOverrides parallel_runtime_env(const CpprunArgs & args) {
+    if (!uses_openmp(args)) {
+        return {};
+    }
+    for (auto name : {"OMP_PROC_BIND", "OMP_PLACES", "GOMP_CPU_AFFINITY", "KMP_AFFINITY"}) {
+        if (std::getenv(name)) {
+            return {};
+        }
+    }
+    return OPENMP_ENV_DEFAULTS;
+}
+
+// Stack usage analysis: frame sizes come from GCC's -fstack-usage (.su) files, the call graph from the relocations
+// of the object files.
+
+struct FrameUsage {
+    std::string name;      // as printed by the compiler, e.g. "int S::f(int)"
+    std::string location;  // file:line:column
+    uint64_t bytes = 0;
+    std::string kind;  // static, dynamic or "dynamic,bounded"
+};
+
+// One line per function: "su.cpp:5:5:int S::f(int)\t16\tstatic"
+std::vector<FrameUsage> parse_stack_usage(const std::string & text) {
+    std::vector<FrameUsage> frames;
+    std::istringstream iss(text);
+    std::string line;
+    while (std::getline(iss, line)) {
+        auto tab2 = line.rfind('\t');
+        auto tab1 = tab2 == std::string::npos || tab2 == 0 ? std::string::npos : line.rfind('\t', tab2 - 1);
+        if (tab1 == std::string::npos) {
+            continue;
+        }
+        FrameUsage f;
+        auto head = line.substr(0, tab1);
+        // the location ends at the first ":<line>:<column>:", file names may contain colons too
+        size_t pos = std::string::npos;
+        for (size_t i = head.find(':'); i != std::string::npos && pos == std::string::npos; i = head.find(':', i + 1)) {
+            auto line_end = head.find_first_not_of("0123456789", i + 1);
+            if (line_end == i + 1 || line_end == std::string::npos || head[line_end] != ':') {
+                continue;
+            }
+            auto column_end = head.find_first_not_of("0123456789", line_end + 1);
+            if (column_end != line_end + 1 && column_end != std::string::npos && head[column_end] == ':') {
+                pos = column_end;
+            }
+        }
+        if (pos == std::string::npos) {
+            continue;
+        }
+        f.location = head.substr(0, pos);
+        f.name = head.substr(pos + 1);
+        f.bytes = std::stoull(line.substr(tab1 + 1, tab2 - tab1 - 1));
+        f.kind = line.substr(tab2 + 1);
+        frames.push_back(f);
+    }
+    return frames;
+}
+
+// Reduces a function signature to its qualified name without template arguments, return type or parameters, so
+// that .su names ("T big(T) [with T = int]") and demangled symbols ("int big<int>(int)") can be matched up.
+std::string function_key(const std::string & signature) {
+    auto name = signature.substr(0, signature.find(" [with "));
+    name = template_family(name);
+    for (auto pos = name.find("<>"); pos != std::string::npos; pos = name.find("<>")) {
+        name.erase(pos, 2);
+    }
+    // the parameter list starts at the first parenthesis that is not part of "operator()"
+    size_t paren = 0;
+    while ((paren = name.find('(', paren)) != std::string::npos) {
+        if (paren >= 8 && name.compare(paren - 8, 8, "operator") == 0) {
+            paren += 2;
+            continue;
+        }
+        break;
+    }
+    name = name.substr(0, paren);
+    auto space = name.rfind(' ');
+    if (space != std::string::npos && name.compare(space + 1, 8, "operator") != 0) {
+        name = name.substr(space + 1);
+    } else if (space != std::string::npos) {
+        auto prefix = name.rfind(' ', space - 1);
+        name = name.substr(prefix == std::string::npos ? 0 : prefix + 1);
+    }
+    return name;
+}
+
+using CallGraph = std::map<std::string, std::set<std::string>>;
+
+// Direct calls found in a relocatable object: relocations of code sections that target function symbols. Calls
+// through pointers and virtual functions are not visible this way.
+void collect_call_graph(const ElfFile & elf, CallGraph & graph) {
+    std::map<uint16_t, std::vector<const ElfSymbol *>> functions;  // per section, sorted by offset
+    for (auto & s : elf.symbols) {
+        if (s.type == STT_FUNC && s.shndx != SHN_UNDEF && s.shndx < elf.sections.size()) {
+            functions[s.shndx].push_back(&s);
+        }
+    }
+    for (auto & [_, list] : functions) {
+        std::sort(list.begin(), list.end(), [](auto * a, auto * b) { return a->value < b->value; });
+    }
+    auto function_at = [&](uint16_t section, uint64_t offset) -> const ElfSymbol * {
+        auto it = functions.find(section);
+        if (it == functions.end()) {
+            return nullptr;
+        }
+        for (auto * f : it->second) {
+            if (offset >= f->value && offset < f->value + std::max<uint64_t>(f->size, 1)) {
+                return f;
+            }
+        }
+        return nullptr;
+    };
+
+    bool aarch64 = elf.machine == EM_AARCH64;
+    for (auto & s : elf.sections) {
+        if (s.type != SHT_RELA || s.info >= elf.sections.size() || !(elf.sections[s.info].flags & SHF_EXECINSTR)) {
+            continue;
+        }
+        auto relocs = elf.section_data(s);
+        auto code = elf.section_data(elf.sections[s.info]);
+        // PC32 is also used for data addressed relative to rip; it is a call or a jump only after an e8/e9 opcode
+        auto branch_at = [&](uint64_t offset) {
+            return offset > 0 && offset <= code.size() &&
+                   (uint8_t(code[offset - 1]) == 0xe8 || uint8_t(code[offset - 1]) == 0xe9);
+        };
+        for (uint64_t off = 0; off + sizeof(Elf64_Rela) <= relocs.size(); off += sizeof(Elf64_Rela)) {
+            auto r = read_at<Elf64_Rela>(relocs, off);
+            auto type = ELF64_R_TYPE(r.r_info);
+            bool call = aarch64 ? (type == R_AARCH64_CALL26 || type == R_AARCH64_JUMP26)
+                                : (type == R_X86_64_PLT32 || (type == R_X86_64_PC32 && branch_at(r.r_offset)));
+            auto index = ELF64_R_SYM(r.r_info);
+            if (!call || index >= elf.symbols.size()) {
+                continue;
+            }
+            auto caller = function_at(uint16_t(s.info), r.r_offset);
+            auto & target = elf.symbols[index];
+            const ElfSymbol * callee = &target;
+            if (target.type == STT_SECTION) {
+                // local calls may be expressed relative to the section
+                callee = function_at(target.shndx, uint64_t(r.r_addend + (aarch64 ? 0 : 4)));
+            } else if (target.type != STT_FUNC && !(target.type == STT_NOTYPE && target.shndx == SHN_UNDEF)) {
+                continue;
+            }
+            if (caller && callee && !callee->name.empty()) {
+                graph[function_key(demangle(caller->name))].insert(function_key(demangle(callee->name)));
+            }
+        }
+    }
+}
+
+struct StackChain {
+    uint64_t bytes = 0;
+    std::vector<std::string> path;
+    bool recursive = false;
+    bool dynamic = false;
+    std::set<std::string> unknown;  // callees without stack usage information (other libraries)
+};
+
+class StackEstimator {
+   public:
+    StackEstimator(const CallGraph & graph, const std::map<std::string, FrameUsage> & frames)
+        : graph_(graph), frames_(frames) {
+    }
+
+    const StackChain & worst(const std::string & function) {
+        auto memo = memo_.find(function);
+        if (memo != memo_.end()) {
+            return memo->second;
+        }
+        StackChain chain;
+        chain.path.push_back(function);
+        auto frame = frames_.find(function);
+        if (frame != frames_.end()) {
+            chain.bytes = frame->second.bytes;
+            chain.dynamic = frame->second.kind.find("dynamic") != std::string::npos &&
+                            frame->second.kind.find("bounded") == std::string::npos;
+        }
+
+        active_.insert(function);
+        StackChain deepest;
+        auto callees = graph_.find(function);
+        if (callees != graph_.end()) {
+            for (auto & callee : callees->second) {
+                if (active_.count(callee)) {
+                    chain.recursive = true;
+                    continue;
+                }
+                if (!frames_.count(callee) && !graph_.count(callee)) {
+                    chain.unknown.insert(callee);
+                    continue;
+                }
+                auto & sub = worst(callee);
+                chain.recursive |= sub.recursive;
+                chain.dynamic |= sub.dynamic;
+                chain.unknown.insert(sub.unknown.begin(), sub.unknown.end());
+                if (sub.bytes > deepest.bytes || deepest.path.empty()) {
+                    deepest = sub;
+                }
+            }
+        }
+        active_.erase(function);
+
+        chain.bytes += deepest.bytes;
+        extend(chain.path, deepest.path);
+        return memo_[function] = chain;
+    }
+
+   private:
+    const CallGraph & graph_;
+    const std::map<std::string, FrameUsage> & frames_;
+    std::map<std::string, StackChain> memo_;
+    std::set<std::string> active_;
+};
+
+void print_stack_report(std::ostream & out, const std::vector<FrameUsage> & frame_list, const CallGraph & graph,
+                        size_t top) {
+    std::map<std::string, FrameUsage> frames;
+    for (auto & f : frame_list) {
+        auto key = function_key(f.name);
+        // overloads and instantiations share a key, assume the largest frame for all of them
+        if (frames[key].bytes <= f.bytes) {
+            frames[key] = f;
+        }
+    }
+
+    auto sorted = frame_list;
+    std::sort(sorted.begin(), sorted.end(), [](auto & a, auto & b) { return a.bytes > b.bytes; });
+    out << "largest frames:\n";
+    out << "     bytes  kind              function\n";
+    for (size_t i = 0; i < std::min(top, sorted.size()); ++i) {
+        out << std::setw(10) << sorted[i].bytes << "  " << std::left << std::setw(16) << sorted[i].kind << std::right
+            << "  " << sorted[i].name << "  (" << sorted[i].location << ")\n";
+    }
+
+    out << "\ndynamically sized frames:\n";
+    size_t dynamic = 0;
+    for (auto & f : sorted) {
+        if (f.kind.find("dynamic") != std::string::npos) {
+            out << std::setw(10) << f.bytes << "+ " << std::left << std::setw(16) << f.kind << std::right << "  "
+                << f.name << "  (" << f.location << ")\n";
+            dynamic++;
+        }
+    }
+    if (dynamic == 0) {
+        out << "    (none)\n";
+    }
+
+    StackEstimator estimator(graph, frames);
+    std::set<std::string> called;
+    for (auto & [_, callees] : graph) {
+        called.insert(callees.begin(), callees.end());
+    }
+    std::vector<StackChain> chains;
+    for (auto & [function, _] : frames) {
+        if (function == "main" || !called.count(function)) {
+            chains.push_back(estimator.worst(function));
+        }
+    }
+    std::sort(chains.begin(), chains.end(), [](auto & a, auto & b) { return a.bytes > b.bytes; });
+
+    out << "\nworst-case call chains (from main and other uncalled functions):\n";
+    for (size_t i = 0; i < std::min(top, chains.size()); ++i) {
+        auto & c = chains[i];
+        out << std::setw(10) << c.bytes << (c.recursive || c.dynamic || !c.unknown.empty() ? "+ " : "  ");
+        for (size_t j = 0; j < c.path.size(); ++j) {
+            out << (j ? " -> " : "") << c.path[j];
+        }
+        out << "\n";
+        if (c.recursive) {
+            out << "            unbounded: recursion is reachable from " << c.path.front() << "\n";
+        }
+        if (c.dynamic) {
+            out << "            unbounded: dynamically sized frames are reachable from " << c.path.front() << "\n";
+        }
+        if (!c.unknown.empty()) {
+            std::vector<std::string> unknown(c.unknown.begin(), c.unknown.end());
+            out << "            plus the stack of external functions: " << join_shell(unknown) << "\n";
+        }
+    }
+}
+
+int report_stack_usage(const CpprunArgs & args, const fs::path & output_path, const fs::path & workdir) {
+    auto sources = source_files(args.build_args);
+    if (sources.empty()) {
+        std::cerr << "ERROR: --cpprun-stack-usage needs at least one source file" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> compile_flags;
+    std::vector<std::string> link_flags;
+    if (args.cxx_standard) {
+        append(compile_flags, *args.cxx_standard);
+    }
+    for (auto & a : args.build_args) {
+        if (!is_source_file(a)) {
+            append(is_link_only_arg(a) ? link_flags : compile_flags, a);
+        }
+    }
+    if (args.static_link) {
+        extend(link_flags, static_link_flags(*args.static_link));
+    }
+    append(compile_flags, "-fstack-usage");
+    if (*args.stack_usage > 0) {
+        append(compile_flags, "-Wframe-larger-than=" + std::to_string(*args.stack_usage));
+    }
+
+    std::vector<FrameUsage> frames;
+    CallGraph graph;
+    std::vector<std::string> objects;
+    for (auto & source : sources) {
+        auto object = workdir / (source.stem().string() + ".o");
+        auto cmd = compile_flags;
+        extend(cmd, {"-c", source.string(), "-o", object.string()});
+        int rc = run_cmd(args.cxx, cmd, args.verbose);
+        if (rc != 0) {
+            return rc;
+        }
+        auto su = object;
+        su.replace_extension(".su");
+        if (!fs::exists(su)) {
+            std::cerr << "ERROR: " << args.cxx << " did not write " << su << ", -fstack-usage is only supported by GCC"
+                      << std::endl;
+            return 1;
+        }
+        extend(frames, parse_stack_usage(read_file(su)));
+        collect_call_graph(read_elf(object), graph);
+        append(objects, object.string());
+    }
+
+    if (!args.build_only) {
+        auto cmd = objects;
+        extend(cmd, link_flags);
+        extend(cmd, {"-o", output_path.string()});
+        int rc = run_cmd(args.cxx, cmd, args.verbose);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    print_stack_report(std::cout, frames, graph, 20);
+    return 0;
+}
+
+// Build history: every compile that is not served from the cache appends one line to CPPRUN_CACHE_DIR/builds.log,
+// keyed by the script, the flags and the compiler fingerprint, so that slowdowns after a toolchain upgrade show up
+// in --cpprun-build-trends.
+
+struct BuildLogEntry {
+    int64_t time = 0;  // seconds since the epoch
+    std::string script;
+    std::string flags;
+    std::string compiler;  // fingerprint
+    double wall_seconds = 0;
+    double cpu_seconds = 0;
+    long max_rss_kb = 0;
+    std::string compiler_path;
+    std::string sources;
+};
+
+// "time\tscript\tflags\tcompiler\twall\tcpu\trss\tcompiler_path\tsources"
+std::string format_build_log_entry(const BuildLogEntry & e) {
+    std::ostringstream out;
+    out << e.time << '\t' << e.script << '\t' << e.flags << '\t' << e.compiler << '\t' << std::fixed
+        << std::setprecision(4) << e.wall_seconds << '\t' << e.cpu_seconds << '\t' << e.max_rss_kb << '\t'
+        << e.compiler_path << '\t' << e.sources << '\n';
+    return out.str();
+}
+
+std::vector<BuildLogEntry> parse_build_log(const std::string & text) {
+    std::vector<BuildLogEntry> entries;
+    std::istringstream iss(text);
+    std::string line;
+    while (std::getline(iss, line)) {
+        std::vector<std::string> fields;
+        std::istringstream fs(line);
+        std::string field;
+        while (std::getline(fs, field, '\t')) {
+            fields.push_back(field);
+        }
+        if (fields.size() != 9) {
+            continue;  // a truncated line from an interrupted write
+        }
+        try {
+            entries.push_back({std::stoll(fields[0]), fields[1], fields[2], fields[3], std::stod(fields[4]),
+                               std::stod(fields[5]), std::stol(fields[6]), fields[7], fields[8]});
+        } catch (const std::exception &) {
+        }
+    }
+    return entries;
+}
+
+void record_build(const CpprunArgs & args, const CmdStats & stats) {
+    auto dir = cache_dir();
+    auto sources = source_files(args.build_args);
+    if (!dir || sources.empty()) {
+        return;
+    }
+    std::vector<std::string> flags;
+    for (auto & a : make_build_record(args).args) {
+        if (!is_source_file(a)) {
+            flags.push_back(a);
+        }
+    }
+    std::vector<std::string> names;
+    for (auto & s : sources) {
+        names.push_back(s.string());
+    }
+    auto program = resolve_program(args.cxx);
+    BuildLogEntry entry{std::time(nullptr),
+                        script_key(sources),
+                        join_shell(flags),
+                        compiler_fingerprint(args.cxx),
+                        stats.wall_seconds,
+                        stats.user_seconds + stats.system_seconds,
+                        stats.max_rss_kb,
+                        program ? program->string() : args.cxx,
+                        join_shell(names)};
+
+    std::error_code ec;
+    fs::create_directories(*dir, ec);
+    // a single append of a short line, concurrent cpprun processes do not interleave their entries
+    std::ofstream log(*dir / "builds.log", std::ios::app);
+    log << format_build_log_entry(entry);
+}
+
+// Consecutive builds of one script and flag set with the same compiler.
+struct BuildTrendSegment {
+    std::string compiler;
+    std::string compiler_path;
+    int64_t first = 0;
+    int64_t last = 0;
+    std::vector<double> wall_seconds;
+    std::vector<double> cpu_seconds;
+    std::vector<long> max_rss_kb;
+};
+
+std::vector<BuildTrendSegment> build_trend_segments(const std::vector<BuildLogEntry> & builds) {
+    std::vector<BuildTrendSegment> segments;
+    for (auto & b : builds) {
+        if (segments.empty() || segments.back().compiler != b.compiler) {
+            segments.push_back({b.compiler, b.compiler_path, b.time, b.time, {}, {}, {}});
+        }
+        auto & s = segments.back();
+        s.last = b.time;
+        s.wall_seconds.push_back(b.wall_seconds);
+        s.cpu_seconds.push_back(b.cpu_seconds);
+        s.max_rss_kb.push_back(b.max_rss_kb);
+    }
+    return segments;
+}
+
+// A compiler change is a regression when the median build gets at least 20% and 50 ms slower, or uses at least 20%
+// more memory.
+std::vector<std::string> build_regressions(const BuildTrendSegment & before, const BuildTrendSegment & after) {
+    std::vector<std::string> found;
+    auto change = [](double a, double b) { return a > 0 ? (b - a) / a * 100 : 0; };
+    auto check_time = [&](const std::string & what, double a, double b) {
+        if (b >= a * 1.2 && b - a >= 0.05) {
+            std::ostringstream out;
+            out << what << " +" << std::fixed << std::setprecision(0) << change(a, b) << "%";
+            found.push_back(out.str());
+        }
+    };
+    check_time("wall time", median(before.wall_seconds), median(after.wall_seconds));
+    check_time("CPU time", median(before.cpu_seconds), median(after.cpu_seconds));
+    double rss_a = median(before.max_rss_kb), rss_b = median(after.max_rss_kb);
+    if (rss_b >= rss_a * 1.2) {
+        std::ostringstream out;
+        out << "peak RSS +" << std::fixed << std::setprecision(0) << change(rss_a, rss_b) << "%";
+        found.push_back(out.str());
+    }
+    return found;
+}
+
+static std::string format_date(int64_t time) {
+    std::time_t t = time;
+    std::tm tm{};
+    localtime_r(&t, &tm);
+    std::ostringstream out;
+    out << std::put_time(&tm, "%Y-%m-%d");
+    return out.str();
+}
+
+int report_build_trends(std::ostream & out) {
+    auto dir = cache_dir();
+    if (!dir || !fs::exists(*dir / "builds.log")) {
+        out << "no builds recorded yet" << (dir ? "" : ", CPPRUN_CACHE_DIR is disabled") << std::endl;
+        return 0;
+    }
+
+    // group by script and flags, most recently built first
+    std::map<std::pair<std::string, std::string>, std::vector<BuildLogEntry>> groups;
+    for (auto & e : parse_build_log(read_file(*dir / "builds.log"))) {
+        groups[{e.script, e.flags}].push_back(e);
+    }
+    std::vector<const std::vector<BuildLogEntry> *> order;
+    for (auto & [_, builds] : groups) {
+        order.push_back(&builds);
+    }
+    std::stable_sort(order.begin(), order.end(), [](auto * a, auto * b) { return a->back().time > b->back().time; });
+
+    size_t regressions = 0;
+    for (auto * builds : order) {
+        out << builds->back().sources << "\n    flags: " << builds->back().flags << "\n";
+        out << "    compiler           builds  period                      wall ms   cpu ms  peak RSS MB\n";
+        auto segments = build_trend_segments(*builds);
+        for (size_t i = 0; i < segments.size(); ++i) {
+            auto & s = segments[i];
+            auto compiler = s.compiler.substr(0, 8) + " " + fs::path(s.compiler_path).filename().string();
+            out << "    " << std::left << std::setw(19) << compiler << std::right << std::setw(6)
+                << s.wall_seconds.size() << "  " << format_date(s.first) << " .. " << format_date(s.last) << std::fixed
+                << std::setprecision(1) << std::setw(11) << median(s.wall_seconds) * 1000 << std::setw(9)
+                << median(s.cpu_seconds) * 1000 << std::setw(13) << median(s.max_rss_kb) / 1024.0 << "\n";
+            if (i > 0) {
+                auto found = build_regressions(segments[i - 1], s);
+                if (!found.empty()) {
+                    out << "    REGRESSION after compiler change " << segments[i - 1].compiler.substr(0, 8) << " -> "
+                        << s.compiler.substr(0, 8) << ":";
+                    for (size_t j = 0; j < found.size(); ++j) {
+                        out << (j ? ", " : " ") << found[j];
+                    }
+                    out << "\n";
+                    regressions++;
+                }
+            }
+        }
+        out << "\n";
+    }
+    out << groups.size() << " scripts and flag sets, " << regressions << " regressions after compiler changes"
+        << std::endl;
+    return 0;
+}
+
+// Environment diagnosis: measures what makes cpprun slow on this host and ranks the fixes by the time they would
+// save per build.
+
+struct FilesystemType {
+    std::string name;
+    bool remote = false;  // network or userspace filesystems, slow for many small files
+};
+
+FilesystemType filesystem_type(long magic) {
+    static const std::map<long, FilesystemType> types = {
+        {0x01021994, {"tmpfs", false}}, {0x858458f6, {"ramfs", false}}, {0xEF53, {"ext4", false}},
+        {0x58465342, {"xfs", false}},   {0x9123683E, {"btrfs", false}}, {0x2fc12fc1, {"zfs", false}},
+        {0xF2F52010, {"f2fs", false}},  {0x794c7630, {"overlay", false}}, {0x6969, {"nfs", true}},
+        {0x01021997, {"9p", true}},     {0x65735546, {"fuse", true}},   {0xFF534D42, {"cifs", true}},
+        {0xFE534D42, {"smb2", true}},
+    };
+    auto it = types.find(magic);
+    if (it != types.end()) {
+        return it->second;
+    }
+    std::ostringstream name;
+    name << "0x" << std::hex << magic;
+    return {name.str(), false};
+}
+
+struct DoctorFinding {
+    std::optional<double> saving_ms;  // per build, when it can be estimated
+    std::string problem;
+    std::string fix;
+};
+
+struct DirectoryCheck {
+    fs::path path;
+    FilesystemType type;
+    double write_mb_per_s = 0;
+};
+
+// Writes and syncs a 16 MiB file, like a compiler writing objects and executables.
+static std::optional<DirectoryCheck> check_directory(const fs::path & dir) {
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    struct statfs st;
+    if (statfs(dir.c_str(), &st) != 0) {
+        return std::nullopt;
+    }
+    DirectoryCheck check{dir, filesystem_type(long(st.f_type)), 0};
+
+    auto file = dir / ("cpprun-doctor-" + std::to_string(getpid()));
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return check;
+    }
+    std::string chunk(1 << 20, 'x');
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = true;
+    for (int i = 0; i < 16 && ok; ++i) {
+        ok = write(fd, chunk.data(), chunk.size()) == ssize_t(chunk.size());
+    }
+    ok = ok && fsync(fd) == 0;
+    double seconds = seconds_since(start);
+    close(fd);
+    fs::remove(file, ec);
+    if (ok && seconds > 0) {
+        check.write_mb_per_s = 16 / seconds;
+    }
+    return check;
+}
+
+const char * const DOCTOR_HELLO_SOURCE = R"probe(#include <iostream>
+#include <string>
+#include <vector>
+
+int main() {
+    std::vector<std::string> words{"Hello", "World!"};
+    for (auto & w : words) {
+        std::cout << w << " ";
+    }
+    std::cout << std::endl;
+}
+)probe";
+
+const char * const DOCTOR_TEMPLATE_SOURCE = R"probe(#include <array>
+#include <iostream>
+#include <map>
+#include <string>
+#include <variant>
+#include <vector>
+
+template <int N>
+size_t build() {
+    std::map<std::array<char, N>, std::variant<int, std::string, std::vector<std::array<int, N>>>> m;
+    m[std::array<char, N>{}] = N;
+    return m.size() + build<N - 1>();
+}
+
+template <>
+size_t build<0>() {
+    return 0;
+}
+
+int main() {
+    std::cout << build<8>() << std::endl;
+}
+)probe";
+
+const char * const DOCTOR_MODULE_SOURCE = R"probe(export module cpprun_probe;
+export int probe() {
+    return 1;
+}
+)probe";
+
+int run_doctor(const CpprunArgs & args, const fs::path & workdir) {
+    std::vector<DoctorFinding> findings;
+    auto & out = std::cout;
+    out << std::fixed << std::setprecision(1);
+    auto label = [&](const std::string & name) -> std::ostream & {
+        return out << "  " << std::left << std::setw(22) << name << std::right;
+    };
+    out << "environment:\n";
+
+    // process creation, paid for every compiler, linker and program start
+    std::vector<double> spawns;
+    for (int i = 0; i < 20; ++i) {
+        CmdStats stats;
+        if (run_cmd("true", {}, false, {}, &stats) == 0) {
+            spawns.push_back(stats.wall_seconds * 1000);
+        }
+    }
+    double spawn_ms = median(spawns);
+    label("spawn latency") << spawn_ms << " ms (median of " << spawns.size() << " runs of true)\n";
+    if (spawn_ms > 5) {
+        // driver, compiler proper, assembler, linker and the program itself
+        findings.push_back({spawn_ms * 5, "starting a process takes " + std::to_string(int(spawn_ms)) + " ms",
+                            "check for security software or a slow shell profile hooking process creation"});
+    }
+
+    // the compiler driver
+    auto program = resolve_program(args.cxx);
+    std::string version;
+    CmdStats driver;
+    bool compiler_ok = program && capture_cmd(args.cxx, {"--version"}, version, false, STDOUT_FILENO, &driver) == 0;
+    if (!compiler_ok) {
+        label("compiler") << args.cxx << " not found\n";
+        std::cerr << "ERROR: can not run the compiler " << args.cxx << std::endl;
+        return 1;
+    }
+    std::error_code ec;
+    auto real = fs::canonical(*program, ec);
+    bool clang = version.find("clang") != std::string::npos;
+    label("compiler") << program->string() << (real != *program ? " -> " + real.string() : "") << "\n";
+    label("version") << version.substr(0, version.find('\n')) << "\n";
+    label("driver startup") << driver.wall_seconds * 1000 << " ms (" << args.cxx << " --version)\n";
+    char head[2] = {};
+    std::ifstream(real, std::ios::binary).read(head, 2);
+    if (head[0] == '#' && head[1] == '!') {
+        findings.push_back({std::nullopt, args.cxx + " is a script wrapping the compiler (" + real.string() + ")",
+                            "point CPPRUN_CXX at the compiler binary, or check that the wrapper is still current"});
+    }
+    for (auto wrapper : {"ccache", "sccache", "distcc", "icecc"}) {
+        if (real.filename().string().find(wrapper) != std::string::npos) {
+            findings.push_back({driver.wall_seconds * 1000, args.cxx + " goes through " + wrapper,
+                                std::string("cpprun caches builds itself, set CPPRUN_CXX to the compiler that ") +
+                                    wrapper + " runs"});
+        }
+    }
+
+    // filesystems
+    auto temp = check_directory(fs::temp_directory_path());
+    auto cache = cache_dir();
+    auto cache_check = cache ? check_directory(*cache) : std::nullopt;
+    for (auto & [name, check] : {std::pair{"temp dir", temp}, std::pair{"cache dir", cache_check}}) {
+        if (!check) {
+            label(name) << (std::string(name) == "cache dir" && !cache ? "disabled" : "not usable") << "\n";
+            continue;
+        }
+        label(name) << check->path.string() << "  " << check->type.name << "  write+fsync "
+                    << check->write_mb_per_s << " MB/s\n";
+        if (check->type.remote || (check->write_mb_per_s > 0 && check->write_mb_per_s < 50)) {
+            // an executable with debug info is a few MB, written once and read back for every run
+            double saving = check->write_mb_per_s > 0 ? 4.0 / check->write_mb_per_s * 1000 : 0;
+            findings.push_back({saving, std::string(name) + " is on a " +
+                                            (check->type.remote ? check->type.name + " filesystem" : "slow disk"),
+                                std::string(name) == "temp dir" ? "set TMPDIR to a local disk or tmpfs"
+                                                                 : "set CPPRUN_CACHE_DIR to a local disk"});
+        }
+    }
+    if (!cache) {
+        findings.push_back({std::nullopt, "the build cache is disabled",
+                            "unset CPPRUN_CACHE_DIR to skip the compiler when a script runs again unchanged"});
+    }
+
+    // probe builds, with the flags cpprun would use
+    std::vector<std::string> flags;
+    if (args.cxx_standard) {
+        append(flags, *args.cxx_standard);
+    }
+    extend(flags, args.build_args);
+    auto compile = [&](const std::vector<std::string> & extra, const fs::path & output) -> std::optional<double> {
+        auto cmd = flags;
+        extend(cmd, extra);
+        extend(cmd, {"-o", output.string()});
+        std::string errors;
+        CmdStats stats;
+        if (capture_cmd(args.cxx, cmd, errors, args.verbose, STDERR_FILENO, &stats) != 0) {
+            return std::nullopt;
+        }
+        return stats.wall_seconds * 1000;
+    };
+
+    auto hello = workdir / "hello.cpp", heavy = workdir / "heavy.cpp";
+    write_file_atomic(hello, DOCTOR_HELLO_SOURCE);
+    write_file_atomic(heavy, DOCTOR_TEMPLATE_SOURCE);
+    auto hello_compile = compile({"-c", hello.string()}, workdir / "hello.o");
+    auto hello_link = hello_compile ? compile({(workdir / "hello.o").string()}, workdir / "hello") : std::nullopt;
+    auto heavy_compile = compile({"-c", heavy.string()}, workdir / "heavy.o");
+    if (!hello_compile || !hello_link) {
+        label("hello probe") << "failed to build\n";
+        std::cerr << "ERROR: unable to build a hello world program with " << args.cxx << " " << join_shell(flags)
+                  << std::endl;
+        return 1;
+    }
+    label("hello probe") << "compile " << *hello_compile << " ms, link " << *hello_link << " ms\n";
+    if (heavy_compile) {
+        label("template probe") << "compile " << *heavy_compile << " ms\n";
+    } else {
+        label("template probe") << "failed to build\n";
+    }
+
+    // linkers
+    std::map<std::string, double> linkers;
+    label("linkers") << "default " << *hello_link << " ms";
+    for (auto linker : {"bfd", "gold", "lld", "mold"}) {
+        auto time = compile({"-fuse-ld=" + std::string(linker), (workdir / "hello.o").string()}, workdir / "hello");
+        out << ", " << linker << " " << (time ? std::to_string(int(*time)) + " ms" : "-");
+        if (time) {
+            linkers[linker] = *time;
+        }
+    }
+    out << "\n";
+    if (!linkers.empty()) {
+        auto fastest = std::min_element(linkers.begin(), linkers.end(),
+                                        [](auto & a, auto & b) { return a.second < b.second; });
+        double saving = *hello_link - fastest->second;
+        if (saving > 5 && saving > *hello_link * 0.15) {
+            findings.push_back({saving, "the default linker is slower than " + fastest->first,
+                                "add -fuse-ld=" + fastest->first + " to CPPRUN_CXXFLAGS"});
+        }
+    }
+    if (!linkers.count("lld") && !linkers.count("mold")) {
+        findings.push_back({std::nullopt, "no fast linker (lld or mold) is installed",
+                            "install mold or lld and add -fuse-ld=mold or -fuse-ld=lld to CPPRUN_CXXFLAGS"});
+    }
+
+    // precompiled headers
+    auto prelude = workdir / "prelude.hpp";
+    write_file_atomic(prelude, "#include <iostream>\n#include <string>\n#include <vector>\n");
+    auto pch = prelude;
+    pch += clang ? ".pch" : ".gch";
+    auto pch_build = compile({"-x", "c++-header", prelude.string()}, pch);
+    auto pch_compile = pch_build ? compile({"-include", prelude.string(), "-c", hello.string()}, workdir / "pch.o")
+                                 : std::nullopt;
+    if (pch_compile) {
+        double saving = *hello_compile - *pch_compile;
+        label("precompiled headers") << "supported, hello probe compiles in " << *pch_compile << " ms with a PCH\n";
+        if (saving > 20) {
+            findings.push_back({saving, "standard headers are parsed again for every build",
+                                "precompile the common headers, see --cpprun-header-report"});
+        }
+    } else {
+        label("precompiled headers") << "not supported\n";
+    }
+
+    // C++20 modules
+    auto module = workdir / "probe_module.cpp";
+    write_file_atomic(module, DOCTOR_MODULE_SOURCE);
+    std::vector<std::string> module_flags = {"-std=c++20"};
+    if (clang) {
+        extend(module_flags, {"-x", "c++-module", "--precompile", module.string()});
+    } else {
+        // the mapper keeps the compiled module interface out of the current directory
+        auto mapper = workdir / "module.map";
+        write_file_atomic(mapper, "cpprun_probe " + (workdir / "probe.gcm").string() + "\n");
+        extend(module_flags, {"-fmodules-ts", "-fmodule-mapper=" + mapper.string(), "-c", module.string()});
+    }
+    auto module_time = compile(module_flags, workdir / (clang ? "probe.pcm" : "probe.o"));
+    label("modules") << (module_time ? std::string("supported (") + (clang ? "--precompile" : "-fmodules-ts") + ")"
+                                     : std::string("not supported"))
+                     << "\n";
+
+    // kernel settings
+    auto first_line = [](const fs::path & path) {
+        auto text = fs::exists(path) ? read_file(path) : std::string();
+        return text.substr(0, text.find('\n'));
+    };
+    auto paranoid = first_line("/proc/sys/kernel/perf_event_paranoid");
+    label("perf_event_paranoid") << (paranoid.empty() ? "unknown" : paranoid) << "\n";
+    if (!paranoid.empty() && std::atoi(paranoid.c_str()) > 2) {
+        findings.push_back({std::nullopt, "perf_event_paranoid is " + paranoid + ", perf can not profile programs",
+                            "sysctl kernel.perf_event_paranoid=1, or use --cpprun-annotate which needs no perf"});
+    }
+    auto thp = first_line("/sys/kernel/mm/transparent_hugepage/enabled");
+    label("transparent hugepages") << (thp.empty() ? "unknown" : thp) << "\n";
+    if (thp.find("[never]") != std::string::npos && heavy_compile) {
+        // the compiler's large heaps page fault noticeably less with huge pages
+        findings.push_back({*heavy_compile * 0.05, "transparent huge pages are disabled",
+                            "echo madvise > /sys/kernel/mm/transparent_hugepage/enabled"});
+    }
+    auto governor = first_line("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor");
+    if (!governor.empty()) {
+        label("cpu governor") << governor << "\n";
+        if (governor == "powersave" && heavy_compile) {
+            findings.push_back({*heavy_compile * 0.2, "the CPU frequency governor is powersave",
+                                "switch to the performance or schedutil governor while building"});
+        }
+    }
+
+    std::stable_sort(findings.begin(), findings.end(), [](auto & a, auto & b) {
+        return a.saving_ms.value_or(-1) > b.saving_ms.value_or(-1);
+    });
+    out << "\nrecommendations (by expected saving per build):\n";
+    if (findings.empty()) {
+        out << "  none, this environment looks fine\n";
+    }
+    for (size_t i = 0; i < findings.size(); ++i) {
+        auto & f = findings[i];
+        out << "  " << i + 1 << ". " << f.problem << "\n     " << f.fix << "\n     expected saving: ";
+        if (f.saving_ms) {
+            out << "~" << *f.saving_ms << " ms per build\n";
+        } else {
+            out << "unknown\n";
+        }
+    }
+    out << std::defaultfloat;
+    return 0;
+}
+
+// Metrics export: CPPRUN_METRICS_FILE receives one JSON line per invocation, CPPRUN_METRICS_TEXTFILE holds
+// aggregate counters and histograms over all invocations in the Prometheus text format, for the textfile collector
+// of node_exporter. The textfile is rewritten under a lock and replaced with a rename, so a scrape never sees a
+// partial file.
+
+struct InvocationMetrics {
+    timespec start{};
+    std::string mode;
+    std::vector<fs::path> sources;
+    std::string cache = "disabled";  // hit, miss or disabled
+    std::vector<std::pair<std::string, CmdStats>> phases;
+    int exit_code = 0;
+    std::string error;  // the message of an error that ended the invocation
+};
+
+// The options that choose what an invocation does, and the other ones each of them can be given with. A pair that
+// neither lists is rejected before anything is built; the combinations listed are those where both take effect,
+// or where --cpprun-jit hands over to the regular path.
+struct ModeOption {
+    std::string name;
+    bool (*given)(const CpprunArgs &);
+    std::vector<std::string> combines_with;
+};
+
+const std::vector<ModeOption> & mode_options() {
+    static const std::vector<ModeOption> options = {
+        {"-c", [](const CpprunArgs & a) { return a.build_only; },
+         {"-o", "--cpprun-static", "--cpprun-size", "--cpprun-jit"}},
+        {"-o", [](const CpprunArgs & a) { return a.output_path.has_value(); },
+         {"-c", "--cpprun-static", "--cpprun-size", "--cpprun-startup", "--cpprun-annotate", "--cpprun-memoize",
+          "--cpprun-stack-usage", "--cpprun-build-profile", "--cpprun-tee", "--cpprun-jit"}},
+        {"--cpprun-static", [](const CpprunArgs & a) { return a.static_link.has_value(); },
+         {"-c", "-o", "--cpprun-size", "--cpprun-startup", "--cpprun-annotate", "--cpprun-memoize",
+          "--cpprun-stack-usage", "--cpprun-build-profile", "--cpprun-tee", "--cpprun-jit", "--cpprun-pipeline",
+          "--cpprun-asm-diff", "--cpprun-capture"}},
+        {"--cpprun-jit", [](const CpprunArgs & a) { return a.jit; },
+         {"-c", "-o", "--cpprun-static", "--cpprun-size", "--cpprun-startup", "--cpprun-annotate", "--cpprun-memoize",
+          "--cpprun-tee"}},
+        {"--cpprun-tee", [](const CpprunArgs & a) { return a.tee_file.has_value(); },
+         {"-o", "--cpprun-static", "--cpprun-jit"}},
+        {"--cpprun-size", [](const CpprunArgs & a) { return a.size_report.has_value(); },
+         {"-c", "-o", "--cpprun-static", "--cpprun-jit"}},
+        {"--cpprun-startup", [](const CpprunArgs & a) { return a.startup_runs.has_value(); },
+         {"-o", "--cpprun-static", "--cpprun-jit", "--cpprun-replay"}},
+        {"--cpprun-annotate", [](const CpprunArgs & a) { return a.annotate_hz.has_value(); },
+         {"-o", "--cpprun-static", "--cpprun-jit", "--cpprun-replay", "--cpprun-asm-diff"}},
+        {"--cpprun-memoize", [](const CpprunArgs & a) { return a.memoize.has_value(); },
+         {"-o", "--cpprun-static", "--cpprun-jit"}},
+        {"--cpprun-stack-usage", [](const CpprunArgs & a) { return a.stack_usage.has_value(); },
+         {"-o", "--cpprun-static"}},
+        {"--cpprun-build-profile", [](const CpprunArgs & a) { return a.build_profile; }, {"-o", "--cpprun-static"}},
+        {"--cpprun-header-report", [](const CpprunArgs & a) { return a.header_report.has_value(); }, {}},
+        {"--cpprun-pipeline", [](const CpprunArgs & a) { return a.pipeline; }, {"--cpprun-static"}},
+        {"--cpprun-sanitize", [](const CpprunArgs & a) { return !a.sanitizers.empty(); }, {}},
+        {"--cpprun-fuzz", [](const CpprunArgs & a) { return a.fuzz_seconds.has_value(); }, {}},
+        {"--cpprun-asm-diff", [](const CpprunArgs & a) { return !a.asm_diff.empty(); },
+         {"--cpprun-static", "--cpprun-annotate"}},
+        {"--cpprun-capture", [](const CpprunArgs & a) { return a.capture_bundle.has_value(); }, {"--cpprun-static"}},
+        {"--cpprun-replay", [](const CpprunArgs & a) { return a.replay_bundle.has_value(); },
+         {"--cpprun-startup", "--cpprun-annotate"}},
+        {"--cpprun-doctor", [](const CpprunArgs & a) { return a.doctor; }, {}},
+        {"--cpprun-build-trends", [](const CpprunArgs & a) { return a.build_trends; }, {}},
+        {"--cpprun-prewarm", [](const CpprunArgs & a) { return a.prewarm; }, {}},
+    };
+    return options;
+}
+
+// The first two given options that can not be combined, if any
+std::optional<std::pair<std::string, std::string>> conflicting_modes(const CpprunArgs & args) {
+    std::vector<const ModeOption *> given;
+    for (auto & option : mode_options()) {
+        if (option.given(args)) {
+            given.push_back(&option);
+        }
+    }
+    for (size_t i = 0; i < given.size(); ++i) {
+        for (size_t j = i + 1; j < given.size(); ++j) {
+            if (!contains(given[i]->combines_with, given[j]->name) &&
+                !contains(given[j]->combines_with, given[i]->name)) {
+                return std::make_pair(given[i]->name, given[j]->name);
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+std::string invocation_mode(const CpprunArgs & args, const std::vector<std::string> & cpprun_args) {
+    if (args.show_compiler_info || contains(cpprun_args, "--version") || contains(cpprun_args, "-v")) {
+        return "compiler-info";
+    }
+    if (args.doctor) {
+        return "doctor";
+    }
+    if (args.prewarm) {
+        return "prewarm";
+    }
+    if (args.pipeline) {
+        return "pipeline";
+    }
+    if (!args.sanitizers.empty()) {
+        return "sanitize";
+    }
+    if (!args.asm_diff.empty()) {
+        return "asm-diff";
+    }
+    if (args.fuzz_seconds) {
+        return "fuzz";
+    }
+    if (args.replay_bundle) {
+        return "replay";
+    }
+    if (args.capture_bundle) {
+        return "capture";
+    }
+    if (args.build_trends) {
+        return "build-trends";
+    }
+    if (args.header_report) {
+        return "header-report";
+    }
+    if (args.build_profile) {
+        return "build-profile";
+    }
+    if (args.stack_usage) {
+        return "stack-usage";
+    }
+    if (args.size_report) {
+        return "size";
+    }
+    if (args.build_only) {
+        return "build";
+    }
+    if (args.startup_runs) {
+        return "startup";
+    }
+    return args.annotate_hz ? "annotate" : "run";
+}
+
+static CmdStats process_usage(int who) {
+    rusage usage{};
+    getrusage(who, &usage);
+    return {0, to_seconds(usage.ru_utime), to_seconds(usage.ru_stime), usage.ru_maxrss};
+}
+
+std::string format_metrics_json(const InvocationMetrics & m, int64_t time, const CmdStats & self,
+                                const CmdStats & children) {
+    std::ostringstream out;
+    out << std::setprecision(6) << "{\"time\":" << time << ",\"mode\":" << json_string(m.mode) << ",\"sources\":[";
+    for (size_t i = 0; i < m.sources.size(); ++i) {
+        out << (i ? "," : "") << json_string(m.sources[i].string());
+    }
+    out << "],\"cache\":" << json_string(m.cache) << ",\"exit_code\":" << m.exit_code;
+    if (!m.error.empty()) {
+        out << ",\"error\":" << json_string(m.error);
+    }
+    out << ",\"phases\":{";
+    for (size_t i = 0; i < m.phases.size(); ++i) {
+        out << (i ? "," : "") << json_string(m.phases[i].first) << ":" << json_stats(m.phases[i].second);
+    }
+    out << "},\"rusage\":{\"self\":" << json_stats(self) << ",\"children\":" << json_stats(children) << "}}\n";
+    return out.str();
+}
+
+// Series are keyed by their full name including labels, e.g. cpprun_invocations_total{mode="run"}.
+using MetricSeries = std::map<std::string, double>;
+
+const std::vector<double> PHASE_DURATION_BUCKETS = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60};
+
+MetricSeries parse_prometheus_text(const std::string & text) {
+    MetricSeries series;
+    std::istringstream iss(text);
+    std::string line;
+    while (std::getline(iss, line)) {
+        auto space = line.rfind(' ');
+        if (line.empty() || line[0] == '#' || space == std::string::npos) {
+            continue;
+        }
+        try {
+            series[line.substr(0, space)] = std::stod(line.substr(space + 1));
+        } catch (const std::exception &) {
+        }
+    }
+    return series;
+}
+
+static std::string format_bound(double bound) {
+    std::ostringstream out;
+    out << bound;
+    return out.str();
+}
+
+void update_metric_series(MetricSeries & series, const InvocationMetrics & m) {
+    series["cpprun_invocations_total{mode=\"" + m.mode + "\"}"] += 1;
+    if (m.exit_code != 0) {
+        series["cpprun_failures_total{mode=\"" + m.mode + "\"}"] += 1;
+    }
+    if (m.cache != "disabled") {
+        series["cpprun_cache_lookups_total{result=\"" + m.cache + "\"}"] += 1;
+    }
+    for (auto & [phase, stats] : m.phases) {
+        auto labels = "phase=\"" + phase + "\"";
+        for (auto bound : PHASE_DURATION_BUCKETS) {
+            auto & bucket = series["cpprun_phase_duration_seconds_bucket{" + labels + ",le=\"" + format_bound(bound) +
+                                   "\"}"];
+            bucket += stats.wall_seconds <= bound ? 1 : 0;
+        }
+        series["cpprun_phase_duration_seconds_bucket{" + labels + ",le=\"+Inf\"}"] += 1;
+        series["cpprun_phase_duration_seconds_sum{" + labels + "}"] += stats.wall_seconds;
+        series["cpprun_phase_duration_seconds_count{" + labels + "}"] += 1;
+        if (phase == "compile") {
+            series["cpprun_compile_max_rss_bytes"] = double(stats.max_rss_kb) * 1024;
+        }
+    }
+    series["cpprun_last_invocation_timestamp_seconds"] = double(std::time(nullptr));
+}
+
+std::string format_prometheus_text(const MetricSeries & series) {
+    struct Family {
+        const char * name;
+        const char * type;
+        const char * help;
+    };
+    static const std::vector<Family> families = {
+        {"cpprun_invocations_total", "counter", "cpprun invocations by mode"},
+        {"cpprun_failures_total", "counter", "cpprun invocations with a non-zero exit code, by mode"},
+        {"cpprun_cache_lookups_total", "counter", "build cache lookups by result"},
+        {"cpprun_phase_duration_seconds", "histogram",
+         "wall time of each phase (cache_lookup, compile, run) and of the whole invocation (total)"},
+        {"cpprun_compile_max_rss_bytes", "gauge", "peak RSS of the most recent compile"},
+        {"cpprun_last_invocation_timestamp_seconds", "gauge", "time of the most recent cpprun invocation"},
+    };
+
+    std::ostringstream out;
+    out << std::setprecision(12);
+    for (auto & f : families) {
+        std::string name = f.name;
+        std::vector<std::string> lines;
+        if (std::string(f.type) == "histogram") {
+            // buckets of each label set in increasing order, then the sum and count
+            std::string count_prefix = name + "_count{";
+            for (auto it = series.lower_bound(count_prefix); it != series.end(); ++it) {
+                if (it->first.compare(0, count_prefix.size(), count_prefix) != 0) {
+                    break;
+                }
+                auto labels = it->first.substr(count_prefix.size(), it->first.size() - count_prefix.size() - 1);
+                std::vector<std::string> keys;
+                for (auto bound : PHASE_DURATION_BUCKETS) {
+                    keys.push_back(name + "_bucket{" + labels + ",le=\"" + format_bound(bound) + "\"}");
+                }
+                keys.push_back(name + "_bucket{" + labels + ",le=\"+Inf\"}");
+                keys.push_back(name + "_sum{" + labels + "}");
+                keys.push_back(it->first);
+                for (auto & key : keys) {
+                    auto value = series.find(key);
+                    std::ostringstream line;
+                    line << std::setprecision(12) << key << " " << (value == series.end() ? 0.0 : value->second);
+                    lines.push_back(line.str());
+                }
+            }
+        } else {
+            for (auto it = series.lower_bound(name); it != series.end(); ++it) {
+                if (it->first.compare(0, name.size(), name) != 0) {
+                    break;
+                }
+                if (it->first.size() > name.size() && it->first[name.size()] != '{') {
+                    continue;
+                }
+                std::ostringstream line;
+                line << std::setprecision(12) << it->first << " " << it->second;
+                lines.push_back(line.str());
+            }
+        }
+        if (lines.empty()) {
+            continue;
+        }
+        out << "# HELP " << name << " " << f.help << "\n# TYPE " << name << " " << f.type << "\n";
+        for (auto & line : lines) {
+            out << line << "\n";
+        }
+    }
+    return out.str();
+}
+
+static void begin_phase(const std::string & phase) {
+    events().emit("phase_start", ",\"phase\":" + json_string(phase));
+}
+
+static void end_phase(InvocationMetrics & metrics, const std::string & phase, const CmdStats & stats) {
+    metrics.phases.push_back({phase, stats});
+    events().emit("phase_end", ",\"phase\":" + json_string(phase) + ",\"usage\":" + json_stats(stats));
+}
+
+void export_metrics(InvocationMetrics & m) {
+    const char * json_path = std::getenv("CPPRUN_METRICS_FILE");
+    const char * text_path = std::getenv("CPPRUN_METRICS_TEXTFILE");
+    if ((!json_path || !*json_path) && (!text_path || !*text_path)) {
+        return;
+    }
+    m.phases.insert(m.phases.begin(), {"total", CmdStats{seconds_since(m.start), 0, 0, 0}});
+
+    if (json_path && *json_path) {
+        std::ofstream out(json_path, std::ios::app);
+        out << format_metrics_json(m, std::time(nullptr), process_usage(RUSAGE_SELF), process_usage(RUSAGE_CHILDREN));
+        if (!out) {
+            std::cerr << "WARNING: unable to append metrics to " << json_path << std::endl;
+        }
+    }
+
+    if (text_path && *text_path) {
+        fs::path path = text_path;
+        auto lock_path = path;
+        lock_path += ".lock";
+        int lock = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+            std::cerr << "WARNING: unable to lock " << lock_path << ": " << std::strerror(errno) << std::endl;
+        } else {
+            try {
+                auto series = fs::exists(path) ? parse_prometheus_text(read_file(path)) : MetricSeries{};
+                update_metric_series(series, m);
+                write_file_atomic(path, format_prometheus_text(series));
+            } catch (const std::exception & e) {
+                std::cerr << "WARNING: unable to update " << path << ": " << e.what() << std::endl;
+            }
+        }
+        if (lock >= 0) {
+            close(lock);
+        }
+    }
+}
+
+// Pipelines (--cpprun-pipeline a.cpp '|' b.cpp): all stages are built first, the compilers running concurrently,
+// then started together with each stage's stdout connected to the next stage's stdin through an enlarged pipe.
+// While they run, the state of every stage is sampled from /proc: a stage sleeping in read on its stdin waits for
+// its input, one sleeping in write on its stdout waits for the next stage. The stage that waits least is the
+// bottleneck.
+
+struct PipelineStage {
+    std::vector<std::string> cpprun_args;
+    std::vector<std::string> run_args;
+};
+
+// Splits the command line at --cpprun-pipeline, unless a "--" comes first: the cpprun options up to and including
+// it, and the stages after it.
+std::optional<std::pair<std::vector<std::string>, std::vector<std::string>>> split_pipeline_args(
+    const std::vector<std::string> & args) {
+    for (size_t i = 0; i < args.size() && args[i] != "--"; ++i) {
+        if (args[i] == "--cpprun-pipeline") {
+            return std::pair{std::vector<std::string>(args.begin(), args.begin() + long(i) + 1),
+                             std::vector<std::string>(args.begin() + long(i) + 1, args.end())};
+        }
+    }
+    return std::nullopt;
+}
+
+// "[build options] sources [-- run args]" per stage, separated by "|"
+std::vector<PipelineStage> parse_pipeline_stages(const std::vector<std::string> & spec) {
+    std::vector<PipelineStage> stages;
+    std::vector<std::string> current;
+    for (size_t i = 0; i <= spec.size(); ++i) {
+        if (i < spec.size() && spec[i] != "|") {
+            current.push_back(spec[i]);
+            continue;
+        }
+        auto [cpprun_args, run_args] = split_args(current);
+        if (cpprun_args.empty()) {
+            throw std::runtime_error("--cpprun-pipeline: stage " + std::to_string(stages.size() + 1) +
+                                     " has no source file");
+        }
+        for (auto & a : cpprun_args) {
+            if (a.substr(0, 9) == "--cpprun-" || a == "-c" || a == "-o") {
+                throw std::runtime_error("--cpprun-pipeline: " + a + " is not supported in a pipeline stage");
+            }
+        }
+        stages.push_back({cpprun_args, run_args});
+        current.clear();
+    }
+    return stages;
+}
+
+enum class StageState {
+    Busy,             // running, or sleeping on something else than its pipes
+    WaitingForInput,  // in read on its stdin
+    WaitingForOutput, // in write on its stdout
+};
+
+// From the state letter of /proc/<pid>/stat and the contents of /proc/<pid>/syscall ("nr arg0 ...").
+StageState classify_stage_state(char state, const std::string & syscall) {
+    if (state != 'S') {
+        return StageState::Busy;
+    }
+    std::istringstream iss(syscall);
+    long nr = -1;
+    std::string fd;
+    iss >> nr >> fd;
+    bool reads = nr == SYS_read || nr == SYS_readv;
+    bool writes = nr == SYS_write || nr == SYS_writev;
+    if (reads && fd == "0x0") {
+        return StageState::WaitingForInput;
+    }
+    if (writes && fd == "0x1") {
+        return StageState::WaitingForOutput;
+    }
+    return StageState::Busy;
+}
+
+static StageState sample_stage(pid_t pid) {
+    auto proc = "/proc/" + std::to_string(pid) + "/";
+    std::ifstream stat_file(proc + "stat");
+    std::string stat_line;
+    std::getline(stat_file, stat_line);
+    // the command name in parentheses may contain spaces, the state follows the last ')'
+    auto paren = stat_line.rfind(')');
+    if (paren == std::string::npos || paren + 2 >= stat_line.size()) {
+        return StageState::Busy;
+    }
+    std::ifstream syscall_file(proc + "syscall");
+    std::string syscall;
+    std::getline(syscall_file, syscall);
+    return classify_stage_state(stat_line[paren + 2], syscall);
+}
+
+struct StageReport {
+    std::string name;
+    int exit_code = 0;
+    CmdStats stats;
+    double waiting_for_input = 0;
+    double waiting_for_output = 0;
+};
+
+void print_pipeline_report(std::ostream & out, const std::vector<StageReport> & stages, int pipe_size) {
+    out << "pipeline: " << stages.size() << " stages, pipe buffers of " << pipe_size / 1024 << " KiB\n";
+    out << "stage  program                   exit   wall s    cpu s  waiting for input s  waiting for output s\n";
+    size_t bottleneck = 0;
+    double bottleneck_busy = -1;
+    for (size_t i = 0; i < stages.size(); ++i) {
+        auto & s = stages[i];
+        double busy = s.stats.wall_seconds - s.waiting_for_input - s.waiting_for_output;
+        if (busy > bottleneck_busy) {
+            bottleneck = i;
+            bottleneck_busy = busy;
+        }
+        auto name = s.name.size() > 24 ? "..." + s.name.substr(s.name.size() - 21) : s.name;
+        out << std::left << std::setw(7) << i + 1 << std::setw(24) << name << std::right << std::fixed
+            << std::setprecision(2) << std::setw(6) << s.exit_code << std::setw(9) << s.stats.wall_seconds
+            << std::setw(9) << s.stats.user_seconds + s.stats.system_seconds << std::setw(21)
+            << s.waiting_for_input << std::setw(22) << s.waiting_for_output << "\n";
+    }
+    if (!stages.empty()) {
+        auto & s = stages[bottleneck];
+        double share = s.stats.wall_seconds > 0 ? bottleneck_busy / s.stats.wall_seconds : 0;
+        out << "bottleneck: stage " << bottleneck + 1 << " (" << s.name << "), not waiting on its pipes "
+            << std::setprecision(0) << share * 100 << "% of the time\n";
+    }
+    out << std::defaultfloat << std::setprecision(6);
+}
+
+// Starts a command without waiting for it, with in, out and err (unless -1) as its stdin, stdout and stderr.
+// Returns its pid, or -1.
+static pid_t start_cmd(const std::string & prog, const std::vector<std::string> & args, int in, int out, int err) {
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(prog.c_str()));
+    for (auto & a : args) {
+        argv.push_back(const_cast<char *>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        // child; all other descriptors of the pipeline are close-on-exec
+        int fds[] = {in, out, err};
+        for (int target = 0; target < 3; ++target) {
+            if (fds[target] >= 0 && fds[target] != target) {
+                dup2(fds[target], target);
+            }
+        }
+        execvp(prog.c_str(), argv.data());
+        perror("execvp");
+        _exit(127);
+    }
+    emit_process_start(pid, prog, args, {});
+    return pid;
+}
+
+int run_pipeline(const CpprunArgs & args, const std::vector<std::string> & cpprun_args,
+                 const std::vector<std::string> & spec, const fs::path & workdir, InvocationMetrics & metrics) {
+    auto stage_specs = parse_pipeline_stages(spec);
+    std::vector<std::string> common;
+    for (auto & a : cpprun_args) {
+        if (a != "--cpprun-pipeline") {
+            common.push_back(a);
+        }
+    }
+
+    struct Stage {
+        CpprunArgs args;
+        std::vector<std::string> run_args;
+        std::string name;
+        fs::path artifact;
+        std::optional<fs::path> cache_entry;
+        fs::path depfile, log;
+        pid_t pid = -1;
+    };
+    std::vector<Stage> stages;
+    for (auto & s : stage_specs) {
+        auto stage_args = common;
+        extend(stage_args, s.cpprun_args);
+        Stage stage{parse_cpprun_args(stage_args), s.run_args, "", {}, {}, {}, {}};
+        stage.args.runtime_flags = parallel_runtime_flags(stage.args, detect_parallel_runtime(stage.args));
+        auto sources = source_files(stage.args.build_args);
+        if (sources.empty()) {
+            std::cerr << "ERROR: stage " << stages.size() + 1 << " of the pipeline has no source file" << std::endl;
+            return 1;
+        }
+        stage.name = sources.front().filename().string();
+        stages.push_back(stage);
+    }
+    // on an error, the compilers or stages already started are killed and reaped rather than left running
+    auto stop_stages = [&stages]() {
+        for (auto & stage : stages) {
+            if (stage.pid > 0) {
+                kill(stage.pid, SIGKILL);
+                while (waitpid(stage.pid, nullptr, 0) < 0 && errno == EINTR) {
+                }
+                stage.pid = -1;
+            }
+        }
+    };
+
+    // build: the cache misses are compiled concurrently, with their diagnostics collected per stage
+    timespec build_start;
+    clock_gettime(CLOCK_MONOTONIC, &build_start);
+    begin_phase("compile");
+    bool all_hits = true;
+    CmdStats build_stats;
+    size_t compiling = 0;
+    for (size_t i = 0; i < stages.size(); ++i) {
+        auto & stage = stages[i];
+        stage.cache_entry = artifact_cache_entry(stage.args);
+        if (stage.cache_entry && cache_entry_is_valid(*stage.cache_entry)) {
+            stage.artifact = *stage.cache_entry / "artifact.exe";
+            continue;
+        }
+        all_hits = false;
+        auto dir = workdir / ("stage" + std::to_string(i + 1));
+        fs::create_directories(dir);
+        stage.artifact = dir / "artifact.exe";
+        stage.depfile = dir / "artifact.d";
+        stage.log = dir / "compile.log";
+        auto build_args = collect_build_args(stage.args, stage.artifact);
+        if (stage.cache_entry) {
+            extend(build_args, {"-MD", "-MF", stage.depfile.string()});
+        }
+        if (args.verbose) {
+            std::cout << ">>> " << stage.args.cxx << " " << join_shell(build_args) << std::endl;
+        }
+        int log = open(stage.log.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        stage.pid = log < 0 ? -1 : start_cmd(stage.args.cxx, build_args, -1, log, log);
+        if (log >= 0) {
+            close(log);
+        }
+        if (stage.pid < 0) {
+            std::cerr << "ERROR: unable to start the compiler for stage " << i + 1 << std::endl;
+            stop_stages();
+            return 127;
+        }
+        ++compiling;
+    }
+    metrics.cache = all_hits ? "hit" : "miss";
+    int rc = 0;
+    for (; compiling > 0; --compiling) {
+        int status = 0;
+        rusage usage{};
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid < 0 && errno == EINTR) {
+            ++compiling;
+            continue;
+        }
+        auto stage = std::find_if(stages.begin(), stages.end(), [&](auto & s) { return s.pid == pid; });
+        if (pid < 0 || stage == stages.end()) {
+            perror("waitpid");
+            stop_stages();
+            return 127;
+        }
+        stage->pid = -1;
+        CmdStats stats{seconds_since(build_start), to_seconds(usage.ru_utime), to_seconds(usage.ru_stime),
+                       usage.ru_maxrss};
+        emit_process_exit(pid, status, stats);
+        build_stats.user_seconds += stats.user_seconds;
+        build_stats.system_seconds += stats.system_seconds;
+        build_stats.max_rss_kb = std::max(build_stats.max_rss_kb, stats.max_rss_kb);
+
+        auto diagnostics = read_file(stage->log);
+        if (!diagnostics.empty()) {
+            std::cerr << ">>> stage " << stage - stages.begin() + 1 << " (" << stage->name << "):\n" << diagnostics;
+        }
+        int stage_rc = exit_code(status);
+        if (stage_rc != 0) {
+            rc = rc != 0 ? rc : stage_rc;
+            continue;
+        }
+        record_build(stage->args, stats);
+        if (stage->cache_entry && fs::exists(stage->artifact)) {
+            try {
+                store_cache_entry(*stage->cache_entry, stage->args, stage->artifact, stage->depfile);
+            } catch (const std::exception & e) {
+                std::cerr << "WARNING: unable to cache the build: " << e.what() << std::endl;
+            }
+        }
+    }
+    build_stats.wall_seconds = seconds_since(build_start);
+    end_phase(metrics, "compile", build_stats);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // run: stage i reads from pipes[i - 1] and writes to pipes[i]
+    int pipe_size = max_pipe_size();
+    std::vector<std::array<int, 2>> pipes(stages.size() - 1);
+    for (auto & p : pipes) {
+        if (pipe2(p.data(), O_CLOEXEC) != 0) {
+            perror("pipe");
+            return 127;
+        }
+        int size = fcntl(p[1], F_SETPIPE_SZ, pipe_size);
+        pipe_size = size > 0 ? size : fcntl(p[1], F_GETPIPE_SZ);
+    }
+    timespec run_start;
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    begin_phase("run");
+    size_t running = 0;
+    for (size_t i = 0; i < stages.size(); ++i) {
+        auto & stage = stages[i];
+        if (args.verbose) {
+            std::cout << ">>> " << stage.artifact.string() << " " << join_shell(stage.run_args) << std::endl;
+        }
+        stage.pid = start_cmd(stage.artifact.string(), stage.run_args, i > 0 ? pipes[i - 1][0] : -1,
+                              i + 1 < stages.size() ? pipes[i][1] : -1, -1);
+        running += stage.pid > 0 ? 1 : 0;
+    }
+    for (auto & p : pipes) {
+        close(p[0]);
+        close(p[1]);
+    }
+
+    std::vector<StageReport> reports;
+    for (auto & stage : stages) {
+        reports.push_back({stage.name, stage.pid > 0 ? 0 : 127, {}, 0, 0});
+    }
+    double last_sample = 0;
+    while (running > 0) {
+        int status = 0;
+        rusage usage{};
+        pid_t pid = wait4(-1, &status, WNOHANG, &usage);
+        if (pid < 0 && errno != EINTR) {
+            perror("waitpid");
+            stop_stages();
+            break;
+        }
+        if (pid > 0) {
+            auto stage = std::find_if(stages.begin(), stages.end(), [&](auto & s) { return s.pid == pid; });
+            if (stage == stages.end()) {
+                continue;
+            }
+            auto & report = reports[size_t(stage - stages.begin())];
+            report.exit_code = exit_code(status);
+            report.stats = CmdStats{seconds_since(run_start), to_seconds(usage.ru_utime), to_seconds(usage.ru_stime),
+                                    usage.ru_maxrss};
+            emit_process_exit(pid, status, report.stats);
+            stage->pid = -1;
+            --running;
+            continue;
+        }
+        double now = seconds_since(run_start);
+        double dt = now - last_sample;
+        last_sample = now;
+        for (size_t i = 0; i < stages.size(); ++i) {
+            if (stages[i].pid <= 0) {
+                continue;
+            }
+            switch (sample_stage(stages[i].pid)) {
+                case StageState::WaitingForInput:
+                    reports[i].waiting_for_input += dt;
+                    break;
+                case StageState::WaitingForOutput:
+                    reports[i].waiting_for_output += dt;
+                    break;
+                case StageState::Busy:
+                    break;
+            }
+        }
+        timespec interval{0, 2'000'000};
+        nanosleep(&interval, nullptr);
+    }
+    CmdStats run_stats{seconds_since(run_start), 0, 0, 0};
+    for (auto & r : reports) {
+        run_stats.user_seconds += r.stats.user_seconds;
+        run_stats.system_seconds += r.stats.system_seconds;
+        run_stats.max_rss_kb = std::max(run_stats.max_rss_kb, r.stats.max_rss_kb);
+    }
+    end_phase(metrics, "run", run_stats);
+
+    print_pipeline_report(std::cerr, reports, pipe_size);
+    // like "set -o pipefail": the last stage that failed decides
+    for (auto & r : reports) {
+        rc = r.exit_code != 0 ? r.exit_code : rc;
+    }
+    return rc;
+}
+
+// Memoized runs (--cpprun-memoize): the stdout, stderr and exit code of a run are stored under
+// CPPRUN_CACHE_DIR/memo/<key> and replayed on later runs instead of running the program. The key covers the
+// executable, the working directory, the run arguments, the selected environment variables, the standard input and
+// the declared input files. The files the program opens for reading are recorded by a preloaded shim, and like the
+// headers of the artifact cache, an entry only replays while all of them have the same contents.
+
+const char * const READ_TRACE_SHIM_SOURCE = R"shim(
+#undef _FORTIFY_SOURCE  // the fortified headers define open and openat inline
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+int report_fd = -1;
+
+bool reading(int flags) {
+    return (flags & O_ACCMODE) == O_RDONLY && (flags & O_DIRECTORY) == 0;
+}
+
+bool needs_mode(int flags) {
+    return (flags & O_CREAT) != 0 || (flags & O_TMPFILE) == O_TMPFILE;
+}
+
+// Appends the absolute path of a file that was opened for reading, one line per open. A file the program looked
+// for but did not find is recorded with a leading '!'; the errno of the open is kept for the program.
+void record(int dirfd, const char * path, bool missing) {
+    if (report_fd < 0 || path == nullptr || strncmp(path, "/proc/", 6) == 0 || strncmp(path, "/sys/", 5) == 0 ||
+        strncmp(path, "/dev/", 5) == 0) {
+        return;
+    }
+    int saved_errno = errno;
+    char line[8192];
+    size_t n = 0;
+    if (missing) {
+        line[n++] = '!';
+    }
+    if (path[0] != '/') {
+        if (dirfd != AT_FDCWD) {
+            char link[64];
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+            ssize_t len = readlink(link, line + n, sizeof(line) - n - 1);
+            if (len < 0) {
+                errno = saved_errno;
+                return;
+            }
+            n += size_t(len);
+        } else if (getcwd(line + n, sizeof(line) - n) != nullptr) {
+            n += strlen(line + n);
+        } else {
+            errno = saved_errno;
+            return;
+        }
+        line[n++] = '/';
+    }
+    size_t len = strlen(path);
+    if (n + len + 1 <= sizeof(line)) {
+        memcpy(line + n, path, len);
+        n += len;
+        line[n++] = '\n';
+        ssize_t written = write(report_fd, line, n);
+        (void)written;
+    }
+    errno = saved_errno;
+}
+
+template <typename F>
+F next(const char * name) {
+    return reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+}
+
+__attribute__((constructor)) void read_trace_shim_init() {
+    // also inherited by the child processes of the program, which append to the same report
+    if (const char * path = getenv("CPPRUN_READ_TRACE")) {
+        report_fd = int(syscall(SYS_openat, AT_FDCWD, path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644));
+    }
+}
+
+}  // namespace
+
+#define CPPRUN_TRACE_OPEN(name)                                                            \
+    extern "C" int name(const char * path, int flags, ...) {                              \
+        mode_t mode = 0;                                                                   \
+        if (needs_mode(flags)) {                                                           \
+            va_list ap;                                                                    \
+            va_start(ap, flags);                                                           \
+            mode = va_arg(ap, mode_t);                                                     \
+            va_end(ap);                                                                    \
+        }                                                                                  \
+        static auto real = next<int (*)(const char *, int, ...)>(#name);                   \
+        int fd = real(path, flags, mode);                                                  \
+        if ((fd >= 0 || errno == ENOENT) && reading(flags)) {                              \
+            record(AT_FDCWD, path, fd < 0);                                                \
+        }                                                                                  \
+        return fd;                                                                         \
+    }
+
+#define CPPRUN_TRACE_OPENAT(name)                                                          \
+    extern "C" int name(int dirfd, const char * path, int flags, ...) {                   \
+        mode_t mode = 0;                                                                   \
+        if (needs_mode(flags)) {                                                           \
+            va_list ap;                                                                    \
+            va_start(ap, flags);                                                           \
+            mode = va_arg(ap, mode_t);                                                     \
+            va_end(ap);                                                                    \
+        }                                                                                  \
+        static auto real = next<int (*)(int, const char *, int, ...)>(#name);              \
+        int fd = real(dirfd, path, flags, mode);                                           \
+        if ((fd >= 0 || errno == ENOENT) && reading(flags)) {                              \
+            record(dirfd, path, fd < 0);                                                   \
+        }                                                                                  \
+        return fd;                                                                         \
+    }
+
+#define CPPRUN_TRACE_FOPEN(name)                                                           \
+    extern "C" FILE * name(const char * path, const char * mode) {                         \
+        static auto real = next<FILE * (*)(const char *, const char *)>(#name);            \
+        FILE * file = real(path, mode);                                                    \
+        bool read_only = mode[0] == 'r' && strchr(mode, '+') == nullptr;                   \
+        if ((file != nullptr || errno == ENOENT) && read_only) {                           \
+            record(AT_FDCWD, path, file == nullptr);                                       \
+        }                                                                                  \
+        return file;                                                                       \
+    }
+
+CPPRUN_TRACE_OPEN(open)
+CPPRUN_TRACE_OPEN(open64)
+CPPRUN_TRACE_OPENAT(openat)
+CPPRUN_TRACE_OPENAT(openat64)
+CPPRUN_TRACE_FOPEN(fopen)
+CPPRUN_TRACE_FOPEN(fopen64)
+)shim";
+
+// Builds a preload shim with the configured compiler once, into CPPRUN_CACHE_DIR/shims.
+std::optional<fs::path> cached_shim(const CpprunArgs & args, const std::string & name, const char * source) {
+    auto dir = cache_dir();
+    if (!dir) {
+        return std::nullopt;
+    }
+    uint64_t hash = fnv1a64(source, fnv1a64(compiler_fingerprint(args.cxx)));
+    auto shim = *dir / "shims" / (name + "-" + hex64(hash) + ".so");
+    std::error_code ec;
+    if (fs::exists(shim, ec)) {
+        return shim;
+    }
+    fs::create_directories(shim.parent_path(), ec);
+    auto tmp = shim;
+    tmp += temp_suffix();
+    auto shim_source = tmp;
+    shim_source += ".cpp";
+    std::ofstream(shim_source) << source;
+    int rc = run_cmd(args.cxx, {"-shared", "-fPIC", "-O2", "-o", tmp.string(), shim_source.string(), "-ldl"},
+                     args.verbose);
+    fs::remove(shim_source, ec);
+    if (rc != 0 || !fs::exists(tmp, ec)) {
+        fs::remove(tmp, ec);
+        return std::nullopt;
+    }
+    fs::rename(tmp, shim, ec);
+    return shim;
+}
+
+std::optional<uint64_t> file_content_hash(const fs::path & path) {
+    uint64_t hash = fnv1a64("");
+    if (!hash_file(path.c_str(), hash)) {
+        return std::nullopt;
+    }
+    return hash;
+}
+
+// input is nullopt when the standard input is a terminal
+uint64_t memo_key(const fs::path & artifact, const std::vector<std::string> & run_args,
+                  const std::vector<std::string> & env_names, const std::optional<std::string> & input,
+                  const std::vector<fs::path> & declared_inputs) {
+    auto field = [](const std::string & s) { return std::to_string(s.size()) + ":" + s; };
+    auto contents = [](const fs::path & path) {
+        auto hash = file_content_hash(path);
+        return hash ? hex64(*hash) : std::string("-");
+    };
+    std::string key = "exe " + contents(artifact) + "\ncwd " + field(fs::current_path().string()) + "\n";
+    for (auto & a : run_args) {
+        key += "arg " + field(a) + "\n";
+    }
+    for (auto & name : env_names) {
+        const char * value = std::getenv(name.c_str());
+        key += "env " + field(name) + (value ? " " + field(value) : " unset") + "\n";
+    }
+    key += "stdin " + (input ? hex64(fnv1a64(*input)) : "terminal") + "\n";
+    for (auto & path : declared_inputs) {
+        key += "file " + field(fs::absolute(path).lexically_normal().string()) + " " + contents(path) + "\n";
+    }
+    return fnv1a64(key);
+}
+
+// "hash path" per line for the regular files among paths, each once, then "- path" for the missing ones: files the
+// program looked for and did not find, which must still not exist
+std::string format_memo_inputs(const std::vector<fs::path> & paths, const std::vector<fs::path> & missing = {}) {
+    std::set<fs::path> seen;
+    std::string out;
+    for (auto & p : paths) {
+        auto path = p.lexically_normal();
+        std::error_code ec;
+        if (!seen.insert(path).second || !fs::is_regular_file(path, ec)) {
+            continue;
+        }
+        if (auto hash = file_content_hash(path)) {
+            out += hex64(*hash) + " " + path.string() + "\n";
+        }
+    }
+    for (auto & p : missing) {
+        auto path = p.lexically_normal();
+        if (seen.insert(path).second) {
+            out += "- " + path.string() + "\n";
+        }
+    }
+    return out;
+}
+
+bool memo_inputs_current(const std::string & inputs) {
+    std::istringstream iss(inputs);
+    std::string hash, path;
+    while (iss >> hash && std::getline(iss >> std::ws, path)) {
+        if (hash == "-") {
+            std::error_code ec;
+            if (fs::exists(path, ec) || ec) {
+                return false;
+            }
+            continue;
+        }
+        auto current = file_content_hash(path);
+        if (!current || hex64(*current) != hash) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::string read_fd(int fd) {
+    std::string data;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        data.append(buf, size_t(n));
+    }
+    return data;
+}
+
+int memoized_run(const CpprunArgs & args, const fs::path & artifact, const std::vector<std::string> & run_args,
+                 const fs::path & workdir, InvocationMetrics & metrics) {
+    auto dir = cache_dir();
+    if (!dir) {
+        std::cerr << "WARNING: --cpprun-memoize needs a cache directory (CPPRUN_CACHE_DIR), running normally"
+                  << std::endl;
+        return run_cmd(artifact.string(), run_args, args.verbose);
+    }
+
+    timespec lookup_start;
+    clock_gettime(CLOCK_MONOTONIC, &lookup_start);
+    begin_phase("memo_lookup");
+    std::optional<std::string> input;
+    if (!isatty(STDIN_FILENO)) {
+        input = read_fd(STDIN_FILENO);
+    }
+    auto entry = *dir / "memo" / hex64(memo_key(artifact, run_args, args.memoize_env, input, *args.memoize));
+    std::error_code ec;
+    bool hit = fs::exists(entry / "result", ec) && memo_inputs_current(read_file(entry / "inputs"));
+    end_phase(metrics, "memo_lookup", CmdStats{seconds_since(lookup_start), 0, 0, 0});
+    events().emit("memoize", ",\"result\":" + json_string(hit ? "hit" : "miss") + ",\"entry\":" +
+                                 json_string(entry.string()));
+
+    if (hit) {
+        if (args.verbose) {
+            std::cerr << ">>> Replaying memoized run: " << entry << std::endl;
+        }
+        write_all(STDOUT_FILENO, read_file(entry / "stdout"));
+        write_all(STDERR_FILENO, read_file(entry / "stderr"));
+        return std::stoi(read_file(entry / "result"));
+    }
+
+    auto trace = workdir / "reads.txt";
+    RunOptions options;
+    options.input = input.value_or("");
+    options.echo = true;
+    options.env = parallel_runtime_env(args);
+    auto shim = cached_shim(args, "read_trace", READ_TRACE_SHIM_SOURCE);
+    if (shim) {
+        const char * preload = std::getenv("LD_PRELOAD");
+        extend(options.env, {{"LD_PRELOAD", shim->string() + (preload && *preload ? std::string(":") + preload : "")},
+                             {"CPPRUN_READ_TRACE", trace.string()}});
+    } else {
+        std::cerr << "WARNING: unable to build the read tracing shim, only the declared inputs are checked"
+                  << std::endl;
+    }
+    if (args.verbose) {
+        std::cout << ">>> ";
+        for (auto & [name, value] : options.env) {
+            std::cout << name << "=" << value << " ";
+        }
+        std::cout << artifact.string() << " " << join_shell(run_args) << std::endl;
+    }
+
+    begin_phase("run");
+    auto result = spawn_process(artifact.string(), run_args, options);
+    end_phase(metrics, "run", result.stats);
+    if (result.exit_code >= 128) {
+        return result.exit_code;  // killed by a signal (or could not be started), nothing to replay
+    }
+
+    std::vector<fs::path> reads, missing;
+    if (fs::exists(trace, ec)) {
+        std::istringstream iss(read_file(trace));
+        for (std::string line; std::getline(iss, line);) {
+            if (!line.empty() && line[0] == '!') {
+                missing.push_back(line.substr(1));
+            } else {
+                reads.push_back(line);
+            }
+        }
+    } else if (shim) {
+        std::cerr << "WARNING: the reads of the program could not be traced (statically linked?), only the declared "
+                     "inputs are checked"
+                  << std::endl;
+    }
+    std::vector<fs::path> declared;
+    for (auto & path : *args.memoize) {
+        declared.push_back(fs::absolute(path).lexically_normal());
+    }
+    auto undeclared = [&](std::vector<fs::path> & paths) {
+        paths.erase(std::remove_if(paths.begin(), paths.end(),
+                                   [&](const fs::path & p) {
+                                       auto path = p.lexically_normal();
+                                       return path == artifact || std::find(declared.begin(), declared.end(),
+                                                                            path) != declared.end();
+                                   }),
+                    paths.end());
+    };
+    undeclared(reads);
+    undeclared(missing);
+    try {
+        write_file_atomic(entry / "stdout", result.output);
+        write_file_atomic(entry / "stderr", result.errors);
+        write_file_atomic(entry / "inputs", format_memo_inputs(reads, missing));
+        // written last: an entry without a result is never replayed
+        write_file_atomic(entry / "result", std::to_string(result.exit_code) + "\n");
+    } catch (const std::exception & e) {
+        std::cerr << "WARNING: unable to store the memoized run: " << e.what() << std::endl;
+    }
+    return result.exit_code;
+}
+
+// Parallel builds of several translation units: each source is compiled to an object file of its own, and the
+// objects are linked once all of them are done. The tasks form a DAG and run on CPPRUN_JOBS jobs, the ready task with
+// the longest expected path to the end of the build first (critical path scheduling), so the slowest compile does
+// not start last. The expected durations are those measured in earlier builds, kept in CPPRUN_CACHE_DIR/durations
+// per compiler, flags and source.
+
+struct BuildTask {
+    std::string name;  // the source file name, or "link"
+    std::string key;   // for the recorded duration, see build_task_key
+    std::vector<std::string> command;
+    std::vector<size_t> deps;  // tasks that have to finish first
+    double expected = 0;       // seconds
+};
+
+std::string build_task_key(const std::string & cxx, const std::vector<std::string> & flags,
+                           const std::vector<fs::path> & sources) {
+    std::string key = compiler_fingerprint(cxx) + "\n";
+    for (auto & f : flags) {
+        key += f + "\n";
+    }
+    for (auto & s : sources) {
+        key += s.string() + "\n";
+    }
+    return hex64(fnv1a64(key));
+}
+
+// "key seconds" per line
+std::map<std::string, double> parse_durations(const std::string & text) {
+    std::map<std::string, double> durations;
+    std::istringstream iss(text);
+    std::string key;
+    double seconds;
+    while (iss >> key >> seconds) {
+        durations[key] = seconds;
+    }
+    return durations;
+}
+
+std::string format_durations(const std::map<std::string, double> & durations) {
+    std::ostringstream out;
+    out << std::setprecision(6);
+    for (auto & [key, seconds] : durations) {
+        out << key << " " << seconds << "\n";
+    }
+    return out.str();
+}
+
+static std::map<std::string, double> load_durations() {
+    auto dir = cache_dir();
+    std::error_code ec;
+    if (!dir || !fs::exists(*dir / "durations", ec)) {
+        return {};
+    }
+    return parse_durations(read_file(*dir / "durations"));
+}
+
+// Merged into the current file under a lock, so concurrent builds do not drop each other's updates.
+static void store_durations(const std::map<std::string, double> & measured) {
+    auto dir = cache_dir();
+    if (!dir || measured.empty()) {
+        return;
+    }
+    std::error_code ec;
+    fs::create_directories(*dir, ec);
+    auto lock_path = *dir / "durations.lock";
+    int lock = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+        if (lock >= 0) {
+            close(lock);
+        }
+        return;
+    }
+    try {
+        auto durations = load_durations();
+        for (auto & [key, seconds] : measured) {
+            durations[key] = seconds;
+        }
+        write_file_atomic(*dir / "durations", format_durations(durations));
+    } catch (const std::exception &) {
+    }
+    close(lock);
+}
+
+// The expected duration of each task plus the longest chain of tasks that depend on it, down to the end of the
+// build. Tasks are listed after their dependencies.
+std::vector<double> critical_path_priorities(const std::vector<BuildTask> & tasks) {
+    std::vector<double> priority(tasks.size(), 0);
+    for (size_t i = tasks.size(); i-- > 0;) {
+        priority[i] += tasks[i].expected;
+        for (auto dep : tasks[i].deps) {
+            priority[dep] = std::max(priority[dep], priority[i]);
+        }
+    }
+    return priority;
+}
+
+// Picks the ready task (all deps done) that is not started yet with the highest priority, if any.
+static std::optional<size_t> next_build_task(const std::vector<BuildTask> & tasks, const std::vector<double> & priority,
+                                             const std::vector<bool> & started, const std::vector<bool> & done) {
+    std::optional<size_t> next;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        bool ready = !started[i] && std::all_of(tasks[i].deps.begin(), tasks[i].deps.end(), [&](size_t d) {
+            return done[d];
+        });
+        if (ready && (!next || priority[i] > priority[*next])) {
+            next = i;
+        }
+    }
+    return next;
+}
+
+// When each task would finish with its expected duration, scheduled like run_build_tasks does on jobs workers.
+std::vector<double> predict_schedule(const std::vector<BuildTask> & tasks, size_t jobs) {
+    auto priority = critical_path_priorities(tasks);
+    std::vector<bool> started(tasks.size()), done(tasks.size());
+    std::vector<double> finish(tasks.size(), 0);
+    std::vector<std::pair<double, size_t>> running;  // finish time, task
+    double now = 0;
+    for (size_t completed = 0; completed < tasks.size();) {
+        std::optional<size_t> next;
+        while (running.size() < jobs && (next = next_build_task(tasks, priority, started, done))) {
+            started[*next] = true;
+            finish[*next] = now + tasks[*next].expected;
+            running.emplace_back(finish[*next], *next);
+        }
+        auto first = std::min_element(running.begin(), running.end());
+        now = first->first;
+        done[first->second] = true;
+        running.erase(first);
+        ++completed;
+    }
+    return finish;
+}
+
+struct BuildTaskResult {
+    RunResult run;
+    double finish = 0;  // seconds since the start of the build
+};
+
+// Runs the tasks on up to jobs threads; once one fails, no more are started. The diagnostics of each task are
+// written to echo, if given, as soon as it finishes.
+std::vector<BuildTaskResult> run_build_tasks(const std::string & compiler, const std::vector<BuildTask> & tasks,
+                                             size_t jobs, bool verbose, std::ostream * echo) {
+    auto priority = critical_path_priorities(tasks);
+    std::vector<bool> started(tasks.size()), done(tasks.size());
+    std::vector<BuildTaskResult> results(tasks.size());
+    bool failed = false;
+    std::mutex mutex;
+    std::condition_variable changed;
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    auto worker = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!failed && std::find(started.begin(), started.end(), false) != started.end()) {
+            auto next = next_build_task(tasks, priority, started, done);
+            if (!next) {
+                changed.wait(lock);
+                continue;
+            }
+            started[*next] = true;
+            if (verbose) {
+                std::cout << ">>> " << compiler << " " << join_shell(tasks[*next].command) << std::endl;
+            }
+            lock.unlock();
+            auto run = spawn_process(compiler, tasks[*next].command, {});
+            lock.lock();
+            results[*next] = {run, seconds_since(start)};
+            done[*next] = true;
+            failed = failed || run.exit_code != 0;
+            if (echo) {
+                *echo << run.output << run.errors << std::flush;
+            }
+            changed.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::max<size_t>(1, jobs); ++i) {
+        threads.emplace_back(worker);
+    }
+    for (auto & t : threads) {
+        t.join();
+    }
+    return results;
+}
+
+// CPPRUN_JOBS: a number, or "auto" for one per CPU. Unset, several sources are built by a single compiler
+// invocation as before.
+size_t build_jobs() {
+    const char * jobs = std::getenv("CPPRUN_JOBS");
+    if (!jobs || !*jobs) {
+        return 1;
+    }
+    if (std::string(jobs) == "auto") {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    return std::max(1l, std::atol(jobs));
+}
+
+// One compile task per source and a link task after them, or nothing if the build is a single compiler invocation:
+// with one source, with -c, or with a single job.
+std::optional<std::vector<BuildTask>> plan_parallel_build(const CpprunArgs & args, const fs::path & output_path,
+                                                          const fs::path & object_dir, bool depfiles) {
+    auto sources = source_files(args.build_args);
+    if (sources.size() < 2 || args.build_only || build_jobs() < 2 ||
+        contains(args.build_args, "-x")) {
+        return std::nullopt;
+    }
+    auto durations = load_durations();
+    std::vector<std::string> compile_flags;
+    if (args.cxx_standard) {
+        append(compile_flags, *args.cxx_standard);
+    }
+    for (auto & a : without_link_only_args(args.build_args)) {
+        if (!is_source_file(a)) {
+            append(compile_flags, a);
+        }
+    }
+    extend(compile_flags, without_link_only_args(args.runtime_flags));
+
+    std::vector<BuildTask> tasks;
+    // the link command is the single invocation with each source replaced by its object, in the same place
+    auto link = collect_build_args(args, output_path);
+    link.pop_back();  // the output path is part of the command, not of the key
+    auto link_key = build_task_key(args.cxx, link, sources);
+    for (auto & a : link) {
+        if (!is_source_file(a)) {
+            continue;
+        }
+        auto source = fs::absolute(a).lexically_normal();
+        auto object = object_dir / (std::to_string(tasks.size()) + "-" + source.stem().string() + ".o");
+        BuildTask task{source.filename().string(), build_task_key(args.cxx, compile_flags, {source}), compile_flags,
+                       {}, 0};
+        extend(task.command, {"-c", a, "-o", object.string()});
+        if (depfiles) {
+            extend(task.command, {"-MD", "-MF", object.string() + ".d"});
+        }
+        // without history, larger sources are expected to take longer
+        std::error_code ec;
+        auto size = fs::file_size(source, ec);
+        task.expected = durations.count(task.key) ? durations[task.key] : double(ec ? 0 : size) * 1e-4;
+        tasks.push_back(task);
+        a = object.string();
+    }
+    BuildTask link_task{"link", link_key, link, {}, 0};
+    link_task.command.push_back(output_path.string());
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        link_task.deps.push_back(i);
+    }
+    link_task.expected = durations.count(link_task.key) ? durations[link_task.key] : 0.2;
+    tasks.push_back(link_task);
+    return tasks;
+}
+
+// The depfile of the single invocation, from those of the compile tasks.
+static void merge_depfiles(const std::vector<BuildTask> & tasks, const fs::path & depfile) {
+    std::string merged = "artifact.exe:";
+    for (auto & task : tasks) {
+        auto d = std::find(task.command.begin(), task.command.end(), "-MF");
+        std::error_code ec;
+        if (d == task.command.end() || std::next(d) == task.command.end() || !fs::exists(*std::next(d), ec)) {
+            continue;
+        }
+        for (auto & dep : parse_depfile(read_file(*std::next(d)))) {
+            std::string escaped;
+            for (char c : dep) {
+                escaped += c == ' ' || c == '#' ? std::string("\\") + c : std::string(1, c);
+            }
+            merged += " " + escaped;
+        }
+    }
+    write_file_atomic(depfile, merged + "\n");
+}
+
+struct ParallelBuild {
+    int exit_code = 0;
+    std::string diagnostics;  // unless they were echoed
+    CmdStats stats;           // wall time of the whole build, CPU time of all tasks, largest RSS
+};
+
+// Builds like the single compiler invocation of collect_build_args(args, output_path) would, writing depfile if
+// given. In verbose mode, the commands and the predicted and actual completion times are printed.
+ParallelBuild run_parallel_build(const CpprunArgs & args, const std::vector<BuildTask> & tasks,
+                                 const std::optional<fs::path> & depfile, std::ostream * echo) {
+    ParallelBuild build;
+    auto compiler = resolve_program(args.cxx);
+    if (!compiler) {
+        build.exit_code = 127;
+        build.diagnostics = "cpprun: compiler " + args.cxx + " not found\n";
+        return build;
+    }
+    size_t jobs = std::min(build_jobs(), tasks.size() - 1);
+    std::ostringstream collected;
+    auto results = run_build_tasks(compiler->string(), tasks, jobs, args.verbose, echo ? echo : &collected);
+    build.diagnostics = collected.str();
+
+    std::map<std::string, double> measured;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        auto & s = results[i].run.stats;
+        build.stats.wall_seconds = std::max(build.stats.wall_seconds, results[i].finish);
+        build.stats.user_seconds += s.user_seconds;
+        build.stats.system_seconds += s.system_seconds;
+        build.stats.max_rss_kb = std::max(build.stats.max_rss_kb, s.max_rss_kb);
+        if (results[i].run.exit_code != 0) {
+            build.exit_code = build.exit_code != 0 ? build.exit_code : results[i].run.exit_code;
+        } else if (s.wall_seconds > 0) {
+            measured[tasks[i].key] = s.wall_seconds;
+        }
+    }
+    if (build.exit_code == 0 && depfile) {
+        merge_depfiles(tasks, *depfile);
+    }
+    store_durations(measured);
+
+    if (args.verbose && build.exit_code == 0) {
+        auto predicted = predict_schedule(tasks, jobs);
+        std::cout << std::fixed << std::setprecision(2) << ">>> " << tasks.size() - 1 << " compiles and a link on "
+                  << jobs << " jobs, longest expected path first: predicted " << predicted.back() << " s, actual "
+                  << results.back().finish << " s\n"
+                  << ">>>   task                      expected   actual   predicted end   actual end\n";
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            std::cout << ">>>   " << std::left << std::setw(24) << tasks[i].name.substr(0, 24) << std::right
+                      << std::setw(10) << tasks[i].expected << std::setw(9) << results[i].run.stats.wall_seconds
+                      << std::setw(16) << predicted[i] << std::setw(13) << results[i].finish << "\n";
+        }
+        std::cout << std::defaultfloat << std::flush;
+    }
+    return build;
+}
+
+// The build of cpprun::build, from complete arguments. Safe to call from several threads at once.
+Build build_with(const CpprunArgs & args, bool use_cache) {
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Build result;
+    auto cache_entry = use_cache ? artifact_cache_entry(args) : std::nullopt;
+    if (cache_entry && cache_entry_is_valid(*cache_entry)) {
+        result.executable = *cache_entry / "artifact.exe";
+        result.cache_hit = true;
+        result.seconds = seconds_since(start);
+        return result;
+    }
+
+    thread_local std::mt19937 rng(std::random_device{}());
+    auto workdir = std::shared_ptr<const fs::path>(new fs::path(make_temp_dir(rng)), [](const fs::path * dir) {
+        std::error_code ec;
+        fs::remove_all(*dir, ec);
+        delete dir;
+    });
+    auto output_path = *workdir / "artifact.exe";
+    auto depfile = *workdir / "artifact.d";
+    auto build_args = collect_build_args(args, output_path);
+    if (cache_entry) {
+        extend(build_args, {"-MD", "-MF", depfile.string()});
+    }
+
+    RunResult compile;
+    if (auto tasks = plan_parallel_build(args, output_path, *workdir, cache_entry.has_value())) {
+        auto parallel = run_parallel_build(args, *tasks, cache_entry ? std::make_optional(depfile) : std::nullopt,
+                                           nullptr);
+        compile.exit_code = parallel.exit_code;
+        compile.errors = parallel.diagnostics;
+        compile.stats = parallel.stats;
+    } else if (auto compiler = resolve_program(args.cxx)) {
+        compile = spawn_process(compiler->string(), build_args, {});
+    } else {
+        compile.exit_code = 127;
+        compile.errors = "cpprun: compiler " + args.cxx + " not found\n";
+    }
+    result.exit_code = compile.exit_code;
+    result.diagnostics = compile.output + compile.errors;
+    result.compile = compile.stats;
+
+    if (compile.exit_code == 0 && fs::exists(output_path)) {
+        record_build(args, compile.stats);
+        result.executable = output_path;
+        result.workdir = workdir;
+        if (cache_entry) {
+            try {
+                store_cache_entry(*cache_entry, args, output_path, depfile);
+                result.executable = *cache_entry / "artifact.exe";
+                result.workdir.reset();
+            } catch (const std::exception & e) {
+                result.diagnostics += std::string("cpprun: unable to cache the build: ") + e.what() + "\n";
+            }
+        }
+    }
+    result.seconds = seconds_since(start);
+    return result;
+}
+
+// Sanitizer matrix (--cpprun-sanitize=address,undefined,thread): every sanitizer gets a build of its own, cached
+// under its own key since the -fsanitize flag is part of it. The builds are compiled concurrently and then run
+// concurrently, with the same arguments and input. Their reports are merged: a finding with the same stack, from
+// several variants or several times from one, is shown once.
+
+// Runtime options in favor of speed: stop at the first error, keep allocation stacks short, check for leaks only at
+// exit. Options already set in the environment take precedence.
+const std::map<std::string, std::pair<std::string, std::string>> SANITIZER_RUNTIME_OPTIONS = {
+    {"address",
+     {"ASAN_OPTIONS", "halt_on_error=1:detect_leaks=1:leak_check_at_exit=1:malloc_context_size=10:"
+                      "detect_stack_use_after_return=0"}},
+    {"undefined", {"UBSAN_OPTIONS", "halt_on_error=1:print_stacktrace=1"}},
+    {"thread", {"TSAN_OPTIONS", "halt_on_error=1:report_signal_unsafe=0"}},
+    {"leak", {"LSAN_OPTIONS", "leak_check_at_exit=1:malloc_context_size=10"}},
+};
+
+EnvOverrides sanitizer_env(const std::string & sanitizer) {
+    auto & [name, defaults] = SANITIZER_RUNTIME_OPTIONS.at(sanitizer);
+    const char * set = std::getenv(name.c_str());
+    // the last value of an option wins
+    return {{name, set && *set ? defaults + ":" + set : defaults}};
+}
+
+struct SanitizerFinding {
+    std::string kind;                 // e.g. "heap-buffer-overflow", "data race", "runtime error: ..."
+    std::vector<std::string> frames;  // "#N function file:line", without addresses and sanitizer runtime frames
+};
+
+// "0x4011f6 in main /src/a.cpp:7" (ASan, UBSan) or "main /src/a.cpp:7 (a.out+0x11f6)" (TSan) -> "main /src/a.cpp:7",
+// a frame without a symbol is named by its module: "0x7f12  (/lib/libc.so.6+0x27249)" -> "libc.so.6"
+std::string normalize_frame(std::string frame) {
+    if (frame.rfind("0x", 0) == 0) {
+        auto in = frame.find(" in ");
+        frame = in != std::string::npos ? frame.substr(in + 4) : frame.substr(std::min(frame.find(' '), frame.size()));
+    }
+    frame.erase(0, std::min(frame.find_first_not_of(' '), frame.size()));
+    auto paren = frame.rfind('(');
+    if (paren == std::string::npos || frame.back() != ')' || frame.find("+0x", paren) == std::string::npos) {
+        return frame;
+    }
+    auto symbol = paren > 0 ? frame.substr(0, paren - 1) : "";
+    if (!symbol.empty() && symbol.rfind("<null>", 0) != 0) {
+        return symbol;
+    }
+    auto module = frame.substr(paren + 1, frame.find("+0x", paren) - paren - 1);
+    return fs::path(module).filename().string();
+}
+
+static bool is_sanitizer_runtime_frame(const std::string & frame) {
+    for (auto * marker : {"libsanitizer/", "compiler-rt/", "__interceptor_", "__sanitizer", "__asan", "__tsan",
+                          "__ubsan", "__lsan", "libasan.so", "libtsan.so", "libubsan.so", "liblsan.so"}) {
+        if (frame.find(marker) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The reports in the standard error of a sanitized run.
+std::vector<SanitizerFinding> parse_sanitizer_reports(const std::string & text) {
+    std::vector<SanitizerFinding> findings;
+    bool in_report = false;
+    auto start = [&](std::string kind) {
+        findings.push_back({std::move(kind), {}});
+        in_report = true;
+    };
+    std::istringstream iss(text);
+    for (std::string line; std::getline(iss, line);) {
+        auto sanitizer = line.find("Sanitizer: ");
+        auto runtime_error = line.find(": runtime error: ");
+        size_t indent = line.find_first_not_of(' ');
+        if (line.rfind("==", 0) == 0 && line.find("ERROR: ") != std::string::npos && sanitizer != std::string::npos) {
+            // "==123==ERROR: AddressSanitizer: heap-buffer-overflow on address ..."; leaks follow one by one
+            auto kind = line.substr(sanitizer + 11);
+            kind = kind.substr(0, kind.find(" on "));
+            if (kind == "detected memory leaks") {
+                in_report = false;
+            } else {
+                start(kind);
+            }
+        } else if (line.rfind("WARNING: ThreadSanitizer: ", 0) == 0) {
+            auto kind = line.substr(26);
+            start(kind.substr(0, kind.find(" (pid=")));
+        } else if (line.rfind("Direct leak of ", 0) == 0 || line.rfind("Indirect leak of ", 0) == 0) {
+            start(line.substr(0, line.find(" of ")));
+        } else if (runtime_error != std::string::npos) {
+            // "a.cpp:7:12: runtime error: signed integer overflow: ...", the location stands in for the stack
+            start("runtime error: " + line.substr(runtime_error + 17));
+            findings.back().frames.push_back(line.substr(0, runtime_error));
+        } else if (line.rfind("SUMMARY: ", 0) == 0) {
+            in_report = false;
+        } else if (in_report && indent != std::string::npos && line.compare(indent, 1, "#") == 0) {
+            auto space = line.find(' ', indent);
+            if (space == std::string::npos) {
+                continue;
+            }
+            if (is_sanitizer_runtime_frame(line)) {
+                continue;
+            }
+            // the numbers are kept, a report may have several stacks (access and allocation, both threads)
+            auto frame = line.substr(indent, space - indent) + " " + normalize_frame(line.substr(space + 1));
+            auto & frames = findings.back().frames;
+            // with a stack, the location of a runtime error is its first frame
+            if (frames.size() == 1 && findings.back().kind.rfind("runtime error: ", 0) == 0 &&
+                frame.find(frames.front().substr(0, frames.front().rfind(':'))) != std::string::npos) {
+                frames.clear();
+            }
+            frames.push_back(frame);
+        }
+    }
+    return findings;
+}
+
+struct MergedFinding {
+    SanitizerFinding finding;
+    std::vector<std::string> variants;  // that reported it
+    size_t reports = 0;
+};
+
+// Findings in the order they were first seen, the same kind and stack merged into one.
+std::vector<MergedFinding> merge_sanitizer_findings(
+    const std::vector<std::pair<std::string, std::vector<SanitizerFinding>>> & by_variant) {
+    std::vector<MergedFinding> merged;
+    std::map<std::string, size_t> index;
+    for (auto & [variant, findings] : by_variant) {
+        for (auto & f : findings) {
+            auto key = f.kind;
+            for (auto & frame : f.frames) {
+                key += "\n" + frame;
+            }
+            auto [it, inserted] = index.emplace(key, merged.size());
+            if (inserted) {
+                merged.push_back({f, {}, 0});
+            }
+            auto & m = merged[it->second];
+            if (!contains(m.variants, variant)) {
+                m.variants.push_back(variant);
+            }
+            ++m.reports;
+        }
+    }
+    return merged;
+}
+
+struct SanitizerVariant {
+    std::string name;
+    Build build;
+    RunResult run;
+    size_t reports = 0;
+};
+
+void print_sanitizer_report(std::ostream & out, const std::vector<SanitizerVariant> & variants,
+                            const std::vector<MergedFinding> & findings) {
+    out << "variant     build s   exit   run s  reports\n";
+    size_t reports = 0;
+    for (auto & v : variants) {
+        out << std::left << std::setw(10) << v.name << std::right << std::fixed << std::setprecision(2);
+        if (v.build.cache_hit) {
+            out << std::setw(9) << "hit";
+        } else {
+            out << std::setw(9) << v.build.seconds;
+        }
+        if (!v.build.ok()) {
+            out << "  build failed with exit code " << v.build.exit_code << "\n";
+            continue;
+        }
+        out << std::setw(7) << v.run.exit_code << std::setw(8) << v.run.stats.wall_seconds << std::setw(9)
+            << v.reports << "\n";
+        reports += v.reports;
+    }
+    out << std::defaultfloat << std::setprecision(6);
+    if (findings.empty()) {
+        out << "no findings\n";
+        return;
+    }
+    out << findings.size() << (findings.size() == 1 ? " finding" : " distinct findings") << " in " << reports
+        << (reports == 1 ? " report" : " reports") << ":\n";
+    for (auto & m : findings) {
+        out << m.finding.kind << " [";
+        for (size_t i = 0; i < m.variants.size(); ++i) {
+            out << (i > 0 ? ", " : "") << m.variants[i];
+        }
+        out << "]";
+        if (m.reports > 1) {
+            out << ", reported " << m.reports << " times";
+        }
+        out << "\n";
+        for (auto & frame : m.finding.frames) {
+            out << "    " << frame << "\n";
+        }
+    }
+}
+
+int run_sanitizers(const CpprunArgs & args, const std::vector<std::string> & run_args, InvocationMetrics & metrics) {
+    // every variant gets the same input
+    std::string input;
+    if (!isatty(STDIN_FILENO)) {
+        input = read_fd(STDIN_FILENO);
+    }
+
+    std::vector<SanitizerVariant> variants;
+    std::vector<std::future<Build>> builds;
+    timespec build_start;
+    clock_gettime(CLOCK_MONOTONIC, &build_start);
+    begin_phase("compile");
+    for (auto & name : args.sanitizers) {
+        auto variant = args;
+        extend(variant.build_args, {"-fsanitize=" + name, "-fno-omit-frame-pointer"});
+        if (args.verbose) {
+            std::cout << ">>> [" << name << "] " << variant.cxx << " " << join_shell(collect_build_args(variant, "-"))
+                      << std::endl;
+        }
+        variants.push_back({name, {}, {}, 0});
+        builds.push_back(std::async(std::launch::async, [variant] { return build_with(variant, true); }));
+    }
+    CmdStats build_stats;
+    bool all_hits = true;
+    for (size_t i = 0; i < variants.size(); ++i) {
+        auto & b = variants[i].build = builds[i].get();
+        if (!b.diagnostics.empty()) {
+            std::cerr << ">>> " << variants[i].name << " build:\n" << b.diagnostics;
+        }
+        all_hits = all_hits && b.cache_hit;
+        build_stats.user_seconds += b.compile.user_seconds;
+        build_stats.system_seconds += b.compile.system_seconds;
+        build_stats.max_rss_kb = std::max(build_stats.max_rss_kb, b.compile.max_rss_kb);
+    }
+    build_stats.wall_seconds = seconds_since(build_start);
+    metrics.cache = all_hits ? "hit" : "miss";
+    end_phase(metrics, "compile", build_stats);
+
+    timespec run_start;
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    begin_phase("run");
+    std::vector<std::future<RunResult>> runs;
+    for (auto & v : variants) {
+        if (!v.build.ok()) {
+            runs.emplace_back();
+            continue;
+        }
+        RunOptions options;
+        options.env = sanitizer_env(v.name);
+        extend(options.env, parallel_runtime_env(args));
+        options.input = input;
+        if (args.verbose) {
+            std::cout << ">>> [" << v.name << "] " << v.build.executable.string() << " " << join_shell(run_args)
+                      << std::endl;
+        }
+        runs.push_back(std::async(std::launch::async, [exe = v.build.executable.string(), &run_args, options] {
+            return spawn_process(exe, run_args, options);
+        }));
+    }
+    CmdStats run_stats{0, 0, 0, 0};
+    std::vector<std::pair<std::string, std::vector<SanitizerFinding>>> by_variant;
+    for (size_t i = 0; i < variants.size(); ++i) {
+        auto & v = variants[i];
+        if (!runs[i].valid()) {
+            continue;
+        }
+        v.run = runs[i].get();
+        auto findings = parse_sanitizer_reports(v.run.errors);
+        v.reports = findings.size();
+        by_variant.emplace_back(v.name, std::move(findings));
+        run_stats.user_seconds += v.run.stats.user_seconds;
+        run_stats.system_seconds += v.run.stats.system_seconds;
+        run_stats.max_rss_kb = std::max(run_stats.max_rss_kb, v.run.stats.max_rss_kb);
+        if (args.verbose) {
+            std::cerr << ">>> " << v.name << " stderr:\n" << v.run.errors;
+        }
+    }
+    run_stats.wall_seconds = seconds_since(run_start);
+    end_phase(metrics, "run", run_stats);
+
+    // the variants run the same program, the output of the first one stands for all
+    int rc = 0;
+    bool output_shown = false;
+    for (auto & v : variants) {
+        if (!output_shown && v.build.ok()) {
+            std::cout << v.run.output << std::flush;
+            output_shown = true;
+        }
+        int variant_rc = v.build.ok() ? v.run.exit_code : v.build.exit_code;
+        rc = rc != 0 ? rc : variant_rc;
+    }
+    print_sanitizer_report(std::cerr, variants, merge_sanitizer_findings(by_variant));
+    return rc;
+}
+
+// Assembly diff (--cpprun-asm-diff=VARIANT, given twice): both variants are built (or taken from the cache) and
+// their executables disassembled with objdump. Functions are matched by symbol, with the clones GCC splits off
+// (.cold, .part.N, .isra.N, ...) counted as part of the function, and ranked by how much their instruction mix
+// changed. With --cpprun-annotate, both variants also run once under the sampling profiler, and the ranking is
+// weighted by the share of samples in each function.
+
+const size_t ASM_DIFF_TABLE_ROWS = 20;
+const size_t ASM_DIFF_SHOWN = 5;             // functions shown side by side
+const size_t ASM_DIFF_MAX_LINES = 200;       // per function
+const size_t ASM_DIFF_CONTEXT = 3;           // unchanged instructions around a change
+const size_t ASM_DIFF_MAX_CELLS = 16 << 20;  // of the LCS table; bigger functions are compared line by line
+
+struct AsmInstruction {
+    uint64_t address = 0;
+    std::string text;  // as objdump prints it, without the addresses of branch targets
+    std::string key;   // for comparing, without the offsets that move when code is added or removed
+    std::string mnemonic;
+    size_t samples = 0;
+};
+
+struct AsmFunction {
+    std::string name;  // mangled, without the clone suffix
+    uint64_t bytes = 0;
+    std::vector<AsmInstruction> instructions;
+    size_t samples = 0;
+};
+
+using AsmListing = std::map<std::string, AsmFunction>;
+
+// A variant is a list of build options, optionally preceded by a compiler: "-O3", "g++-13 -O2 -march=native"
+CpprunArgs asm_diff_variant(const CpprunArgs & args, const std::string & spec) {
+    auto variant = args;
+    variant.asm_diff.clear();
+    std::istringstream iss(spec);
+    std::string word;
+    for (bool first = true; iss >> word; first = false) {
+        if (first && word[0] != '-') {
+            variant.cxx = word;
+        } else {
+            variant.build_args.push_back(word);
+        }
+    }
+    return variant;
+}
+
+// foo.cold, foo.part.0 and foo.constprop.0.isra.0 all belong to foo. Only the compilers' clone suffixes are
+// stripped: other dotted names (foo.1, local labels, C symbols with dots) stay functions of their own.
+std::string asm_function_key(const std::string & symbol) {
+    static const std::set<std::string> clone_suffixes = {"cold",     "part",       "isra", "constprop",
+                                                         "lto_priv", "localalias", "llvm", "specialized"};
+    auto key = symbol.size();
+    for (auto end = symbol.size(); end > 0;) {
+        auto dot = symbol.rfind('.', end - 1);
+        if (dot == std::string::npos || dot == 0) {
+            break;
+        }
+        auto part = symbol.substr(dot + 1, end - dot - 1);
+        if (clone_suffixes.count(part)) {
+            key = dot;
+        } else if (part.empty() || part.find_first_not_of("0123456789") != std::string::npos) {
+            break;
+        }
+        end = dot;
+    }
+    return symbol.substr(0, key);
+}
+
+std::string asm_mnemonic(const std::string & text) {
+    static const std::set<std::string> prefixes = {"rep",  "repz",   "repe",   "repne", "repnz", "lock",
+                                                   "bnd",  "notrack", "data16", "cs",    "ds",    "addr32"};
+    std::istringstream iss(text);
+    std::string mnemonic, word;
+    while (iss >> word) {
+        mnemonic += (mnemonic.empty() ? "" : " ") + word;
+        if (!prefixes.count(word)) {
+            break;
+        }
+    }
+    return mnemonic;
+}
+
+// Branch targets and RIP-relative operands carry addresses, e.g. "jne    12d0 <f+0x10>", "call   1060 <g@plt>" and
+// "mov    0x2fcd(%rip),%rax        # 3fd8 <x>". The address goes, a target in the function itself becomes its
+// offset, and the key leaves out offsets altogether.
+AsmInstruction parse_asm_instruction(uint64_t address, const std::string & text, const std::string & function) {
+    AsmInstruction insn;
+    insn.address = address;
+    insn.text = text;
+    auto open = text.rfind(" <");
+    if (open != std::string::npos && text.back() == '>') {
+        auto target = text.substr(open + 2, text.size() - open - 3);
+        auto before = text.substr(0, open);
+        auto word = before.find_last_of(" \t");
+        if (word != std::string::npos &&
+            before.find_first_not_of("0123456789abcdef", word + 1) == std::string::npos) {
+            before.erase(word + 1);
+        }
+        if (auto comment = before.rfind(" # "); comment != std::string::npos) {
+            before = before.substr(0, before.find_last_not_of(' ', comment) + 1) + "  # ";
+        }
+        auto symbol = target.substr(0, target.find('+'));
+        auto offset = target.substr(symbol.size());
+        bool local = symbol == function;
+        auto base = symbol.substr(0, symbol.find('@'));
+        auto name = base.rfind("_Z", 0) == 0 ? demangle(base) : base;  // "i" would demangle to int
+        insn.text = before + "<" + (local ? offset : name + symbol.substr(base.size()) + offset) + ">";
+        insn.key = before + "<" + (local ? "" : symbol) + ">";
+    } else {
+        insn.key = text;
+    }
+    for (size_t at; (at = insn.key.find("(%rip)")) != std::string::npos;) {
+        auto start = insn.key.find_last_of(" ,", at);
+        start = start == std::string::npos ? 0 : start + 1;
+        insn.key.replace(start, at + 6 - start, "RIP");
+    }
+    insn.mnemonic = asm_mnemonic(text);
+    return insn;
+}
+
+// The output of objdump -d --no-show-raw-insn, split into the functions of the symbol table. The part named like
+// the function comes first, its clones follow by name.
+AsmListing parse_objdump(const std::string & text, const ElfFile & elf) {
+    AsmListing listing;
+    SymbolIndex symbols(elf);
+    std::map<std::string, std::map<std::pair<bool, std::string>, std::vector<AsmInstruction>>> parts;
+    std::istringstream iss(text);
+    std::string line;
+    while (std::getline(iss, line)) {
+        // "    12c0:\tmov    (%rdi),%rdx"
+        auto colon = line.find(":\t");
+        auto start = line.find_first_not_of(' ');
+        if (colon == std::string::npos || start >= colon ||
+            line.find_first_not_of("0123456789abcdef", start) != colon) {
+            continue;
+        }
+        uint64_t address = std::stoull(line.substr(start, colon - start), nullptr, 16);
+        auto sym = symbols.find(address);
+        if (!sym) {
+            continue;
+        }
+        auto key = asm_function_key(sym->name);
+        auto & part = parts[key][{sym->name != key, sym->name}];
+        if (part.empty()) {
+            listing[key].bytes += sym->size;
+        }
+        part.push_back(parse_asm_instruction(address, line.substr(colon + 2), sym->name));
+    }
+    for (auto & [key, by_name] : parts) {
+        auto & f = listing[key];
+        f.name = key;
+        for (auto & [_, instructions] : by_name) {
+            extend(f.instructions, instructions);
+        }
+    }
+    return listing;
+}
+
+void attribute_asm_samples(AsmListing & listing, const AttributedSamples & samples) {
+    std::map<uint64_t, std::pair<AsmFunction *, AsmInstruction *>> by_address;
+    for (auto & [_, f] : listing) {
+        for (auto & insn : f.instructions) {
+            by_address[insn.address] = {&f, &insn};
+        }
+    }
+    for (auto & [address, count] : samples.executable) {
+        auto it = by_address.upper_bound(address);
+        if (it == by_address.begin()) {
+            continue;
+        }
+        --it;
+        it->second.first->samples += count;
+        it->second.second->samples += count;
+    }
+}
+
+std::map<std::string, int> instruction_mix(const AsmFunction & f) {
+    std::map<std::string, int> mix;
+    for (auto & insn : f.instructions) {
+        mix[insn.mnemonic]++;
+    }
+    return mix;
+}
+
+// Change in the count of each mnemonic, largest first
+std::vector<std::pair<std::string, int>> mix_change(const AsmFunction & a, const AsmFunction & b) {
+    auto mix = instruction_mix(b);
+    for (auto & [mnemonic, n] : instruction_mix(a)) {
+        mix[mnemonic] -= n;
+    }
+    std::vector<std::pair<std::string, int>> change;
+    for (auto & [mnemonic, n] : mix) {
+        if (n != 0) {
+            change.emplace_back(mnemonic, n);
+        }
+    }
+    std::stable_sort(change.begin(), change.end(),
+                     [](auto & x, auto & y) { return std::abs(x.second) > std::abs(y.second); });
+    return change;
+}
+
+size_t mix_distance(const AsmFunction & a, const AsmFunction & b) {
+    size_t distance = 0;
+    for (auto & [_, n] : mix_change(a, b)) {
+        distance += size_t(std::abs(n));
+    }
+    return distance;
+}
+
+struct AsmDiffLine {
+    char mark;  // ' ' same, '|' changed, '<' only in a, '>' only in b
+    const AsmInstruction * a;
+    const AsmInstruction * b;
+};
+
+// Longest common subsequence of the keys; a run of removed instructions followed by added ones pairs up as changed
+std::vector<AsmDiffLine> diff_instructions(const std::vector<AsmInstruction> & a,
+                                           const std::vector<AsmInstruction> & b) {
+    size_t n = a.size(), m = b.size();
+    std::vector<AsmDiffLine> lines;
+    if ((n + 1) * (m + 1) > ASM_DIFF_MAX_CELLS) {
+        for (size_t i = 0; i < std::max(n, m); ++i) {
+            auto * x = i < n ? &a[i] : nullptr;
+            auto * y = i < m ? &b[i] : nullptr;
+            lines.push_back({!x ? '>' : !y ? '<' : x->key == y->key ? ' ' : '|', x, y});
+        }
+        return lines;
+    }
+    std::vector<uint32_t> lcs((n + 1) * (m + 1), 0);
+    auto at = [&](size_t i, size_t j) -> uint32_t & { return lcs[i * (m + 1) + j]; };
+    for (size_t i = n; i-- > 0;) {
+        for (size_t j = m; j-- > 0;) {
+            at(i, j) = a[i].key == b[j].key ? at(i + 1, j + 1) + 1 : std::max(at(i + 1, j), at(i, j + 1));
+        }
+    }
+    std::vector<const AsmInstruction *> removed, added;
+    auto flush = [&] {
+        for (size_t k = 0; k < std::max(removed.size(), added.size()); ++k) {
+            auto * x = k < removed.size() ? removed[k] : nullptr;
+            auto * y = k < added.size() ? added[k] : nullptr;
+            lines.push_back({x && y ? '|' : x ? '<' : '>', x, y});
+        }
+        removed.clear();
+        added.clear();
+    };
+    size_t i = 0, j = 0;
+    while (i < n || j < m) {
+        if (i < n && j < m && a[i].key == b[j].key) {
+            flush();
+            lines.push_back({' ', &a[i++], &b[j++]});
+        } else if (j == m || (i < n && at(i + 1, j) >= at(i, j + 1))) {
+            removed.push_back(&a[i++]);
+        } else {
+            added.push_back(&b[j++]);
+        }
+    }
+    flush();
+    return lines;
+}
+
+struct AsmDiffVariant {
+    std::string label;
+    Build build;
+    AsmListing listing;
+    std::optional<RunResult> run;  // of the profiling run
+    size_t samples = 0;
+};
+
+struct AsmDiffRow {
+    const AsmFunction * a;
+    const AsmFunction * b;
+    size_t distance;
+    double weight;  // distance times the larger share of samples, when profiled
+};
+
+std::vector<AsmDiffRow> rank_asm_changes(const AsmDiffVariant & a, const AsmDiffVariant & b) {
+    auto share = [](const AsmFunction & f, const AsmDiffVariant & v) {
+        return v.samples ? double(f.samples) / double(v.samples) : 0.0;
+    };
+    std::vector<AsmDiffRow> rows;
+    for (auto & [key, fa] : a.listing) {
+        auto fb = b.listing.find(key);
+        if (fb == b.listing.end()) {
+            continue;
+        }
+        auto distance = mix_distance(fa, fb->second);
+        if (distance == 0 && fa.bytes == fb->second.bytes) {
+            continue;
+        }
+        double hot = std::max(share(fa, a), share(fb->second, b));
+        rows.push_back({&fa, &fb->second, distance, double(distance) * hot});
+    }
+    std::stable_sort(rows.begin(), rows.end(), [](auto & x, auto & y) {
+        if (x.weight != y.weight) {
+            return x.weight > y.weight;
+        }
+        if (x.distance != y.distance) {
+            return x.distance > y.distance;
+        }
+        return std::llabs(int64_t(x.a->bytes) - int64_t(x.b->bytes)) >
+               std::llabs(int64_t(y.a->bytes) - int64_t(y.b->bytes));
+    });
+    return rows;
+}
+
+static std::string asm_cell(const AsmInstruction * insn, const AsmDiffVariant & v, size_t width) {
+    std::ostringstream out;
+    if (insn && v.run) {
+        if (insn->samples) {
+            out << std::fixed << std::setprecision(1) << std::setw(5)
+                << 100.0 * double(insn->samples) / double(std::max<size_t>(v.samples, 1)) << "% ";
+        } else {
+            out << "       ";
+        }
+    }
+    if (insn) {
+        out << insn->text;
+    }
+    auto cell = out.str();
+    std::replace(cell.begin(), cell.end(), '\t', ' ');
+    return cell.size() > width ? cell.substr(0, width - 1) + "~" : cell + std::string(width - cell.size(), ' ');
+}
+
+void print_function_diff(std::ostream & out, const AsmDiffRow & row, const AsmDiffVariant & a,
+                         const AsmDiffVariant & b) {
+    const size_t width = 57;
+    out << "\n" << demangle(row.a->name) << ": " << row.a->bytes << " -> " << row.b->bytes << " bytes, "
+        << row.a->instructions.size() << " -> " << row.b->instructions.size() << " instructions\n";
+    auto change = mix_change(*row.a, *row.b);
+    if (!change.empty()) {
+        out << "mix:";
+        for (size_t i = 0; i < std::min<size_t>(8, change.size()); ++i) {
+            out << (i ? ", " : " ") << std::showpos << change[i].second << std::noshowpos << " " << change[i].first;
+        }
+        out << (change.size() > 8 ? ", ..." : "") << "\n";
+    }
+    out << "  " << std::left << std::setw(int(width)) << "A" << " B\n" << std::right;
+
+    auto lines = diff_instructions(row.a->instructions, row.b->instructions);
+    // unchanged instructions further than ASM_DIFF_CONTEXT from a change are left out
+    std::vector<bool> shown(lines.size(), false);
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (lines[i].mark != ' ') {
+            for (size_t k = i >= ASM_DIFF_CONTEXT ? i - ASM_DIFF_CONTEXT : 0;
+                 k < std::min(lines.size(), i + ASM_DIFF_CONTEXT + 1); ++k) {
+                shown[k] = true;
+            }
+        }
+    }
+    size_t printed = 0, skipped = 0;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (!shown[i]) {
+            skipped++;
+            continue;
+        }
+        if (skipped) {
+            out << "  ... " << skipped << " unchanged\n";
+            skipped = 0;
+        }
+        if (printed++ == ASM_DIFF_MAX_LINES) {
+            out << "  ... " << lines.size() - i << " more lines\n";
+            return;
+        }
+        auto line = asm_cell(lines[i].a, a, width) + " " + asm_cell(lines[i].b, b, width);
+        out << lines[i].mark << " " << line.substr(0, line.find_last_not_of(' ') + 1) << "\n";
+    }
+    if (skipped) {
+        out << "  ... " << skipped << " unchanged\n";
+    }
+}
+
+void print_asm_diff(std::ostream & out, const AsmDiffVariant & a, const AsmDiffVariant & b) {
+    out << "A: " << a.label << "\nB: " << b.label << "\n";
+    bool profiled = a.run && b.run;
+    if (profiled) {
+        out << std::fixed << std::setprecision(2);
+        for (auto * v : {&a, &b}) {
+            out << (v == &a ? "A" : "B") << " run: " << v->run->stats.wall_seconds << " s, "
+                << v->run->stats.user_seconds + v->run->stats.system_seconds << " s CPU, " << v->samples
+                << " samples";
+            if (v->run->exit_code != 0) {
+                out << ", exit code " << v->run->exit_code;
+            }
+            out << "\n";
+        }
+        out << std::defaultfloat;
+    }
+
+    auto rows = rank_asm_changes(a, b);
+    if (rows.empty()) {
+        out << "\nno matching function changed\n";
+    } else {
+        out << "\n" << std::right << std::setw(8) << "bytes A" << std::setw(8) << "bytes B" << std::setw(8)
+            << "insns A" << std::setw(8) << "insns B" << std::setw(9) << "changed";
+        if (profiled) {
+            out << std::setw(8) << "hot A" << std::setw(8) << "hot B";
+        }
+        out << "  function\n";
+        auto pct = [](size_t n, size_t total) { return 100.0 * double(n) / double(std::max<size_t>(total, 1)); };
+        for (size_t i = 0; i < std::min(ASM_DIFF_TABLE_ROWS, rows.size()); ++i) {
+            auto & r = rows[i];
+            out << std::setw(8) << r.a->bytes << std::setw(8) << r.b->bytes << std::setw(8)
+                << r.a->instructions.size() << std::setw(8) << r.b->instructions.size() << std::setw(9)
+                << r.distance;
+            if (profiled) {
+                out << std::fixed << std::setprecision(1) << std::setw(7) << pct(r.a->samples, a.samples) << "%"
+                    << std::setw(7) << pct(r.b->samples, b.samples) << "%" << std::defaultfloat;
+            }
+            out << "  " << demangle(r.a->name) << "\n";
+        }
+        if (rows.size() > ASM_DIFF_TABLE_ROWS) {
+            out << "... and " << rows.size() - ASM_DIFF_TABLE_ROWS << " more changed functions\n";
+        }
+    }
+
+    for (auto [x, y, name] : {std::tuple{&a, &b, "A"}, std::tuple{&b, &a, "B"}}) {
+        std::vector<const AsmFunction *> only;
+        for (auto & [key, f] : x->listing) {
+            if (!y->listing.count(key)) {
+                only.push_back(&f);
+            }
+        }
+        if (only.empty()) {
+            continue;
+        }
+        std::sort(only.begin(), only.end(), [](auto * f, auto * g) { return f->bytes > g->bytes; });
+        out << "only in " << name << " (inlined or not emitted in the other): ";
+        for (size_t i = 0; i < std::min<size_t>(3, only.size()); ++i) {
+            out << (i ? ", " : "") << demangle(only[i]->name) << " (" << only[i]->bytes << " bytes)";
+        }
+        out << (only.size() > 3 ? ", and " + std::to_string(only.size() - 3) + " more" : "") << "\n";
+    }
+
+    for (size_t i = 0; i < std::min(ASM_DIFF_SHOWN, rows.size()); ++i) {
+        print_function_diff(out, rows[i], a, b);
+    }
+}
+
+int run_asm_diff(const CpprunArgs & args, const std::vector<std::string> & run_args, const fs::path & workdir,
+                 InvocationMetrics & metrics) {
+    auto objdump = resolve_program("objdump");
+    if (!objdump) {
+        std::cerr << "ERROR: --cpprun-asm-diff needs objdump (binutils) in PATH" << std::endl;
+        return 1;
+    }
+    std::string input;
+    if (args.annotate_hz && !isatty(STDIN_FILENO)) {
+        input = read_fd(STDIN_FILENO);
+    }
+
+    std::vector<AsmDiffVariant> variants;
+    std::vector<std::future<Build>> builds;
+    timespec build_start;
+    clock_gettime(CLOCK_MONOTONIC, &build_start);
+    begin_phase("compile");
+    for (auto & spec : args.asm_diff) {
+        auto variant = asm_diff_variant(args, spec);
+        auto flags = join_shell(std::vector<std::string>(variant.build_args.begin() + long(args.build_args.size()),
+                                                         variant.build_args.end()));
+        variants.push_back({flags.empty() ? variant.cxx : variant.cxx + " " + flags, {}, {}, {}, 0});
+        if (args.verbose) {
+            auto command = collect_build_args(variant, "-");
+            command.resize(command.size() - 2);
+            std::cout << ">>> [" << char('A' + builds.size()) << "] " << variant.cxx << " " << join_shell(command)
+                      << std::endl;
+        }
+        builds.push_back(std::async(std::launch::async, [variant] { return build_with(variant, true); }));
+    }
+    CmdStats build_stats;
+    bool all_hits = true;
+    int rc = 0;
+    for (size_t i = 0; i < variants.size(); ++i) {
+        auto & b = variants[i].build = builds[i].get();
+        std::cerr << b.diagnostics;
+        if (!b.ok()) {
+            std::cerr << "ERROR: variant " << char('A' + i) << " (" << variants[i].label << ") did not build"
+                      << std::endl;
+            rc = b.exit_code ? b.exit_code : 1;
+        }
+        all_hits = all_hits && b.cache_hit;
+        build_stats.user_seconds += b.compile.user_seconds;
+        build_stats.system_seconds += b.compile.system_seconds;
+        build_stats.max_rss_kb = std::max(build_stats.max_rss_kb, b.compile.max_rss_kb);
+    }
+    build_stats.wall_seconds = seconds_since(build_start);
+    metrics.cache = all_hits ? "hit" : "miss";
+    end_phase(metrics, "compile", build_stats);
+    if (rc != 0) {
+        return rc;
+    }
+
+    for (auto & v : variants) {
+        std::string listing;
+        if (capture_cmd(objdump->string(), {"-d", "--no-show-raw-insn", "-j", ".text", v.build.executable.string()},
+                        listing, args.verbose) != 0) {
+            std::cerr << "ERROR: unable to disassemble " << v.build.executable << std::endl;
+            return 1;
+        }
+        v.listing = parse_objdump(listing, read_elf(v.build.executable));
+    }
+
+    if (args.annotate_hz) {
+        auto shim = cached_shim(args, "sampling", SAMPLING_SHIM_SOURCE);
+        if (!shim) {
+            std::cerr << "WARNING: unable to build the sampling shim, the functions are not weighted by hotness"
+                      << std::endl;
+        }
+        CmdStats run_stats;
+        begin_phase("run");
+        for (size_t i = 0; shim && i < variants.size(); ++i) {
+            auto & v = variants[i];
+            auto report = workdir / ("samples-" + std::to_string(i) + ".txt");
+            RunOptions options;
+            options.env = {{"LD_PRELOAD", shim->string()},
+                           {"CPPRUN_PROFILE_REPORT", report.string()},
+                           {"CPPRUN_PROFILE_HZ", std::to_string(*args.annotate_hz)}};
+            extend(options.env, parallel_runtime_env(args));
+            options.input = input;
+            if (args.verbose) {
+                std::cout << ">>> [" << char('A' + i) << "] " << v.build.executable.string() << " "
+                          << join_shell(run_args) << std::endl;
+            }
+            v.run = spawn_process(v.build.executable.string(), run_args, options);
+            run_stats.wall_seconds += v.run->stats.wall_seconds;
+            run_stats.user_seconds += v.run->stats.user_seconds;
+            run_stats.system_seconds += v.run->stats.system_seconds;
+            run_stats.max_rss_kb = std::max(run_stats.max_rss_kb, v.run->stats.max_rss_kb);
+            if (!fs::exists(report)) {
+                std::cerr << "WARNING: no samples were written for variant " << char('A' + i)
+                          << " (statically linked, or the program did not exit normally)" << std::endl;
+                continue;
+            }
+            auto samples = attribute_samples(parse_sample_profile(read_file(report)));
+            v.samples = samples.total;
+            attribute_asm_samples(v.listing, samples);
+        }
+        end_phase(metrics, "run", run_stats);
+    }
+
+    print_asm_diff(std::cout, variants[0], variants[1]);
+    return 0;
+}
+
+// Fuzzing (--cpprun-fuzz[=SECONDS]): the sources are a libFuzzer style harness (LLVMFuzzerTestOneInput). Clang
+// builds it with -fsanitize=fuzzer, other compilers with coverage instrumentation and the driver below. Workers run
+// in parallel for the given time, each fuzzing in one process without an exec per input, and share the corpus
+// through CPPRUN_CACHE_DIR/fuzz/<script key>/corpus, where it persists across sessions. cpprun follows their status
+// lines to report the executions per second and coverage over time, and minimizes the crashes they find.
+
+// The fuzzing driver for compilers without libFuzzer (GCC): the harness is built with -fsanitize-coverage=trace-pc
+// and linked with this shared object, which provides main. It runs LLVMFuzzerTestOneInput on mutated inputs in a
+// loop in one process, keeps the inputs that reach new edges, and takes the subset of libFuzzer's flags and prints
+// the status lines of libFuzzer that run_fuzz relies on.
+const char * const FUZZ_DRIVER_SOURCE = R"driver(
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size);
+extern "C" __attribute__((weak)) int LLVMFuzzerInitialize(int * argc, char *** argv);
+extern "C" __attribute__((weak)) void __sanitizer_set_death_callback(void (*callback)());
+
+namespace {
+
+constexpr size_t MAP_SIZE = 1 << 16;
+uint8_t edges[MAP_SIZE];  // hit counts of the current run
+uint8_t seen[MAP_SIZE];   // hit count classes reached by any run so far
+uintptr_t previous_block = 0;
+
+}  // namespace
+
+// called by the instrumentation at the start of every basic block of the harness
+extern "C" void __sanitizer_cov_trace_pc() {
+    auto block = uintptr_t(__builtin_return_address(0));
+    block = (block ^ (block >> 15)) & (MAP_SIZE - 1);
+    ++edges[block ^ previous_block];
+    previous_block = block >> 1;
+}
+
+namespace {
+
+const uint8_t * current_data = nullptr;
+size_t current_size = 0;
+std::string artifact_prefix = "./";
+bool crash_written = false;
+bool minimizing = false;
+size_t covered_edges = 0;
+size_t executions = 0;
+
+uint64_t hash(const uint8_t * data, size_t size) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; ++i) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+std::string hex(uint64_t value) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(value));
+    return buf;
+}
+
+// Writes the input that was running when the process died, like libFuzzer does.
+void write_crash() {
+    if (minimizing || crash_written || !current_data) {
+        return;
+    }
+    crash_written = true;
+    auto path = artifact_prefix + "crash-" + hex(hash(current_data, current_size));
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        ssize_t n = write(fd, current_data, current_size);
+        close(fd);
+        dprintf(STDERR_FILENO, "==%d== Test unit written to %s (%zd bytes)\n", getpid(), path.c_str(), n);
+    }
+}
+
+void on_signal(int sig) {
+    write_crash();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Folds the hit counts of the last run into classes (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+) and tells whether an
+// edge reached a class that it had not reached before. Clears the counts for the next run.
+bool new_coverage() {
+    bool found = false;
+    for (size_t w = 0; w < MAP_SIZE; w += 8) {
+        uint64_t word;
+        memcpy(&word, edges + w, 8);
+        if (word == 0) {
+            continue;
+        }
+        for (size_t i = w; i < w + 8; ++i) {
+            uint8_t c = edges[i];
+            if (c == 0) {
+                continue;
+            }
+            uint8_t cls = c == 1    ? 1
+                          : c == 2  ? 2
+                          : c == 3  ? 4
+                          : c < 8   ? 8
+                          : c < 16  ? 16
+                          : c < 32  ? 32
+                          : c < 128 ? 64
+                                    : 128;
+            if (cls & ~seen[i]) {
+                covered_edges += seen[i] == 0 ? 1 : 0;
+                seen[i] |= cls;
+                found = true;
+            }
+            edges[i] = 0;
+        }
+    }
+    return found;
+}
+
+void call_harness(const std::vector<uint8_t> & input) {
+    // a copy of exactly the size of the input, so that the sanitizers catch reads past its end
+    auto copy = new uint8_t[input.size()];
+    if (!input.empty()) {
+        memcpy(copy, input.data(), input.size());
+    }
+    current_data = copy;
+    current_size = input.size();
+    previous_block = 0;
+    LLVMFuzzerTestOneInput(copy, input.size());
+    current_data = nullptr;
+    delete[] copy;
+    ++executions;
+}
+
+bool run_one(const std::vector<uint8_t> & input) {
+    call_harness(input);
+    return new_coverage();
+}
+
+bool read_input(const std::string & path, std::vector<uint8_t> & data) {
+    FILE * f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    data.clear();
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(f);
+    return true;
+}
+
+bool write_input(const std::string & path, const std::vector<uint8_t> & data) {
+    auto tmp = path + ".tmp" + std::to_string(getpid());
+    FILE * f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = fclose(f) == 0 && ok;
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool is_directory(const std::string & path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+struct Corpus {
+    std::vector<std::vector<uint8_t>> inputs;
+    std::set<std::string> names;  // files of the corpus directories already run
+};
+
+// Runs the files of a corpus directory that have not been run yet, such as those other workers added, and keeps
+// those that reach new edges.
+void sync_corpus(Corpus & corpus, const std::string & dir) {
+    DIR * d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    std::vector<std::string> names;
+    while (dirent * e = readdir(d)) {
+        if (e->d_name[0] != '.' && corpus.names.insert(e->d_name).second) {
+            names.push_back(e->d_name);
+        }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    std::vector<uint8_t> data;
+    for (auto & name : names) {
+        if (name.find(".tmp") == std::string::npos && read_input(dir + "/" + name, data) && run_one(data)) {
+            corpus.inputs.push_back(data);
+        }
+    }
+}
+
+std::vector<uint8_t> mutate(std::vector<uint8_t> data, const Corpus & corpus, std::mt19937_64 & rng, size_t max_len) {
+    static const uint8_t interesting[] = {0, 1, 16, 32, 64, 100, 127, 128, 255};
+    int count = 1 + int(rng() % 4);
+    for (int m = 0; m < count; ++m) {
+        size_t pos = data.empty() ? 0 : rng() % data.size();
+        switch (rng() % 8) {
+            case 0:
+                if (!data.empty()) {
+                    data[pos] ^= uint8_t(1u << (rng() % 8));
+                }
+                break;
+            case 1:
+                if (!data.empty()) {
+                    data[pos] = uint8_t(rng());
+                }
+                break;
+            case 2:
+                if (!data.empty()) {
+                    data[pos] = interesting[rng() % sizeof(interesting)];
+                }
+                break;
+            case 3:
+                if (!data.empty()) {
+                    data[pos] = uint8_t(data[pos] + int(rng() % 33) - 16);
+                }
+                break;
+            case 4:
+                if (data.size() < max_len) {
+                    data.insert(data.begin() + long(data.empty() ? 0 : rng() % (data.size() + 1)), uint8_t(rng()));
+                }
+                break;
+            case 5:
+                if (!data.empty()) {
+                    size_t len = 1 + rng() % std::min<size_t>(data.size() - pos, 8);
+                    data.erase(data.begin() + long(pos), data.begin() + long(pos + len));
+                }
+                break;
+            case 6:
+                if (!data.empty() && data.size() < max_len) {
+                    // repeat a part of the input somewhere else
+                    size_t len = 1 + rng() % std::min<size_t>(data.size() - pos, 8);
+                    std::vector<uint8_t> part(data.begin() + long(pos), data.begin() + long(pos + len));
+                    data.insert(data.begin() + long(rng() % (data.size() + 1)), part.begin(), part.end());
+                }
+                break;
+            case 7: {
+                // the start of this input and the end of another
+                auto & other = corpus.inputs[rng() % corpus.inputs.size()];
+                size_t cut = other.empty() ? 0 : rng() % other.size();
+                data.resize(data.empty() ? 0 : rng() % (data.size() + 1));
+                data.insert(data.end(), other.begin() + long(cut), other.end());
+                break;
+            }
+        }
+    }
+    if (data.size() > max_len) {
+        data.resize(max_len);
+    }
+    return data;
+}
+
+double seconds_since(const timespec & start) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return double(now.tv_sec - start.tv_sec) + double(now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void print_status(const char * event, const Corpus & corpus, double elapsed) {
+    fprintf(stderr, "#%zu\t%s cov: %zu corp: %zu exec/s: %zu\n", executions, event, covered_edges,
+            corpus.inputs.size(), size_t(elapsed > 0 ? double(executions) / elapsed : 0));
+}
+
+// Runs an input in a child process, which is expected to die; a hang (SIGALRM) does not count.
+bool crashes(const std::vector<uint8_t> & input) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        alarm(10);
+        call_harness(input);
+        _exit(0);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+        return false;
+    }
+    if (WIFSIGNALED(status)) {
+        return WTERMSIG(status) != SIGALRM;
+    }
+    return WEXITSTATUS(status) != 0;
+}
+
+// Removes ever smaller parts of a crashing input as long as it keeps crashing.
+int minimize_crash(const std::string & path, const std::string & output, long runs) {
+    minimizing = true;
+    std::vector<uint8_t> data;
+    if (!read_input(path, data)) {
+        fprintf(stderr, "ERROR: can not read %s\n", path.c_str());
+        return 1;
+    }
+    if (!crashes(data)) {
+        fprintf(stderr, "ERROR: %s does not crash\n", path.c_str());
+        return 1;
+    }
+    size_t original = data.size();
+    long attempts = 0, budget = runs > 0 ? runs : 1000;
+    for (size_t chunk = std::max<size_t>(data.size() / 2, 1); !data.empty() && attempts < budget; chunk /= 2) {
+        for (size_t offset = 0; offset < data.size() && attempts < budget; ++attempts) {
+            auto candidate = data;
+            candidate.erase(candidate.begin() + long(offset),
+                            candidate.begin() + long(std::min(offset + chunk, candidate.size())));
+            if (crashes(candidate)) {
+                data = candidate;
+            } else {
+                offset += chunk;
+            }
+        }
+        if (chunk == 1) {
+            break;
+        }
+    }
+    if (!write_input(output, data)) {
+        fprintf(stderr, "ERROR: can not write %s\n", output.c_str());
+        return 1;
+    }
+    fprintf(stderr, "CRASH_MIN: %zu bytes from %zu after %ld runs, written to %s\n", data.size(), original, attempts,
+            output.c_str());
+    return 0;
+}
+
+}  // namespace
+
+int main(int argc, char ** argv) {
+    if (LLVMFuzzerInitialize) {
+        LLVMFuzzerInitialize(&argc, &argv);
+    }
+    long max_total_time = 0, runs = -1;
+    size_t max_len = 4096;
+    bool minimize = false;
+    uint64_t seed = std::random_device{}();
+    std::string exact_artifact_path;
+    std::vector<std::string> dirs, files;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&](const char * flag) -> const char * {
+            size_t n = strlen(flag);
+            return a.compare(0, n, flag) == 0 ? argv[i] + n : nullptr;
+        };
+        if (auto v = value("-max_total_time=")) {
+            max_total_time = atol(v);
+        } else if (auto v = value("-runs=")) {
+            runs = atol(v);
+        } else if (auto v = value("-max_len=")) {
+            max_len = std::max(1ul, strtoul(v, nullptr, 10));
+        } else if (auto v = value("-seed=")) {
+            seed = strtoull(v, nullptr, 10);
+        } else if (auto v = value("-artifact_prefix=")) {
+            artifact_prefix = v;
+        } else if (auto v = value("-exact_artifact_path=")) {
+            exact_artifact_path = v;
+        } else if (auto v = value("-minimize_crash=")) {
+            minimize = atoi(v) != 0;
+        } else if (a[0] == '-') {
+            fprintf(stderr, "WARNING: flag %s is not supported by this driver, ignored\n", argv[i]);
+        } else if (is_directory(a)) {
+            dirs.push_back(a);
+        } else {
+            files.push_back(a);
+        }
+    }
+
+    if (minimize) {
+        if (files.size() != 1) {
+            fprintf(stderr, "ERROR: -minimize_crash=1 takes one input file\n");
+            return 1;
+        }
+        std::string name = files[0].substr(files[0].find_last_of('/') + 1);
+        auto output = exact_artifact_path.empty() ? artifact_prefix + "minimized-from-" + name : exact_artifact_path;
+        return minimize_crash(files[0], output, runs);
+    }
+
+    if (__sanitizer_set_death_callback) {
+        __sanitizer_set_death_callback(write_crash);
+    }
+    for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+        // the sanitizers handle these three themselves and then call write_crash
+        if (__sanitizer_set_death_callback && (sig == SIGSEGV || sig == SIGBUS || sig == SIGFPE)) {
+            continue;
+        }
+        signal(sig, on_signal);
+    }
+
+    // input files are run once each, to reproduce a crash
+    if (!files.empty()) {
+        std::vector<uint8_t> data;
+        for (auto & f : files) {
+            if (!read_input(f, data)) {
+                fprintf(stderr, "ERROR: can not read %s\n", f.c_str());
+                return 1;
+            }
+            fprintf(stderr, "Running: %s\n", f.c_str());
+            call_harness(data);
+        }
+        return 0;
+    }
+
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    std::mt19937_64 rng(seed);
+    Corpus corpus;
+    for (auto & dir : dirs) {
+        sync_corpus(corpus, dir);
+    }
+    if (corpus.inputs.empty()) {
+        run_one({});
+        corpus.inputs.push_back({});
+    }
+    fprintf(stderr, "INFO: Seed: %llu\n", static_cast<unsigned long long>(seed));
+    print_status("INITED", corpus, seconds_since(start));
+
+    double last_sync = 0, last_pulse = 0;
+    while (runs < 0 || long(executions) < runs) {
+        if ((executions & 255) == 0) {
+            double elapsed = seconds_since(start);
+            if (max_total_time > 0 && elapsed >= double(max_total_time)) {
+                break;
+            }
+            if (elapsed - last_sync >= 1) {
+                for (auto & dir : dirs) {
+                    sync_corpus(corpus, dir);
+                }
+                last_sync = elapsed;
+            }
+            if (elapsed - last_pulse >= 1) {
+                print_status("pulse", corpus, elapsed);
+                last_pulse = elapsed;
+            }
+        }
+        auto input = mutate(corpus.inputs[rng() % corpus.inputs.size()], corpus, rng, max_len);
+        if (run_one(input)) {
+            corpus.inputs.push_back(input);
+            if (!dirs.empty()) {
+                auto name = hex(hash(input.data(), input.size()));
+                corpus.names.insert(name);
+                write_input(dirs[0] + "/" + name, input);
+            }
+            print_status("NEW", corpus, seconds_since(start));
+        }
+    }
+    double elapsed = seconds_since(start);
+    print_status("DONE", corpus, elapsed);
+    fprintf(stderr, "Done %zu runs in %.0f second(s)\n", executions, elapsed);
+    fprintf(stderr, "stat::number_of_executed_units: %zu\n", executions);
+    fprintf(stderr, "stat::average_exec_per_sec: %zu\n", size_t(elapsed > 0 ? double(executions) / elapsed : 0));
+    return 0;
+}
+)driver";
+
+// the sanitizers report crashes to the fuzzer instead of only aborting, and leaks are not checked in workers that
+// run for the whole session
+const EnvOverrides FUZZ_SANITIZER_OPTIONS = {{"ASAN_OPTIONS", "detect_leaks=0:malloc_context_size=10"},
+                                             {"UBSAN_OPTIONS", "halt_on_error=1:print_stacktrace=1"}};
+
+// A status line of libFuzzer or the driver, e.g. "#4096\tpulse  cov: 112 ft: 150 corp: 12/340b exec/s: 2048".
+struct FuzzStatus {
+    uint64_t executions = 0;
+    uint64_t coverage = 0;
+    uint64_t corpus = 0;
+};
+
+std::optional<FuzzStatus> parse_fuzz_status(const std::string & line) {
+    if (line.size() < 2 || line[0] != '#' || !std::isdigit(static_cast<unsigned char>(line[1])) ||
+        line.find(" cov: ") == std::string::npos) {
+        return std::nullopt;
+    }
+    auto field = [&](const char * name) -> uint64_t {
+        auto pos = line.find(name);
+        return pos == std::string::npos ? 0 : std::strtoull(line.c_str() + pos + std::strlen(name), nullptr, 10);
+    };
+    return FuzzStatus{std::strtoull(line.c_str() + 1, nullptr, 10), field(" cov: "), field(" corp: ")};
+}
+
+struct FuzzSample {
+    double seconds = 0;
+    uint64_t executions = 0;
+    uint64_t coverage = 0;
+    size_t corpus = 0;
+    size_t crashes = 0;
+};
+
+void print_fuzz_sample(std::ostream & out, const FuzzSample & sample, const FuzzSample & previous) {
+    double dt = sample.seconds - previous.seconds;
+    double rate = dt > 0 ? double(sample.executions - previous.executions) / dt : 0;
+    out << std::fixed << std::setprecision(0) << std::setw(7) << sample.seconds << std::setw(12) << sample.executions
+        << std::setw(10) << rate << std::setw(7) << sample.coverage << std::setw(8) << sample.corpus << std::setw(9)
+        << sample.crashes << "\n"
+        << std::defaultfloat;
+}
+
+static size_t count_files(const fs::path & dir, const std::function<bool(const fs::path &)> & filter) {
+    size_t n = 0;
+    std::error_code ec;
+    for (auto & e : fs::directory_iterator(dir, ec)) {
+        n += e.is_regular_file() && filter(e.path()) ? 1 : 0;
+    }
+    return n;
+}
+
+static bool is_crash_file(const fs::path & path) {
+    auto name = path.filename().string();
+    return name.rfind("crash-", 0) == 0 && path.extension() != ".min";
+}
+
+int run_fuzz(const CpprunArgs & args, const std::vector<std::string> & run_args, InvocationMetrics & metrics) {
+    auto cache = cache_dir();
+    if (!cache) {
+        std::cerr << "ERROR: --cpprun-fuzz keeps its corpus in CPPRUN_CACHE_DIR, which is disabled" << std::endl;
+        return 1;
+    }
+    auto fuzz_dir = *cache / "fuzz" / script_key(source_files(args.build_args));
+    auto corpus_dir = fuzz_dir / "corpus", crash_dir = fuzz_dir / "crashes", log_dir = fuzz_dir / "logs";
+    for (auto & dir : {corpus_dir, crash_dir, log_dir}) {
+        fs::create_directories(dir);
+    }
+
+    std::string version;
+    bool clang =
+        capture_cmd(args.cxx, {"--version"}, version, false) == 0 && version.find("clang") != std::string::npos;
+    auto variant = args;
+    // -O1 unless the build options say otherwise
+    variant.build_args.insert(variant.build_args.begin(), "-O1");
+    if (clang) {
+        append(variant.build_args, "-fsanitize=fuzzer,address,undefined");
+    } else {
+        auto driver = cached_shim(args, "fuzz_driver", FUZZ_DRIVER_SOURCE);
+        if (!driver) {
+            std::cerr << "ERROR: unable to build the fuzzing driver" << std::endl;
+            return 1;
+        }
+        extend(variant.build_args, {"-fsanitize=address,undefined", "-fsanitize-coverage=trace-pc", driver->string(),
+                                    "-Wl,-rpath," + driver->parent_path().string()});
+    }
+    if (args.verbose) {
+        std::cout << ">>> " << variant.cxx << " " << join_shell(collect_build_args(variant, "-")) << std::endl;
+    }
+    begin_phase("compile");
+    auto build = build_with(variant, true);
+    end_phase(metrics, "compile", build.compile);
+    metrics.cache = build.cache_hit ? "hit" : "miss";
+    std::cerr << build.diagnostics;
+    if (!build.ok()) {
+        return build.exit_code != 0 ? build.exit_code : 1;
+    }
+
+    for (auto & [name, defaults] : FUZZ_SANITIZER_OPTIONS) {
+        const char * set = std::getenv(name.c_str());
+        setenv(name.c_str(), (set && *set ? defaults + ":" + set : defaults).c_str(), 1);
+    }
+    std::set<fs::path> known_crashes;
+    std::error_code ec;
+    for (auto & e : fs::directory_iterator(crash_dir, ec)) {
+        known_crashes.insert(e.path());
+    }
+
+    struct Worker {
+        fs::path log;
+        pid_t pid = -1;
+        std::streamoff offset = 0;
+        uint64_t finished_executions = 0;  // of the earlier processes of this worker
+        FuzzStatus status;
+        std::optional<uint64_t> initial_coverage;  // with the corpus loaded, before fuzzing
+    };
+    size_t seconds = *args.fuzz_seconds;
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    auto start_worker = [&](Worker & w) {
+        auto remaining = std::max<long>(1, long(seconds) - long(seconds_since(start)));
+        std::vector<std::string> worker_args = {corpus_dir.string(), "-artifact_prefix=" + crash_dir.string() + "/",
+                                                "-max_total_time=" + std::to_string(remaining)};
+        extend(worker_args, run_args);
+        if (args.verbose) {
+            std::cout << ">>> " << build.executable.string() << " " << join_shell(worker_args) << std::endl;
+        }
+        int log = open(w.log.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        w.pid = log < 0 ? -1 : start_cmd(build.executable.string(), worker_args, null, log, log);
+        close(log);
+        close(null);
+    };
+    // follows the status lines a worker wrote since the last call
+    auto read_status = [](Worker & w) {
+        std::ifstream in(w.log);
+        in.seekg(w.offset);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (in.eof()) {
+                break;  // a partial line, read again next time
+            }
+            w.offset = in.tellg();
+            if (auto status = parse_fuzz_status(line)) {
+                w.status = *status;
+                w.initial_coverage = w.initial_coverage.value_or(status->coverage);
+            }
+        }
+    };
+
+    size_t workers_wanted = args.fuzz_workers.value_or(std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<Worker> workers(workers_wanted);
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].log = log_dir / ("worker" + std::to_string(i + 1) + ".log");
+        fs::remove(workers[i].log, ec);
+        start_worker(workers[i]);
+        if (workers[i].pid < 0) {
+            std::cerr << "ERROR: unable to start fuzzing worker " << i + 1 << std::endl;
+            return 127;
+        }
+    }
+
+    begin_phase("run");
+    std::cerr << "fuzzing " << workers.size() << (workers.size() == 1 ? " worker" : " workers") << " for "
+              << seconds << " s with " << (clang ? "libFuzzer" : "the cpprun driver") << ", corpus " << corpus_dir
+              << "\n";
+    std::cerr << " time s       execs    exec/s    cov  corpus  crashes\n";
+    auto sample = [&]() {
+        FuzzSample s{seconds_since(start), 0, 0, 0, 0};
+        for (auto & w : workers) {
+            read_status(w);
+            s.executions += w.finished_executions + w.status.executions;
+            s.coverage = std::max(s.coverage, w.status.coverage);
+        }
+        s.corpus = count_files(corpus_dir, [](const fs::path & p) { return p.filename().string()[0] != '.'; });
+        s.crashes =
+            count_files(crash_dir, [&](const fs::path & p) { return is_crash_file(p) && !known_crashes.count(p); });
+        return s;
+    };
+    FuzzSample first = sample(), previous = first, last = first;
+    double interval = std::max<double>(1, double(seconds) / 10);
+    size_t running = workers.size();
+    CmdStats run_stats;
+    while (running > 0) {
+        int status = 0;
+        rusage usage{};
+        pid_t pid = wait4(-1, &status, WNOHANG, &usage);
+        if (pid < 0 && errno != EINTR) {
+            perror("waitpid");
+            break;
+        }
+        if (pid > 0) {
+            auto w = std::find_if(workers.begin(), workers.end(), [&](auto & w) { return w.pid == pid; });
+            if (w == workers.end()) {
+                continue;
+            }
+            CmdStats stats{seconds_since(start), to_seconds(usage.ru_utime), to_seconds(usage.ru_stime),
+                           usage.ru_maxrss};
+            emit_process_exit(pid, status, stats);
+            run_stats.user_seconds += stats.user_seconds;
+            run_stats.system_seconds += stats.system_seconds;
+            run_stats.max_rss_kb = std::max(run_stats.max_rss_kb, stats.max_rss_kb);
+            read_status(*w);
+            w->finished_executions += w->status.executions;
+            w->status.executions = 0;
+            w->pid = -1;
+            // a worker that crashed starts over while there is time left, with the corpus as it is now
+            if (seconds_since(start) + 1 < double(seconds)) {
+                start_worker(*w);
+            }
+            running -= w->pid < 0 ? 1 : 0;
+            continue;
+        }
+        if (seconds_since(start) > double(seconds) + 30) {
+            for (auto & w : workers) {
+                if (w.pid > 0) {
+                    kill(w.pid, SIGKILL);
+                }
+            }
+        }
+        if (seconds_since(start) - previous.seconds >= interval) {
+            last = sample();
+            print_fuzz_sample(std::cerr, last, previous);
+            previous = last;
+        }
+        timespec pause{0, 50'000'000};
+        nanosleep(&pause, nullptr);
+    }
+    last = sample();
+    for (auto & w : workers) {
+        first.coverage = std::max(first.coverage, w.initial_coverage.value_or(0));
+    }
+    if (last.seconds - previous.seconds >= 0.5) {
+        print_fuzz_sample(std::cerr, last, previous);
+    }
+    run_stats.wall_seconds = last.seconds;
+    end_phase(metrics, "run", run_stats);
+    std::cerr << std::fixed << std::setprecision(0) << "total: " << last.executions << " executions in "
+              << last.seconds << " s, " << (last.seconds > 0 ? double(last.executions) / last.seconds : 0)
+              << " exec/s; coverage " << first.coverage << " -> " << last.coverage << "; corpus " << first.corpus
+              << " -> " << last.corpus << " inputs\n"
+              << std::defaultfloat;
+
+    // the new crashes, each minimized next to the original; a bug that the workers found again after a restart is
+    // reported once, for the first crash that minimizes to the same input
+    std::vector<fs::path> crashes;
+    for (auto & e : fs::directory_iterator(crash_dir, ec)) {
+        if (is_crash_file(e.path()) && !known_crashes.count(e.path())) {
+            crashes.push_back(e.path());
+        }
+    }
+    std::sort(crashes.begin(), crashes.end(), [&](auto & a, auto & b) {
+        return fs::last_write_time(a, ec) < fs::last_write_time(b, ec);
+    });
+    std::vector<std::future<RunResult>> minimizing;
+    for (auto & crash : crashes) {
+        if (minimizing.size() >= workers.size()) {
+            minimizing[minimizing.size() - workers.size()].wait();  // as many at a time as there were workers
+        }
+        minimizing.push_back(std::async(std::launch::async, [&, crash] {
+            RunOptions options;
+            options.timeout_seconds = 60;
+            return spawn_process(build.executable.string(),
+                                 {"-minimize_crash=1", "-runs=1000",
+                                  "-exact_artifact_path=" + crash.string() + ".min", crash.string()},
+                                 options);
+        }));
+    }
+    std::map<std::string, std::pair<fs::path, size_t>> unique;  // minimized input -> first crash, duplicates
+    for (auto & crash : known_crashes) {
+        auto minimized = crash.string() + ".min";
+        if (is_crash_file(crash) && fs::exists(minimized, ec)) {
+            unique.try_emplace(read_file(minimized), crash, 0);
+        }
+    }
+    std::vector<std::string> order;
+    size_t known = 0;
+    for (size_t i = 0; i < crashes.size(); ++i) {
+        auto result = minimizing[i].get();
+        auto minimized = crashes[i].string() + ".min";
+        auto input = fs::exists(minimized, ec) ? read_file(minimized) : read_file(crashes[i]);
+        auto [it, inserted] = unique.try_emplace(input, crashes[i], 0);
+        if (!inserted) {
+            known += known_crashes.count(it->second.first);
+            ++it->second.second;
+            fs::remove(crashes[i], ec);
+            fs::remove(minimized, ec);
+            continue;
+        }
+        order.push_back(input);
+        if (!fs::exists(minimized, ec) && args.verbose) {
+            std::cerr << "not minimized: " << crashes[i].string() << "\n" << result.errors;
+        }
+    }
+    for (auto & input : order) {
+        auto & [crash, duplicates] = unique[input];
+        auto minimized = crash.string() + ".min";
+        std::cerr << "crash: " << crash.string() << " (" << fs::file_size(crash, ec) << " bytes)";
+        if (fs::exists(minimized, ec)) {
+            std::cerr << ", minimized to " << minimized << " (" << input.size() << " bytes)";
+        }
+        if (duplicates > 0) {
+            std::cerr << ", found " << duplicates + 1 << " times";
+        }
+        std::cerr << "\n";
+    }
+    if (known > 0) {
+        std::cerr << known << (known == 1 ? " crash" : " crashes") << " minimized to an input of an earlier session\n";
+    }
+    if (!crashes.empty()) {
+        std::cerr << "reproduce with: " << build.executable.string() << " CRASH_FILE" << std::endl;
+    }
+    return crashes.empty() ? 0 : 1;
+}
+
+// Run capture (--cpprun-capture=BUNDLE) and replay (--cpprun-replay BUNDLE): a capture builds and runs the program
+// as usual, and writes what it takes to repeat the run on another host into a tar archive: the sources and the local
+// headers they include, the build command, the compiler, the run arguments, a part of the environment, the standard
+// input, the declared input files, and the time and memory of the build and of the run. A replay restores the files
+// under CPPRUN_CACHE_DIR/replay/<bundle>/root, moves the absolute paths among the arguments there, rebuilds (a cache
+// hit from the second replay on), runs the program several times with the captured environment and input, and compares
+// the times with the captured ones. --cpprun-annotate and --cpprun-startup then profile the replayed program.
+
+using TarMembers = std::vector<std::pair<std::string, std::string>>;
+
+// Regular files in the ustar format, with names of less than 100 characters.
+std::string format_tar(const TarMembers & members) {
+    std::string out;
+    for (auto & [name, data] : members) {
+        if (name.size() >= 100) {
+            throw std::runtime_error("tar member name too long: " + name);
+        }
+        char header[512] = {};
+        std::memcpy(header, name.data(), name.size());
+        std::snprintf(header + 100, 8, "%07o", 0644u);
+        std::snprintf(header + 108, 8, "%07o", 0u);
+        std::snprintf(header + 116, 8, "%07o", 0u);
+        std::snprintf(header + 124, 12, "%011llo", static_cast<unsigned long long>(data.size()));
+        std::snprintf(header + 136, 12, "%011llo", static_cast<unsigned long long>(time(nullptr)));
+        header[156] = '0';
+        std::memcpy(header + 257, "ustar", 6);
+        std::memcpy(header + 263, "00", 2);
+        // the checksum is computed with its own field set to spaces
+        std::memset(header + 148, ' ', 8);
+        unsigned sum = 0;
+        for (unsigned char c : header) {
+            sum += c;
+        }
+        std::snprintf(header + 148, 7, "%06o", sum);
+        out.append(header, sizeof(header));
+        out += data;
+        out.append((512 - data.size() % 512) % 512, '\0');
+    }
+    out.append(1024, '\0');
+    return out;
+}
+
+// The regular files of a tar archive; other member types are skipped.
+TarMembers parse_tar(const std::string & data) {
+    TarMembers members;
+    auto octal = [](const char * field, size_t size) {
+        return std::strtoull(std::string(field, strnlen(field, size)).c_str(), nullptr, 8);
+    };
+    for (size_t pos = 0; pos + 512 <= data.size();) {
+        const char * header = data.data() + pos;
+        if (header[0] == '\0') {
+            break;
+        }
+        unsigned sum = 0;
+        for (size_t i = 0; i < 512; ++i) {
+            sum += i >= 148 && i < 156 ? ' ' : static_cast<unsigned char>(header[i]);
+        }
+        if (octal(header + 148, 8) != sum) {
+            throw std::runtime_error("not a tar archive (bad header checksum)");
+        }
+        size_t size = octal(header + 124, 12);
+        pos += 512;
+        if (size > data.size() - pos) {
+            throw std::runtime_error("truncated tar archive");
+        }
+        if (header[156] == '0' || header[156] == '\0') {
+            members.emplace_back(std::string(header, strnlen(header, 100)), data.substr(pos, size));
+        }
+        pos += (size + 511) / 512 * 512;
+    }
+    return members;
+}
+
+// Lists of strings that may contain any character but NUL, each terminated by a NUL like /proc/<pid>/environ.
+std::string format_nul_list(const std::vector<std::string> & items) {
+    std::string out;
+    for (auto & item : items) {
+        out += item;
+        out += '\0';
+    }
+    return out;
+}
+
+std::vector<std::string> parse_nul_list(const std::string & text) {
+    std::vector<std::string> items;
+    for (size_t pos = 0; pos < text.size();) {
+        auto end = text.find('\0', pos);
+        end = end == std::string::npos ? text.size() : end;
+        items.push_back(text.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return items;
+}
+
+// Bundles are meant to be shared, so the environment is captured selectively: cpprun's own variables, those of the
+// locale and of the runtime libraries, and the ones named with --cpprun-capture-env. Tokens and credentials stay out.
+bool captured_env_var(const CpprunArgs & args, const std::string & name) {
+    static const std::set<std::string> names = {"PATH", "HOME", "TMPDIR", "LANG", "LANGUAGE", "TZ", "LD_LIBRARY_PATH",
+                                                "LD_PRELOAD", "GLIBC_TUNABLES"};
+    static const std::vector<std::string> prefixes = {"CPPRUN_", "LC_",   "OMP_",  "GOMP_", "KMP_",  "TBB_",
+                                                      "MALLOC_", "ASAN_", "UBSAN_", "TSAN_", "LSAN_", "MSAN_"};
+    return names.count(name) || contains(args.capture_env, name) ||
+           std::any_of(prefixes.begin(), prefixes.end(),
+                       [&](const std::string & prefix) { return name.compare(0, prefix.size(), prefix) == 0; });
+}
+
+struct RunCapture {
+    std::string cxx;
+    fs::path cwd;
+    std::string compiler;          // compiler_fingerprint, only meaningful on the capturing host
+    std::string compiler_version;  // first line of --version
+    std::vector<std::string> build_args;  // complete, without -o
+    std::vector<std::string> run_args;
+    std::vector<std::string> env;       // NAME=VALUE
+    std::optional<std::string> input;   // nullopt when the standard input was a terminal
+    std::vector<std::pair<fs::path, std::string>> files;  // absolute path, contents
+    CmdStats compile;
+    CmdStats run;
+    int exit_code = 0;
+    std::string output_hash;  // of the standard output
+};
+
+static std::string format_stats(const CmdStats & s) {
+    std::ostringstream out;
+    out << std::setprecision(9) << s.wall_seconds << " " << s.user_seconds << " " << s.system_seconds << " "
+        << s.max_rss_kb;
+    return out.str();
+}
+
+// A "cpprun-bundle" member with "key value" lines, the lists in members of their own, and files/<n> for the n-th
+// entry of "paths".
+std::string format_bundle(const RunCapture & c) {
+    std::string info = "cpprun-bundle 1\ncxx " + c.cxx + "\ncwd " + c.cwd.string() + "\ncompiler " + c.compiler +
+                       "\ncompiler_version " + c.compiler_version + "\nexit_code " + std::to_string(c.exit_code) +
+                       "\noutput_hash " + c.output_hash + "\ncompile " + format_stats(c.compile) + "\nrun " +
+                       format_stats(c.run) + "\n";
+    TarMembers members = {{"cpprun-bundle", info},
+                          {"build_args", format_nul_list(c.build_args)},
+                          {"run_args", format_nul_list(c.run_args)},
+                          {"environ", format_nul_list(c.env)}};
+    if (c.input) {
+        members.emplace_back("stdin", *c.input);
+    }
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < c.files.size(); ++i) {
+        paths.push_back(c.files[i].first.string());
+        members.emplace_back("files/" + std::to_string(i), c.files[i].second);
+    }
+    members.emplace_back("paths", format_nul_list(paths));
+    return format_tar(members);
+}
+
+RunCapture parse_bundle(const std::string & data) {
+    std::map<std::string, std::string> members;
+    for (auto & [name, contents] : parse_tar(data)) {
+        members[name] = contents;
+    }
+    if (!members.count("cpprun-bundle")) {
+        throw std::runtime_error("not a cpprun bundle");
+    }
+    std::map<std::string, std::string> info;
+    std::istringstream iss(members["cpprun-bundle"]);
+    for (std::string line; std::getline(iss, line);) {
+        auto space = line.find(' ');
+        info[line.substr(0, space)] = space == std::string::npos ? "" : line.substr(space + 1);
+    }
+    if (info["cpprun-bundle"] != "1") {
+        throw std::runtime_error("unsupported cpprun bundle version " + info["cpprun-bundle"]);
+    }
+    auto stats = [](const std::string & text) {
+        CmdStats s;
+        std::istringstream(text) >> s.wall_seconds >> s.user_seconds >> s.system_seconds >> s.max_rss_kb;
+        return s;
+    };
+    RunCapture c;
+    c.cxx = info["cxx"];
+    c.cwd = info["cwd"];
+    c.compiler = info["compiler"];
+    c.compiler_version = info["compiler_version"];
+    c.exit_code = std::atoi(info["exit_code"].c_str());
+    c.output_hash = info["output_hash"];
+    c.compile = stats(info["compile"]);
+    c.run = stats(info["run"]);
+    c.build_args = parse_nul_list(members["build_args"]);
+    c.run_args = parse_nul_list(members["run_args"]);
+    c.env = parse_nul_list(members["environ"]);
+    if (members.count("stdin")) {
+        c.input = members["stdin"];
+    }
+    auto paths = parse_nul_list(members["paths"]);
+    for (size_t i = 0; i < paths.size(); ++i) {
+        c.files.emplace_back(paths[i], members["files/" + std::to_string(i)]);
+    }
+    return c;
+}
+
+// An argument that is an absolute path to one of the captured files, or to a directory containing some of them,
+// also as part of an include or library option, pointed to the same path under root.
+std::string relocate_arg(const std::string & arg, const std::vector<fs::path> & captured, const fs::path & root) {
+    for (std::string prefix : {"", "-I", "-iquote", "-isystem", "-idirafter", "-include", "-L"}) {
+        if (arg.size() <= prefix.size() || arg.compare(0, prefix.size(), prefix) != 0 || arg[prefix.size()] != '/') {
+            continue;
+        }
+        auto path = fs::path(arg.substr(prefix.size())).lexically_normal();
+        bool contains_capture = std::any_of(captured.begin(), captured.end(), [&](const fs::path & file) {
+            auto relative = file.lexically_relative(path);
+            return !relative.empty() && *relative.begin() != "..";
+        });
+        if (contains_capture) {
+            return prefix + (root / path.relative_path()).string();
+        }
+    }
+    return arg;
+}
+
+static std::string first_line(const std::string & text) {
+    return text.substr(0, text.find('\n'));
+}
+
+int run_capture(const CpprunArgs & args, const std::vector<std::string> & run_args, const fs::path & workdir,
+                InvocationMetrics & metrics) {
+    RunCapture capture;
+    capture.cxx = args.cxx;
+    capture.cwd = fs::current_path();
+    capture.compiler = compiler_fingerprint(args.cxx);
+    std::string version;
+    capture_cmd(args.cxx, {"--version"}, version, false);
+    capture.compiler_version = first_line(version);
+
+    auto artifact = workdir / "artifact.exe";
+    auto depfile = workdir / "artifact.d";
+    capture.build_args = collect_build_args(args, artifact);
+    capture.build_args.resize(capture.build_args.size() - 2);  // -o artifact
+    auto build_args = collect_build_args(args, artifact);
+    extend(build_args, {"-MD", "-MF", depfile.string()});
+    begin_phase("compile");
+    int rc = run_cmd(args.cxx, build_args, args.verbose, {}, &capture.compile);
+    end_phase(metrics, "compile", capture.compile);
+    if (rc != 0) {
+        return rc;
+    }
+    record_build(args, capture.compile);
+    if (auto entry = artifact_cache_entry(args)) {
+        try {
+            store_cache_entry(*entry, args, artifact, depfile);
+        } catch (const std::exception & e) {
+            std::cerr << "WARNING: unable to cache the build: " << e.what() << std::endl;
+        }
+    }
+
+    // the sources, the headers outside of the compiler's system directories, and the declared inputs
+    std::vector<fs::path> paths;
+    for (auto & source : source_files(args.build_args)) {
+        paths.push_back(fs::absolute(source).lexically_normal());
+    }
+    auto system_dirs = system_include_dirs(args);
+    for (auto & dep : parse_depfile(read_file(depfile))) {
+        auto path = fs::absolute(dep).lexically_normal();
+        bool system = std::any_of(system_dirs.begin(), system_dirs.end(), [&](const fs::path & dir) {
+            auto relative = path.lexically_relative(dir.lexically_normal());
+            return !relative.empty() && *relative.begin() != "..";
+        });
+        if (!system) {
+            paths.push_back(path);
+        }
+    }
+    for (auto & file : args.capture_files) {
+        paths.push_back(fs::absolute(file).lexically_normal());
+    }
+    std::set<fs::path> seen;
+    for (auto & path : paths) {
+        if (seen.insert(path).second) {
+            capture.files.emplace_back(path, read_file(path));
+        }
+    }
+
+    if (!isatty(STDIN_FILENO)) {
+        capture.input = read_fd(STDIN_FILENO);
+    }
+    RunOptions options;
+    options.input = capture.input.value_or("");
+    options.echo = true;
+    options.env = parallel_runtime_env(args);
+    size_t env_size = options.env.size();
+    for (char ** e = environ; *e != nullptr; ++e) {
+        std::string entry = *e;
+        auto name = entry.substr(0, entry.find('='));
+        if (std::none_of(options.env.begin(), options.env.end(), [&](auto & kv) { return kv.first == name; })) {
+            ++env_size;
+            if (captured_env_var(args, name)) {
+                capture.env.push_back(entry);
+            }
+        }
+    }
+    for (auto & [name, value] : options.env) {
+        capture.env.push_back(name + "=" + value);
+    }
+    if (args.verbose) {
+        std::cout << ">>> " << artifact.string() << " " << join_shell(run_args) << std::endl;
+    }
+    begin_phase("run");
+    auto result = spawn_process(artifact.string(), run_args, options);
+    end_phase(metrics, "run", result.stats);
+    capture.run_args = run_args;
+    capture.run = result.stats;
+    capture.exit_code = result.exit_code;
+    capture.output_hash = hex64(fnv1a64(result.output));
+
+    auto bundle = fs::absolute(*args.capture_bundle);
+    try {
+        write_file_atomic(bundle, format_bundle(capture));
+    } catch (const std::exception & e) {
+        std::cerr << "ERROR: unable to write the bundle: " << e.what() << std::endl;
+        return 1;
+    }
+    size_t bytes = 0;
+    for (auto & file : capture.files) {
+        bytes += file.second.size();
+    }
+    std::cerr << "captured to " << bundle.string() << ": " << capture.files.size()
+              << (capture.files.size() == 1 ? " file (" : " files (") << bytes << " bytes), "
+              << (capture.input ? capture.input->size() : 0) << " bytes of input, " << capture.env.size() << " of "
+              << env_size << " environment variables, exit code " << capture.exit_code << " after " << std::fixed
+              << std::setprecision(3) << capture.run.wall_seconds
+              << " s" << std::defaultfloat << std::endl;
+    return result.exit_code;
+}
+
+void print_replay_report(std::ostream & out, const RunCapture & capture, const Build & build,
+                         const std::vector<CmdStats> & runs) {
+    auto row = [&](const std::string & name, double captured, std::vector<double> values) {
+        std::sort(values.begin(), values.end());
+        double med = median(values);
+        out << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(10) << captured << std::setw(10) << med << std::setw(10) << values.front();
+        if (captured > 0) {
+            out << std::showpos << std::setprecision(1) << std::setw(9) << (med - captured) / captured * 100 << "%"
+                << std::noshowpos;
+        }
+        out << "\n" << std::defaultfloat;
+    };
+    out << std::left << std::setw(12) << "" << std::right << std::setw(10) << "captured" << std::setw(10)
+        << "median" << std::setw(10) << "min" << std::setw(10) << "change" << "\n";
+    if (build.cache_hit) {
+        out << std::left << std::setw(12) << "compile s" << std::right << std::fixed << std::setprecision(3)
+            << std::setw(10) << capture.compile.wall_seconds << std::defaultfloat << "  (cache hit)\n";
+    } else {
+        row("compile s", capture.compile.wall_seconds, {build.compile.wall_seconds});
+    }
+    auto column = [&](auto member) {
+        std::vector<double> values;
+        for (auto & r : runs) {
+            values.push_back(double(r.*member));
+        }
+        return values;
+    };
+    row("wall s", capture.run.wall_seconds, column(&CmdStats::wall_seconds));
+    row("user s", capture.run.user_seconds, column(&CmdStats::user_seconds));
+    row("system s", capture.run.system_seconds, column(&CmdStats::system_seconds));
+    auto rss = column(&CmdStats::max_rss_kb);
+    for (auto & kb : rss) {
+        kb /= 1024;
+    }
+    row("max RSS MB", double(capture.run.max_rss_kb) / 1024, rss);
+}
+
+int replay_capture(const CpprunArgs & args, const fs::path & workdir, InvocationMetrics & metrics) {
+    std::string data;
+    RunCapture capture;
+    try {
+        data = read_file(*args.replay_bundle);
+        capture = parse_bundle(data);
+    } catch (const std::exception & e) {
+        std::cerr << "ERROR: " << args.replay_bundle->string() << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::string version;
+    capture_cmd(capture.cxx, {"--version"}, version, false);
+    if (first_line(version) != capture.compiler_version) {
+        std::cerr << "WARNING: the compiler differs, captured with \"" << capture.compiler_version << "\", "
+                  << capture.cxx << " here is \"" << first_line(version) << "\"" << std::endl;
+    }
+
+    // restored once per bundle, later replays leave the files (and their mtimes) alone for the artifact cache
+    auto cache = cache_dir();
+    auto root = (cache ? *cache / "replay" / hex64(fnv1a64(data)) : workdir) / "root";
+    std::vector<fs::path> captured;
+    for (auto & [path, contents] : capture.files) {
+        auto target = root / path.relative_path();
+        std::error_code ec;
+        if (!fs::exists(target, ec) || read_file(target) != contents) {
+            write_file_atomic(target, contents);
+        }
+        captured.push_back(path);
+    }
+    auto cwd = root / capture.cwd.relative_path();
+    fs::create_directories(cwd);
+    if (chdir(cwd.c_str()) != 0) {
+        perror("chdir");
+        return 1;
+    }
+
+    auto replay = args;
+    replay.cxx = unwrap_or_else(resolve_program(capture.cxx), [&] { return fs::path(capture.cxx); }).string();
+    replay.cxx_standard = std::nullopt;
+    replay.runtime_flags.clear();
+    replay.build_args.clear();
+    for (auto & a : capture.build_args) {
+        replay.build_args.push_back(relocate_arg(a, captured, root));
+    }
+    std::vector<std::string> run_args;
+    for (auto & a : capture.run_args) {
+        run_args.push_back(relocate_arg(a, captured, root));
+    }
+    if (args.verbose) {
+        std::cout << ">>> " << replay.cxx << " " << join_shell(collect_build_args(replay, "-")) << std::endl;
+    }
+    begin_phase("compile");
+    auto build = build_with(replay, true);
+    end_phase(metrics, "compile", build.compile);
+    metrics.cache = build.cache_hit ? "hit" : "miss";
+    std::cerr << build.diagnostics;
+    if (!build.ok()) {
+        return build.exit_code != 0 ? build.exit_code : 1;
+    }
+
+    // from here on, the environment is the captured one
+    clearenv();
+    for (auto & entry : capture.env) {
+        auto eq = entry.find('=');
+        if (eq != std::string::npos && eq > 0) {
+            setenv(entry.substr(0, eq).c_str(), entry.c_str() + eq + 1, 1);
+        }
+    }
+    RunOptions options;
+    options.input = capture.input.value_or("");
+    std::vector<CmdStats> runs;
+    std::vector<int> exit_codes;
+    size_t different_output = 0;
+    CmdStats run_stats;
+    begin_phase("run");
+    for (size_t i = 0; i < args.replay_runs; ++i) {
+        if (args.verbose) {
+            std::cout << ">>> " << build.executable.string() << " " << join_shell(run_args) << std::endl;
+        }
+        auto result = spawn_process(build.executable.string(), run_args, options);
+        if (i == 0 && args.verbose) {
+            std::cout << result.output;
+            std::cerr << result.errors;
+        }
+        runs.push_back(result.stats);
+        exit_codes.push_back(result.exit_code);
+        different_output += hex64(fnv1a64(result.output)) != capture.output_hash ? 1 : 0;
+        run_stats.wall_seconds += result.stats.wall_seconds;
+        run_stats.user_seconds += result.stats.user_seconds;
+        run_stats.system_seconds += result.stats.system_seconds;
+        run_stats.max_rss_kb = std::max(run_stats.max_rss_kb, result.stats.max_rss_kb);
+    }
+    end_phase(metrics, "run", run_stats);
+
+    std::cerr << "replay of " << args.replay_bundle->string() << ", " << runs.size()
+              << (runs.size() == 1 ? " run" : " runs") << " in " << cwd.string() << "\n";
+    print_replay_report(std::cerr, capture, build, runs);
+    auto mismatched = std::count_if(exit_codes.begin(), exit_codes.end(), [&](int rc) {
+        return rc != capture.exit_code;
+    });
+    if (mismatched > 0) {
+        std::cerr << "exit code differs from the captured " << capture.exit_code << " in " << mismatched << " of "
+                  << runs.size() << " runs\n";
+    }
+    if (different_output > 0) {
+        std::cerr << "standard output differs from the captured one in " << different_output << " of "
+                  << runs.size() << " runs\n";
+    }
+    if (mismatched == 0 && different_output == 0) {
+        std::cerr << "exit code and standard output as captured\n";
+    }
+
+    int rc = exit_codes.front();
+    if (args.startup_runs || args.annotate_hz) {
+        // the profiled run reads the captured input too
+        auto input = workdir / "stdin";
+        std::ofstream(input, std::ios::binary) << capture.input.value_or("");
+        int fd = open(input.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || dup2(fd, STDIN_FILENO) < 0) {
+            perror("dup2");
+            return 1;
+        }
+        close(fd);
+        rc = args.startup_runs ? profile_startup(replay, build.executable, workdir, *args.startup_runs)
+                               : annotate_run(replay, build.executable, run_args, workdir);
+    }
+    return rc;
+}
+
+// JIT backend (--cpprun-jit): when cpprun is built with the LLVM libraries (CPPRUN_JIT, see CMakeLists.txt), a plain
+// run of a single source file is compiled to a position independent object file by the configured compiler, linked
+// in memory with ORC and its main called in a forked copy of cpprun, without a linker run and without an exec. The
+// object is cached in an artifact entry of its own. Anything the JIT can not take runs through the regular path
+// instead.
+
+// Why the invocation can not be run by the JIT, if it can not.
+std::optional<std::string> jit_unsupported(const CpprunArgs & args) {
+    if (args.build_only || args.output_path || args.static_link) {
+        return "-c, -o and --cpprun-static need an object or executable file";
+    }
+    if (args.size_report || args.startup_runs || args.annotate_hz || args.memoize) {
+        return "only plain runs are supported";
+    }
+    if (args.tee_file) {
+        return "--cpprun-tee needs the output of a separate process";
+    }
+    if (uses_openmp(args)) {
+        return "OpenMP needs its runtime library";
+    }
+    if (source_files(args.build_args).size() != 1) {
+        return "only a single source file is supported";
+    }
+    for (auto & a : args.build_args) {
+        if (is_link_only_arg(a)) {
+            return "linker argument " + a;
+        }
+    }
+    for (auto & a : args.runtime_flags) {
+        if (is_link_only_arg(a)) {
+            return "linker argument " + a;
+        }
+    }
+    return std::nullopt;
+}
+
+static std::nullopt_t jit_fallback(const CpprunArgs & args, const std::string & reason) {
+    if (args.verbose) {
+        std::cerr << ">>> --cpprun-jit: " << reason << ", building an executable instead" << std::endl;
+    }
+    return std::nullopt;
+}
+
+#if defined(CPPRUN_JIT)
+
+// The object is linked with RuntimeDyld, which does not run static constructors; the .init_array sections are
+// recorded as they are loaded and called before main. The atexit handlers (static destructors) the constructors
+// register go to the libc of cpprun and run at the exit of the forked copy, under this __dso_handle.
+static char jit_dso_handle;
+
+struct JitInitArray {
+    std::string section;  // .init_array or .init_array.<priority>
+    uint64_t address = 0;
+    uint64_t size = 0;
+};
+
+static llvm::Expected<std::unique_ptr<llvm::orc::LLJIT>> create_jit(std::vector<JitInitArray> & init_arrays) {
+    auto jit = llvm::orc::LLJITBuilder()
+                   .setPlatformSetUp(llvm::orc::setUpInactivePlatform)
+                   .setObjectLinkingLayerCreator([&](llvm::orc::ExecutionSession & session, const llvm::Triple &) {
+                       auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+                           session, [] { return std::make_unique<llvm::SectionMemoryManager>(); });
+                       layer->setNotifyLoaded([&](llvm::orc::MaterializationResponsibility &,
+                                                  const llvm::object::ObjectFile & object,
+                                                  const llvm::RuntimeDyld::LoadedObjectInfo & info) {
+                           for (auto & section : object.sections()) {
+                               auto name = section.getName();
+                               if (name && name->startswith(".init_array")) {
+                                   init_arrays.push_back(
+                                       {name->str(), info.getSectionLoadAddress(section), section.getSize()});
+                               }
+                           }
+                       });
+                       return llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>>(std::move(layer));
+                   })
+                   .create();
+    if (!jit) {
+        return jit.takeError();
+    }
+    // unresolved symbols are looked up in cpprun itself and the libraries it is linked with (libstdc++, libc)
+    auto & dylib = (*jit)->getMainJITDylib();
+    auto process_symbols =
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess((*jit)->getDataLayout().getGlobalPrefix());
+    if (!process_symbols) {
+        return process_symbols.takeError();
+    }
+    dylib.addGenerator(std::move(*process_symbols));
+    llvm::orc::MangleAndInterner mangle((*jit)->getExecutionSession(), (*jit)->getDataLayout());
+    auto dso_handle = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&jit_dso_handle),
+                                               llvm::JITSymbolFlags::Exported);
+    if (auto error = dylib.define(llvm::orc::absoluteSymbols({{mangle("__dso_handle"), dso_handle}}))) {
+        return error;
+    }
+    return jit;
+}
+
+// Runs the program in a forked copy of cpprun, so that its exit() or a crash ends that copy and cpprun still
+// cleans up and exports its metrics; nullopt if it has to be built and run the regular way.
+std::optional<int> run_jit(const CpprunArgs & args, const std::vector<std::string> & run_args,
+                           const fs::path & workdir, InvocationMetrics & metrics) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    auto jit_args = args;
+    jit_args.build_args.push_back("-fPIC");
+    auto source = source_files(args.build_args).front();
+
+    timespec lookup_start;
+    clock_gettime(CLOCK_MONOTONIC, &lookup_start);
+    begin_phase("cache_lookup");
+    auto cache_entry = artifact_cache_entry(jit_args);
+    if (cache_entry) {
+        // an entry of its own: the manifest of an executable built with the same command says nothing about the object
+        *cache_entry += ".jit";
+    }
+    bool cache_hit = cache_entry && cache_entry_is_valid(*cache_entry, "artifact.o");
+    if (cache_entry) {
+        metrics.cache = cache_hit ? "hit" : "miss";
+    }
+    end_phase(metrics, "cache_lookup", CmdStats{seconds_since(lookup_start), 0, 0, 0});
+    events().emit("cache", ",\"result\":" + json_string(metrics.cache) + ",\"entry\":" +
+                               json_string(cache_entry ? cache_entry->string() : ""));
+
+    auto object = workdir / "artifact.o";
+    if (cache_hit) {
+        object = *cache_entry / "artifact.o";
+        if (args.verbose) {
+            std::cerr << ">>> Using cached build: " << object << std::endl;
+        }
+    } else {
+        auto compile_args = jit_args;
+        compile_args.build_only = true;
+        auto build_args = collect_build_args(compile_args, object);
+        auto depfile = workdir / "artifact.d";
+        if (cache_entry) {
+            extend(build_args, {"-MD", "-MF", depfile.string()});
+        }
+        CmdStats stats;
+        begin_phase("compile");
+        int rc = run_cmd(args.cxx, build_args, args.verbose, {}, &stats);
+        end_phase(metrics, "compile", stats);
+        if (rc != 0) {
+            return rc;
+        }
+        if (cache_entry) {
+            try {
+                store_cache_entry(*cache_entry, jit_args, object, depfile, "artifact.o");
+            } catch (const std::exception & e) {
+                std::cerr << "WARNING: unable to cache the build: " << e.what() << std::endl;
+            }
+        }
+    }
+
+    std::vector<JitInitArray> init_arrays;
+    auto jit = create_jit(init_arrays);
+    if (!jit) {
+        return jit_fallback(args, llvm::toString(jit.takeError()));
+    }
+    auto buffer = llvm::MemoryBuffer::getFile(object.string());
+    if (!buffer) {
+        return jit_fallback(args, "unable to read " + object.string() + ": " + buffer.getError().message());
+    }
+    if (auto error = (*jit)->addObjectFile(std::move(*buffer))) {
+        return jit_fallback(args, llvm::toString(std::move(error)));
+    }
+    // links the whole object, so that a missing symbol is found before any code of the program runs
+    auto main_symbol = (*jit)->lookup("main");
+    if (!main_symbol) {
+        return jit_fallback(args, llvm::toString(main_symbol.takeError()));
+    }
+#if LLVM_VERSION_MAJOR >= 15
+    auto main_fn = main_symbol->toPtr<int (*)(int, char **)>();
+#else
+    auto main_fn = llvm::jitTargetAddressToFunction<int (*)(int, char **)>(main_symbol->getAddress());
+#endif
+    // the prioritized sections first, in increasing priority, then the plain .init_array
+    std::sort(init_arrays.begin(), init_arrays.end(), [](auto & a, auto & b) {
+        return std::make_tuple(a.section == ".init_array", a.section) <
+               std::make_tuple(b.section == ".init_array", b.section);
+    });
+
+    std::vector<std::string> program_args{source.string()};
+    extend(program_args, run_args);
+    std::vector<char *> argv;
+    for (auto & a : program_args) {
+        argv.push_back(a.data());
+    }
+    argv.push_back(nullptr);
+
+    timespec run_start;
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    begin_phase("run");
+    std::cout.flush();
+    std::fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 127;
+    }
+    if (pid == 0) {
+        for (auto & init : init_arrays) {
+            auto functions = reinterpret_cast<void (**)()>(init.address);
+            for (size_t i = 0; i < init.size / sizeof(void (*)()); ++i) {
+                functions[i]();
+            }
+        }
+        std::exit(main_fn(int(program_args.size()), argv.data()));
+    }
+    int status = 0;
+    rusage usage{};
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return 127;
+        }
+    }
+    end_phase(metrics, "run",
+              CmdStats{seconds_since(run_start), to_seconds(usage.ru_utime), to_seconds(usage.ru_stime),
+                       usage.ru_maxrss});
+    return exit_code(status);
+}
+
+#else
+
+std::optional<int> run_jit(const CpprunArgs & args, const std::vector<std::string> &, const fs::path &,
+                           InvocationMetrics &) {
+    return jit_fallback(args, "cpprun was built without the LLVM libraries");
+}
+
+#endif
+
+int run_invocation(const CpprunArgs & args, const std::vector<std::string> & cpprun_args,
+                   const std::vector<std::string> & run_args, InvocationMetrics & metrics) {
+    if (args.show_compiler_info or contains(cpprun_args, "--version") or contains(cpprun_args, "-v")) {
+        run_cmd(args.cxx, {"--version"}, true);
+        return 0;
+    }
+
+    if (auto conflict = conflicting_modes(args)) {
+        std::cerr << "ERROR: " << conflict->first << " can not be combined with " << conflict->second << std::endl;
+        return 1;
+    }
+
+    std::mt19937 rng(std::random_device{}());
+
+    if (args.doctor) {
+        auto workdir = make_temp_dir(rng);
+        int rc = run_doctor(args, workdir);
+        fs::remove_all(workdir);
+        return rc;
+    }
+
+    if (args.build_trends) {
+        return report_build_trends(std::cout);
+    }
+
+    if (args.prewarm) {
+        return run_prewarm(args);
+    }
+
+    if (args.pipeline) {
+        auto workdir = make_temp_dir(rng);
+        int rc = run_pipeline(args, cpprun_args, run_args, workdir, metrics);
+        fs::remove_all(workdir);
+        return rc;
+    }
+
+    if (!args.sanitizers.empty()) {
+        return run_sanitizers(args, run_args, metrics);
+    }
+
+    if (!args.asm_diff.empty() && args.asm_diff.size() != 2) {
+        std::cerr << "ERROR: --cpprun-asm-diff compares two variants, give it twice, e.g. --cpprun-asm-diff=-O2 "
+                     "--cpprun-asm-diff=-O3"
+                  << std::endl;
+        return 1;
+    }
+
+    if (!args.asm_diff.empty()) {
+        auto workdir = make_temp_dir(rng);
+        int rc = run_asm_diff(args, run_args, workdir, metrics);
+        fs::remove_all(workdir);
+        return rc;
+    }
+
+    if (args.fuzz_seconds) {
+        return run_fuzz(args, run_args, metrics);
+    }
+
+    if (args.replay_bundle && (!source_files(args.build_args).empty() || !run_args.empty())) {
+        std::cerr << "ERROR: --cpprun-replay takes the sources, arguments and build options from the bundle"
+                  << std::endl;
+        return 1;
+    }
+
+    if (args.replay_bundle) {
+        auto workdir = make_temp_dir(rng);
+        int rc = replay_capture(args, workdir, metrics);
+        fs::remove_all(workdir);
+        return rc;
+    }
+
+    if (args.capture_bundle) {
+        auto workdir = make_temp_dir(rng);
+        int rc = run_capture(args, run_args, workdir, metrics);
+        fs::remove_all(workdir);
+        return rc;
+    }
+
+    if (args.header_report) {
+        auto workdir = make_temp_dir(rng);
+        int rc = report_header_costs(args, workdir, *args.header_report);
+        fs::remove_all(workdir);
+        return rc;
+    }
+
+    auto make_path = [&args, &rng]() -> fs::path {
+        auto tmpdir = fs::temp_directory_path();
+        auto rundir = format_run_dir(random_value(rng), getpid());
+        return tmpdir / rundir / (args.build_only ? "artifact.o" : "artifact.exe");
+    };
+
+    fs::path output_path = fs::absolute(unwrap_or_else(args.output_path, make_path));
+
+    fs::create_directories(output_path.parent_path());
+
+    auto cleanup = [&]() {
+        try {
+            if (!args.output_path) {
+                if (args.verbose) {
+                    std::cerr << ">>> Cleaning up temporary directory: " << output_path.parent_path() << std::endl;
+                }
+                // only cleanup if we created the output file in a temporary directory
+                fs::remove_all(output_path.parent_path());
+            }
+        } catch (...) {
+        }
+    };
+
+    if (args.static_link) {
+        if (auto problem = check_static_runtime(args)) {
+            std::cerr << "ERROR: unable to link statically: " << *problem << std::endl;
+            cleanup();
+            return 1;
+        }
+    }
+
+    if (args.build_profile) {
+        auto workdir = make_temp_dir(rng);
+        int rc = profile_build(args, output_path, workdir);
+        fs::remove_all(workdir);
+        cleanup();
+        return rc;
+    }
+
+    if (args.stack_usage) {
+        auto workdir = make_temp_dir(rng);
+        int rc = report_stack_usage(args, output_path, workdir);
+        fs::remove_all(workdir);
+        cleanup();
+        return rc;
+    }
+
+    if (args.jit) {
+        if (auto reason = jit_unsupported(args)) {
+            jit_fallback(args, *reason);
+        } else {
+            auto workdir = make_temp_dir(rng);
+            auto rc = run_jit(args, run_args, workdir, metrics);
+            fs::remove_all(workdir);
+            if (rc) {
+                cleanup();
+                return *rc;
+            }
+        }
+    }
+
+    timespec lookup_start;
+    clock_gettime(CLOCK_MONOTONIC, &lookup_start);
+    begin_phase("cache_lookup");
+    auto cache_entry = artifact_cache_entry(args);
+    bool cache_hit = cache_entry && cache_entry_is_valid(*cache_entry);
+    if (cache_entry) {
+        metrics.cache = cache_hit ? "hit" : "miss";
+    }
+    end_phase(metrics, "cache_lookup", CmdStats{seconds_since(lookup_start), 0, 0, 0});
+    events().emit("cache", ",\"result\":" + json_string(metrics.cache) + ",\"entry\":" +
+                               json_string(cache_entry ? cache_entry->string() : ""));
+    fs::path artifact = output_path;
+    int rc = 0;
+
+    if (cache_hit) {
+        artifact = *cache_entry / "artifact.exe";
+        if (args.verbose) {
+            std::cerr << ">>> Using cached build: " << artifact << std::endl;
+        }
+    } else {
+        auto build_args = collect_build_args(args, output_path);
+        auto depfile = output_path.parent_path() / "artifact.d";
+        if (cache_entry) {
+            extend(build_args, {"-MD", "-MF", depfile.string()});
+        }
+
+        CmdStats stats;
+        begin_phase("compile");
+        auto object_dir = fs::temp_directory_path() / format_run_dir(random_value(rng), getpid());
+        if (auto tasks = plan_parallel_build(args, output_path, object_dir, cache_entry.has_value())) {
+            fs::create_directories(object_dir);
+            auto parallel = run_parallel_build(args, *tasks, cache_entry ? std::make_optional(depfile) : std::nullopt,
+                                               &std::cerr);
+            fs::remove_all(object_dir);
+            rc = parallel.exit_code;
+            stats = parallel.stats;
+        } else {
+            rc = run_cmd(args.cxx, build_args, args.verbose, {}, &stats);
+        }
+        end_phase(metrics, "compile", stats);
+        if (rc == 0) {
+            record_build(args, stats);
+        }
+
+        if (rc == 0 && cache_entry && fs::exists(output_path)) {
+            try {
+                store_cache_entry(*cache_entry, args, output_path, depfile);
+            } catch (const std::exception & e) {
+                std::cerr << "WARNING: unable to cache the build: " << e.what() << std::endl;
+            }
+        }
+    }
+
+    if (rc != 0 || (args.build_only && !args.size_report)) {
+        cleanup();
+        return rc;
+    }
+
+    if (not fs::exists(artifact)) {
+        std::cerr << "ERROR: expected output file at " << artifact << " was not created, unable to continue!"
+                  << std::endl;
+        cleanup();
+        return 127;
+    }
+
+    if (args.size_report) {
+        rc = report_binary_size(artifact, source_files(args.build_args), *args.size_report);
+        cleanup();
+        return rc;
+    }
+
+    if (args.startup_runs) {
+        auto workdir = make_temp_dir(rng);
+        rc = profile_startup(args, artifact, workdir, *args.startup_runs);
+        fs::remove_all(workdir);
+        cleanup();
+        return rc;
+    }
+
+    if (args.annotate_hz) {
+        auto workdir = make_temp_dir(rng);
+        rc = annotate_run(args, artifact, run_args, workdir);
+        fs::remove_all(workdir);
+        cleanup();
+        return rc;
+    }
+
+    if (args.memoize) {
+        auto workdir = make_temp_dir(rng);
+        rc = memoized_run(args, artifact, run_args, workdir, metrics);
+        fs::remove_all(workdir);
+        cleanup();
+        return rc;
+    }
+
+    std::optional<TeeOutput> tee;
+    if (args.tee_file) {
+        int fd = open(args.tee_file->c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            std::cerr << "ERROR: unable to open " << *args.tee_file << ": " << std::strerror(errno) << std::endl;
+            cleanup();
+            return 1;
+        }
+        tee = TeeOutput{fd, *args.tee_file};
+    }
+
+    CmdStats stats;
+    begin_phase("run");
+    rc = run_cmd(artifact.string(), run_args, args.verbose, parallel_runtime_env(args), &stats, tee ? &*tee : nullptr);
+    end_phase(metrics, "run", stats);
+    if (tee) {
+        close(tee->fd);
+        if (args.verbose) {
+            std::cerr << ">>> " << tee->written << " bytes of output saved to " << tee->path << std::endl;
+        }
+    }
+
+    cleanup();
 
     return rc;
 }
+
+int inner_main(int argc, const char ** argv_raw) {
+    InvocationMetrics metrics;
+    clock_gettime(CLOCK_MONOTONIC, &metrics.start);
+
+    std::vector<std::string> argv(argv_raw + 1, argv_raw + argc);
+    // in a pipeline, the stages take the place of the run arguments
+    auto [cpprun_args, run_args] = split_pipeline_args(argv).value_or(split_args(argv));
+
+    CpprunArgs args = parse_cpprun_args(cpprun_args);
+    if (!args.pipeline) {
+        args.runtime_flags = parallel_runtime_flags(args, detect_parallel_runtime(args));
+    }
+
+    metrics.mode = invocation_mode(args, cpprun_args);
+    metrics.sources = source_files(args.build_args);
+
+    if (args.events_fd) {
+        // the events are for the wrapper, not for the compiler or the program
+        if (fcntl(*args.events_fd, F_SETFD, FD_CLOEXEC) != 0) {
+            throw std::runtime_error("--cpprun-events-fd: file descriptor " + std::to_string(*args.events_fd) +
+                                     " is not open");
+        }
+        events().open(*args.events_fd);
+    }
+    events().emit("start", ",\"pid\":" + std::to_string(getpid()) + ",\"argv\":" +
+                               json_array(std::vector<std::string>(argv_raw, argv_raw + argc)) +
+                               ",\"mode\":" + json_string(metrics.mode));
+
+    // an invocation that ends in an error is recorded as a failure before the error is passed on
+    std::exception_ptr error;
+    try {
+        metrics.exit_code = run_invocation(args, cpprun_args, run_args, metrics);
+    } catch (const std::exception & e) {
+        metrics.exit_code = 1;
+        metrics.error = e.what();
+        error = std::current_exception();
+    }
+    events().emit("exit", ",\"exit_code\":" + std::to_string(metrics.exit_code));
+    export_metrics(metrics);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return metrics.exit_code;
+}
+
+}  // namespace
+
+// Library API, see libcpprun.hpp. The building blocks are those of the command, but nothing here reads the
+// CPPRUN_* build settings, prints, or emits events.
+
+Build build(const BuildSpec & spec) {
+    if (spec.sources.empty()) {
+        throw std::runtime_error("cpprun::build: no source files");
+    }
+    CpprunArgs args;
+    args.cxx = spec.cxx;
+    args.cxx_standard = spec.standard;
+    args.build_args = spec.flags;
+    for (auto & s : spec.sources) {
+        args.build_args.push_back(s.string());
+    }
+    return build_with(args, spec.use_cache);
+}
+
+RunResult run(const Build & build, const std::vector<std::string> & args, const RunOptions & options) {
+    if (!build.ok()) {
+        throw std::runtime_error("cpprun::run: the build failed, there is nothing to run");
+    }
+    return spawn_process(build.executable.string(), args, options);
+}
+
+int command_main(int argc, const char ** argv) {
+    exec_if_cached(argc, argv);
+    return inner_main(argc, argv);
+}
 }  // namespace cpprun
 
-#if !defined(CPPRUN_TESTS)
-int main(int argc, const char ** argv_raw) {
-    return cpprun::inner_main(argc, argv_raw);
+#if !defined(CPPRUN_TESTS) && !defined(CPPRUN_LIBRARY)
+int main(int argc, const char ** argv) {
+    return cpprun::command_main(argc, argv);
 }
 #endif
\ No newline at end of file
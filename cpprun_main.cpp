@@ -0,0 +1,8 @@
+// cpprun_main.cpp - the main of the cpprun executable of the CMake build, which links the command from cpprun_lib
+// instead of compiling cpprun.cpp a second time.
+
+#include "libcpprun.hpp"
+
+int main(int argc, const char ** argv) {
+    return cpprun::command_main(argc, argv);
+}
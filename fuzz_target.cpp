@@ -0,0 +1,22 @@
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+// Parses "key=value" lines, for --cpprun-fuzz.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+    std::map<std::string, std::string> entries;
+    std::string line;
+    for (size_t i = 0; i <= size; ++i) {
+        if (i < size && data[i] != '\n') {
+            line += char(data[i]);
+            continue;
+        }
+        auto eq = line.find('=');
+        if (eq != std::string::npos && eq > 0) {
+            entries[line.substr(0, eq)] = line.substr(eq + 1);
+        }
+        line.clear();
+    }
+    return 0;
+}
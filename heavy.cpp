@@ -0,0 +1,39 @@
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <string>
+#include <tuple>
+#include <variant>
+#include <vector>
+
+template <int N>
+struct Tag {};
+
+template <int N>
+using Value = std::variant<int, double, std::string, std::vector<Tag<N>>>;
+
+template <int N>
+size_t fill() {
+    std::map<std::string, std::tuple<Value<N>, std::vector<int>>> m;
+    for (int i = 0; i < N; ++i) {
+        m.emplace(std::to_string(i), std::tuple{Value<N>{i}, std::vector<int>(size_t(i), N)});
+    }
+    size_t total = 0;
+    for (auto & [key, entry] : m) {
+        auto & values = std::get<1>(entry);
+        total += key.size() + std::accumulate(values.begin(), values.end(), size_t(0));
+    }
+    if constexpr (N > 0) {
+        return total + fill<N - 1>();
+    } else {
+        return total;
+    }
+}
+
+int main(int argc, const char ** argv) {
+    std::cout << "heavy: " << fill<4>() << std::endl;
+    for (int i = 1; i < argc; ++i) {
+        std::cout << "argv[" << i << "]: " << argv[i] << std::endl;
+    }
+}
@@ -0,0 +1,122 @@
+// libcpprun.hpp - build and run C++ programs from within another program, without spawning cpprun for each one.
+
+/*
+usage:
+    #include "libcpprun.hpp"
+
+    cpprun::BuildSpec spec;
+    spec.sources = {"hello.cpp"};
+    spec.flags.push_back("-O2");
+    auto build = cpprun::build(spec);
+    if (!build.ok()) {
+        std::cerr << build.diagnostics;
+    }
+    auto result = cpprun::run(build, {"foo", "bar"});
+    std::cout << result.output;
+
+link with the cpprun_lib CMake target, or compile cpprun.cpp with -DCPPRUN_LIBRARY (leaves out main) into the host.
+the functions declared here are all that the library exports, everything else in cpprun.cpp has internal linkage.
+
+build and run may be called from any number of threads at the same time; build_async and run_async run them on a
+thread of their own. Builds share the artifact cache of the cpprun command (CPPRUN_CACHE_DIR, see cpprun.cpp), so
+a program that cpprun has already built is not compiled again, and the other way around. Like for the command, the
+cache key includes the current working directory of the process.
+*/
+
+#pragma once
+
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cpprun {
+
+const std::vector<std::string> DEFAULT_CXXFLAGS = {
+    "-Wall",
+    "-Wextra",
+    "-pedantic",
+    "-g",
+};
+
+const std::string DEFAULT_CXX_STANDARD = "-std=c++23";
+
+using EnvOverrides = std::vector<std::pair<std::string, std::string>>;
+
+// Time and memory used by a child process, as reported by wait4.
+struct CmdStats {
+    double wall_seconds = 0;
+    double user_seconds = 0;
+    double system_seconds = 0;
+    long max_rss_kb = 0;
+};
+
+// What to build. The defaults are those of the cpprun command without CPPRUN_CXXFLAGS, CPPRUN_CXX_STANDARD and
+// CPPRUN_CXX; unlike the command, the build does not look at these variables.
+struct BuildSpec {
+    std::vector<std::filesystem::path> sources;
+    std::vector<std::string> flags = DEFAULT_CXXFLAGS;  // compiler and linker flags besides the standard
+    std::optional<std::string> standard = DEFAULT_CXX_STANDARD;
+    std::string cxx = "c++";
+    bool use_cache = true;
+};
+
+// The result of a build. Copies share the executable; one built outside the cache (use_cache = false, or no cache
+// directory) is deleted together with the last copy.
+struct Build {
+    std::filesystem::path executable;  // empty if the build failed
+    int exit_code = 0;                 // of the compiler, 0 on a cache hit
+    std::string diagnostics;           // what the compiler printed, on stdout and stderr
+    bool cache_hit = false;
+    double seconds = 0;  // cache lookup and compile
+    CmdStats compile;    // of the compiler, zeros on a cache hit
+    std::shared_ptr<const std::filesystem::path> workdir;
+
+    bool ok() const {
+        return !executable.empty();
+    }
+};
+
+struct RunOptions {
+    EnvOverrides env;   // set on top of the environment of the host
+    std::string input;  // written to the standard input of the program, followed by end of file
+    bool capture = true;  // collect stdout and stderr into the result, instead of sharing those of the host
+    bool echo = false;    // when capturing, also pass the output through to stdout and stderr of the host
+    std::optional<double> timeout_seconds;  // kill the program with SIGKILL after this long
+    std::optional<std::filesystem::path> working_directory;
+};
+
+struct RunResult {
+    int exit_code = 0;  // 128 + the signal number if it was killed, 127 if it could not be started
+    bool timed_out = false;
+    std::string output;
+    std::string errors;
+    CmdStats stats;
+};
+
+// Builds an executable, or takes it from the cache. Throws std::runtime_error if spec has no sources; a compiler
+// that fails or can not be started is reported in the result.
+Build build(const BuildSpec & spec);
+
+// Runs a successful build with the given arguments and waits for it to exit.
+RunResult run(const Build & build, const std::vector<std::string> & args = {}, const RunOptions & options = {});
+
+// The cpprun command, with its command line: what the main of the cpprun executable runs. Returns the exit code, or
+// replaces the process with the cached program through execv and does not return.
+int command_main(int argc, const char ** argv);
+
+inline std::future<Build> build_async(BuildSpec spec) {
+    return std::async(std::launch::async, [spec = std::move(spec)] { return build(spec); });
+}
+
+// The future keeps its own copy of the build, which may go out of scope in the meantime.
+inline std::future<RunResult> run_async(Build b, std::vector<std::string> args = {}, RunOptions options = {}) {
+    return std::async(std::launch::async, [b = std::move(b), args = std::move(args), options = std::move(options)] {
+        return run(b, args, options);
+    });
+}
+
+}  // namespace cpprun
@@ -2,6 +2,35 @@
 
 #include "cpprun.cpp"
 
+// Sets an environment variable, or unsets it for std::nullopt, and restores the previous state at the end of the
+// scope, also when a failed ASSERT returns early.
+class ScopedEnv {
+   public:
+    ScopedEnv(const char * name, const std::optional<std::string> & value) : name_(name) {
+        if (const char * old = std::getenv(name)) {
+            old_ = old;
+        }
+        set(value);
+    }
+    ~ScopedEnv() {
+        set(old_);
+    }
+    ScopedEnv(const ScopedEnv &) = delete;
+    ScopedEnv & operator=(const ScopedEnv &) = delete;
+
+    void set(const std::optional<std::string> & value) {
+        if (value) {
+            setenv(name_, value->c_str(), 1);
+        } else {
+            unsetenv(name_);
+        }
+    }
+
+   private:
+    const char * name_;
+    std::optional<std::string> old_;
+};
+
 TEST(CppRun, RandomValue) {
     {
         std::mt19937 rng{1234};
@@ -148,4 +177,1170 @@ TEST(CppRun, ParseCxxFlags) {
         cpprun::parse_cxxflags_into(output, "-Wall -Wextra -O2");
         EXPECT_EQ(output, V({"-Wall", "-Wextra", "-O2"}));
     }
-}
\ No newline at end of file
+}
+
+TEST(CppRun, TemplateFamily) {
+    EXPECT_EQ(cpprun::template_family("main"), "main");
+    EXPECT_EQ(cpprun::template_family("std::vector<int, std::allocator<int> >::push_back(int const&)"),
+              "std::vector<>::push_back(int const&)");
+    EXPECT_EQ(cpprun::template_family("std::basic_ostream<char, std::char_traits<char> >& std::operator<< "
+                                      "<std::char_traits<char> >(std::basic_ostream<char, std::char_traits<char> >&)"),
+              "std::basic_ostream<>& std::operator<< <>(std::basic_ostream<>&)");
+    EXPECT_EQ(cpprun::template_family("bool foo<3>::operator<(foo<3> const&) const"),
+              "bool foo<>::operator<(foo<> const&) const");
+}
+
+TEST(CppRun, Demangle) {
+    EXPECT_EQ(cpprun::demangle("_ZN3foo3barEv"), "foo::bar()");
+    EXPECT_EQ(cpprun::demangle("main"), "main");
+}
+
+TEST(CppRun, SizeSnapshotRoundTrip) {
+    cpprun::SizeSnapshot snapshot{{"std::vector<>::push_back(int const&)", 123}, {"[section] .text", 4567}};
+    EXPECT_EQ(cpprun::parse_size_snapshot(cpprun::format_size_snapshot(snapshot)), snapshot);
+}
+
+TEST(CppRun, ReadElfSelf) {
+    auto elf = cpprun::read_elf("/proc/self/exe");
+    EXPECT_NE(elf.find_section(".text"), nullptr);
+
+    auto report = cpprun::compute_size_report(elf);
+    EXPECT_GT(report.sections[".text"], 0u);
+    EXPECT_TRUE(std::any_of(report.symbols.begin(), report.symbols.end(), [](auto & s) {
+        return s.name.rfind("cpprun::(anonymous namespace)::template_family(", 0) == 0;
+    }));
+}
+
+TEST(CppRun, ParseLdDebugStatistics) {
+    auto stats = cpprun::parse_ld_debug_statistics(
+        "      7316:\t\n"
+        "      7316:\truntime linker statistics:\n"
+        "      7316:\t  total startup time in dynamic loader: 180449 cycles\n"
+        "      7316:\t            time needed for relocation: 100399 cycles (55.6%)\n"
+        "      7316:\t                 number of relocations: 1766\n"
+        "      7316:\t\n"
+        "      7316:\truntime linker statistics:\n"
+        "      7316:\t           final number of relocations: 1853\n");
+    EXPECT_EQ(stats["total startup time in dynamic loader"], 180449u);
+    EXPECT_EQ(stats["time needed for relocation"], 100399u);
+    EXPECT_EQ(stats["number of relocations"], 1766u);
+    EXPECT_EQ(stats.count("final number of relocations"), 0u);
+}
+
+TEST(CppRun, ParseStartupReport) {
+    auto sample = cpprun::parse_startup_report(
+        "pid 42\npreload_ns 100\nstart_main_ns 200\nmain_ns 350\ninit 1130 7\ninit 11a0 50\n"
+        "dso /lib/x86_64-linux-gnu/libc.so.6\n");
+    EXPECT_EQ(sample.pid, 42);
+    EXPECT_EQ(sample.preload_ns, 100u);
+    EXPECT_EQ(sample.start_main_ns, 200u);
+    EXPECT_EQ(sample.main_ns, 350u);
+    using P = std::pair<uint64_t, uint64_t>;
+    EXPECT_EQ(sample.initializers, std::vector<P>({P{0x1130, 7}, P{0x11a0, 50}}));
+    EXPECT_EQ(sample.dsos, std::vector<std::string>({"/lib/x86_64-linux-gnu/libc.so.6"}));
+}
+
+TEST(CppRun, ReadDynamicInfoSelf) {
+    auto info = cpprun::read_dynamic_info(cpprun::read_elf("/proc/self/exe"));
+    EXPECT_TRUE(std::any_of(info.needed.begin(), info.needed.end(),
+                            [](auto & n) { return n.rfind("libc.so", 0) == 0; }));
+}
+
+TEST(CppRun, ParseStaticLink) {
+    EXPECT_EQ(cpprun::parse_cpprun_args({}).static_link, std::nullopt);
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-static"}).static_link, cpprun::StaticLink::Full);
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-static=pie"}).static_link, cpprun::StaticLink::Pie);
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-static=runtime"}).static_link, cpprun::StaticLink::Runtime);
+    EXPECT_THROW(cpprun::parse_cpprun_args({"--cpprun-static=foo"}), std::runtime_error);
+
+    auto args = cpprun::parse_cpprun_args({"--cpprun-static=runtime", "hello.cpp"});
+    EXPECT_EQ(cpprun::collect_build_args(args, "out"),
+              std::vector<std::string>({"-std=c++23", "-Wall", "-Wextra", "-pedantic", "-g", "hello.cpp",
+                                        "-static-libstdc++", "-static-libgcc", "-o", "out"}));
+}
+
+TEST(CppRun, StaticRuntimeVerdict) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(8, getpid());
+    ScopedEnv cache_dir("CPPRUN_CACHE_DIR", dir.string());
+    auto args = cpprun::parse_cpprun_args({"--cpprun-static", "hello.cpp"});
+    args.cxx = "false";
+
+    // a missing runtime is not remembered, it may be installed later
+    EXPECT_NE(cpprun::check_static_runtime(args), std::nullopt);
+    auto cached = dir / "static" / (cpprun::compiler_fingerprint("false") + ".static");
+    EXPECT_FALSE(fs::exists(cached));
+    fs::create_directories(cached.parent_path());
+    std::ofstream(cached) << "";
+    EXPECT_EQ(cpprun::check_static_runtime(args), std::nullopt);
+
+    fs::remove_all(dir);
+}
+
+TEST(CppRun, ConflictingModes) {
+    auto conflict = [](const std::vector<std::string> & args) {
+        return cpprun::conflicting_modes(cpprun::parse_cpprun_args(args));
+    };
+    EXPECT_EQ(conflict({"hello.cpp"}), std::nullopt);
+    EXPECT_EQ(conflict({"-c", "-o", "hello.o", "--cpprun-size", "hello.cpp"}), std::nullopt);
+    EXPECT_EQ(conflict({"--cpprun-replay=b.tar", "--cpprun-annotate"}), std::nullopt);
+    EXPECT_EQ(conflict({"--cpprun-asm-diff=-O1", "--cpprun-asm-diff=-O2", "--cpprun-annotate", "hello.cpp"}),
+              std::nullopt);
+    EXPECT_EQ(conflict({"--cpprun-sanitize", "--cpprun-fuzz", "hello.cpp"}),
+              std::make_pair(std::string("--cpprun-sanitize"), std::string("--cpprun-fuzz")));
+    EXPECT_EQ(conflict({"-c", "--cpprun-startup", "hello.cpp"}),
+              std::make_pair(std::string("-c"), std::string("--cpprun-startup")));
+    EXPECT_NE(conflict({"--cpprun-doctor", "--cpprun-prewarm"}), std::nullopt);
+    EXPECT_NE(conflict({"--cpprun-build-trends", "--cpprun-size"}), std::nullopt);
+    EXPECT_NE(conflict({"--cpprun-pipeline", "--cpprun-jit"}), std::nullopt);
+    EXPECT_NE(conflict({"--cpprun-capture=b.tar", "--cpprun-tee=out.log", "hello.cpp"}), std::nullopt);
+}
+
+TEST(CppRun, ParseDepfile) {
+    using V = std::vector<std::string>;
+    EXPECT_EQ(cpprun::parse_depfile(""), V{});
+    EXPECT_EQ(cpprun::parse_depfile("out.o: hello.cpp /usr/include/stdio.h \\\n /path/with\\ space.h\n"),
+              V({"hello.cpp", "/usr/include/stdio.h", "/path/with space.h"}));
+}
+
+TEST(CppRun, ManifestIsCurrent) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(1, getpid());
+    fs::create_directories(dir);
+    auto header = dir / "header.h";
+    std::ofstream(header) << "#pragma once\n";
+
+    auto manifest = cpprun::format_manifest({header.string()}, {});
+    EXPECT_TRUE(cpprun::manifest_is_current(manifest));
+    std::ofstream(dir / "manifest") << manifest;
+    EXPECT_TRUE(cpprun::fast_manifest_is_current((dir / "manifest").c_str()));
+
+    std::ofstream(header, std::ios::app) << "int x;\n";
+    EXPECT_FALSE(cpprun::manifest_is_current(manifest));
+    EXPECT_FALSE(cpprun::fast_manifest_is_current((dir / "manifest").c_str()));
+
+    // a dependency that was missing keeps the following entries aligned
+    auto missing = dir / "missing.h";
+    manifest = cpprun::format_manifest({missing.string(), header.string()}, {});
+    EXPECT_EQ(cpprun::manifest_paths(manifest), std::vector<fs::path>({missing, header}));
+    std::ofstream(dir / "manifest") << manifest;
+    EXPECT_TRUE(cpprun::manifest_is_current(manifest));
+    EXPECT_TRUE(cpprun::fast_manifest_is_current((dir / "manifest").c_str()));
+    std::ofstream(header, std::ios::app) << "int y;\n";
+    EXPECT_FALSE(cpprun::manifest_is_current(manifest));
+    EXPECT_FALSE(cpprun::fast_manifest_is_current((dir / "manifest").c_str()));
+    manifest = cpprun::format_manifest({missing.string(), header.string()}, {});
+    std::ofstream(dir / "manifest") << manifest;
+    std::ofstream(missing) << "#pragma once\n";
+    EXPECT_FALSE(cpprun::manifest_is_current(manifest));
+    EXPECT_FALSE(cpprun::fast_manifest_is_current((dir / "manifest").c_str()));
+
+    fs::remove_all(dir);
+}
+
+TEST(CppRun, ParseTimeReport) {
+    auto phases = cpprun::parse_time_report(
+        "Time variable                                   usr           sys          wall           GGC\n"
+        " phase setup                        :   0.00 (  0%)   0.00 (  0%)   0.01 (  1%)  1576k (  3%)\n"
+        " phase parsing                      :   0.62 ( 70%)   0.31 ( 82%)   0.94 ( 72%)    45M ( 75%)\n"
+        " |name lookup                       :   0.06 (  7%)   0.02 (  5%)   0.07 (  5%)  2391k (  4%)\n"
+        " template instantiation             :   0.25 ( 28%)   0.11 ( 29%)   0.29 ( 22%)    18M ( 31%)\n"
+        " TOTAL                              :   0.89          0.38          1.30           60M\n");
+    using P = std::pair<std::string, double>;
+    EXPECT_EQ(phases, std::vector<P>({P{"phase setup", 0.01}, P{"phase parsing", 0.94},
+                                      P{"template instantiation", 0.29}}));
+}
+
+TEST(CppRun, IsLinkOnlyArg) {
+    EXPECT_TRUE(cpprun::is_link_only_arg("-lm"));
+    EXPECT_TRUE(cpprun::is_link_only_arg("-Wl,-z,now"));
+    EXPECT_TRUE(cpprun::is_link_only_arg("libfoo.a"));
+    EXPECT_FALSE(cpprun::is_link_only_arg("-O2"));
+    EXPECT_FALSE(cpprun::is_link_only_arg("-Iinclude"));
+}
+
+TEST(CppRun, ParseIncludeTree) {
+    using P = std::pair<int, std::string>;
+    auto tree = cpprun::parse_include_tree(
+        ". /usr/include/c++/12/map\n"
+        ".. /usr/include/c++/12/bits/stl_tree.h\n"
+        "Multiple include guards may be useful for:\n"
+        "/usr/include/c++/12/cstdio\n"
+        ". local.h\n");
+    EXPECT_EQ(tree, std::vector<P>({P{1, "/usr/include/c++/12/map"}, P{2, "/usr/include/c++/12/bits/stl_tree.h"},
+                                    P{1, "local.h"}}));
+}
+
+TEST(CppRun, SystemIncludeDirs) {
+    auto dirs = cpprun::parse_system_include_dirs(
+        "#include \"...\" search starts here:\n"
+        "#include <...> search starts here:\n"
+        " /usr/include/c++/12\n"
+        " /usr/include/x86_64-linux-gnu/c++/12\n"
+        " /usr/include\n"
+        "End of search list.\n");
+    EXPECT_EQ(dirs, std::vector<fs::path>({"/usr/include/c++/12", "/usr/include/x86_64-linux-gnu/c++/12",
+                                           "/usr/include"}));
+    EXPECT_EQ(cpprun::include_spelling("/usr/include/c++/12/iostream", dirs), "<iostream>");
+    EXPECT_EQ(cpprun::include_spelling("/usr/include/c++/12/bits/stl_tree.h", dirs), "<bits/stl_tree.h>");
+    EXPECT_EQ(cpprun::include_spelling("/home/user/foo.h", dirs), "\"/home/user/foo.h\"");
+}
+
+TEST(CppRun, BuildRecordRoundTrip) {
+    cpprun::BuildRecord record{"g++", "/tmp/work", {"-std=c++17", "-O2", "hello.cpp"}};
+    auto parsed = cpprun::parse_build_record(cpprun::format_build_record(record));
+    ASSERT_TRUE(parsed.has_value());
+    EXPECT_EQ(parsed->cxx, record.cxx);
+    EXPECT_EQ(parsed->cwd, record.cwd);
+    EXPECT_EQ(parsed->args, record.args);
+    EXPECT_FALSE(cpprun::parse_build_record("").has_value());
+}
+
+TEST(CppRun, DwarfReaderLeb128) {
+    std::string data("\xe5\x8e\x26\x7f\x80\x7f\x02", 7);
+    cpprun::DwarfReader r(data);
+    EXPECT_EQ(r.uleb(), 624485u);
+    EXPECT_EQ(r.sleb(), -1);
+    EXPECT_EQ(r.sleb(), -128);
+    EXPECT_EQ(r.uleb(), 2u);
+    EXPECT_TRUE(r.done());
+}
+
+TEST(CppRun, AttributeSamples) {
+    auto profile = cpprun::parse_sample_profile(
+        "object 555555554000 555555555000 555555556000 [executable]\n"
+        "object 7ffff7c00000 7ffff7c28000 7ffff7dbd000 /lib/x86_64-linux-gnu/libc.so.6\n"
+        "555555555100\n555555555100\n555555555108\n7ffff7c30000\n1234\n");
+    EXPECT_EQ(profile.objects.size(), 2u);
+    EXPECT_EQ(profile.pcs.size(), 5u);
+
+    auto samples = cpprun::attribute_samples(profile);
+    EXPECT_EQ(samples.total, 5u);
+    EXPECT_EQ(samples.executable, (std::map<uint64_t, size_t>{{0x1100, 2}, {0x1108, 1}}));
+    EXPECT_EQ(samples.elsewhere, (std::map<std::string, size_t>{{"libc.so.6", 1}, {"[unknown]", 1}}));
+}
+
+TEST(CppRun, ParseAnnotateHz) {
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-annotate"}).annotate_hz, 1000);
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-annotate=0"}).annotate_hz, 1);
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-annotate=5000000"}).annotate_hz, 1000000);
+}
+
+TEST(CppRun, ParseStackUsage) {
+    auto frames = cpprun::parse_stack_usage(
+        "/tmp/a:b/su.cpp:3:25:T big(T) [with T = int]\t4008\tstatic\n"
+        "su.cpp:6:5:int vla(int)\t64\tdynamic,bounded\n"
+        "garbage\n");
+    ASSERT_EQ(frames.size(), 2u);
+    EXPECT_EQ(frames[0].location, "/tmp/a:b/su.cpp:3:25");
+    EXPECT_EQ(frames[0].name, "T big(T) [with T = int]");
+    EXPECT_EQ(frames[0].bytes, 4008u);
+    EXPECT_EQ(frames[0].kind, "static");
+    EXPECT_EQ(frames[1].name, "int vla(int)");
+    EXPECT_EQ(frames[1].kind, "dynamic,bounded");
+}
+
+TEST(CppRun, CollectCallGraph) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(9, getpid());
+    fs::create_directories(dir);
+    // without -fpic, the load of counter is a PC32 relocation against an undefined symbol like the calls
+    std::ofstream(dir / "cg.cpp") << "extern int counter;\nint leaf();\nint f() { return leaf() + counter; }\n";
+    ASSERT_EQ(cpprun::run_cmd("c++", {"-O1", "-fno-pic", "-c", (dir / "cg.cpp").string(), "-o",
+                                      (dir / "cg.o").string()},
+                              false),
+              0);
+    cpprun::CallGraph graph;
+    cpprun::collect_call_graph(cpprun::read_elf(dir / "cg.o"), graph);
+    EXPECT_EQ(graph["f"], std::set<std::string>({"leaf"}));
+    fs::remove_all(dir);
+}
+
+TEST(CppRun, FunctionKey) {
+    EXPECT_EQ(cpprun::function_key("T big(T) [with T = int]"), "big");
+    EXPECT_EQ(cpprun::function_key("int big<int>(int)"), "big");
+    EXPECT_EQ(cpprun::function_key("int S::f(int)"), "S::f");
+    EXPECT_EQ(cpprun::function_key("main"), "main");
+    EXPECT_EQ(cpprun::function_key("std::vector<int, std::allocator<int> >::push_back(int const&)"),
+              "std::vector::push_back");
+    EXPECT_EQ(cpprun::function_key("bool Less::operator()(int, int) const"), "Less::operator()");
+}
+
+TEST(CppRun, BuildLogRoundTrip) {
+    cpprun::BuildLogEntry entry{1700000000, "81f56bedd0cbeb44", "-std=c++23 -O2", "0a82778d4527e8d2", 1.25, 1.5,
+                                30400,      "/usr/bin/c++",     "/tmp/hello.cpp"};
+    auto text = cpprun::format_build_log_entry(entry) + "1700000001\ttruncated";
+    auto parsed = cpprun::parse_build_log(text);
+    ASSERT_EQ(parsed.size(), 1u);
+    EXPECT_EQ(parsed[0].time, entry.time);
+    EXPECT_EQ(parsed[0].flags, entry.flags);
+    EXPECT_EQ(parsed[0].compiler, entry.compiler);
+    EXPECT_DOUBLE_EQ(parsed[0].wall_seconds, 1.25);
+    EXPECT_DOUBLE_EQ(parsed[0].cpu_seconds, 1.5);
+    EXPECT_EQ(parsed[0].max_rss_kb, 30400);
+    EXPECT_EQ(parsed[0].sources, entry.sources);
+}
+
+TEST(CppRun, BuildTrendRegressions) {
+    auto build = [](int64_t time, const std::string & compiler, double seconds, long rss_kb) {
+        return cpprun::BuildLogEntry{time, "s", "-O2", compiler, seconds, seconds, rss_kb, "/usr/bin/c++", "a.cpp"};
+    };
+    auto segments = cpprun::build_trend_segments({build(1, "aaaa", 1.0, 1000), build(2, "aaaa", 1.1, 1000),
+                                                  build(3, "bbbb", 2.0, 1100), build(4, "bbbb", 2.1, 1100),
+                                                  build(5, "cccc", 2.05, 1500)});
+    ASSERT_EQ(segments.size(), 3u);
+    EXPECT_EQ(segments[0].wall_seconds.size(), 2u);
+    EXPECT_EQ(segments[1].first, 3);
+    EXPECT_EQ(segments[1].last, 4);
+
+    auto slower = cpprun::build_regressions(segments[0], segments[1]);
+    ASSERT_EQ(slower.size(), 2u);
+    EXPECT_EQ(slower[0].substr(0, 10), "wall time ");
+    EXPECT_EQ(slower[1].substr(0, 9), "CPU time ");
+
+    auto bigger = cpprun::build_regressions(segments[1], segments[2]);
+    ASSERT_EQ(bigger.size(), 1u);
+    EXPECT_EQ(bigger[0].substr(0, 8), "peak RSS");
+}
+
+TEST(CppRun, InvocationMode) {
+    auto mode = [](const std::vector<std::string> & cpprun_args) {
+        return cpprun::invocation_mode(cpprun::parse_cpprun_args(cpprun_args), cpprun_args);
+    };
+    EXPECT_EQ(mode({"hello.cpp"}), "run");
+    EXPECT_EQ(mode({"hello.cpp", "-c"}), "build");
+    EXPECT_EQ(mode({"hello.cpp", "-c", "--cpprun-size"}), "size");
+    EXPECT_EQ(mode({"--version"}), "compiler-info");
+    EXPECT_EQ(mode({"hello.cpp", "--cpprun-annotate"}), "annotate");
+}
+
+TEST(CppRun, MetricsJson) {
+    EXPECT_EQ(cpprun::json_string("a\"b\\c\n"), "\"a\\\"b\\\\c\\u000a\"");
+
+    cpprun::InvocationMetrics m;
+    m.mode = "run";
+    m.sources = {"/tmp/hello.cpp"};
+    m.cache = "hit";
+    m.phases = {{"run", cpprun::CmdStats{0.5, 0.25, 0, 1024}}};
+    m.exit_code = 3;
+    auto line = cpprun::format_metrics_json(m, 1700000000, {}, {});
+    EXPECT_EQ(line.back(), '\n');
+    EXPECT_NE(line.find("\"mode\":\"run\",\"sources\":[\"/tmp/hello.cpp\"],\"cache\":\"hit\",\"exit_code\":3"),
+              std::string::npos);
+    EXPECT_NE(
+        line.find("\"run\":{\"wall_seconds\":0.5,\"user_seconds\":0.25,\"system_seconds\":0,\"max_rss_kb\":1024}"),
+        std::string::npos);
+    EXPECT_EQ(line.find("\"error\""), std::string::npos);
+
+    m.exit_code = 1;
+    m.error = "no such file";
+    line = cpprun::format_metrics_json(m, 1700000000, {}, {});
+    EXPECT_NE(line.find("\"exit_code\":1,\"error\":\"no such file\",\"phases\""), std::string::npos);
+}
+
+TEST(CppRun, PrometheusTextfile) {
+    cpprun::InvocationMetrics m;
+    m.mode = "run";
+    m.cache = "miss";
+    m.phases = {{"compile", cpprun::CmdStats{0.3, 0.2, 0.1, 2048}}};
+
+    cpprun::MetricSeries series;
+    cpprun::update_metric_series(series, m);
+    m.cache = "hit";
+    m.exit_code = 1;
+    m.phases = {{"compile", cpprun::CmdStats{2, 0, 0, 1024}}};
+    cpprun::update_metric_series(series, m);
+
+    auto text = cpprun::format_prometheus_text(series);
+    auto parsed = cpprun::parse_prometheus_text(text);
+    EXPECT_EQ(parsed["cpprun_invocations_total{mode=\"run\"}"], 2);
+    EXPECT_EQ(parsed["cpprun_failures_total{mode=\"run\"}"], 1);
+    EXPECT_EQ(parsed["cpprun_cache_lookups_total{result=\"hit\"}"], 1);
+    EXPECT_EQ(parsed["cpprun_cache_lookups_total{result=\"miss\"}"], 1);
+    EXPECT_EQ(parsed["cpprun_phase_duration_seconds_bucket{phase=\"compile\",le=\"0.5\"}"], 1);
+    EXPECT_EQ(parsed["cpprun_phase_duration_seconds_bucket{phase=\"compile\",le=\"2.5\"}"], 2);
+    EXPECT_EQ(parsed["cpprun_phase_duration_seconds_bucket{phase=\"compile\",le=\"+Inf\"}"], 2);
+    EXPECT_DOUBLE_EQ(parsed["cpprun_phase_duration_seconds_sum{phase=\"compile\"}"], 2.3);
+    EXPECT_EQ(parsed["cpprun_compile_max_rss_bytes"], 1024 * 1024);
+    EXPECT_EQ(cpprun::format_prometheus_text(parsed), text);
+
+    auto le_01 = text.find("le=\"0.1\"");
+    auto le_1 = text.find("le=\"1\"");
+    auto le_inf = text.find("le=\"+Inf\"");
+    EXPECT_LT(le_01, le_1);
+    EXPECT_LT(le_1, le_inf);
+    EXPECT_NE(text.find("# TYPE cpprun_phase_duration_seconds histogram\n"), std::string::npos);
+}
+
+TEST(CppRun, EventStream) {
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    cpprun::EventStream stream;
+    EXPECT_FALSE(stream.enabled());
+    stream.open(fds[1]);
+    stream.emit("process_start", ",\"argv\":" + cpprun::json_array({"c++", "a b.cpp"}));
+    close(fds[1]);
+
+    std::string data(4096, '\0');
+    data.resize(size_t(read(fds[0], data.data(), data.size())));
+    close(fds[0]);
+
+    auto newline = data.find('\n');
+    ASSERT_NE(newline, std::string::npos);
+    auto json = data.substr(newline + 1);
+    EXPECT_EQ(std::stoul(data.substr(0, newline)), json.size());
+    EXPECT_EQ(json.rfind("{\"event\":\"process_start\",\"time\":", 0), 0u);
+    EXPECT_EQ(json.substr(json.find(",\"argv\"")), ",\"argv\":[\"c++\",\"a b.cpp\"]}");
+}
+
+TEST(CppRun, FilesystemType) {
+    EXPECT_EQ(cpprun::filesystem_type(0x01021994).name, "tmpfs");
+    EXPECT_FALSE(cpprun::filesystem_type(0xEF53).remote);
+    EXPECT_TRUE(cpprun::filesystem_type(0x6969).remote);
+    EXPECT_EQ(cpprun::filesystem_type(0x1234).name, "0x1234");
+}
+
+TEST(CppRun, IsSourceFile) {
+    EXPECT_TRUE(cpprun::is_source_file("hello.cpp"));
+    EXPECT_TRUE(cpprun::is_source_file("dir.d/main.C"));
+    EXPECT_FALSE(cpprun::is_source_file(".cpp"));
+    EXPECT_FALSE(cpprun::is_source_file("src.cpp/header.h"));
+    EXPECT_FALSE(cpprun::is_source_file("-DX=a.cpp"));
+    EXPECT_EQ(cpprun::hex64(0x1234abcd), "000000001234abcd");
+}
+
+TEST(CppRun, FindCachedArtifact) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(2, getpid());
+    fs::create_directories(dir);
+    auto source = dir / "fast.cpp";
+    std::ofstream(source) << "int main() {}\n";
+    ScopedEnv cache_dir("CPPRUN_CACHE_DIR", (dir / "cache").string());
+    ScopedEnv cxxflags("CPPRUN_CXXFLAGS", " -O1  -g ");
+
+    std::vector<const char *> argv = {"cpprun", "-std=c++17", source.c_str(), "--", "run", "args"};
+    auto args = cpprun::parse_cpprun_args({"-std=c++17", source.string()});
+    auto entry = cpprun::artifact_cache_entry(args);
+    ASSERT_TRUE(entry.has_value());
+
+    cpprun::PathBuffer artifact;
+    int run_begin = 0;
+    EXPECT_FALSE(cpprun::find_cached_artifact(int(argv.size()), argv.data(), artifact, run_begin));
+
+    // the same key as the regular path, once the entry has a manifest
+    fs::create_directories(*entry);
+    std::ofstream(*entry / "manifest") << "";
+    ASSERT_TRUE(cpprun::find_cached_artifact(int(argv.size()), argv.data(), artifact, run_begin));
+    EXPECT_EQ(fs::path(artifact.c_str()), *entry / "artifact.exe");
+    EXPECT_EQ(run_begin, 4);
+
+    // the compiler's search paths are part of the key
+    ScopedEnv include_path("CPLUS_INCLUDE_PATH", "/opt/include");
+    EXPECT_FALSE(cpprun::find_cached_artifact(int(argv.size()), argv.data(), artifact, run_begin));
+    auto include_path_entry = cpprun::artifact_cache_entry(args);
+    ASSERT_TRUE(include_path_entry.has_value());
+    EXPECT_NE(*include_path_entry, *entry);
+    fs::create_directories(*include_path_entry);
+    std::ofstream(*include_path_entry / "manifest") << "";
+    EXPECT_TRUE(cpprun::find_cached_artifact(int(argv.size()), argv.data(), artifact, run_begin));
+    include_path.set(std::nullopt);
+
+    // entries with environment defaults take the regular path
+    std::ofstream(*entry / "env") << "OMP_PROC_BIND=close\n";
+    EXPECT_FALSE(cpprun::find_cached_artifact(int(argv.size()), argv.data(), artifact, run_begin));
+
+    std::vector<const char *> size_argv = {"cpprun", "--cpprun-size", source.c_str()};
+    EXPECT_FALSE(cpprun::find_cached_artifact(int(size_argv.size()), size_argv.data(), artifact, run_begin));
+
+    fs::remove_all(dir);
+}
+
+TEST(CppRun, LinkInputs) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(10, getpid());
+    fs::create_directories(dir / "lib");
+    std::ofstream(dir / "util.o") << "";
+    std::ofstream(dir / "lib" / "libfoo.a") << "";
+    std::ofstream(dir / "lib" / "libbar.so") << "";
+    std::ofstream(dir / "lib" / "libbar.a") << "";
+
+    auto args = cpprun::parse_cpprun_args({"main.cpp", (dir / "util.o").string(), "-L", (dir / "lib").string(),
+                                           "-lfoo", "-l", "bar", "-lm", "-lnot-a-library"});
+    auto inputs = cpprun::link_inputs(args);
+    ASSERT_GE(inputs.size(), 3u);
+    EXPECT_EQ(inputs[0], (dir / "util.o").string());
+    EXPECT_EQ(inputs[1], (dir / "lib" / "libfoo.a").string());
+    EXPECT_EQ(inputs[2], (dir / "lib" / "libbar.so").string());
+    EXPECT_LE(inputs.size(), 4u);  // and libm from the compiler's library path
+
+    args = cpprun::parse_cpprun_args({"--cpprun-static", "main.cpp", "-L" + (dir / "lib").string(), "-lbar"});
+    EXPECT_EQ(cpprun::link_inputs(args), std::vector<std::string>({(dir / "lib" / "libbar.a").string()}));
+
+    fs::remove_all(dir);
+}
+
+TEST(CppRun, PruneArtifactCache) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(11, getpid());
+    auto now = fs::file_time_type::clock::now();
+    for (int i = 0; i < 3; ++i) {
+        auto entry = dir / ("entry" + std::to_string(i));
+        fs::create_directories(entry);
+        std::ofstream(entry / "artifact.exe") << std::string(600 * 1024, 'x');
+        std::ofstream(entry / "manifest") << "";
+        fs::last_write_time(entry / "manifest", now - std::chrono::hours(3 - i));
+    }
+    fs::create_directories(dir / "storing");
+    std::ofstream(dir / "storing" / "artifact.exe") << "";
+
+    ScopedEnv max_mb("CPPRUN_CACHE_MAX_MB", "1");
+    cpprun::prune_artifact_cache(dir);
+    EXPECT_FALSE(fs::exists(dir / "entry0"));
+    EXPECT_FALSE(fs::exists(dir / "entry1"));
+    EXPECT_TRUE(fs::exists(dir / "entry2"));
+    EXPECT_TRUE(fs::exists(dir / "storing"));
+
+    max_mb.set("0");
+    std::ofstream(dir / "storing" / "artifact.exe") << std::string(2 * 1024 * 1024, 'x');
+    std::ofstream(dir / "storing" / "manifest") << "";
+    cpprun::prune_artifact_cache(dir);
+    EXPECT_TRUE(fs::exists(dir / "entry2"));
+
+    fs::remove_all(dir);
+}
+
+TEST(CppRun, LibraryBuildAndRun) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(3, getpid());
+    fs::create_directories(dir);
+    ScopedEnv cache_dir("CPPRUN_CACHE_DIR", (dir / "cache").string());
+    std::ofstream(dir / "echo.cpp") << R"(
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+int main(int argc, char ** argv) {
+    if (argc > 1 && std::string(argv[1]) == "sleep") {
+        sleep(10);
+    }
+    std::string line;
+    std::getline(std::cin, line);
+    std::cout << "in: " << line << " env: " << std::getenv("ECHO_VALUE") << std::endl;
+    std::cerr << "argc: " << argc << std::endl;
+    return 3;
+}
+)";
+    std::ofstream(dir / "broken.cpp") << "int main() { return undeclared; }\n";
+
+    cpprun::BuildSpec spec;
+    spec.sources = {dir / "echo.cpp"};
+    spec.flags = {};
+    spec.standard = "-std=c++17";
+    auto build = cpprun::build(spec);
+    ASSERT_TRUE(build.ok()) << build.diagnostics;
+    EXPECT_FALSE(build.cache_hit);
+    EXPECT_EQ(build.executable.parent_path().parent_path(), dir / "cache" / "artifacts");
+
+    cpprun::RunOptions options;
+    options.input = "hello\n";
+    options.env = {{"ECHO_VALUE", "42"}};
+    auto result = cpprun::run(build, {"a", "b"}, options);
+    EXPECT_EQ(result.exit_code, 3);
+    EXPECT_EQ(result.output, "in: hello env: 42\n");
+    EXPECT_EQ(result.errors, "argc: 3\n");
+    EXPECT_GT(result.stats.wall_seconds, 0);
+
+    auto cached = cpprun::build_async(spec).get();
+    EXPECT_TRUE(cached.cache_hit);
+    EXPECT_EQ(cached.executable, build.executable);
+
+    std::vector<std::future<cpprun::RunResult>> runs;
+    for (int i = 0; i < 4; ++i) {
+        auto run_options = options;
+        run_options.input = std::to_string(i) + "\n";
+        runs.push_back(cpprun::run_async(cached, {}, run_options));
+    }
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(runs[size_t(i)].get().output, "in: " + std::to_string(i) + " env: 42\n");
+    }
+
+    options.timeout_seconds = 0.2;
+    auto slow = cpprun::run(build, {"sleep"}, options);
+    EXPECT_TRUE(slow.timed_out);
+    EXPECT_EQ(slow.exit_code, 128 + SIGKILL);
+
+    // without the cache, the executable lives as long as the last copy of the build
+    spec.use_cache = false;
+    fs::path executable;
+    {
+        auto uncached = cpprun::build(spec);
+        ASSERT_TRUE(uncached.ok());
+        executable = uncached.executable;
+        EXPECT_TRUE(fs::exists(executable));
+    }
+    EXPECT_FALSE(fs::exists(executable));
+
+    spec.sources = {dir / "broken.cpp"};
+    auto broken = cpprun::build(spec);
+    EXPECT_FALSE(broken.ok());
+    EXPECT_NE(broken.exit_code, 0);
+    EXPECT_NE(broken.diagnostics.find("undeclared"), std::string::npos);
+    EXPECT_THROW(cpprun::run(broken), std::runtime_error);
+    EXPECT_THROW(cpprun::build(cpprun::BuildSpec{}), std::runtime_error);
+
+    fs::remove_all(dir);
+}
+
+TEST(CppRun, ParseMemoizeArgs) {
+    auto args = cpprun::parse_cpprun_args({"--cpprun-memoize=a.csv,,b.csv", "--cpprun-memoize-env=LANG,TZ", "x.cpp"});
+    ASSERT_TRUE(args.memoize.has_value());
+    EXPECT_EQ(*args.memoize, std::vector<fs::path>({"a.csv", "b.csv"}));
+    EXPECT_EQ(args.memoize_env, std::vector<std::string>({"LANG", "TZ"}));
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-memoize"}).memoize, std::vector<fs::path>{});
+    EXPECT_FALSE(cpprun::parse_cpprun_args({"x.cpp"}).memoize.has_value());
+}
+
+TEST(CppRun, MemoKey) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(4, getpid());
+    fs::create_directories(dir);
+    auto exe = dir / "program", data = dir / "data.csv";
+    std::ofstream(exe) << "binary";
+    std::ofstream(data) << "1,2,3\n";
+    ScopedEnv memo_test("CPPRUN_MEMO_TEST", std::nullopt);
+
+    auto key = [&](std::vector<std::string> run_args, std::optional<std::string> input) {
+        return cpprun::memo_key(exe, run_args, {"CPPRUN_MEMO_TEST"}, input, {data});
+    };
+    auto base = key({"a", "b"}, "in");
+    EXPECT_EQ(key({"a", "b"}, "in"), base);
+    EXPECT_NE(key({"ab"}, "in"), base);
+    EXPECT_NE(key({"a", "b"}, "other"), base);
+    EXPECT_NE(key({"a", "b"}, std::nullopt), base);
+    memo_test.set("");
+    EXPECT_NE(key({"a", "b"}, "in"), base);
+    memo_test.set(std::nullopt);
+    std::ofstream(data) << "1,2,4\n";
+    EXPECT_NE(key({"a", "b"}, "in"), base);
+    std::ofstream(exe) << "rebuilt";
+    std::ofstream(data) << "1,2,3\n";
+    EXPECT_NE(key({"a", "b"}, "in"), base);
+
+    auto inputs = cpprun::format_memo_inputs({data, dir / "." / "data.csv", dir, dir / "missing"});
+    EXPECT_EQ(std::count(inputs.begin(), inputs.end(), '\n'), 1);
+    EXPECT_TRUE(cpprun::memo_inputs_current(inputs));
+    std::ofstream(data, std::ios::app) << "4,5,6\n";
+    EXPECT_FALSE(cpprun::memo_inputs_current(inputs));
+
+    // a file the program did not find must still be missing
+    inputs = cpprun::format_memo_inputs({}, {dir / "config.json"});
+    EXPECT_EQ(inputs, "- " + (dir / "config.json").string() + "\n");
+    EXPECT_TRUE(cpprun::memo_inputs_current(inputs));
+    std::ofstream(dir / "config.json") << "{}";
+    EXPECT_FALSE(cpprun::memo_inputs_current(inputs));
+    fs::remove_all(dir);
+}
+
+TEST(CppRun, PipelineArgs) {
+    using V = std::vector<std::string>;
+    auto split = cpprun::split_pipeline_args({"-O2", "--cpprun-pipeline", "a.cpp", "--", "x", "|", "b.cpp"});
+    ASSERT_TRUE(split.has_value());
+    EXPECT_EQ(split->first, V({"-O2", "--cpprun-pipeline"}));
+    EXPECT_EQ(split->second, V({"a.cpp", "--", "x", "|", "b.cpp"}));
+    EXPECT_FALSE(cpprun::split_pipeline_args({"a.cpp", "--", "--cpprun-pipeline"}).has_value());
+
+    auto stages = cpprun::parse_pipeline_stages(split->second);
+    ASSERT_EQ(stages.size(), 2u);
+    EXPECT_EQ(stages[0].cpprun_args, V({"a.cpp"}));
+    EXPECT_EQ(stages[0].run_args, V({"x"}));
+    EXPECT_EQ(stages[1].cpprun_args, V({"b.cpp"}));
+    EXPECT_TRUE(stages[1].run_args.empty());
+
+    EXPECT_THROW(cpprun::parse_pipeline_stages({"a.cpp", "|", "|", "b.cpp"}), std::runtime_error);
+    EXPECT_THROW(cpprun::parse_pipeline_stages({"a.cpp", "|"}), std::runtime_error);
+    EXPECT_THROW(cpprun::parse_pipeline_stages({"a.cpp", "|", "-o", "x", "b.cpp"}), std::runtime_error);
+}
+
+TEST(CppRun, ClassifyStageState) {
+    using cpprun::StageState;
+    auto nr = [](long n, const char * fd) { return std::to_string(n) + " " + fd + " 0x7ffc5d64e518 0x10000"; };
+    EXPECT_EQ(cpprun::classify_stage_state('S', nr(SYS_read, "0x0")), StageState::WaitingForInput);
+    EXPECT_EQ(cpprun::classify_stage_state('S', nr(SYS_write, "0x1")), StageState::WaitingForOutput);
+    EXPECT_EQ(cpprun::classify_stage_state('S', nr(SYS_read, "0x3")), StageState::Busy);
+    EXPECT_EQ(cpprun::classify_stage_state('R', nr(SYS_read, "0x0")), StageState::Busy);
+    EXPECT_EQ(cpprun::classify_stage_state('S', "running"), StageState::Busy);
+}
+
+TEST(CppRun, PipelineReport) {
+    std::vector<cpprun::StageReport> stages = {
+        {"gen.cpp", 0, {2.0, 0.1, 0.05, 1000}, 0.0, 1.8},
+        {"filter.cpp", 0, {2.0, 1.9, 0.05, 1000}, 0.05, 0.0},
+        {"agg.cpp", 0, {2.0, 0.2, 0.05, 1000}, 1.7, 0.0},
+    };
+    std::ostringstream out;
+    cpprun::print_pipeline_report(out, stages, 1 << 20);
+    EXPECT_NE(out.str().find("pipe buffers of 1024 KiB"), std::string::npos);
+    EXPECT_NE(out.str().find("bottleneck: stage 2 (filter.cpp), not waiting on its pipes 98% of the time"),
+              std::string::npos)
+        << out.str();
+}
+
+TEST(CppRun, ScanParallelRuntime) {
+    cpprun::ParallelRuntime found;
+    std::vector<std::string> includes;
+    cpprun::scan_parallel_runtime("#include <vector>\n#include \"util/pool.h\"\nint main() {}\n", found, includes);
+    EXPECT_FALSE(found.openmp || found.threads || found.parallel_stl);
+    EXPECT_EQ(includes, std::vector<std::string>({"util/pool.h"}));
+
+    cpprun::scan_parallel_runtime("  #  pragma omp parallel for\n", found, includes);
+    EXPECT_TRUE(found.openmp);
+    EXPECT_FALSE(found.threads);
+    cpprun::scan_parallel_runtime("auto f = std::async(work);\n", found, includes);
+    EXPECT_TRUE(found.threads);
+    cpprun::scan_parallel_runtime("#include <execution>\n", found, includes);
+    EXPECT_TRUE(found.parallel_stl);
+}
+
+TEST(CppRun, ParallelRuntimeFlags) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(5, getpid());
+    fs::create_directories(dir / "inc");
+    std::ofstream(dir / "main.cpp") << "#include \"pool.h\"\nint main() {}\n";
+    std::ofstream(dir / "inc" / "pool.h") << "#include \"detail.h\"\n";
+    std::ofstream(dir / "inc" / "detail.h") << "#include <thread>\n";
+
+    auto args = cpprun::parse_cpprun_args({(dir / "main.cpp").string(), "-I" + (dir / "inc").string()});
+    auto found = cpprun::detect_parallel_runtime(args);
+    EXPECT_TRUE(found.threads);
+    EXPECT_FALSE(found.openmp);
+    EXPECT_EQ(cpprun::parallel_runtime_flags(args, found), std::vector<std::string>({"-pthread"}));
+
+    found.openmp = true;
+    EXPECT_EQ(cpprun::parallel_runtime_flags(args, found), std::vector<std::string>({"-fopenmp", "-pthread"}));
+    args.build_args.push_back("-fno-openmp");
+    args.build_args.push_back("-pthread");
+    EXPECT_TRUE(cpprun::parallel_runtime_flags(args, found).empty());
+
+    args.runtime_flags = {"-fopenmp"};
+    ScopedEnv proc_bind("OMP_PROC_BIND", std::nullopt);
+    ScopedEnv places("OMP_PLACES", std::nullopt);
+    EXPECT_EQ(cpprun::parallel_runtime_env(args), cpprun::OPENMP_ENV_DEFAULTS);
+    places.set("threads");
+    EXPECT_TRUE(cpprun::parallel_runtime_env(args).empty());
+    places.set(std::nullopt);
+    args.runtime_flags.clear();
+    EXPECT_TRUE(cpprun::parallel_runtime_env(args).empty());
+
+    // not part of the cache key
+    ScopedEnv cache_dir("CPPRUN_CACHE_DIR", (dir / "cache").string());
+    auto with_flags = args;
+    with_flags.runtime_flags = {"-pthread"};
+    EXPECT_EQ(cpprun::artifact_cache_entry(args), cpprun::artifact_cache_entry(with_flags));
+    EXPECT_EQ(cpprun::collect_build_args(with_flags, "out").back(), "out");
+    EXPECT_TRUE(cpprun::contains(cpprun::collect_build_args(with_flags, "out"), "-pthread"));
+
+    // an explicit -fopenmp gets the defaults as well, and its cache entries keep the fast path from running them
+    auto source = (dir / "main.cpp").string();
+    auto explicit_openmp = cpprun::parse_cpprun_args({source, "-fopenmp"});
+    EXPECT_EQ(cpprun::parallel_runtime_env(explicit_openmp), cpprun::OPENMP_ENV_DEFAULTS);
+    auto entry = cpprun::artifact_cache_entry(explicit_openmp);
+    ASSERT_TRUE(entry.has_value());
+    std::ofstream(dir / "artifact.exe") << "";
+    cpprun::store_cache_entry(*entry, explicit_openmp, dir / "artifact.exe", dir / "artifact.d");
+    std::vector<const char *> argv = {"cpprun", source.c_str(), "-fopenmp"};
+    cpprun::PathBuffer artifact;
+    int run_begin = 0;
+    EXPECT_TRUE(fs::exists(*entry / "env"));
+    EXPECT_FALSE(cpprun::find_cached_artifact(int(argv.size()), argv.data(), artifact, run_begin));
+    fs::remove_all(dir);
+}
+
+TEST(CppRun, JitUnsupported) {
+    auto args = cpprun::parse_cpprun_args({"--cpprun-jit", "-O2", "main.cpp"});
+    EXPECT_TRUE(args.jit);
+    EXPECT_EQ(cpprun::jit_unsupported(args), std::nullopt);
+
+    args.runtime_flags = {"-pthread"};
+    EXPECT_EQ(cpprun::jit_unsupported(args), std::nullopt);
+    args.runtime_flags = {"-fopenmp", "-pthread"};
+    EXPECT_NE(cpprun::jit_unsupported(args), std::nullopt);
+    args.runtime_flags = {"-ltbb"};
+    EXPECT_EQ(cpprun::jit_unsupported(args), "linker argument -ltbb");
+    EXPECT_NE(cpprun::jit_unsupported(cpprun::parse_cpprun_args({"--cpprun-jit", "-fopenmp", "main.cpp"})),
+              std::nullopt);
+
+    EXPECT_NE(cpprun::jit_unsupported(cpprun::parse_cpprun_args({"--cpprun-jit", "main.cpp", "util.cpp"})),
+              std::nullopt);
+    EXPECT_NE(cpprun::jit_unsupported(cpprun::parse_cpprun_args({"--cpprun-jit", "-c", "main.cpp"})), std::nullopt);
+    EXPECT_NE(cpprun::jit_unsupported(cpprun::parse_cpprun_args({"--cpprun-jit", "--cpprun-size", "main.cpp"})),
+              std::nullopt);
+    EXPECT_EQ(cpprun::jit_unsupported(cpprun::parse_cpprun_args({"--cpprun-jit", "main.cpp", "-lm"})),
+              "linker argument -lm");
+}
+
+TEST(CppRun, ParseSanitizers) {
+    auto args = cpprun::parse_cpprun_args({"--cpprun-sanitize=address,thread", "main.cpp"});
+    EXPECT_EQ(args.sanitizers, std::vector<std::string>({"address", "thread"}));
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-sanitize", "main.cpp"}).sanitizers.size(), 3u);
+    EXPECT_THROW(cpprun::parse_cpprun_args({"--cpprun-sanitize=adress", "main.cpp"}), std::runtime_error);
+    EXPECT_THROW(cpprun::parse_cpprun_args({"--cpprun-sanitize=", "main.cpp"}), std::runtime_error);
+
+    ScopedEnv tsan_options("TSAN_OPTIONS", std::nullopt);
+    EXPECT_EQ(cpprun::sanitizer_env("thread")[0].second, "halt_on_error=1:report_signal_unsafe=0");
+    tsan_options.set("halt_on_error=0");
+    EXPECT_EQ(cpprun::sanitizer_env("thread")[0].second, "halt_on_error=1:report_signal_unsafe=0:halt_on_error=0");
+}
+
+TEST(CppRun, NormalizeFrame) {
+    EXPECT_EQ(cpprun::normalize_frame("0x5628f512442d in main /tmp/bug.cpp:9"), "main /tmp/bug.cpp:9");
+    EXPECT_EQ(cpprun::normalize_frame("0x7f7997045304 in __libc_start_main (/lib/libc.so.6+0x27304)"),
+              "__libc_start_main");
+    EXPECT_EQ(cpprun::normalize_frame("0x7f7997045249  (/lib/x86_64-linux-gnu/libc.so.6+0x27249)"), "libc.so.6");
+    EXPECT_EQ(cpprun::normalize_frame("main /tmp/bug.cpp:12 (artifact.exe+0x13e3)"), "main /tmp/bug.cpp:12");
+    EXPECT_EQ(cpprun::normalize_frame("<null> <null> (libstdc++.so.6+0xd44a2)"), "libstdc++.so.6");
+}
+
+TEST(CppRun, ParseSanitizerReports) {
+    std::string asan = "start\n"
+                       "==12==ERROR: AddressSanitizer: heap-buffer-overflow on address 0x602 at pc 0x56 bp 0x7f\n"
+                       "WRITE of size 4 at 0x602 thread T0\n"
+                       "    #0 0x5628f512442d in main /tmp/bug.cpp:9\n"
+                       "    #1 0x7f7997045304 in __libc_start_main (/lib/libc.so.6+0x27304)\n"
+                       "allocated by thread T0 here:\n"
+                       "    #0 0x7f79972b9628 in operator new[](unsigned long) "
+                       "../../../../src/libsanitizer/asan/asan_new_delete.cpp:98\n"
+                       "    #1 0x5628f51243d0 in main /tmp/bug.cpp:8\n"
+                       "SUMMARY: AddressSanitizer: heap-buffer-overflow /tmp/bug.cpp:9 in main\n"
+                       "    #0 not part of a report\n";
+    auto findings = cpprun::parse_sanitizer_reports(asan);
+    ASSERT_EQ(findings.size(), 1u);
+    EXPECT_EQ(findings[0].kind, "heap-buffer-overflow");
+    EXPECT_EQ(findings[0].frames, std::vector<std::string>({"#0 main /tmp/bug.cpp:9", "#1 __libc_start_main",
+                                                            "#1 main /tmp/bug.cpp:8"}));
+
+    std::string ubsan = "/tmp/bug.cpp:5:35: runtime error: signed integer overflow\n"
+                        "    #0 0x55 in overflow(int) /tmp/bug.cpp:5\n"
+                        "    #1 0x56 in main /tmp/bug.cpp:10\n"
+                        "/tmp/bug.cpp:7:3: runtime error: load of null pointer\n";
+    findings = cpprun::parse_sanitizer_reports(ubsan);
+    ASSERT_EQ(findings.size(), 2u);
+    EXPECT_EQ(findings[0].kind, "runtime error: signed integer overflow");
+    EXPECT_EQ(findings[0].frames,
+              std::vector<std::string>({"#0 overflow(int) /tmp/bug.cpp:5", "#1 main /tmp/bug.cpp:10"}));
+    EXPECT_EQ(findings[1].frames, std::vector<std::string>({"/tmp/bug.cpp:7:3"}));
+
+    std::string leaks = "==7==ERROR: LeakSanitizer: detected memory leaks\n\n"
+                        "Direct leak of 40 byte(s) in 1 object(s) allocated from:\n"
+                        "    #0 0x7f in operator new[](unsigned long) ../../../../src/libsanitizer/lsan/x.cpp:250\n"
+                        "    #1 0x55 in main /tmp/leak.cpp:3\n\n"
+                        "Indirect leak of 8 byte(s) in 1 object(s) allocated from:\n"
+                        "    #1 0x55 in make /tmp/leak.cpp:9\n\n"
+                        "SUMMARY: AddressSanitizer: 48 byte(s) leaked in 2 allocation(s).\n";
+    auto leak_findings = cpprun::parse_sanitizer_reports(leaks);
+    ASSERT_EQ(leak_findings.size(), 2u);
+    EXPECT_EQ(leak_findings[0].kind, "Direct leak");
+    EXPECT_EQ(leak_findings[1].kind, "Indirect leak");
+
+    std::string tsan = "==================\n"
+                       "WARNING: ThreadSanitizer: data race (pid=99)\n"
+                       "  Write of size 4 at 0x55 by main thread:\n"
+                       "    #0 main /tmp/bug.cpp:12 (artifact.exe+0x13e3)\n"
+                       "  Previous write of size 4 at 0x55 by thread T1:\n"
+                       "    #0 pthread_create ../../../../src/libsanitizer/tsan/tsan_interceptors_posix.cpp:1001 "
+                       "(libtsan.so.2+0x5e686)\n"
+                       "SUMMARY: ThreadSanitizer: data race /tmp/bug.cpp:12 in main\n";
+    findings = cpprun::parse_sanitizer_reports(tsan);
+    ASSERT_EQ(findings.size(), 1u);
+    EXPECT_EQ(findings[0].kind, "data race");
+    EXPECT_EQ(findings[0].frames, std::vector<std::string>({"#0 main /tmp/bug.cpp:12"}));
+
+    // the same leak from two variants, and twice from one
+    auto merged = cpprun::merge_sanitizer_findings(
+        {{"address", leak_findings}, {"leak", {leak_findings[0], leak_findings[0]}}});
+    ASSERT_EQ(merged.size(), 2u);
+    EXPECT_EQ(merged[0].variants, std::vector<std::string>({"address", "leak"}));
+    EXPECT_EQ(merged[0].reports, 3u);
+    EXPECT_EQ(merged[1].reports, 1u);
+}
+
+TEST(CppRun, ParseFuzzArgs) {
+    auto args = cpprun::parse_cpprun_args({"--cpprun-fuzz=30", "--cpprun-fuzz-workers=4", "target.cpp"});
+    EXPECT_EQ(args.fuzz_seconds, 30u);
+    EXPECT_EQ(args.fuzz_workers, 4u);
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-fuzz", "target.cpp"}).fuzz_seconds, 60u);
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-fuzz", "target.cpp"}).fuzz_workers, std::nullopt);
+    EXPECT_EQ(cpprun::parse_cpprun_args({"target.cpp"}).fuzz_seconds, std::nullopt);
+}
+
+TEST(CppRun, ParseFuzzStatus) {
+    auto status =
+        cpprun::parse_fuzz_status("#4096\tpulse  cov: 112 ft: 150 corp: 12/340b lim: 43 exec/s: 2048 rss: 31Mb");
+    ASSERT_TRUE(status);
+    EXPECT_EQ(status->executions, 4096u);
+    EXPECT_EQ(status->coverage, 112u);
+    EXPECT_EQ(status->corpus, 12u);
+
+    status = cpprun::parse_fuzz_status("#1523\tNEW cov: 17 corp: 9 exec/s: 1523");
+    ASSERT_TRUE(status);
+    EXPECT_EQ(status->executions, 1523u);
+    EXPECT_EQ(status->coverage, 17u);
+    EXPECT_EQ(status->corpus, 9u);
+
+    EXPECT_FALSE(cpprun::parse_fuzz_status("INFO: Seed: 1234"));
+    EXPECT_FALSE(cpprun::parse_fuzz_status("    #0 0x5628f512442d in main /tmp/bug.cpp:9"));
+    EXPECT_FALSE(cpprun::parse_fuzz_status("#12 without coverage"));
+}
+
+TEST(CppRun, TarRoundTrip) {
+    cpprun::TarMembers members = {{"a", "contents"}, {"dir/empty", ""}, {"big", std::string(1000, 'x')}};
+    auto tar = cpprun::format_tar(members);
+    EXPECT_EQ(tar.size() % 512, 0u);
+    EXPECT_EQ(tar.substr(257, 5), "ustar");
+    EXPECT_EQ(cpprun::parse_tar(tar), members);
+
+    tar[0] = 'b';
+    EXPECT_THROW(cpprun::parse_tar(tar), std::runtime_error);
+    EXPECT_THROW(cpprun::format_tar({{std::string(100, 'n'), ""}}), std::runtime_error);
+}
+
+TEST(CppRun, CapturedEnvVar) {
+    auto args = cpprun::parse_cpprun_args({"--cpprun-capture=b.tar", "--cpprun-capture-env=APP_MODE", "hello.cpp"});
+    EXPECT_TRUE(cpprun::captured_env_var(args, "PATH"));
+    EXPECT_TRUE(cpprun::captured_env_var(args, "LC_ALL"));
+    EXPECT_TRUE(cpprun::captured_env_var(args, "OMP_NUM_THREADS"));
+    EXPECT_TRUE(cpprun::captured_env_var(args, "CPPRUN_CXXFLAGS"));
+    EXPECT_TRUE(cpprun::captured_env_var(args, "APP_MODE"));
+    EXPECT_FALSE(cpprun::captured_env_var(args, "GITHUB_TOKEN"));
+    EXPECT_FALSE(cpprun::captured_env_var(args, "AWS_SECRET_ACCESS_KEY"));
+    EXPECT_FALSE(cpprun::captured_env_var(args, "LC"));
+}
+
+TEST(CppRun, BundleRoundTrip) {
+    EXPECT_EQ(cpprun::parse_nul_list(cpprun::format_nul_list({"a b", "", "c\nd"})),
+              std::vector<std::string>({"a b", "", "c\nd"}));
+    EXPECT_TRUE(cpprun::parse_nul_list("").empty());
+
+    cpprun::RunCapture capture;
+    capture.cxx = "g++";
+    capture.cwd = "/home/user/work dir";
+    capture.compiler_version = "g++ (GCC) 12.2.0";
+    capture.build_args = {"-std=c++17", "-O2", "main.cpp"};
+    capture.run_args = {"--input", "/data/in.txt"};
+    capture.env = {"PATH=/usr/bin", "EMPTY="};
+    capture.input = "line\n";
+    capture.files = {{"/home/user/work dir/main.cpp", "int main() {}\n"}, {"/data/in.txt", "1 2 3"}};
+    capture.run = cpprun::CmdStats{1.5, 1.25, 0.125, 4096};
+    capture.exit_code = 3;
+    auto parsed = cpprun::parse_bundle(cpprun::format_bundle(capture));
+    EXPECT_EQ(parsed.cxx, capture.cxx);
+    EXPECT_EQ(parsed.cwd, capture.cwd);
+    EXPECT_EQ(parsed.compiler_version, capture.compiler_version);
+    EXPECT_EQ(parsed.build_args, capture.build_args);
+    EXPECT_EQ(parsed.run_args, capture.run_args);
+    EXPECT_EQ(parsed.env, capture.env);
+    EXPECT_EQ(parsed.input, capture.input);
+    EXPECT_EQ(parsed.files, capture.files);
+    EXPECT_DOUBLE_EQ(parsed.run.user_seconds, 1.25);
+    EXPECT_EQ(parsed.run.max_rss_kb, 4096);
+    EXPECT_EQ(parsed.exit_code, 3);
+
+    EXPECT_THROW(cpprun::parse_bundle(cpprun::format_tar({{"other", ""}})), std::runtime_error);
+}
+
+TEST(CppRun, RelocateArg) {
+    std::vector<fs::path> captured = {"/src/app/main.cpp", "/src/app/include/util.h", "/data/in.txt"};
+    fs::path root = "/replay/root";
+    EXPECT_EQ(cpprun::relocate_arg("/src/app/main.cpp", captured, root), "/replay/root/src/app/main.cpp");
+    EXPECT_EQ(cpprun::relocate_arg("-I/src/app/include", captured, root), "-I/replay/root/src/app/include");
+    EXPECT_EQ(cpprun::relocate_arg("/data", captured, root), "/replay/root/data");
+    EXPECT_EQ(cpprun::relocate_arg("/data/out.txt", captured, root), "/data/out.txt");
+    EXPECT_EQ(cpprun::relocate_arg("-I/usr/include", captured, root), "-I/usr/include");
+    EXPECT_EQ(cpprun::relocate_arg("main.cpp", captured, root), "main.cpp");
+    EXPECT_EQ(cpprun::relocate_arg("-O2", captured, root), "-O2");
+}
+
+TEST(CppRun, ParseCaptureArgs) {
+    auto args = cpprun::parse_cpprun_args({"--cpprun-capture=run.tar", "--cpprun-capture-files=a.txt,b.txt", "x.cpp"});
+    EXPECT_EQ(args.capture_bundle, fs::path("run.tar"));
+    EXPECT_EQ(args.capture_files, std::vector<fs::path>({"a.txt", "b.txt"}));
+    args = cpprun::parse_cpprun_args({"--cpprun-replay", "run.tar", "--cpprun-replay-runs=3"});
+    EXPECT_EQ(args.replay_bundle, fs::path("run.tar"));
+    EXPECT_EQ(args.replay_runs, 3u);
+    EXPECT_TRUE(cpprun::source_files(args.build_args).empty());
+    EXPECT_THROW(cpprun::parse_cpprun_args({"--cpprun-replay"}), std::runtime_error);
+}
+
+TEST(CppRun, ParsePrewarm) {
+    auto args = cpprun::parse_cpprun_args({"--cpprun-prewarm"});
+    EXPECT_TRUE(args.prewarm);
+    EXPECT_FALSE(args.prewarm_wait);
+    EXPECT_TRUE(cpprun::parse_cpprun_args({"--cpprun-prewarm=wait"}).prewarm_wait);
+    EXPECT_THROW(cpprun::parse_cpprun_args({"--cpprun-prewarm=now"}), std::runtime_error);
+    EXPECT_EQ(cpprun::manifest_paths("12 1700000000.5 /usr/include/a b.h\n- - /tmp/gone.h\n3 1.0 /x.h\n"),
+              std::vector<fs::path>({"/usr/include/a b.h", "/tmp/gone.h", "/x.h"}));
+}
+
+TEST(CppRun, TeeOutput) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(6, getpid());
+    fs::create_directories(dir);
+    std::string data(100000, 'x');
+    // to a pipe, where tee(2) can copy directly, and to a file, which takes the second pipe
+    for (bool out_is_pipe : {true, false}) {
+        int in[2], out[2];
+        ASSERT_EQ(pipe(in), 0);
+        ASSERT_EQ(pipe(out), 0);
+        fcntl(out[1], F_SETPIPE_SZ, 1 << 20);
+        int out_file = open((dir / "out").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        cpprun::TeeOutput tee{open((dir / "log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644), dir / "log"};
+        std::thread writer([&] {
+            cpprun::write_all(in[1], data);
+            close(in[1]);
+        });
+        cpprun::tee_pipe(in[0], out_is_pipe ? out[1] : out_file, tee);
+        writer.join();
+        close(tee.fd);
+        close(out[1]);
+        EXPECT_EQ(tee.written, data.size());
+        EXPECT_EQ(cpprun::read_file(dir / "log"), data);
+        EXPECT_EQ(out_is_pipe ? cpprun::read_fd(out[0]) : cpprun::read_file(dir / "out"), data);
+        close(in[0]);
+        close(out[0]);
+        close(out_file);
+    }
+    EXPECT_EQ(cpprun::parse_cpprun_args({"--cpprun-tee=out.log", "x.cpp"}).tee_file, fs::path("out.log"));
+    fs::remove_all(dir);
+}
+
+TEST(CppRun, AsmDiffVariant) {
+    auto args = cpprun::parse_cpprun_args({"--cpprun-asm-diff=-O2", "--cpprun-asm-diff=g++-13 -O2 -march=native",
+                                           "x.cpp"});
+    EXPECT_EQ(args.asm_diff, std::vector<std::string>({"-O2", "g++-13 -O2 -march=native"}));
+    auto a = cpprun::asm_diff_variant(args, args.asm_diff[0]);
+    EXPECT_EQ(a.cxx, "c++");
+    EXPECT_EQ(a.build_args.size(), args.build_args.size() + 1);
+    EXPECT_EQ(a.build_args.back(), "-O2");
+    EXPECT_TRUE(a.asm_diff.empty());
+    auto b = cpprun::asm_diff_variant(args, args.asm_diff[1]);
+    EXPECT_EQ(b.cxx, "g++-13");
+    EXPECT_EQ(std::vector<std::string>(b.build_args.end() - 2, b.build_args.end()),
+              std::vector<std::string>({"-O2", "-march=native"}));
+}
+
+TEST(CppRun, AsmFunctionKey) {
+    EXPECT_EQ(cpprun::asm_function_key("_Z1fv"), "_Z1fv");
+    EXPECT_EQ(cpprun::asm_function_key("_Z1fv.cold"), "_Z1fv");
+    EXPECT_EQ(cpprun::asm_function_key("_Z1fv.part.0"), "_Z1fv");
+    EXPECT_EQ(cpprun::asm_function_key("_Z1fv.constprop.0.isra.0"), "_Z1fv");
+    EXPECT_EQ(cpprun::asm_function_key("_Z1fv.lto_priv.0"), "_Z1fv");
+    EXPECT_EQ(cpprun::asm_function_key("counter.1"), "counter.1");
+    EXPECT_EQ(cpprun::asm_function_key("my.func"), "my.func");
+    EXPECT_EQ(cpprun::asm_function_key("my.func.cold"), "my.func");
+    EXPECT_EQ(cpprun::asm_function_key(".L42"), ".L42");
+}
+
+TEST(CppRun, ParseObjdump) {
+    cpprun::ElfFile elf;
+    elf.symbols = {{"_Z1fv", 0x1000, 0x10, 1, STT_FUNC, STB_GLOBAL},
+                   {"_Z1fv.cold", 0x900, 0x4, 1, STT_FUNC, STB_LOCAL},
+                   {"main", 0x1010, 0x8, 1, STT_FUNC, STB_GLOBAL}};
+    auto listing = cpprun::parse_objdump("0000000000000900 <_Z1fv.cold>:\n"
+                                         "     900:\tcall   1020 <abort@plt>\n"
+                                         "\n"
+                                         "0000000000001000 <_Z1fv>:\n"
+                                         "    1000:\tmov    0x2fcd(%rip),%rax        # 3fd8 <x>\n"
+                                         "    1007:\tjne    1000 <_Z1fv>\n"
+                                         "    1009:\tjmp    900 <_Z1fv.cold>\n"
+                                         "    100e:\trep stos %rax,%es:(%rdi)\n"
+                                         "0000000000001010 <main>:\n"
+                                         "    1010:\tcall   1000 <_Z1fv>\n",
+                                         elf);
+    ASSERT_EQ(listing.size(), 2u);
+    auto & f = listing["_Z1fv"];
+    EXPECT_EQ(f.bytes, 0x14u);
+    ASSERT_EQ(f.instructions.size(), 5u);
+    EXPECT_EQ(f.instructions[0].text, "mov    0x2fcd(%rip),%rax  # <x>");
+    EXPECT_EQ(f.instructions[0].key, "mov    RIP,%rax  # <x>");
+    EXPECT_EQ(f.instructions[1].text, "jne    <>");
+    EXPECT_EQ(f.instructions[1].key, "jne    <>");
+    EXPECT_EQ(f.instructions[2].text, "jmp    <f() [clone .cold]>");
+    EXPECT_EQ(f.instructions[3].mnemonic, "rep stos");
+    // the clone comes after the function itself
+    EXPECT_EQ(f.instructions[4].text, "call   <abort@plt>");
+    EXPECT_EQ(listing["main"].instructions[0].text, "call   <f()>");
+}
+
+TEST(CppRun, DiffInstructions) {
+    auto insns = [](std::vector<std::string> texts) {
+        std::vector<cpprun::AsmInstruction> out;
+        for (auto & t : texts) {
+            out.push_back(cpprun::parse_asm_instruction(0, t, "f"));
+        }
+        return out;
+    };
+    auto a = insns({"push   %rbx", "mov    $0x0,%eax", "jne    10 <f+0x10>", "pop    %rbx", "ret"});
+    auto b = insns({"push   %rbx", "xor    %eax,%eax", "jne    14 <f+0x14>", "vzeroupper", "pop    %rbx", "ret"});
+    std::string marks;
+    for (auto & line : cpprun::diff_instructions(a, b)) {
+        marks += line.mark;
+    }
+    EXPECT_EQ(marks, " | >  ");
+
+    cpprun::AsmFunction fa{"f", 8, a, 0}, fb{"f", 10, b, 0};
+    EXPECT_EQ(cpprun::mix_change(fa, fb),
+              (std::vector<std::pair<std::string, int>>({{"mov", -1}, {"vzeroupper", 1}, {"xor", 1}})));
+    EXPECT_EQ(cpprun::mix_distance(fa, fb), 3u);
+}
+
+TEST(CppRun, CriticalPathSchedule) {
+    // three compiles and a link: the 3 s compile has to start first for the link to start at 3 s
+    std::vector<cpprun::BuildTask> tasks = {{"a.cpp", "a", {}, {}, 1},
+                                            {"b.cpp", "b", {}, {}, 1},
+                                            {"slow.cpp", "slow", {}, {}, 3},
+                                            {"link", "link", {}, {0, 1, 2}, 0.5}};
+    EXPECT_EQ(cpprun::critical_path_priorities(tasks), std::vector<double>({1.5, 1.5, 3.5, 0.5}));
+    auto finish = cpprun::predict_schedule(tasks, 2);
+    EXPECT_DOUBLE_EQ(finish[2], 3);
+    EXPECT_DOUBLE_EQ(finish[0], 1);
+    EXPECT_DOUBLE_EQ(finish[1], 2);
+    EXPECT_DOUBLE_EQ(finish[3], 3.5);
+    EXPECT_DOUBLE_EQ(cpprun::predict_schedule(tasks, 1)[3], 5.5);
+
+    EXPECT_EQ(cpprun::parse_durations(cpprun::format_durations({{"k1", 0.25}, {"k2", 12.5}})),
+              (std::map<std::string, double>{{"k1", 0.25}, {"k2", 12.5}}));
+}
+
+TEST(CppRun, PlanParallelBuild) {
+    auto dir = fs::temp_directory_path() / cpprun::format_run_dir(7, getpid());
+    fs::create_directories(dir);
+    ScopedEnv cache_dir("CPPRUN_CACHE_DIR", (dir / "cache").string());
+    std::ofstream(dir / "main.cpp") << "int f();\nint main() { return f(); }\n";
+    std::ofstream(dir / "f.cpp") << "int f() { return 7; }\n";
+
+    ScopedEnv jobs("CPPRUN_JOBS", "2");
+    auto args = cpprun::parse_cpprun_args(
+        {"-O1", (dir / "main.cpp").string(), (dir / "f.cpp").string(), "-L", "/opt/lib", "-l", "m"});
+    auto tasks = cpprun::plan_parallel_build(args, dir / "out.exe", dir, false);
+    ASSERT_TRUE(tasks);
+    ASSERT_EQ(tasks->size(), 3u);
+    EXPECT_EQ(tasks->at(0).name, "main.cpp");
+    EXPECT_TRUE(cpprun::contains(tasks->at(0).command, "-c"));
+    EXPECT_FALSE(cpprun::contains(tasks->at(0).command, "-l"));
+    EXPECT_FALSE(cpprun::contains(tasks->at(0).command, "m"));
+    EXPECT_FALSE(cpprun::contains(tasks->at(0).command, "/opt/lib"));
+    auto & link = tasks->at(2).command;
+    EXPECT_EQ(tasks->at(2).deps, std::vector<size_t>({0, 1}));
+    EXPECT_TRUE(cpprun::contains(link, (dir / "0-main.o").string()));
+    EXPECT_FALSE(cpprun::contains(link, (dir / "main.cpp").string()));
+    EXPECT_EQ(link.back(), (dir / "out.exe").string());
+    EXPECT_LT(std::find(link.begin(), link.end(), (dir / "1-f.o").string()),
+              std::find(link.begin(), link.end(), "-l"));
+
+    // the library builds through the same path, and the durations are recorded for the next build
+    cpprun::BuildSpec spec;
+    spec.sources = {dir / "main.cpp", dir / "f.cpp"};
+    auto build = cpprun::build(spec);
+    ASSERT_TRUE(build.ok()) << build.diagnostics;
+    EXPECT_EQ(cpprun::run(build).exit_code, 7);
+    EXPECT_EQ(cpprun::parse_durations(cpprun::read_file(dir / "cache" / "durations")).size(), 3u);
+
+    jobs.set("1");
+    EXPECT_FALSE(cpprun::plan_parallel_build(args, dir / "out.exe", dir, false));
+    // a single compiler invocation unless asked for
+    jobs.set(std::nullopt);
+    EXPECT_EQ(cpprun::build_jobs(), 1u);
+    EXPECT_FALSE(cpprun::plan_parallel_build(args, dir / "out.exe", dir, false));
+    jobs.set("auto");
+    EXPECT_EQ(cpprun::build_jobs(), std::max(1u, std::thread::hardware_concurrency()));
+    fs::remove_all(dir);
+}